@@ -0,0 +1,355 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include "aof.h"
+#include "log.h"
+#include "protocol.h"
+
+static struct {
+    int fd = -1;
+    std::string path;
+    uint32_t policy = AOF_FSYNC_EVERYSEC;
+    std::string buf;
+    bool rewriting = false;
+    std::string diff;           // logged since the rewrite child was forked
+    AofStats stats;
+    // the fsync thread and the event loop
+    std::mutex mu;              // held while the thread uses `fd`
+    std::atomic<uint64_t> written{0};
+    std::atomic<uint64_t> synced{0};
+    std::atomic<uint64_t> fsyncs{0};
+    std::atomic<uint64_t> fsync_usec{0};
+} g_aof;
+
+static uint64_t get_usec() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return (uint64_t)tv.tv_sec * 1000000 + (uint64_t)tv.tv_nsec / 1000;
+}
+
+bool aof_parse_fsync(const char *s, uint32_t *policy) {
+    if (strcasecmp(s, "always") == 0) {
+        *policy = AOF_FSYNC_ALWAYS;
+    } else if (strcasecmp(s, "everysec") == 0) {
+        *policy = AOF_FSYNC_EVERYSEC;
+    } else if (strcasecmp(s, "no") == 0) {
+        *policy = AOF_FSYNC_NO;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+const char *aof_fsync_name(uint32_t policy) {
+    switch (policy) {
+    case AOF_FSYNC_ALWAYS: return "always";
+    case AOF_FSYNC_EVERYSEC: return "everysec";
+    default: return "no";
+    }
+}
+
+static bool aof_fsync(int fd) {
+    uint64_t t0 = get_usec();
+    int rv = fdatasync(fd);
+    int err = errno;
+    g_aof.fsync_usec.fetch_add(get_usec() - t0, std::memory_order_relaxed);
+    g_aof.fsyncs.fetch_add(1, std::memory_order_relaxed);
+    if (rv != 0) {
+        log_error("append-only log: fdatasync: %s", strerror(err));
+    }
+    return rv == 0;
+}
+
+// AOF_FSYNC_EVERYSEC: the write() happens in the event loop, the fsync here
+static void fsync_worker() {
+    while (true) {
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+        std::lock_guard<std::mutex> lock(g_aof.mu);
+        uint64_t written = g_aof.written.load(std::memory_order_acquire);
+        // a failed fsync is tried again next second
+        if (written != g_aof.synced.load(std::memory_order_relaxed) && aof_fsync(g_aof.fd)) {
+            g_aof.synced.store(written, std::memory_order_relaxed);
+        }
+    }
+}
+
+bool aof_open(const char *path, uint32_t policy) {
+    int fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return false;
+    }
+    g_aof.fd = fd;
+    g_aof.path = path;
+    g_aof.policy = policy;
+    g_aof.stats.size = (uint64_t)st.st_size;
+    g_aof.stats.base_size = g_aof.stats.size;
+    g_aof.written.store(g_aof.stats.size);
+    g_aof.synced.store(g_aof.stats.size);
+    if (policy == AOF_FSYNC_EVERYSEC) {
+        std::thread(fsync_worker).detach();
+    }
+    return true;
+}
+
+bool aof_is_open() {
+    return g_aof.fd >= 0;
+}
+
+uint32_t aof_fsync_policy() {
+    return g_aof.policy;
+}
+
+void aof_append(const char *frame, size_t len) {
+    if (g_aof.fd < 0) {
+        return;
+    }
+    g_aof.buf.append(frame, len);
+}
+
+bool aof_has_pending() {
+    return !g_aof.buf.empty();
+}
+
+static bool write_all(int fd, const char *p, size_t n) {
+    while (n > 0) {
+        ssize_t rv = write(fd, p, n);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv <= 0) {
+            return false;
+        }
+        p += rv;
+        n -= (size_t)rv;
+    }
+    return true;
+}
+
+bool aof_flush() {
+    if (g_aof.fd < 0 || g_aof.buf.empty()) {
+        return true;
+    }
+    bool ok = write_all(g_aof.fd, g_aof.buf.data(), g_aof.buf.size());
+    // under "always" the replies wait for the data to be on disk: a failed
+    // fsync is a failed write, the pages it couldn't flush may be gone
+    if (ok && g_aof.policy == AOF_FSYNC_ALWAYS) {
+        ok = aof_fsync(g_aof.fd);
+    }
+    if (!ok) {
+        // drop what made it to the file, so the log never ends with half
+        // a record, and try again later with the whole buffer
+        if (ftruncate(g_aof.fd, (off_t)g_aof.stats.size) != 0) {
+            log_error("append-only log: ftruncate: %s", strerror(errno));
+        }
+        g_aof.stats.last_write_ok = false;
+        return false;
+    }
+    if (g_aof.rewriting) {
+        g_aof.diff.append(g_aof.buf);
+    }
+    g_aof.stats.size += g_aof.buf.size();
+    g_aof.stats.writes++;
+    g_aof.stats.last_write_ok = true;
+    g_aof.buf.clear();
+    g_aof.written.store(g_aof.stats.size, std::memory_order_release);
+    return true;
+}
+
+void aof_get_stats(AofStats *stats) {
+    *stats = g_aof.stats;
+    stats->buffered = g_aof.buf.size();
+    stats->diff_bytes = g_aof.diff.size();
+    stats->fsyncs = g_aof.fsyncs.load(std::memory_order_relaxed);
+    stats->fsync_usec = g_aof.fsync_usec.load(std::memory_order_relaxed);
+}
+
+bool aof_rewrite_start() {
+    if (!aof_flush()) {
+        return false;
+    }
+    g_aof.rewriting = true;
+    g_aof.diff.clear();
+    return true;
+}
+
+void aof_rewrite_abort() {
+    g_aof.rewriting = false;
+    std::string().swap(g_aof.diff);
+}
+
+// make a rename() in the directory of `path` durable
+static bool fsync_dir(const std::string &path) {
+    size_t slash = path.rfind('/');
+    std::string dir = slash == std::string::npos ? "." : path.substr(0, slash ? slash : 1);
+    int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = fsync(fd) == 0;
+    close(fd);
+    return ok;
+}
+
+bool aof_rewrite_done(const char *tmp_path) {
+    // the commands of this iteration go to the old file and the diff
+    bool ok = aof_flush();
+    int fd = ok ? open(tmp_path, O_WRONLY | O_APPEND | O_CLOEXEC) : -1;
+    ok = fd >= 0 && write_all(fd, g_aof.diff.data(), g_aof.diff.size()) && fdatasync(fd) == 0;
+    struct stat st;
+    ok = ok && fstat(fd, &st) == 0 && rename(tmp_path, g_aof.path.c_str()) == 0;
+    aof_rewrite_abort();
+    if (!ok) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        unlink(tmp_path);
+        return false;
+    }
+
+    // the new file is already open, it just changed its name
+    int old_fd = -1;
+    {
+        std::lock_guard<std::mutex> lock(g_aof.mu);
+        old_fd = g_aof.fd;
+        g_aof.fd = fd;
+        g_aof.written.store((uint64_t)st.st_size);
+        g_aof.synced.store((uint64_t)st.st_size);
+    }
+    close(old_fd);
+    // the log is the new file from here on, a failure only risks a crash
+    // bringing back the old one, which is still complete
+    if (!fsync_dir(g_aof.path)) {
+        log_error("append-only log: fsync of the directory: %s", strerror(errno));
+    }
+    g_aof.stats.size = g_aof.stats.base_size = (uint64_t)st.st_size;
+    g_aof.stats.rewrites++;
+    return true;
+}
+
+bool aof_rewrite_needed() {
+    return g_aof.fd >= 0 && !g_aof.rewriting && g_aof.stats.size >= k_aof_rewrite_min_size
+        && g_aof.stats.size >= 2 * g_aof.stats.base_size;
+}
+
+struct AofWriter {
+    int fd = -1;
+    std::string buf;
+    bool failed = false;
+};
+
+static void writer_flush(AofWriter *w) {
+    if (!w->failed && !write_all(w->fd, w->buf.data(), w->buf.size())) {
+        w->failed = true;
+    }
+    w->buf.clear();
+}
+
+AofWriter *aof_writer_open(const char *path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return NULL;
+    }
+    AofWriter *w = new AofWriter();
+    w->fd = fd;
+    return w;
+}
+
+void aof_writer_put(AofWriter *w, const std::vector<std::string> &cmd) {
+    size_t start = w->buf.size();
+    put_req(w->buf, cmd);
+    if (w->buf.size() - start - 4 > k_aof_max_record) {
+        // the replay would refuse the log
+        log_error("append-only log: a record of %zu bytes is too large", w->buf.size() - start - 4);
+        w->failed = true;
+    }
+    if (w->buf.size() >= (64 << 10)) {
+        writer_flush(w);
+    }
+}
+
+bool aof_writer_close(AofWriter *w) {
+    writer_flush(w);
+    bool ok = !w->failed && fdatasync(w->fd) == 0;
+    ok = close(w->fd) == 0 && ok;
+    delete w;
+    return ok;
+}
+
+int aof_replay(const char *path, bool (*fn)(const uint8_t *req, size_t len, void *arg),
+    void *arg, uint64_t *ncmds)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -2;
+    }
+    size_t size = (size_t)st.st_size;
+    if (size == 0) {
+        close(fd);
+        return 0;
+    }
+    void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return -2;
+    }
+    madvise(data, size, MADV_SEQUENTIAL);
+
+    const uint8_t *begin = (const uint8_t *)data;
+    const uint8_t *p = begin;
+    const uint8_t *end = begin + size;
+    uint64_t n = 0;
+    int rv = 0;
+    while (p < end) {
+        uint32_t len = 0;
+        if (end - p < 4) {
+            break;          // truncated
+        }
+        memcpy(&len, p, 4);
+        if (len > k_aof_max_record) {
+            rv = -2;
+            break;
+        }
+        if ((size_t)(end - p - 4) < len) {
+            break;          // truncated
+        }
+        if (!fn(p + 4, len, arg)) {
+            rv = -2;
+            break;
+        }
+        p += 4 + len;
+        n++;
+    }
+    size_t good = (size_t)(p - begin);
+    munmap(data, size);
+
+    if (rv == 0 && good < size) {
+        log_warn("append-only log: dropping %zu bytes of an incomplete record", size - good);
+        if (truncate(path, (off_t)good) != 0) {
+            return -2;
+        }
+    }
+    if (ncmds) {
+        *ncmds = n;
+    }
+    return rv;
+}
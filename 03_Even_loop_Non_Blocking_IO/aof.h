@@ -0,0 +1,93 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/*
+Append-only log of the write commands, replayed at startup.
+
+Each record is a command framed exactly like a request on the wire:
+    len(4) | nstr(4) | len(4) | str1 | ... | len(4) | strn
+
+Group commit: commands are appended to a buffer while the event loop runs
+them, the buffer is written with a single write() once per loop iteration,
+followed by a single fsync under AOF_FSYNC_ALWAYS. The replies to those
+commands are held until then, so one fsync covers every client of the
+iteration. Under AOF_FSYNC_EVERYSEC a background thread calls fdatasync()
+once per second, under AOF_FSYNC_NO the kernel decides.
+
+Rewrite: a forked child writes the smallest log that rebuilds its copy of
+the keyspace to a new file. Meanwhile the commands logged by the parent
+also go to a diff buffer, which is appended to the new file once the child
+is done, then the new file is renamed over the old one.
+*/
+
+enum {
+    AOF_FSYNC_NO = 0,
+    AOF_FSYNC_EVERYSEC = 1,
+    AOF_FSYNC_ALWAYS = 2,
+};
+
+struct AofStats {
+    uint64_t size = 0;          // bytes in the file
+    uint64_t buffered = 0;      // bytes not written yet
+    uint64_t writes = 0;
+    uint64_t fsyncs = 0;
+    uint64_t fsync_usec = 0;    // total time spent in fsync
+    bool last_write_ok = true;
+    uint64_t base_size = 0;     // size after the last rewrite, or at startup
+    uint64_t diff_bytes = 0;    // logged while a rewrite is running
+    uint64_t rewrites = 0;
+};
+
+// records are bounded by the request size of a client, but a rewritten log
+// may hold larger ones; the rewrite splits values that wouldn't fit
+const size_t k_aof_max_record = 512 << 20;
+
+// rewrite when the log has doubled since the last one, and is at least this big
+const uint64_t k_aof_rewrite_min_size = 64 << 20;
+
+bool aof_parse_fsync(const char *s, uint32_t *policy);
+const char *aof_fsync_name(uint32_t policy);
+
+// open for appending, starts the fsync thread under AOF_FSYNC_EVERYSEC
+bool aof_open(const char *path, uint32_t policy);
+bool aof_is_open();
+uint32_t aof_fsync_policy();
+
+// buffer one command, already framed
+void aof_append(const char *frame, size_t len);
+bool aof_has_pending();
+
+// write the buffer (and fsync it under AOF_FSYNC_ALWAYS). On a write or
+// fsync error the file is cut back, the buffer kept and retried by the
+// next call.
+bool aof_flush();
+void aof_get_stats(AofStats *stats);
+
+// start collecting the diff, the buffer is written first so that
+// everything logged before the fork is in the old file only
+bool aof_rewrite_start();
+// append the diff to the file written by the child and rename it over the
+// log, which is reopened. The diff is dropped if this fails.
+bool aof_rewrite_done(const char *tmp_path);
+void aof_rewrite_abort();
+bool aof_rewrite_needed();
+
+// writing a new log, used by the rewrite child
+struct AofWriter;
+AofWriter *aof_writer_open(const char *path);
+void aof_writer_put(AofWriter *w, const std::vector<std::string> &cmd);
+// fsync and close, false on any I/O error or a record over k_aof_max_record
+bool aof_writer_close(AofWriter *w);
+
+/*
+Call `fn` with the payload of every record (what follows the length), `fn`
+returns false if it can't parse it. A record cut short by a crash at the
+end of the file is dropped and the file truncated to the last complete one.
+0 on success, -1 if the file doesn't exist, -2 if it is corrupt.
+*/
+int aof_replay(const char *path, bool (*fn)(const uint8_t *req, size_t len, void *arg),
+    void *arg, uint64_t *ncmds);
@@ -0,0 +1,147 @@
+/*
+Write throughput of the server under each fsync policy of the append-only log.
+
+    g++ -O2 bench_aof.cpp -o bench_aof
+    ./server --appendonly bench.aof --appendfsync always &
+    ./bench_aof [conns] [seconds] [value bytes]     (default 64 conns, 5 s, 100 bytes)
+
+Every connection sends a SET, waits for the reply and sends the next one, so
+with "always" each reply means the write is on disk. The more connections,
+the more writes share one fsync.
+*/
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <string>
+#include <vector>
+
+struct BenchConn {
+    int fd = -1;
+    std::string req;
+    size_t sent = 0;
+    uint8_t rbuf[256];
+    size_t rlen = 0;
+    uint64_t start_us = 0;
+};
+
+static uint64_t get_usec() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return (uint64_t)tv.tv_sec * 1000000 + (uint64_t)tv.tv_nsec / 1000;
+}
+
+static void die(const char *msg) {
+    perror(msg);
+    exit(1);
+}
+
+static void put_u32(std::string &out, uint32_t v) {
+    out.append((const char *)&v, 4);
+}
+
+// a framed SET request, same encoding as the client
+static void make_set(std::string &out, const std::string &key, const std::string &val) {
+    out.clear();
+    put_u32(out, 4 + 4 + 3 + 4 + (uint32_t)key.size() + 4 + (uint32_t)val.size());
+    put_u32(out, 3);
+    put_u32(out, 3);
+    out.append("set");
+    put_u32(out, (uint32_t)key.size());
+    out.append(key);
+    put_u32(out, (uint32_t)val.size());
+    out.append(val);
+}
+
+int main(int argc, char **argv) {
+    size_t nconns = argc > 1 ? (size_t)atoi(argv[1]) : 64;
+    double seconds = argc > 2 ? atof(argv[2]) : 5;
+    size_t vsize = argc > 3 ? (size_t)atoi(argv[3]) : 100;
+    std::string val(vsize, 'x');
+
+    std::vector<BenchConn> conns(nconns);
+    std::vector<struct pollfd> pfds(nconns);
+    for (size_t i = 0; i < nconns; ++i) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) {
+            die("socket()");
+        }
+        struct sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = ntohs(1234);
+        addr.sin_addr.s_addr = ntohl(INADDR_LOOPBACK);
+        if (connect(fd, (const struct sockaddr *)&addr, sizeof(addr)) != 0) {
+            die("connect");
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        conns[i].fd = fd;
+    }
+
+    uint64_t ops = 0;
+    uint64_t lat_total = 0;
+    uint64_t lat_max = 0;
+    uint64_t seq = 0;
+    uint64_t start = get_usec();
+    uint64_t deadline = start + (uint64_t)(seconds * 1e6);
+    for (BenchConn &c : conns) {
+        make_set(c.req, "bench:" + std::to_string(seq++ % 100000), val);
+        c.start_us = get_usec();
+    }
+    while (get_usec() < deadline) {
+        for (size_t i = 0; i < nconns; ++i) {
+            BenchConn &c = conns[i];
+            pfds[i].fd = c.fd;
+            pfds[i].events = c.sent < c.req.size() ? POLLOUT : POLLIN;
+            pfds[i].revents = 0;
+        }
+        if (poll(pfds.data(), (nfds_t)nconns, 100) < 0) {
+            die("poll");
+        }
+        for (size_t i = 0; i < nconns; ++i) {
+            BenchConn &c = conns[i];
+            if (!pfds[i].revents) {
+                continue;
+            }
+            if (c.sent < c.req.size()) {
+                ssize_t rv = write(c.fd, c.req.data() + c.sent, c.req.size() - c.sent);
+                if (rv < 0) {
+                    die("write");
+                }
+                c.sent += (size_t)rv;
+                continue;
+            }
+            ssize_t rv = read(c.fd, c.rbuf + c.rlen, sizeof(c.rbuf) - c.rlen);
+            if (rv <= 0) {
+                die("read");
+            }
+            c.rlen += (size_t)rv;
+            uint32_t len = 0;
+            if (c.rlen < 4 || (memcpy(&len, c.rbuf, 4), c.rlen < 4 + len)) {
+                continue;
+            }
+            // got the reply, send the next write
+            uint64_t now = get_usec();
+            uint64_t lat = now - c.start_us;
+            lat_total += lat;
+            lat_max = lat > lat_max ? lat : lat_max;
+            ops++;
+            c.rlen = 0;
+            c.sent = 0;
+            c.start_us = now;
+            make_set(c.req, "bench:" + std::to_string(seq++ % 100000), val);
+        }
+    }
+    double elapsed = (get_usec() - start) / 1e6;
+    printf("%zu conns, %zu bytes values: %.0f writes/s, avg latency %.1f us, max %.1f ms\n",
+        nconns, vsize, ops / elapsed, ops ? (double)lat_total / ops : 0.0, lat_max / 1e3);
+    return 0;
+}
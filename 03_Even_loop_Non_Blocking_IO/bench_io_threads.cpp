@@ -0,0 +1,168 @@
+/*
+Scaling of the server with the number of I/O threads.
+
+    g++ -O2 bench_io_threads.cpp -o bench_io_threads
+    ./bench_io_threads [--server ./server] [--load ./bench_load] [--max-threads n]
+                       [--conns n] [--pipeline n] [--value-size n] [--duration s]
+
+Starts the server without --io-threads, then with --io-threads 1, 2, 4... up
+to `max-threads` (default: the number of cores), each time on a fresh port,
+and runs the load generator (bench_load --json, one thread per core) against
+it. Prints the throughput and the latency of every run and the speedup over
+the server without threads. --io-threads 1 shows what batching the replies
+brings by itself, the runs after it what the threads add.
+*/
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct Options {
+    std::string server = "./server";
+    std::string load = "./bench_load";
+    unsigned max_threads = 0;
+    unsigned conns = 32;
+    unsigned pipeline = 16;
+    unsigned value_size = 4000;
+    unsigned duration = 5;
+};
+
+struct Result {
+    double rps = 0;
+    double p50_us = 0;
+    double p99_us = 0;
+};
+
+static pid_t start_server(const Options &o, uint16_t port, unsigned io_threads) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0) {
+        std::string p = std::to_string(port), n = std::to_string(io_threads);
+        std::vector<const char *> argv = {o.server.c_str(), "--port", p.c_str(),
+            "--snapshot", "bench_io_threads.snap", "--loglevel", "warn"};
+        if (io_threads) {
+            argv.push_back("--io-threads");
+            argv.push_back(n.c_str());
+        }
+        argv.push_back(NULL);
+        execv(o.server.c_str(), (char **)argv.data());
+        perror(o.server.c_str());
+        _exit(1);
+    }
+    usleep(300 * 1000);     // listening
+    return pid;
+}
+
+// the "all" line of the JSON of bench_load
+static bool run_load(const Options &o, uint16_t port, Result &r) {
+    unsigned cores = std::thread::hardware_concurrency();
+    cores = cores ? cores : 1;
+    unsigned threads = cores < o.conns ? cores : o.conns;
+    std::string cmd = o.load + " --json --port " + std::to_string(port)
+        + " --threads " + std::to_string(threads)
+        + " --conns " + std::to_string(o.conns / threads)
+        + " --pipeline " + std::to_string(o.pipeline)
+        + " --value-size " + std::to_string(o.value_size)
+        + " --duration " + std::to_string(o.duration) + " --ratio 1:1";
+    FILE *f = popen(cmd.c_str(), "r");
+    if (!f) {
+        perror("popen");
+        return false;
+    }
+    bool found = false;
+    char line[1024];
+    while (fgets(line, sizeof(line), f)) {
+        if (strstr(line, "\"all\"")) {
+            found = sscanf(strstr(line, "\"rps\""), "\"rps\": %lf", &r.rps) == 1
+                && sscanf(strstr(line, "\"p50_us\""), "\"p50_us\": %lf", &r.p50_us) == 1
+                && sscanf(strstr(line, "\"p99_us\""), "\"p99_us\": %lf", &r.p99_us) == 1;
+        }
+    }
+    return pclose(f) == 0 && found;
+}
+
+static bool parse_uint(const char *s, unsigned &out) {
+    char *end = NULL;
+    unsigned long v = strtoul(s, &end, 10);
+    if (*s == '\0' || *end != '\0' || v == 0) {
+        return false;
+    }
+    out = (unsigned)v;
+    return true;
+}
+
+int main(int argc, char **argv) {
+    Options o;
+    for (int i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+        const char *val = i + 1 < argc ? argv[i + 1] : NULL;
+        bool ok = val != NULL;
+        if (ok && strcmp(arg, "--server") == 0) {
+            o.server = val;
+        } else if (ok && strcmp(arg, "--load") == 0) {
+            o.load = val;
+        } else if (ok && strcmp(arg, "--max-threads") == 0) {
+            ok = parse_uint(val, o.max_threads);
+        } else if (ok && strcmp(arg, "--conns") == 0) {
+            ok = parse_uint(val, o.conns);
+        } else if (ok && strcmp(arg, "--pipeline") == 0) {
+            ok = parse_uint(val, o.pipeline);
+        } else if (ok && strcmp(arg, "--value-size") == 0) {
+            ok = parse_uint(val, o.value_size);
+        } else if (ok && strcmp(arg, "--duration") == 0) {
+            ok = parse_uint(val, o.duration);
+        } else {
+            ok = false;
+        }
+        if (!ok) {
+            fprintf(stderr, "usage: %s [--server path] [--load path] [--max-threads n] [--conns n]"
+                " [--pipeline n] [--value-size n] [--duration s]\n", argv[0]);
+            return 1;
+        }
+        ++i;
+    }
+    if (!o.max_threads) {
+        o.max_threads = std::thread::hardware_concurrency();
+        o.max_threads = o.max_threads ? o.max_threads : 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    // 0 is the server without --io-threads
+    std::vector<unsigned> runs = {0};
+    for (unsigned n = 1; n <= o.max_threads; n *= 2) {
+        runs.push_back(n);
+    }
+    printf("%u conns, pipeline %u, values %u bytes, set:get 1:1, %u s per run\n",
+        o.conns, o.pipeline, o.value_size, o.duration);
+    printf("%-10s %12s %10s %10s %8s\n", "io-threads", "req/s", "p50 us", "p99 us", "speedup");
+    double base = 0;
+    uint16_t port = 24000;
+    for (unsigned n : runs) {
+        ++port;
+        pid_t pid = start_server(o, port, n);
+        Result r;
+        bool ok = run_load(o, port, r);
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+        if (!ok) {
+            fprintf(stderr, "the load generator failed against --io-threads %u\n", n);
+            return 1;
+        }
+        if (n == 0) {
+            base = r.rps;
+        }
+        printf("%-10s %12.0f %10.1f %10.1f %7.2fx\n", n ? std::to_string(n).c_str() : "off",
+            r.rps, r.p50_us, r.p99_us, base > 0 ? r.rps / base : 0.0);
+        fflush(stdout);
+    }
+    unlink("bench_io_threads.snap");
+    return 0;
+}
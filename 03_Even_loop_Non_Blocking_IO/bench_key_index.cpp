@@ -0,0 +1,126 @@
+/*
+Benchmark of the radix tree key index against a walk of the hash table.
+
+    g++ -O2 bench_key_index.cpp rax.cpp glob.cpp -o bench_key_index
+    ./bench_key_index [nkeys]       (default 10M keys)
+
+Keys look like "tenant:0042:user:00001234:profile", tenants have very
+different sizes (a few big ones, a long tail of small ones), which is what
+a multi-tenant keyspace looks like.
+*/
+#include <malloc.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "glob.h"
+#include "rax.h"
+
+static uint64_t get_nsec() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return (uint64_t)tv.tv_sec * 1000000000 + (uint64_t)tv.tv_nsec;
+}
+
+static size_t heap_used() {
+    struct mallinfo2 mi = mallinfo2();
+    return mi.uordblks + mi.hblkhd;
+}
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+static uint64_t rng() {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static const char *k_suffixes[] = {"profile", "session", "cart", "settings"};
+
+int main(int argc, char **argv) {
+    size_t nkeys = argc > 1 ? (size_t)strtoull(argv[1], NULL, 10) : 10000000;
+    const uint32_t ntenants = 10000;
+
+    // tenant sizes follow a power law: tenant t gets a share ~ 1/(t+1)
+    std::vector<std::string> keys;
+    keys.reserve(nkeys);
+    char buf[128];
+    for (size_t i = 0; i < nkeys; ++i) {
+        double u = (double)(rng() % 1000000) / 1000000.0;
+        uint32_t tenant = (uint32_t)(ntenants * u * u * u);
+        uint32_t user = (uint32_t)(rng() % 100000000);
+        int n = snprintf(buf, sizeof(buf), "tenant:%04u:user:%08u:%s",
+            tenant, user, k_suffixes[rng() % 4]);
+        keys.push_back(std::string(buf, (size_t)n));
+    }
+    size_t key_bytes = 0;
+    for (const std::string &k : keys) {
+        key_bytes += k.size();
+    }
+    printf("keys: %zu, key bytes: %.1f MB\n", nkeys, key_bytes / 1e6);
+
+    // hash table
+    size_t before = heap_used();
+    uint64_t t0 = get_nsec();
+    std::unordered_map<std::string, void *> db;
+    db.reserve(nkeys);
+    for (const std::string &k : keys) {
+        db[k] = NULL;
+    }
+    uint64_t t1 = get_nsec();
+    printf("hash table: insert %.1f ns/key, %.1f MB\n",
+        (double)(t1 - t0) / nkeys, (heap_used() - before) / 1e6);
+
+    // radix tree
+    before = heap_used();
+    Rax rax;
+    rax_init(&rax);
+    t0 = get_nsec();
+    for (const std::string &k : keys) {
+        rax_insert(&rax, (const uint8_t *)k.data(), k.size(), NULL, NULL);
+    }
+    t1 = get_nsec();
+    printf("radix tree: insert %.1f ns/key, %.1f MB (%zu nodes, %.1f bytes/key)\n",
+        (double)(t1 - t0) / nkeys, (heap_used() - before) / 1e6,
+        rax.numnodes, (double)rax.bytes / rax.numele);
+
+    // prefix and glob queries, for a big, a medium and a small tenant
+    const char *patterns[] = {
+        "tenant:0000:*", "tenant:0100:*", "tenant:5000:*",
+        "tenant:0100:user:*:cart", "tenant:5000:user:0*:session",
+    };
+    for (const char *pat : patterns) {
+        size_t plen = strlen(pat);
+        size_t lit = glob_literal_prefix(pat, plen);
+
+        t0 = get_nsec();
+        size_t n1 = 0;
+        for (const auto &kv : db) {
+            n1 += glob_match(pat, plen, kv.first.data(), kv.first.size()) ? 1 : 0;
+        }
+        t1 = get_nsec();
+
+        size_t n2 = 0;
+        size_t visited = 0;
+        RaxIter it;
+        rax_seek(&it, &rax, (const uint8_t *)pat, lit);
+        while (rax_next(&it)) {
+            if (it.key.compare(0, lit, pat, 0, lit) != 0) {
+                break;
+            }
+            visited++;
+            n2 += glob_match(pat, plen, it.key.data(), it.key.size()) ? 1 : 0;
+        }
+        uint64_t t2 = get_nsec();
+
+        printf("%-28s matches %8zu | full walk %9.3f ms | radix %9.3f ms, %zu keys visited%s\n",
+            pat, n1, (t1 - t0) / 1e6, (t2 - t1) / 1e6, visited, n1 == n2 ? "" : " MISMATCH");
+    }
+
+    rax_clear(&rax, NULL);
+    return 0;
+}
@@ -0,0 +1,505 @@
+/*
+Load generator, in the spirit of redis-benchmark / memtier, built on the
+asynchronous client (client.h).
+
+    g++ -O2 -pthread bench_load.cpp client.cpp protocol.cpp shmring.cpp histogram.cpp -o bench_load
+    ./bench_load [--host h] [--port n] [--threads n] [--conns n] [--pipeline n]
+                 [--duration s] [--requests n] [--keyspace n] [--zipf s]
+                 [--ratio sets:gets] [--value-size n[-m]] [--rate req/s]
+                 [--transport auto|tcp|unix|shm] [--unix-path p] [--populate] [--json]
+
+Every thread has its own client with `conns` connections. Closed loop (the
+default): each connection keeps `pipeline` requests in flight, a reply
+sends the next request. Open loop (--rate): requests are sent on a fixed
+schedule whatever the server does, and the latency of a request is counted
+from the time it was due, not from the time it was sent, so a stall of the
+server shows up in every request it delayed (no coordinated omission).
+
+Keys are "key:<n>" with n uniform in [0, keyspace), or Zipfian with
+exponent s (--zipf 0.99, s < 1) where key:0 is the hottest. Latencies go to
+log-linear histograms (histogram.h), reported as p50/p90/p99/p99.9/max for
+all requests and per command, as text or as one JSON object (--json).
+
+The transport is the client library's (client.h): shared memory by default
+when the server is local and listens on its Unix socket.
+*/
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <thread>
+#include <vector>
+#include "client.h"
+#include "histogram.h"
+
+enum {
+    OP_SET = 0,
+    OP_GET = 1,
+    OP_COUNT = 2,
+};
+
+static const char *const k_op_names[OP_COUNT] = {"set", "get"};
+
+struct BenchOptions {
+    ClientOptions client;
+    uint32_t threads = 1;
+    uint32_t pipeline = 1;
+    double duration = 10;
+    uint64_t requests = 0;      // 0: until `duration`
+    uint64_t keyspace = 100000;
+    double zipf = 0;            // 0: uniform
+    uint32_t ratio_set = 1;
+    uint32_t ratio_get = 10;
+    size_t value_min = 100;
+    size_t value_max = 100;
+    double rate = 0;            // requests/s for all threads, 0: closed loop
+    bool populate = false;
+    bool json = false;
+};
+
+static uint64_t get_nsec() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return (uint64_t)tv.tv_sec * 1000000000 + (uint64_t)tv.tv_nsec;
+}
+
+// xorshift64*
+static uint64_t rand_next(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+static double rand_unit(uint64_t *state) {
+    return (double)(rand_next(state) >> 11) / (double)(1ULL << 53);
+}
+
+/*
+Zipfian ranks in [0, n) with P(k) proportional to 1/(k+1)^theta, the
+method of Gray et al., "Quickly generating billion-record synthetic
+databases" (as in YCSB): O(n) once for zeta(n), then O(1) per sample.
+*/
+struct Zipf {
+    uint64_t n = 0;
+    double theta = 0;
+    double alpha = 0;
+    double zetan = 0;
+    double eta = 0;
+};
+
+static double zeta(uint64_t n, double theta) {
+    double sum = 0;
+    for (uint64_t i = 1; i <= n; ++i) {
+        sum += 1.0 / pow((double)i, theta);
+    }
+    return sum;
+}
+
+static void zipf_init(Zipf *z, uint64_t n, double theta) {
+    z->n = n;
+    z->theta = theta;
+    z->alpha = 1.0 / (1.0 - theta);
+    z->zetan = zeta(n, theta);
+    double zeta2 = zeta(2, theta);
+    z->eta = (1.0 - pow(2.0 / (double)n, 1.0 - theta)) / (1.0 - zeta2 / z->zetan);
+}
+
+static uint64_t zipf_next(const Zipf *z, uint64_t *state) {
+    double u = rand_unit(state);
+    double uz = u * z->zetan;
+    if (uz < 1.0) {
+        return 0;
+    }
+    if (uz < 1.0 + pow(0.5, z->theta)) {
+        return 1;
+    }
+    uint64_t k = (uint64_t)((double)z->n * pow(z->eta * u - z->eta + 1.0, z->alpha));
+    return k < z->n ? k : z->n - 1;
+}
+
+struct Worker;
+
+// a request in flight, the callback argument
+struct Pending {
+    Worker *w;
+    uint32_t op;
+    uint64_t start_ns;
+};
+
+struct Worker {
+    const BenchOptions *opts;
+    const Zipf *zipf;
+    uint32_t id = 0;
+    Client *c = NULL;
+    uint64_t rng = 0;
+    uint64_t budget = 0;        // requests this thread may still send, if --requests
+    bool limited = false;
+    uint64_t deadline_ns = 0;
+    bool open_loop = false;
+    std::vector<Pending *> free_slots;
+    std::vector<std::string> cmd;
+    std::string value;
+    // results
+    Histogram hist[OP_COUNT];
+    uint64_t errors = 0;
+    uint64_t sent = 0;
+    uint64_t late = 0;          // open loop: sends behind schedule by more than 1 ms
+    uint64_t dropped = 0;       // open loop: due with every request slot in flight
+};
+
+static uint64_t next_key(Worker *w) {
+    if (w->zipf->n) {
+        return zipf_next(w->zipf, &w->rng);
+    }
+    return rand_next(&w->rng) % w->opts->keyspace;
+}
+
+static void on_reply(void *arg, Reply *reply);
+
+// false if the thread is done, has no free slot or the client refused the request
+static bool send_one(Worker *w, uint64_t start_ns) {
+    if (w->limited && w->budget == 0) {
+        return false;
+    }
+    if (w->free_slots.empty()) {
+        // only in the open loop, the server is that far behind: the request
+        // is never sent, and counted apart so the latencies aren't flattered
+        w->dropped++;
+        w->budget -= w->limited ? 1 : 0;
+        return false;
+    }
+    const BenchOptions *o = w->opts;
+    uint32_t op = (rand_next(&w->rng) % (o->ratio_set + o->ratio_get)) < o->ratio_set ? OP_SET : OP_GET;
+    w->cmd.resize(op == OP_SET ? 3 : 2);
+    w->cmd[0] = k_op_names[op];
+    w->cmd[1] = "key:" + std::to_string(next_key(w));
+    if (op == OP_SET) {
+        size_t vlen = o->value_min + (o->value_max > o->value_min
+            ? rand_next(&w->rng) % (o->value_max - o->value_min + 1) : 0);
+        w->cmd[2].assign(w->value, 0, vlen);
+    }
+    Pending *p = w->free_slots.back();
+    p->op = op;
+    p->start_ns = start_ns;
+    if (!client_send(w->c, w->cmd, &on_reply, p)) {
+        w->errors++;
+        return false;
+    }
+    w->free_slots.pop_back();
+    w->sent++;
+    w->budget -= w->limited ? 1 : 0;
+    return true;
+}
+
+static void on_reply(void *arg, Reply *reply) {
+    Pending *p = (Pending *)arg;
+    Worker *w = p->w;
+    uint64_t now = get_nsec();
+    if (reply->type == REPLY_ERR) {
+        w->errors++;
+    } else {
+        hist_record(&w->hist[p->op], now - p->start_ns);
+    }
+    w->free_slots.push_back(p);
+    if (!w->open_loop && now < w->deadline_ns) {
+        send_one(w, now);
+    }
+}
+
+static void worker_populate(Worker *w, uint64_t first, uint64_t last) {
+    std::vector<std::string> cmd(3);
+    cmd[0] = "set";
+    uint64_t k = first;
+    while (k < last || client_pending(w->c) > 0) {
+        while (k < last && client_pending(w->c) < w->free_slots.size()) {
+            cmd[1] = "key:" + std::to_string(k);
+            cmd[2].assign(w->value, 0, w->opts->value_min);
+            if (!client_send(w->c, cmd, [](void *, Reply *) {}, NULL)) {
+                fprintf(stderr, "populate: can't reach the server\n");
+                exit(1);
+            }
+            k++;
+        }
+        client_poll(w->c, 100);
+    }
+}
+
+static void worker_run(Worker *w) {
+    uint64_t now = get_nsec();
+    if (!w->open_loop) {
+        // fill the pipelines, the replies keep them full
+        size_t n = w->free_slots.size();
+        for (size_t i = 0; i < n && send_one(w, now); ++i) {}
+        while (client_pending(w->c) > 0 || (now < w->deadline_ns && !(w->limited && w->budget == 0))) {
+            client_poll(w->c, 10);
+            now = get_nsec();
+            if (client_pending(w->c) == 0 && now < w->deadline_ns) {
+                send_one(w, now);   // after an error emptied the pipelines
+            }
+        }
+        return;
+    }
+
+    double interval = 1e9 * w->opts->threads / w->opts->rate;
+    double due = (double)now;
+    while (true) {
+        now = get_nsec();
+        bool done = (double)due >= (double)w->deadline_ns || (w->limited && w->budget == 0);
+        while (!done && due <= (double)now) {
+            if (now - (uint64_t)due > 1000000) {
+                w->late++;
+            }
+            // counted from when it was due; refused ones are errors,
+            // those without a free slot are dropped
+            send_one(w, (uint64_t)due);
+            due += interval;
+            done = due >= (double)w->deadline_ns || (w->limited && w->budget == 0);
+        }
+        if (done && client_pending(w->c) == 0) {
+            break;
+        }
+        int timeout = done ? 100 : (int)((due - (double)now) / 1e6);
+        client_poll(w->c, timeout);
+    }
+}
+
+static void print_hist_text(const char *name, const Histogram *h, double seconds) {
+    printf("%-4s %10llu req %10.0f req/s | avg %8.1f p50 %8.1f p90 %8.1f p99 %8.1f p99.9 %8.1f max %8.1f us\n",
+        name, (unsigned long long)h->total, h->total / seconds, hist_mean(h) / 1e3,
+        hist_percentile(h, 50) / 1e3, hist_percentile(h, 90) / 1e3, hist_percentile(h, 99) / 1e3,
+        hist_percentile(h, 99.9) / 1e3, h->max / 1e3);
+}
+
+static void print_hist_json(const char *name, const Histogram *h, double seconds, bool last) {
+    printf("    \"%s\": {\"requests\": %llu, \"rps\": %.1f, \"avg_us\": %.2f, \"p50_us\": %.2f, \"p90_us\": %.2f, "
+        "\"p99_us\": %.2f, \"p999_us\": %.2f, \"max_us\": %.2f}%s\n",
+        name, (unsigned long long)h->total, h->total / seconds, hist_mean(h) / 1e3,
+        hist_percentile(h, 50) / 1e3, hist_percentile(h, 90) / 1e3, hist_percentile(h, 99) / 1e3,
+        hist_percentile(h, 99.9) / 1e3, h->max / 1e3, last ? "" : ",");
+}
+
+static bool parse_ratio(const char *s, uint32_t *sets, uint32_t *gets) {
+    unsigned a = 0, b = 0;
+    if (sscanf(s, "%u:%u", &a, &b) != 2 || a + b == 0) {
+        return false;
+    }
+    *sets = a;
+    *gets = b;
+    return true;
+}
+
+static bool parse_size_range(const char *s, size_t *lo, size_t *hi) {
+    unsigned long a = 0, b = 0;
+    int n = sscanf(s, "%lu-%lu", &a, &b);
+    if (n == 1) {
+        b = a;
+    }
+    if (n < 1 || b < a || b > 4000) {     // a SET must fit in a request
+        return false;
+    }
+    *lo = a;
+    *hi = b;
+    return true;
+}
+
+static bool parse_transport(const char *s, uint32_t *out) {
+    static const char *const names[] = {"auto", "tcp", "unix", "shm"};
+    for (uint32_t i = 0; i < 4; ++i) {
+        if (strcmp(s, names[i]) == 0) {
+            *out = i;   // CLIENT_TRANSPORT_*
+            return true;
+        }
+    }
+    return false;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [--host h] [--port n] [--threads n] [--conns n] [--pipeline n]"
+        " [--duration s] [--requests n] [--keyspace n] [--zipf s] [--ratio sets:gets]"
+        " [--value-size n[-m]] [--rate req/s] [--transport auto|tcp|unix|shm] [--unix-path p]"
+        " [--populate] [--json]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    BenchOptions o;
+    o.client.nconns = 4;
+    for (int i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+        const char *val = i + 1 < argc ? argv[i + 1] : NULL;
+        bool used = true;
+        if (strcmp(arg, "--populate") == 0) {
+            o.populate = true;
+            used = false;
+        } else if (strcmp(arg, "--json") == 0) {
+            o.json = true;
+            used = false;
+        } else if (!val) {
+            usage(argv[0]);
+        } else if (strcmp(arg, "--host") == 0) {
+            o.client.host = val;
+        } else if (strcmp(arg, "--port") == 0) {
+            o.client.port = (uint16_t)atoi(val);
+        } else if (strcmp(arg, "--threads") == 0) {
+            o.threads = (uint32_t)atoi(val);
+        } else if (strcmp(arg, "--conns") == 0) {
+            o.client.nconns = (uint32_t)atoi(val);
+        } else if (strcmp(arg, "--pipeline") == 0) {
+            o.pipeline = (uint32_t)atoi(val);
+        } else if (strcmp(arg, "--duration") == 0) {
+            o.duration = atof(val);
+        } else if (strcmp(arg, "--requests") == 0) {
+            o.requests = strtoull(val, NULL, 10);
+        } else if (strcmp(arg, "--keyspace") == 0) {
+            o.keyspace = strtoull(val, NULL, 10);
+        } else if (strcmp(arg, "--zipf") == 0) {
+            o.zipf = atof(val);
+        } else if (strcmp(arg, "--ratio") == 0) {
+            if (!parse_ratio(val, &o.ratio_set, &o.ratio_get)) {
+                usage(argv[0]);
+            }
+        } else if (strcmp(arg, "--value-size") == 0) {
+            if (!parse_size_range(val, &o.value_min, &o.value_max)) {
+                usage(argv[0]);
+            }
+        } else if (strcmp(arg, "--rate") == 0) {
+            o.rate = atof(val);
+        } else if (strcmp(arg, "--transport") == 0) {
+            if (!parse_transport(val, &o.client.transport)) {
+                usage(argv[0]);
+            }
+        } else if (strcmp(arg, "--unix-path") == 0) {
+            o.client.unix_path = val;
+        } else {
+            usage(argv[0]);
+        }
+        i += used ? 1 : 0;
+    }
+    if (o.threads == 0 || o.client.nconns == 0 || o.pipeline == 0 || o.keyspace == 0
+        || o.zipf < 0 || o.zipf >= 1 || o.rate < 0)
+    {
+        usage(argv[0]);
+    }
+
+    Zipf zipf;
+    if (o.zipf > 0) {
+        zipf_init(&zipf, o.keyspace, o.zipf);
+    }
+    std::vector<Worker> workers(o.threads);
+    // in open loop the pipelines are only bounded by memory
+    size_t slots = o.rate > 0 ? 100000 : (size_t)o.client.nconns * o.pipeline;
+    std::vector<std::vector<Pending>> pendings(o.threads, std::vector<Pending>(slots));
+    for (uint32_t t = 0; t < o.threads; ++t) {
+        Worker &w = workers[t];
+        w.opts = &o;
+        w.zipf = &zipf;
+        w.id = t;
+        w.c = client_new(o.client);
+        w.rng = 0x9E3779B97F4A7C15ULL * (t + 1);
+        w.open_loop = o.rate > 0;
+        w.limited = o.requests > 0;
+        w.budget = o.requests / o.threads + (t < o.requests % o.threads ? 1 : 0);
+        w.value.assign(o.value_max, 'x');
+        for (Pending &p : pendings[t]) {
+            p.w = &w;
+            w.free_slots.push_back(&p);
+        }
+        for (int op = 0; op < OP_COUNT; ++op) {
+            hist_init(&w.hist[op]);
+        }
+    }
+
+    std::vector<std::thread> threads;
+    if (o.populate) {
+        for (uint32_t t = 0; t < o.threads; ++t) {
+            uint64_t first = o.keyspace * t / o.threads, last = o.keyspace * (t + 1) / o.threads;
+            threads.emplace_back(worker_populate, &workers[t], first, last);
+        }
+        for (std::thread &th : threads) {
+            th.join();
+        }
+        threads.clear();
+    }
+
+    uint64_t start = get_nsec();
+    for (Worker &w : workers) {
+        w.deadline_ns = start + (uint64_t)(o.duration * 1e9);
+        threads.emplace_back(worker_run, &w);
+    }
+    for (std::thread &th : threads) {
+        th.join();
+    }
+    double seconds = (get_nsec() - start) / 1e9;
+
+    Histogram all, per_op[OP_COUNT];
+    hist_init(&all);
+    uint64_t errors = 0, late = 0, dropped = 0;
+    ClientStats cs, total_cs;
+    for (int op = 0; op < OP_COUNT; ++op) {
+        hist_init(&per_op[op]);
+    }
+    for (Worker &w : workers) {
+        for (int op = 0; op < OP_COUNT; ++op) {
+            hist_merge(&per_op[op], &w.hist[op]);
+            hist_merge(&all, &w.hist[op]);
+        }
+        errors += w.errors;
+        late += w.late;
+        dropped += w.dropped;
+        client_get_stats(w.c, &cs);
+        total_cs.requests += cs.requests;
+        total_cs.writes += cs.writes;
+        total_cs.connects += cs.connects;
+        total_cs.shm_connects += cs.shm_connects;
+        client_free(w.c);
+    }
+    double per_write = total_cs.writes ? (double)total_cs.requests / total_cs.writes : 0.0;
+
+    char dist[64];
+    if (o.zipf > 0) {
+        snprintf(dist, sizeof(dist), "zipf %.2f", o.zipf);
+    } else {
+        snprintf(dist, sizeof(dist), "uniform");
+    }
+    if (o.json) {
+        printf("{\n  \"config\": {\"threads\": %u, \"conns\": %u, \"pipeline\": %u, \"keyspace\": %llu, "
+            "\"distribution\": \"%s\", \"ratio\": \"%u:%u\", \"value_min\": %zu, \"value_max\": %zu, "
+            "\"rate\": %.1f},\n",
+            o.threads, o.client.nconns, o.pipeline, (unsigned long long)o.keyspace, dist,
+            o.ratio_set, o.ratio_get, o.value_min, o.value_max, o.rate);
+        printf("  \"seconds\": %.3f,\n  \"errors\": %llu,\n  \"late\": %llu,\n  \"dropped\": %llu,\n"
+            "  \"requests_per_write\": %.2f,\n  \"connects\": %llu,\n  \"shm_connects\": %llu,\n  \"latency\": {\n",
+            seconds, (unsigned long long)errors, (unsigned long long)late, (unsigned long long)dropped, per_write,
+            (unsigned long long)total_cs.connects, (unsigned long long)total_cs.shm_connects);
+        print_hist_json("all", &all, seconds, false);
+        print_hist_json("set", &per_op[OP_SET], seconds, false);
+        print_hist_json("get", &per_op[OP_GET], seconds, true);
+        printf("  }\n}\n");
+        return 0;
+    }
+    printf("%u threads x %u conns, %s, %llu keys %s, set:get %u:%u, values %zu-%zu bytes\n",
+        o.threads, o.client.nconns,
+        o.rate > 0 ? (std::string("open loop ") + std::to_string((uint64_t)o.rate) + " req/s").c_str()
+            : (std::string("pipeline ") + std::to_string(o.pipeline)).c_str(),
+        (unsigned long long)o.keyspace, dist, o.ratio_set, o.ratio_get, o.value_min, o.value_max);
+    printf("%.2f s, %llu errors, %.1f requests per write()", seconds, (unsigned long long)errors, per_write);
+    if (o.rate > 0) {
+        printf(", %llu sends more than 1 ms late, %llu dropped", (unsigned long long)late,
+            (unsigned long long)dropped);
+    }
+    if (total_cs.shm_connects) {
+        printf(", %llu of %llu connections on shared memory",
+            (unsigned long long)total_cs.shm_connects, (unsigned long long)total_cs.connects);
+    }
+    printf("\n");
+    print_hist_text("all", &all, seconds);
+    print_hist_text("set", &per_op[OP_SET], seconds);
+    print_hist_text("get", &per_op[OP_GET], seconds);
+    return 0;
+}
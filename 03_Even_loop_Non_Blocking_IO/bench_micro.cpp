@@ -0,0 +1,766 @@
+/*
+Microbenchmarks of the hot components, each measured in isolation.
+
+    g++ -O2 -pthread bench_micro.cpp clock.cpp histogram.cpp hotkeys.cpp log.cpp protocol.cpp hashtable.cpp rax.cpp hyperloglog.cpp snapshot.cpp stream.cpp cluster.cpp -o bench_micro
+    ./bench_micro [--save out.json] [--baseline base.json] [--threshold pct] [filter...]
+
+Each benchmark is calibrated to run about 100 ms, then run 5 times; the
+median run is reported as ns/op, with the heap allocations per op (malloc
+is interposed and counted) and the user-space instructions per op when the
+kernel gives access to the perf_event counters (n/a otherwise, e.g. in a VM
+without a PMU or with perf_event_paranoid > 2).
+
+--save writes the results as JSON, --baseline compares against such a file
+and exits with 1 if a benchmark got slower than the threshold (10% by
+default). Instructions/op are compared when both runs have them, they
+barely move between runs of the same binary; ns/op otherwise.
+
+A few regression checks of the components run first, a failed one is
+printed and makes the exit status 1 as well.
+*/
+#include <errno.h>
+#include <math.h>
+#include <malloc.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <algorithm>
+#include <functional>
+#include <string>
+#include <vector>
+#include "clock.h"
+#include "cluster.h"
+#include "common.h"
+#include "hashtable.h"
+#include "histogram.h"
+#include "hotkeys.h"
+#include "hyperloglog.h"
+#include "protocol.h"
+#include "rax.h"
+#include "snapshot.h"
+#include "stream.h"
+
+// every allocation of the process goes through here
+static uint64_t g_allocs = 0;
+
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *p, size_t size);
+
+void *malloc(size_t size) {
+    g_allocs++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+    g_allocs++;
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size) {
+    g_allocs++;
+    return __libc_realloc(p, size);
+}
+}
+
+static uint64_t get_nsec() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return (uint64_t)tv.tv_sec * 1000000000 + (uint64_t)tv.tv_nsec;
+}
+
+static int g_perf_fd = -1;
+
+static void perf_open() {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    g_perf_fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static uint64_t perf_read() {
+    uint64_t v = 0;
+    if (g_perf_fd >= 0 && read(g_perf_fd, &v, sizeof(v)) != (ssize_t)sizeof(v)) {
+        v = 0;
+    }
+    return v;
+}
+
+// keeps the compiler from dropping the work of a benchmark
+template <class T>
+static void keep(const T &v) {
+    asm volatile("" : : "g"(&v) : "memory");
+}
+
+static uint64_t g_rng = 0x9e3779b97f4a7c15ULL;
+static uint64_t rng() {
+    g_rng ^= g_rng << 13;
+    g_rng ^= g_rng >> 7;
+    g_rng ^= g_rng << 17;
+    return g_rng;
+}
+
+struct BenchResult {
+    std::string name;
+    double ns = 0;
+    double allocs = 0;
+    double insns = -1;      // -1 without counters
+};
+
+static std::vector<BenchResult> g_results;
+static std::vector<std::string> g_filters;
+
+static bool selected(const char *name) {
+    if (g_filters.empty()) {
+        return true;
+    }
+    for (const std::string &f : g_filters) {
+        if (strstr(name, f.c_str())) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// `fn(n)` runs n operations
+static void bench(const char *name, const std::function<void(uint64_t)> &fn) {
+    if (!selected(name)) {
+        return;
+    }
+    uint64_t n = 1;
+    while (true) {
+        uint64_t t0 = get_nsec();
+        fn(n);
+        uint64_t dt = get_nsec() - t0;
+        if (dt >= 10000000 || n >= (1ULL << 40)) {
+            n = std::max<uint64_t>(1, (uint64_t)((double)n * 100e6 / (double)std::max<uint64_t>(dt, 1)));
+            break;
+        }
+        n *= 4;
+    }
+    std::vector<BenchResult> runs;
+    for (int r = 0; r < 5; ++r) {
+        BenchResult res;
+        uint64_t a0 = g_allocs;
+        if (g_perf_fd >= 0) {
+            ioctl(g_perf_fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(g_perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+        uint64_t t0 = get_nsec();
+        fn(n);
+        uint64_t dt = get_nsec() - t0;
+        if (g_perf_fd >= 0) {
+            ioctl(g_perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+            res.insns = (double)perf_read() / (double)n;
+        }
+        res.allocs = (double)(g_allocs - a0) / (double)n;
+        res.ns = (double)dt / (double)n;
+        runs.push_back(res);
+    }
+    std::sort(runs.begin(), runs.end(), [](const BenchResult &a, const BenchResult &b) { return a.ns < b.ns; });
+    BenchResult res = runs[2];
+    res.name = name;
+    if (res.insns >= 0) {
+        printf("%-32s %10.1f ns/op %8.2f allocs/op %10.1f insns/op\n", name, res.ns, res.allocs, res.insns);
+    } else {
+        printf("%-32s %10.1f ns/op %8.2f allocs/op        n/a insns/op\n", name, res.ns, res.allocs);
+    }
+    fflush(stdout);
+    g_results.push_back(res);
+}
+
+// the request framing and parsing of try_one_request()
+static void bench_protocol() {
+    std::vector<std::string> set_cmd = {"set", "key:12345678", std::string(100, 'x')};
+    std::string frame;
+    put_req(frame, set_cmd);
+
+    bench("protocol/put_req set", [&](uint64_t n) {
+        std::string out;
+        for (uint64_t i = 0; i < n; ++i) {
+            out.clear();
+            put_req(out, set_cmd);
+            keep(out);
+        }
+    });
+
+    bench("protocol/parse_req set", [&](uint64_t n) {
+        std::vector<std::string> cmd;
+        for (uint64_t i = 0; i < n; ++i) {
+            uint32_t len = 0;
+            memcpy(&len, frame.data(), 4);
+            parse_req((const uint8_t *)frame.data() + 4, len, cmd);
+            keep(cmd);
+        }
+    });
+
+    // a read buffer full of pipelined GETs, consumed like conn_consume():
+    // one memmove of the rest of the buffer per request
+    std::string get_frame;
+    put_req(get_frame, {"get", "key:12345678"});
+    const size_t k_rbuf = 4 + 4096;
+    size_t per_buf = k_rbuf / get_frame.size();
+    std::vector<uint8_t> filled;
+    for (size_t i = 0; i < per_buf; ++i) {
+        filled.insert(filled.end(), get_frame.begin(), get_frame.end());
+    }
+
+    bench("protocol/pipeline memmove", [&](uint64_t n) {
+        std::vector<uint8_t> rbuf(k_rbuf);
+        std::vector<std::string> cmd;
+        size_t rbuf_size = 0;
+        for (uint64_t i = 0; i < n; ++i) {
+            if (rbuf_size < 4) {
+                memcpy(rbuf.data(), filled.data(), filled.size());
+                rbuf_size = filled.size();
+            }
+            uint32_t len = 0;
+            memcpy(&len, rbuf.data(), 4);
+            parse_req(&rbuf[4], len, cmd);
+            size_t remain = rbuf_size - 4 - len;
+            memmove(rbuf.data(), &rbuf[4 + len], remain);
+            rbuf_size = remain;
+        }
+        keep(cmd);
+    });
+
+    // the same with a read offset, the buffer is compacted once per refill
+    bench("protocol/pipeline offset", [&](uint64_t n) {
+        std::vector<uint8_t> rbuf(k_rbuf);
+        std::vector<std::string> cmd;
+        size_t start = 0, end = 0;
+        for (uint64_t i = 0; i < n; ++i) {
+            if (end - start < 4) {
+                memmove(rbuf.data(), &rbuf[start], end - start);
+                end -= start;
+                start = 0;
+                memcpy(&rbuf[end], filled.data(), filled.size());
+                end += filled.size();
+            }
+            uint32_t len = 0;
+            memcpy(&len, &rbuf[start], 4);
+            parse_req(&rbuf[start + 4], len, cmd);
+            start += 4 + len;
+        }
+        keep(cmd);
+    });
+}
+
+// the response encoding of the commands
+static void bench_encode() {
+    std::string val(100, 'x');
+    std::vector<std::string> keys;
+    for (int i = 0; i < 10; ++i) {
+        keys.push_back("key:" + std::to_string(i));
+    }
+    bench("encode/str 100B", [&](uint64_t n) {
+        std::string out;
+        for (uint64_t i = 0; i < n; ++i) {
+            out.resize(4);
+            out_str(out, val);
+            keep(out);
+        }
+    });
+    bench("encode/int", [&](uint64_t n) {
+        std::string out;
+        for (uint64_t i = 0; i < n; ++i) {
+            out.resize(4);
+            out_int(out, (int64_t)i);
+            keep(out);
+        }
+    });
+    bench("encode/arr 10 str", [&](uint64_t n) {
+        std::string out;
+        for (uint64_t i = 0; i < n; ++i) {
+            out.resize(4);
+            size_t ctx = out_begin_arr(out);
+            for (const std::string &k : keys) {
+                out_str(out, k);
+            }
+            out_end_arr(out, ctx, (uint32_t)keys.size());
+            keep(out);
+        }
+    });
+}
+
+// an entry of the keyspace, as in the server
+struct BenchEntry {
+    HNode node;
+    std::string key;
+};
+
+struct BenchKey {
+    HNode node;
+    const std::string *key;
+};
+
+static bool bench_entry_eq(HNode *node, HNode *key) {
+    BenchEntry *ent = container_of(node, BenchEntry, node);
+    BenchKey *bk = container_of(key, BenchKey, node);
+    return ent->key == *bk->key;
+}
+
+static void bench_keyspace() {
+    for (size_t size : {1000ul, 100000ul, 1000000ul}) {
+        std::vector<std::string> names(size);
+        for (size_t i = 0; i < size; ++i) {
+            names[i] = "key:" + std::to_string(rng() % 100000000) + ":" + std::to_string(i);
+        }
+        std::vector<BenchEntry> ents(size);
+        for (size_t i = 0; i < size; ++i) {
+            ents[i].key = names[i];
+            ents[i].node.hcode = str_hash((const uint8_t *)names[i].data(), names[i].size());
+        }
+        std::string label = std::to_string(size >= 1000000 ? size / 1000000 : size / 1000)
+            + (size >= 1000000 ? "M" : "k");
+
+        // a table that grows from empty, rehashing included
+        bench(("keyspace/insert " + label).c_str(), [&](uint64_t n) {
+            HMap db;
+            uint64_t done = 0;
+            while (done < n) {
+                size_t batch = (size_t)std::min<uint64_t>(size, n - done);
+                for (size_t i = 0; i < batch; ++i) {
+                    ents[i].node.next = NULL;
+                    hm_insert(&db, &ents[i].node);
+                }
+                hm_clear(&db);
+                done += batch;
+            }
+        });
+
+        HMap db;
+        for (BenchEntry &ent : ents) {
+            hm_insert(&db, &ent.node);
+        }
+        // finish the progressive rehash before measuring lookups
+        for (size_t i = 0; i < size; ++i) {
+            BenchKey bk;
+            bk.node.hcode = ents[0].node.hcode;
+            bk.key = &names[0];
+            keep(hm_lookup(&db, &bk.node, &bench_entry_eq));
+        }
+        std::vector<uint32_t> order(1 << 16);
+        for (uint32_t &o : order) {
+            o = (uint32_t)(rng() % size);
+        }
+        bench(("keyspace/lookup hit " + label).c_str(), [&](uint64_t n) {
+            for (uint64_t i = 0; i < n; ++i) {
+                const std::string &k = names[order[i & 0xffff]];
+                BenchKey bk;
+                bk.node.hcode = str_hash((const uint8_t *)k.data(), k.size());
+                bk.key = &k;
+                keep(hm_lookup(&db, &bk.node, &bench_entry_eq));
+            }
+        });
+        std::string miss = "missing:key:0000";
+        bench(("keyspace/lookup miss " + label).c_str(), [&](uint64_t n) {
+            for (uint64_t i = 0; i < n; ++i) {
+                miss[12] = (char)('0' + i % 10);
+                BenchKey bk;
+                bk.node.hcode = str_hash((const uint8_t *)miss.data(), miss.size());
+                bk.key = &miss;
+                keep(hm_lookup(&db, &bk.node, &bench_entry_eq));
+            }
+        });
+        hm_clear(&db);
+    }
+}
+
+static void bench_types() {
+    // radix tree, the key index and the stream index
+    std::vector<std::string> names(100000);
+    for (size_t i = 0; i < names.size(); ++i) {
+        names[i] = "tenant:" + std::to_string(rng() % 1000) + ":user:" + std::to_string(i);
+    }
+    bench("rax/insert+remove 100k", [&](uint64_t n) {
+        Rax rax;
+        rax_init(&rax);
+        for (uint64_t i = 0; i < n; ++i) {
+            const std::string &k = names[i % names.size()];
+            if ((i / names.size()) % 2 == 0) {
+                rax_insert(&rax, (const uint8_t *)k.data(), k.size(), NULL, NULL);
+            } else {
+                rax_remove(&rax, (const uint8_t *)k.data(), k.size(), NULL);
+            }
+        }
+        rax_clear(&rax, NULL);
+    });
+    Rax rax;
+    rax_init(&rax);
+    for (const std::string &k : names) {
+        rax_insert(&rax, (const uint8_t *)k.data(), k.size(), NULL, NULL);
+    }
+    bench("rax/find 100k", [&](uint64_t n) {
+        void *data = NULL;
+        for (uint64_t i = 0; i < n; ++i) {
+            const std::string &k = names[(i * 7919) % names.size()];
+            keep(rax_find(&rax, (const uint8_t *)k.data(), k.size(), &data));
+        }
+    });
+    rax_clear(&rax, NULL);
+
+    // HyperLogLog
+    bench("hll/add sparse", [&](uint64_t n) {
+        std::string hll;
+        hll_init(hll);
+        for (uint64_t i = 0; i < n; ++i) {
+            if (i % 500 == 0) {
+                hll_init(hll);  // stays sparse
+            }
+            uint64_t ele = rng();
+            hll_add(hll, (const uint8_t *)&ele, sizeof(ele));
+        }
+    });
+    std::string dense;
+    hll_init(dense);
+    for (int i = 0; i < 200000; ++i) {
+        uint64_t ele = rng();
+        hll_add(dense, (const uint8_t *)&ele, sizeof(ele));
+    }
+    bench("hll/add dense", [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            uint64_t ele = rng();
+            hll_add(dense, (const uint8_t *)&ele, sizeof(ele));
+        }
+    });
+    bench("hll/count dense", [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            dense[15] |= (char)0x80;    // invalidate the cached cardinality
+            keep(hll_count(dense));
+        }
+    });
+    std::vector<uint8_t> regs(k_hll_registers);
+    bench("hll/merge dense", [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            hll_merge_raw(regs.data(), dense);
+        }
+        keep(regs);
+    });
+
+    // streams
+    std::vector<std::string> fv = {"sensor", "temp-42", "value", "23.5"};
+    bench("stream/append", [&](uint64_t n) {
+        Stream *s = stream_new();
+        for (uint64_t i = 0; i < n; ++i) {
+            StreamID id;
+            id.ms = i + 1;
+            stream_append(s, id, fv.data(), fv.size());
+        }
+        stream_free(s);
+    });
+    Stream *s = stream_new();
+    for (uint64_t i = 0; i < 100000; ++i) {
+        StreamID id;
+        id.ms = i + 1;
+        stream_append(s, id, fv.data(), fv.size());
+    }
+    bench("stream/range 10 of 100k", [&](uint64_t n) {
+        std::vector<StreamField> out;
+        for (uint64_t i = 0; i < n; ++i) {
+            StreamID start, end;
+            start.ms = 1 + (i * 7919) % 99990;
+            end.ms = start.ms + 9;
+            end.seq = UINT64_MAX;
+            StreamIter it;
+            stream_iter_start(&it, s, start, end);
+            StreamID id;
+            while (stream_iter_next(&it, &id, out)) {
+                keep(out);
+            }
+        }
+    });
+    stream_free(s);
+
+    // cluster slot of a key
+    bench("cluster/key_hash_slot", [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            const std::string &k = names[i % names.size()];
+            keep(key_hash_slot(k.data(), k.size()));
+        }
+    });
+}
+
+static bool check(bool ok, const char *what) {
+    if (!ok) {
+        fprintf(stderr, "check failed: %s\n", what);
+    }
+    return ok;
+}
+
+// XADD 5-0, XTRIM MAXLEN 0, then XADD: the IDs must stay past 5-0
+static bool check_stream_ids() {
+    std::vector<std::string> fv = {"f", "v"};
+    Stream *s = stream_new();
+    StreamID id, last;
+    bool ok = check(!stream_id_ok(s, id), "0-0 is never a valid id");
+    id.ms = 5;
+    stream_append(s, id, fv.data(), fv.size());
+    stream_trim(s, 0, false);
+    last.ms = 5;
+    ok = check(s->length == 0 && stream_id_cmp(s->last_id, last) == 0,
+        "trimming keeps the last id") && ok;
+    id.ms = 1;
+    ok = check(!stream_id_ok(s, id), "an id below the last is refused after a trim") && ok;
+    id.ms = 5;
+    ok = check(!stream_id_ok(s, id), "the last id is refused after a trim") && ok;
+    ok = check(stream_auto_id(s, 1, &id) && id.ms == 5 && id.seq == 1,
+        "* with the clock behind continues after the last id") && ok;
+    ok = check(stream_auto_id(s, 9, &id) && id.ms == 9 && id.seq == 0,
+        "* with the clock ahead uses the clock") && ok;
+    last.ms = 7;
+    last.seq = UINT64_MAX;
+    s->last_id = last;
+    ok = check(stream_auto_id(s, 7, &id) && id.ms == 8 && id.seq == 0,
+        "* carries into the next ms") && ok;
+    last.ms = UINT64_MAX;
+    s->last_id = last;
+    ok = check(!stream_auto_id(s, 7, &id), "* fails at the largest id") && ok;
+    stream_free(s);
+    return ok;
+}
+
+// a RESTORE payload of a stream: the header numbers (length, last ID,
+// number of blocks, then for each block its master ID, last ID, count and
+// length) with the packed bytes of the blocks after their header
+static std::string stream_payload(const std::vector<uint64_t> &nums, const std::vector<std::string> &blocks) {
+    std::string out(1, (char)SNAP_STREAM);
+    for (size_t i = 0, b = 0; i < nums.size(); ++i) {
+        for (uint64_t v = nums[i]; ; v >>= 7) {
+            out.push_back((char)(v >= 0x80 ? (v & 0x7f) | 0x80 : v));
+            if (v < 0x80) {
+                break;
+            }
+        }
+        if (i >= 4 && (i - 4) % 6 == 5) {
+            out.append(blocks[b++]);
+        }
+    }
+    uint16_t version = (uint16_t)k_snap_version;
+    out.append((const char *)&version, 2);
+    uint32_t crc = crc32c(0, out.data(), out.size());
+    out.append((const char *)&crc, 4);
+    return out;
+}
+
+static bool restore_ok(const std::string &payload, Stream **out) {
+    uint32_t type = 0;
+    std::string val;
+    Stream *s = NULL;
+    if (!snap_restore(payload, &type, val, &s)) {
+        return false;
+    }
+    if (out) {
+        *out = s;
+    } else {
+        stream_free(s);
+    }
+    return true;
+}
+
+// RESTORE checks every block of a stream, the readers trust them
+static bool check_stream_restore() {
+    std::vector<std::string> fv = {"f", "v"};
+    Stream *s = stream_new();
+    StreamID id;
+    id.ms = 5;
+    stream_append(s, id, fv.data(), fv.size());
+    stream_trim(s, 0, false);
+    std::string payload;
+    snap_dump_stream(payload, s);
+    stream_free(s);
+    s = NULL;
+    bool ok = check(restore_ok(payload, &s) && s->length == 0 && s->last_id.ms == 5 && !stream_id_ok(s, id),
+        "a stream trimmed to empty restores with its last id");
+    if (s) {
+        stream_free(s);
+    }
+
+    // one entry 1-0 {f: v}: the master fields, then the entry (same fields)
+    std::string one("\x01\x01" "f" "\x01\x00\x00\x01" "v", 8);
+    std::string two = one + std::string("\x01\x00\x01\x01" "w", 5);
+    ok = check(restore_ok(stream_payload({1, 1, 0, 1, 1, 0, 1, 0, 1, 8}, {one}), NULL),
+        "a well-formed block is restored") && ok;
+    ok = check(restore_ok(stream_payload({2, 1, 1, 1, 1, 0, 1, 1, 2, 13}, {two}), NULL),
+        "a well-formed block of two entries is restored") && ok;
+    ok = check(!restore_ok(stream_payload({1, 1, 0, 1, 1, 0, 1, 0, 1, 1}, {"\x05"}), NULL),
+        "a block of fields without data is refused") && ok;
+    ok = check(!restore_ok(stream_payload({2, 1, 0, 1, 1, 0, 1, 0, 2, 8}, {one}), NULL),
+        "a block with fewer entries than its count is refused") && ok;
+    std::string same = one + std::string("\x01\x00\x00\x01" "w", 5);
+    ok = check(!restore_ok(stream_payload({2, 1, 0, 1, 1, 0, 1, 0, 2, 13}, {same}), NULL),
+        "a block with repeated ids is refused") && ok;
+    ok = check(!restore_ok(stream_payload({1, 1, 0, 1, 1, 0, 2, 0, 1, 8}, {one}), NULL),
+        "a block whose last id isn't its last entry's is refused") && ok;
+    ok = check(!restore_ok(stream_payload({2, 1, 0, 2, 1, 0, 1, 0, 1, 8, 1, 0, 1, 0, 1, 8}, {one, one}), NULL),
+        "blocks out of order are refused") && ok;
+    ok = check(!restore_ok(stream_payload({2, 1, 0, 1, 1, 0, 1, 0, 1, 8}, {one}), NULL),
+        "a length other than the sum of the counts is refused") && ok;
+    ok = check(!restore_ok(stream_payload({1, 0, 5, 1, 1, 0, 1, 0, 1, 8}, {one}), NULL),
+        "a last id below the last entry is refused") && ok;
+    return ok;
+}
+
+// what the server adds to every command for its stats
+static void bench_stats() {
+    static Histogram h;
+    hist_init(&h);
+    bench("stats/clock_ticks", [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            keep(clock_ticks());
+        }
+    });
+    bench("stats/time+record", [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            uint64_t t0 = clock_ticks();
+            uint64_t dt = clock_ticks() - t0;
+            hist_record(&h, dt);
+        }
+        keep(h);
+    });
+
+    // hot key sketch, keys drawn from a Zipf 0.99 over 100k like bench_load
+    std::vector<std::string> keys(100000);
+    for (size_t i = 0; i < keys.size(); ++i) {
+        keys[i] = "key:" + std::to_string(i);
+    }
+    std::vector<uint32_t> zipf(1 << 16);
+    {
+        std::vector<double> cdf(keys.size());
+        double sum = 0;
+        for (size_t i = 0; i < keys.size(); ++i) {
+            sum += 1.0 / pow((double)(i + 1), 0.99);
+            cdf[i] = sum;
+        }
+        for (uint32_t &z : zipf) {
+            double u = (double)(rng() % 1000000007) / 1000000007.0 * sum;
+            z = (uint32_t)(std::lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin());
+        }
+    }
+    hotkeys_enable(true, 1000);
+    bench("stats/hotkeys_touch zipf", [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            hotkeys_touch(keys[zipf[i & 0xffff]], (i & 15) == 0);
+        }
+    });
+    bench("stats/hotkeys_touch uniform", [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            hotkeys_touch(keys[(i * 7919) % keys.size()], (i & 15) == 0);
+        }
+    });
+    hotkeys_enable(false, 1000);
+}
+
+static void save_results(const char *path) {
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        perror(path);
+        exit(1);
+    }
+    fprintf(fp, "{\"benchmarks\": [\n");
+    for (size_t i = 0; i < g_results.size(); ++i) {
+        const BenchResult &r = g_results[i];
+        fprintf(fp, "  {\"name\": \"%s\", \"ns_per_op\": %.2f, \"allocs_per_op\": %.3f, \"insns_per_op\": %.1f}%s\n",
+            r.name.c_str(), r.ns, r.allocs, r.insns, i + 1 < g_results.size() ? "," : "");
+    }
+    fprintf(fp, "]}\n");
+    fclose(fp);
+}
+
+// reads what save_results() writes, one benchmark per line
+static std::vector<BenchResult> load_results(const char *path) {
+    std::vector<BenchResult> out;
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        perror(path);
+        exit(1);
+    }
+    char line[512], name[256];
+    while (fgets(line, sizeof(line), fp)) {
+        BenchResult r;
+        if (sscanf(line, " {\"name\": \"%255[^\"]\", \"ns_per_op\": %lf, \"allocs_per_op\": %lf, \"insns_per_op\": %lf",
+            name, &r.ns, &r.allocs, &r.insns) == 4)
+        {
+            r.name = name;
+            out.push_back(r);
+        }
+    }
+    fclose(fp);
+    return out;
+}
+
+// 1 if a benchmark is slower than the baseline by more than `threshold` %
+static int compare_results(const char *path, double threshold) {
+    std::vector<BenchResult> base = load_results(path);
+    int regressions = 0;
+    printf("\n%-32s %12s %12s %8s  %s\n", "vs baseline", "before", "after", "delta", "metric");
+    for (const BenchResult &r : g_results) {
+        for (const BenchResult &b : base) {
+            if (b.name != r.name) {
+                continue;
+            }
+            bool insns = r.insns >= 0 && b.insns >= 0;
+            double before = insns ? b.insns : b.ns;
+            double after = insns ? r.insns : r.ns;
+            double delta = before > 0 ? (after - before) / before * 100 : 0;
+            bool bad = delta > threshold || r.allocs > b.allocs + 0.01;
+            regressions += bad ? 1 : 0;
+            printf("%-32s %12.1f %12.1f %+7.1f%%  %s%s\n", r.name.c_str(), before, after, delta,
+                insns ? "insns/op" : "ns/op", bad ? "  REGRESSION" : "");
+        }
+    }
+    return regressions ? 1 : 0;
+}
+
+int main(int argc, char **argv) {
+    const char *save = NULL;
+    const char *baseline = NULL;
+    double threshold = 10;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--save") == 0 && i + 1 < argc) {
+            save = argv[++i];
+        } else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) {
+            baseline = argv[++i];
+        } else if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc) {
+            threshold = atof(argv[++i]);
+        } else if (argv[i][0] == '-') {
+            fprintf(stderr, "usage: %s [--save out.json] [--baseline base.json] [--threshold pct] [filter...]\n",
+                argv[0]);
+            return 1;
+        } else {
+            g_filters.push_back(argv[i]);
+        }
+    }
+    perf_open();
+    clock_init();
+    if (g_perf_fd < 0) {
+        fprintf(stderr, "perf_event_open: %s, no instruction counts\n", strerror(errno));
+    }
+
+    bool ok = check_stream_ids();
+    ok = check_stream_restore() && ok;
+
+    bench_protocol();
+    bench_encode();
+    bench_keyspace();
+    bench_types();
+    bench_stats();
+
+    if (save) {
+        save_results(save);
+    }
+    int rv = baseline ? compare_results(baseline, threshold) : 0;
+    return ok ? rv : 1;
+}
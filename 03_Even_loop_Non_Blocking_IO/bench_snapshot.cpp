@@ -0,0 +1,156 @@
+/*
+Benchmark of the snapshot loader.
+
+    g++ -O2 -pthread bench_snapshot.cpp snapshot.cpp stream.cpp rax.cpp hashtable.cpp -o bench_snapshot
+    ./bench_snapshot [GB] [path] [threads]     (default 10 GB, bench.snap, one per core)
+
+Writes a synthetic snapshot of string keys, drops it from the page cache,
+measures the sequential read bandwidth of the file, then loads it with one
+thread and with several threads, each time from a cold cache.
+Loading keeps everything in memory, a 10 GB file needs about twice as much RAM.
+*/
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <string>
+#include <thread>
+#include <vector>
+#include "common.h"
+#include "snapshot.h"
+
+struct BenchEntry {
+    HNode node;
+    std::string key;
+    std::string val;
+};
+
+static uint64_t get_usec() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return (uint64_t)tv.tv_sec * 1000000 + (uint64_t)tv.tv_nsec / 1000;
+}
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+static uint64_t rng() {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static HNode *on_str(void *, std::string &key, std::string &val) {
+    BenchEntry *ent = new BenchEntry();
+    ent->key.swap(key);
+    ent->val.swap(val);
+    ent->node.hcode = str_hash((const uint8_t *)ent->key.data(), ent->key.size());
+    return &ent->node;
+}
+
+static HNode *on_hll(void *arg, std::string &key, std::string &val) {
+    return on_str(arg, key, val);
+}
+
+static HNode *on_stream(void *, std::string &, Stream *s) {
+    stream_free(s);
+    return NULL;
+}
+
+static bool collect_cb(HNode *node, void *arg) {
+    ((std::vector<HNode *> *)arg)->push_back(node);
+    return true;
+}
+
+// evict the file from the page cache so the next read hits the disk
+static void drop_cache(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd >= 0) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+}
+
+static void load(const char *path, uint32_t nthreads, double disk_mbps) {
+    drop_cache(path);
+    HMap db;
+    SnapHandler h = {NULL, &on_str, &on_hll, &on_stream};
+    SnapStats stats;
+    if (snap_load(path, &h, &db, nthreads, &stats) != 0) {
+        fprintf(stderr, "load failed\n");
+        exit(1);
+    }
+    double mbps = stats.bytes / (double)stats.usec;
+    printf("load, %2u threads: %llu keys in %.2f s, %.1f MB/s (%.0f%% of disk), %.1f M keys/s\n",
+        nthreads, (unsigned long long)stats.keys, stats.usec / 1e6, mbps,
+        100 * mbps / disk_mbps, stats.keys / (double)stats.usec);
+    std::vector<HNode *> nodes;
+    hm_foreach(&db, &collect_cb, &nodes);
+    hm_clear(&db);
+    for (HNode *node : nodes) {
+        delete container_of(node, BenchEntry, node);
+    }
+}
+
+int main(int argc, char **argv) {
+    double gb = argc > 1 ? atof(argv[1]) : 10;
+    const char *path = argc > 2 ? argv[2] : "bench.snap";
+    uint64_t target = (uint64_t)(gb * 1e9);
+
+    // keys of ~24 bytes, values of 16 to 240 bytes, some of them integers
+    SnapWriter *w = snap_open(path);
+    if (!w) {
+        perror("snap_open");
+        return 1;
+    }
+    char kbuf[64];
+    std::string val;
+    uint64_t written = 0;
+    for (uint64_t i = 0; written < target; ++i) {
+        int klen = snprintf(kbuf, sizeof(kbuf), "user:%016llx", (unsigned long long)rng());
+        std::string key(kbuf, (size_t)klen);
+        if (i % 8 == 0) {
+            val = std::to_string((int64_t)(rng() % 1000000));
+        } else {
+            val.resize(16 + rng() % 225);
+            for (size_t j = 0; j < val.size(); j += 8) {
+                uint64_t r = rng();
+                memcpy(&val[j], &r, val.size() - j < 8 ? val.size() - j : 8);
+            }
+        }
+        snap_put_str(w, key, val);
+        written += 4 + 1 + 1 + key.size() + val.size();
+    }
+    SnapStats stats;
+    if (!snap_close(w, &stats)) {
+        perror("snap_close");
+        return 1;
+    }
+    printf("write: %llu keys, %.2f GB in %.2f s, %.1f MB/s\n",
+        (unsigned long long)stats.keys, stats.bytes / 1e9, stats.usec / 1e6,
+        stats.bytes / (double)stats.usec);
+
+    // the baseline: reading the file sequentially
+    drop_cache(path);
+    int fd = open(path, O_RDONLY);
+    std::vector<char> buf(4 << 20);
+    uint64_t t0 = get_usec();
+    uint64_t total = 0;
+    ssize_t rv;
+    while ((rv = read(fd, buf.data(), buf.size())) > 0) {
+        total += (uint64_t)rv;
+    }
+    close(fd);
+    double disk_mbps = total / (double)(get_usec() - t0);
+    printf("sequential read: %.1f MB/s\n", disk_mbps);
+
+    load(path, 1, disk_mbps);
+    uint32_t nthreads = argc > 3 ? (uint32_t)atoi(argv[3]) : std::thread::hardware_concurrency();
+    if (nthreads > 1) {
+        load(path, nthreads, disk_mbps);
+    }
+    unlink(path);
+    return 0;
+}
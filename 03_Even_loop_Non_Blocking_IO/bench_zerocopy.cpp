@@ -0,0 +1,272 @@
+/*
+GET throughput of large values, with and without zero-copy replies.
+
+    g++ -O2 -pthread bench_zerocopy.cpp client.cpp protocol.cpp shmring.cpp histogram.cpp -o bench_zerocopy
+    ./bench_zerocopy [--server ./server] [--host h] [--value-size bytes] [--keys n]
+                     [--conns n] [--pipeline n] [--duration s] [--threshold bytes]
+
+Starts the server without --zerocopy, then with --zerocopy `threshold`, each
+time on a fresh port, builds `keys` values of `value-size` bytes (1 MB by
+default) with APPEND, and GETs them in a closed loop over TCP. Prints the
+throughput, the latency, the CPU time of the server per GB sent, and the
+zero-copy counters of the server: to a client on the same host the kernel
+copies anyway, run the server with --host on another machine to see the
+difference (started by hand then, with and without --zerocopy).
+*/
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <string>
+#include <vector>
+#include "client.h"
+#include "histogram.h"
+
+struct Options {
+    std::string server = "./server";
+    std::string host;           // a server started by hand, not forked
+    unsigned value_size = 1 << 20;
+    unsigned keys = 16;
+    unsigned conns = 4;
+    unsigned pipeline = 2;
+    unsigned duration = 5;
+    unsigned threshold = 64 << 10;
+};
+
+struct Run {
+    Client *c = NULL;
+    unsigned keys = 0;
+    uint64_t next = 0;
+    uint64_t deadline_ns = 0;
+    uint64_t replies = 0;
+    uint64_t bytes = 0;
+    uint64_t errors = 0;
+    Histogram lat;          // ns
+    std::vector<std::string> cmd = {"get", ""};
+};
+
+struct Slot {
+    Run *run;
+    uint64_t t0;
+};
+
+static uint64_t get_nsec() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+}
+
+static void send_get(Slot *s);
+
+static void on_get(void *arg, Reply *reply) {
+    Slot *s = (Slot *)arg;
+    Run *run = s->run;
+    uint64_t now = get_nsec();
+    hist_record(&run->lat, now - s->t0);
+    run->replies++;
+    if (reply->type == REPLY_STR) {
+        run->bytes += reply->str.size();
+    } else {
+        run->errors++;
+    }
+    if (now < run->deadline_ns) {
+        send_get(s);
+    }
+}
+
+static void send_get(Slot *s) {
+    Run *run = s->run;
+    run->cmd[1] = "zc:" + std::to_string(run->next++ % run->keys);
+    s->t0 = get_nsec();
+    if (!client_send(run->c, run->cmd, &on_get, s)) {
+        run->errors++;
+    }
+}
+
+static void on_reply(void *arg, Reply *reply) {
+    Reply *out = (Reply *)arg;
+    if (out) {
+        *out = std::move(*reply);
+    }
+}
+
+// one request, waited for
+static Reply call(Client *c, const std::vector<std::string> &cmd) {
+    Reply r;
+    client_send(c, cmd, &on_reply, &r);
+    client_wait(c);
+    return r;
+}
+
+static uint64_t info_field(const std::string &info, const char *name) {
+    size_t pos = info.find(std::string(name) + ":");
+    return pos == std::string::npos ? 0 : strtoull(&info[pos + strlen(name) + 1], NULL, 10);
+}
+
+// user + system time of a process, in ms
+static double cpu_ms(pid_t pid) {
+    if (pid <= 0) {
+        return 0;
+    }
+    std::string path = "/proc/" + std::to_string(pid) + "/stat";
+    FILE *f = fopen(path.c_str(), "r");
+    unsigned long long utime = 0, stime = 0;
+    // after "pid (comm) state", utime and stime are fields 14 and 15
+    bool ok = f && fscanf(f, "%*d %*s %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime, &stime) == 2;
+    if (f) {
+        fclose(f);
+    }
+    return ok ? (double)(utime + stime) * 1000.0 / (double)sysconf(_SC_CLK_TCK) : 0;
+}
+
+static pid_t start_server(const Options &o, uint16_t port, bool zerocopy) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0) {
+        std::string p = std::to_string(port), t = std::to_string(o.threshold);
+        std::vector<const char *> argv = {o.server.c_str(), "--port", p.c_str(),
+            "--snapshot", "bench_zerocopy.snap", "--loglevel", "warn"};
+        if (zerocopy) {
+            argv.push_back("--zerocopy");
+            argv.push_back(t.c_str());
+        }
+        argv.push_back(NULL);
+        execv(o.server.c_str(), (char **)argv.data());
+        perror(o.server.c_str());
+        _exit(1);
+    }
+    usleep(300 * 1000);     // listening
+    return pid;
+}
+
+static bool run_bench(const Options &o, const char *name, uint16_t port, pid_t pid) {
+    ClientOptions co;
+    co.host = o.host.empty() ? "127.0.0.1" : o.host;
+    co.port = port;
+    co.nconns = o.conns;
+    co.transport = CLIENT_TRANSPORT_TCP;
+    Run run;
+    run.c = client_new(co);
+    run.keys = o.keys;
+    hist_init(&run.lat);
+
+    // the values, in requests the server takes
+    std::string chunk(4000, 'v');
+    std::vector<std::string> cmd = {"append", "", ""};
+    for (unsigned k = 0; k < o.keys; ++k) {
+        cmd[1] = "zc:" + std::to_string(k);
+        call(run.c, {"del", cmd[1]});
+        for (unsigned n = 0; n < o.value_size; n += (unsigned)chunk.size()) {
+            cmd[2].assign(chunk, 0, o.value_size - n < chunk.size() ? o.value_size - n : chunk.size());
+            client_send(run.c, cmd, &on_reply, NULL);
+        }
+        client_wait(run.c);
+    }
+    Reply r = call(run.c, {"info"});
+    uint64_t sends0 = info_field(r.str, "zerocopy_sends"), copied0 = info_field(r.str, "zerocopy_copied");
+
+    std::vector<Slot> slots(o.conns * o.pipeline);
+    double cpu0 = cpu_ms(pid);
+    uint64_t start = get_nsec();
+    run.deadline_ns = start + (uint64_t)o.duration * 1000000000;
+    for (Slot &s : slots) {
+        s.run = &run;
+        send_get(&s);
+    }
+    client_wait(run.c);
+    double seconds = (double)(get_nsec() - start) / 1e9;
+    double cpu = cpu_ms(pid) - cpu0;
+
+    r = call(run.c, {"info"});
+    uint64_t sends = info_field(r.str, "zerocopy_sends") - sends0;
+    uint64_t copied = info_field(r.str, "zerocopy_copied") - copied0;
+    client_free(run.c);
+    if (run.errors || !run.replies) {
+        fprintf(stderr, "%s: %llu errors\n", name, (unsigned long long)run.errors);
+        return false;
+    }
+    double gb = (double)run.bytes / 1e9;
+    printf("%-10s %10.0f %8.2f %10.1f %10.1f %10s %10llu %10llu\n", name,
+        (double)run.replies / seconds, gb / seconds,
+        (double)hist_percentile(&run.lat, 50) / 1e3, (double)hist_percentile(&run.lat, 99) / 1e3,
+        pid > 0 ? std::to_string((long long)(cpu / gb)).c_str() : "-",
+        (unsigned long long)sends, (unsigned long long)copied);
+    fflush(stdout);
+    return true;
+}
+
+static bool parse_uint(const char *s, unsigned &out) {
+    char *end = NULL;
+    unsigned long v = strtoul(s, &end, 10);
+    if (*s == '\0' || *end != '\0' || v == 0) {
+        return false;
+    }
+    out = (unsigned)v;
+    return true;
+}
+
+int main(int argc, char **argv) {
+    Options o;
+    unsigned port = 1234;
+    for (int i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+        const char *val = i + 1 < argc ? argv[i + 1] : NULL;
+        bool ok = val != NULL;
+        if (ok && strcmp(arg, "--server") == 0) {
+            o.server = val;
+        } else if (ok && strcmp(arg, "--host") == 0) {
+            o.host = val;
+        } else if (ok && strcmp(arg, "--port") == 0) {
+            ok = parse_uint(val, port);
+        } else if (ok && strcmp(arg, "--value-size") == 0) {
+            ok = parse_uint(val, o.value_size);
+        } else if (ok && strcmp(arg, "--keys") == 0) {
+            ok = parse_uint(val, o.keys);
+        } else if (ok && strcmp(arg, "--conns") == 0) {
+            ok = parse_uint(val, o.conns);
+        } else if (ok && strcmp(arg, "--pipeline") == 0) {
+            ok = parse_uint(val, o.pipeline);
+        } else if (ok && strcmp(arg, "--duration") == 0) {
+            ok = parse_uint(val, o.duration);
+        } else if (ok && strcmp(arg, "--threshold") == 0) {
+            ok = parse_uint(val, o.threshold);
+        } else {
+            ok = false;
+        }
+        if (!ok) {
+            fprintf(stderr, "usage: %s [--server path] [--host h [--port n]] [--value-size bytes] [--keys n]"
+                " [--conns n] [--pipeline n] [--duration s] [--threshold bytes]\n", argv[0]);
+            return 1;
+        }
+        ++i;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("%u conns, pipeline %u, %u values of %u bytes, %u s per run\n",
+        o.conns, o.pipeline, o.keys, o.value_size, o.duration);
+    printf("%-10s %10s %8s %10s %10s %10s %10s %10s\n",
+        "zerocopy", "GET/s", "GB/s", "p50 us", "p99 us", "cpu ms/GB", "zc sends", "copied");
+    if (!o.host.empty()) {
+        // a server started by hand, whatever its --zerocopy
+        return run_bench(o, "remote", (uint16_t)port, 0) ? 0 : 1;
+    }
+    uint16_t base_port = 25000;
+    for (int zerocopy = 0; zerocopy < 2; ++zerocopy) {
+        uint16_t p = (uint16_t)(base_port + zerocopy);
+        pid_t pid = start_server(o, p, zerocopy);
+        bool ok = run_bench(o, zerocopy ? std::to_string(o.threshold).c_str() : "off", p, pid);
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+        if (!ok) {
+            return 1;
+        }
+    }
+    unlink("bench_zerocopy.snap");
+    return 0;
+}
@@ -0,0 +1,570 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <algorithm>
+#include <deque>
+#include "client.h"
+#include "protocol.h"
+#include "shmring.h"
+
+// the server's limits
+const size_t k_client_max_req = 4096;
+const size_t k_client_max_res = 32 << 20;
+const size_t k_client_read_chunk = 64 << 10;
+// for the reply to SHM, then the connection falls back or is retried
+const uint64_t k_client_handshake_ms = 1000;
+
+struct PendingReply {
+    ReplyCallback cb;
+    void *arg;
+};
+
+struct ClientConn {
+    int fd = -1;
+    bool connecting = false;
+    // SHM was sent on a new Unix connection and its reply is awaited, in
+    // `rbuf`, with the fds of the rings and the eventfds; nothing else is
+    // written meanwhile
+    bool handshake = false;
+    uint64_t handshake_end_ms = 0;
+    int shm_memfd = -1;
+    // on shared memory: `fd` only tells that the server left, the server
+    // signals `efd_wait` and is signaled on `efd_wake`
+    ShmChannel shm;
+    int efd_wait = -1;
+    int efd_wake = -1;
+    uint64_t retry_ms = 0;
+    // requests not written yet
+    std::string wbuf;
+    size_t wbuf_sent = 0;
+    std::vector<uint8_t> rbuf;
+    size_t rbuf_size = 0;
+    // one per request written or queued, in order
+    std::deque<PendingReply> inflight;
+};
+
+struct Client {
+    ClientOptions opts;
+    uint32_t transport = CLIENT_TRANSPORT_TCP;     // AUTO resolved
+    bool shm_fallback = false;                      // AUTO: TCP if shm fails
+    std::vector<ClientConn> conns;
+    size_t pending = 0;
+    Reply reply;    // reused for every reply
+    ClientStats stats;
+    std::vector<struct pollfd> pfds;
+};
+
+static uint64_t get_msec() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return (uint64_t)tv.tv_sec * 1000 + (uint64_t)tv.tv_nsec / 1000 / 1000;
+}
+
+int32_t reply_parse(const uint8_t *data, size_t size, Reply *out) {
+    if (size < 1) {
+        return -1;
+    }
+    out->type = data[0];
+    out->code = 0;
+    out->num = 0;
+    out->str.clear();
+    out->arr.clear();
+    uint32_t len = 0;
+    switch (data[0]) {
+    case REPLY_NIL:
+        return 1;
+    case REPLY_ERR:
+        if (size < 1 + 8) {
+            return -1;
+        }
+        memcpy(&out->code, &data[1], 4);
+        memcpy(&len, &data[1 + 4], 4);
+        if (size - 1 - 8 < len) {
+            return -1;
+        }
+        out->str.assign((const char *)&data[1 + 8], len);
+        return (int32_t)(1 + 8 + len);
+    case REPLY_STR:
+        if (size < 1 + 4) {
+            return -1;
+        }
+        memcpy(&len, &data[1], 4);
+        if (size - 1 - 4 < len) {
+            return -1;
+        }
+        out->str.assign((const char *)&data[1 + 4], len);
+        return (int32_t)(1 + 4 + len);
+    case REPLY_INT:
+        if (size < 1 + 8) {
+            return -1;
+        }
+        memcpy(&out->num, &data[1], 8);
+        return 1 + 8;
+    case REPLY_ARR: {
+        if (size < 1 + 4) {
+            return -1;
+        }
+        memcpy(&len, &data[1], 4);
+        if (len > size) {
+            return -1;  // every value takes at least a byte
+        }
+        out->arr.resize(len);
+        size_t pos = 1 + 4;
+        for (uint32_t i = 0; i < len; ++i) {
+            int32_t rv = reply_parse(&data[pos], size - pos, &out->arr[i]);
+            if (rv < 0) {
+                return -1;
+            }
+            pos += (size_t)rv;
+        }
+        return (int32_t)pos;
+    }
+    default:
+        return -1;
+    }
+}
+
+static bool is_loopback(const std::string &host) {
+    return host == "localhost" || host == "::1" || host.compare(0, 4, "127.") == 0;
+}
+
+Client *client_new(const ClientOptions &opts) {
+    Client *c = new Client();
+    c->opts = opts;
+    c->conns.resize(opts.nconns ? opts.nconns : 1);
+    if (c->opts.unix_path.empty()) {
+        char path[64];
+        snprintf(path, sizeof(path), CLIENT_UNIX_PATH_FMT, (unsigned)opts.port);
+        c->opts.unix_path = path;
+    }
+    c->transport = opts.transport;
+    if (opts.transport == CLIENT_TRANSPORT_AUTO) {
+        bool local = is_loopback(opts.host) && access(c->opts.unix_path.c_str(), F_OK) == 0;
+        c->transport = local ? CLIENT_TRANSPORT_SHM : CLIENT_TRANSPORT_TCP;
+        c->shm_fallback = local;
+    }
+    return c;
+}
+
+static void conn_close(ClientConn *conn) {
+    for (int *fd : {&conn->fd, &conn->shm_memfd, &conn->efd_wait, &conn->efd_wake}) {
+        if (*fd >= 0) {
+            close(*fd);
+            *fd = -1;
+        }
+    }
+    shm_detach(&conn->shm);
+}
+
+void client_free(Client *c) {
+    for (ClientConn &conn : c->conns) {
+        conn_close(&conn);
+    }
+    delete c;
+}
+
+size_t client_pending(const Client *c) {
+    return c->pending;
+}
+
+void client_get_stats(const Client *c, ClientStats *stats) {
+    *stats = c->stats;
+}
+
+// fail every request of the connection, it reconnects for the next one
+static void conn_fail(Client *c, ClientConn *conn) {
+    conn_close(conn);
+    conn->connecting = false;
+    conn->handshake = false;
+    conn->retry_ms = get_msec() + c->opts.reconnect_ms;
+    conn->wbuf.clear();
+    conn->wbuf_sent = 0;
+    conn->rbuf_size = 0;
+    std::deque<PendingReply> failed;
+    failed.swap(conn->inflight);
+    c->pending -= failed.size();
+    for (PendingReply &p : failed) {
+        Reply r;
+        r.type = REPLY_ERR;
+        r.code = k_client_err_io;
+        r.str = "connection lost";
+        c->stats.errors++;
+        p.cb(p.arg, &r);
+    }
+}
+
+static void conn_connect(Client *c, ClientConn *conn);
+
+/*
+SHM on a new connection to the Unix socket: the request fits in the empty
+socket buffer, so it is written at once, before the requests queued
+meanwhile. The reply is read by client_process() like any other, it brings
+the memfd of the rings, the eventfd of the server and ours.
+*/
+static bool conn_shm_start(ClientConn *conn) {
+    std::string req;
+    put_req(req, {"shm"});
+    if (write(conn->fd, req.data(), req.size()) != (ssize_t)req.size()) {
+        return false;
+    }
+    conn->handshake = true;
+    conn->handshake_end_ms = get_msec() + k_client_handshake_ms;
+    conn->rbuf_size = 0;
+    return true;
+}
+
+// the handshake failed or timed out: TCP under AUTO, otherwise a retry
+static void conn_shm_failed(Client *c, ClientConn *conn) {
+    conn_close(conn);
+    conn->handshake = false;
+    conn->rbuf_size = 0;
+    if (!c->shm_fallback) {
+        return conn_fail(c, conn);
+    }
+    c->transport = CLIENT_TRANSPORT_TCP;
+    conn_connect(c, conn);
+}
+
+// a nil: the length then the tag
+const size_t k_shm_reply_len = 5;
+
+static void conn_shm_read(Client *c, ClientConn *conn) {
+    if (conn->rbuf.size() < k_shm_reply_len) {
+        conn->rbuf.resize(k_shm_reply_len);
+    }
+    while (conn->rbuf_size < k_shm_reply_len) {
+        int fds[3] = {-1, -1, -1};
+        size_t nfds = 0;
+        bool first = conn->shm_memfd < 0;
+        ssize_t rv = recv_fds(conn->fd, &conn->rbuf[conn->rbuf_size], k_shm_reply_len - conn->rbuf_size,
+            fds, first ? 3 : 0, &nfds);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv < 0 && errno == EAGAIN) {
+            return;
+        }
+        if (rv <= 0 || (first && nfds != 3)) {
+            for (size_t i = 0; i < nfds; ++i) {
+                close(fds[i]);
+            }
+            return conn_shm_failed(c, conn);
+        }
+        if (first) {
+            conn->shm_memfd = fds[0];
+            conn->efd_wake = fds[1];
+            conn->efd_wait = fds[2];
+        }
+        conn->rbuf_size += (size_t)rv;
+    }
+    uint32_t len = 0;
+    memcpy(&len, conn->rbuf.data(), 4);
+    if (len != 1 || conn->rbuf[4] != REPLY_NIL || !shm_attach(&conn->shm, conn->shm_memfd)) {
+        return conn_shm_failed(c, conn);
+    }
+    close(conn->shm_memfd);     // mapped
+    conn->shm_memfd = -1;
+    conn->handshake = false;
+    conn->rbuf_size = 0;
+    c->stats.shm_connects++;
+}
+
+static void conn_connect(Client *c, ClientConn *conn) {
+    if (c->transport == CLIENT_TRANSPORT_UNIX || c->transport == CLIENT_TRANSPORT_SHM) {
+        conn->fd = unix_connect_nb(c->opts.unix_path);
+        // a full backlog is worth a retry, not a fallback
+        bool busy = conn->fd < 0 && errno == EAGAIN;
+        if (conn->fd >= 0 && c->transport == CLIENT_TRANSPORT_SHM && !conn_shm_start(conn)) {
+            conn_close(conn);
+        }
+        if (conn->fd >= 0) {
+            c->stats.connects++;
+            return;
+        }
+        if (!c->shm_fallback || busy) {
+            return conn_fail(c, conn);
+        }
+        // AUTO: the socket is stale or the server refused, TCP from now on
+        c->transport = CLIENT_TRANSPORT_TCP;
+    }
+    conn->fd = tcp_connect_nb(c->opts.host, c->opts.port);
+    if (conn->fd < 0) {
+        return conn_fail(c, conn);
+    }
+    conn->connecting = true;
+    c->stats.connects++;
+}
+
+// write() and read() of a connection, or copies to and from the rings
+static ssize_t conn_send(ClientConn *conn, const void *buf, size_t len) {
+    if (!conn->shm.hdr) {
+        return write(conn->fd, buf, len);
+    }
+    ssize_t rv = shm_write(&conn->shm, SHM_REQ, buf, len);
+    if (rv > 0 && shm_wake_reader(&conn->shm, SHM_REQ)) {
+        shm_signal(conn->efd_wake);
+    }
+    errno = rv < 0 ? EPROTO : EAGAIN;
+    return rv == 0 ? -1 : rv;
+}
+
+static ssize_t conn_recv(ClientConn *conn, void *buf, size_t cap) {
+    if (!conn->shm.hdr) {
+        return read(conn->fd, buf, cap);
+    }
+    ssize_t rv = shm_read(&conn->shm, SHM_RES, buf, cap);
+    if (rv > 0 && shm_wake_writer(&conn->shm, SHM_RES)) {
+        shm_signal(conn->efd_wake);
+    }
+    errno = rv < 0 ? EPROTO : EAGAIN;
+    return rv == 0 ? -1 : rv;
+}
+
+static void conn_flush(Client *c, ClientConn *conn) {
+    if (conn->fd < 0 || conn->connecting || conn->handshake) {
+        return;
+    }
+    while (conn->wbuf_sent < conn->wbuf.size()) {
+        ssize_t rv = conn_send(conn, &conn->wbuf[conn->wbuf_sent], conn->wbuf.size() - conn->wbuf_sent);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv < 0 && errno == EAGAIN) {
+            return;
+        }
+        if (rv <= 0) {
+            return conn_fail(c, conn);
+        }
+        conn->wbuf_sent += (size_t)rv;
+        c->stats.writes++;
+        c->stats.bytes_out += (uint64_t)rv;
+    }
+    conn->wbuf.clear();
+    conn->wbuf_sent = 0;
+}
+
+// run the callbacks of the complete replies in the buffer
+static size_t conn_dispatch(Client *c, ClientConn *conn) {
+    size_t n = 0;
+    size_t pos = 0;
+    while (conn->rbuf_size - pos >= 4) {
+        uint32_t len = 0;
+        memcpy(&len, &conn->rbuf[pos], 4);
+        if (len > k_client_max_res || conn->inflight.empty()) {
+            conn_fail(c, conn);
+            return n;
+        }
+        if (conn->rbuf_size - pos - 4 < len) {
+            break;
+        }
+        int32_t rv = reply_parse(&conn->rbuf[pos + 4], len, &c->reply);
+        if (rv < 0 || (uint32_t)rv != len) {
+            conn_fail(c, conn);
+            return n;
+        }
+        pos += 4 + len;
+        // popped first, the callback may queue more requests here
+        PendingReply p = conn->inflight.front();
+        conn->inflight.pop_front();
+        c->pending--;
+        c->stats.replies++;
+        n++;
+        p.cb(p.arg, &c->reply);
+    }
+    if (pos > 0) {
+        memmove(conn->rbuf.data(), &conn->rbuf[pos], conn->rbuf_size - pos);
+        conn->rbuf_size -= pos;
+    }
+    return n;
+}
+
+static size_t conn_read(Client *c, ClientConn *conn) {
+    size_t n = 0;
+    while (conn->fd >= 0) {
+        if (conn->rbuf.size() - conn->rbuf_size < k_client_read_chunk) {
+            conn->rbuf.resize(conn->rbuf_size + k_client_read_chunk);
+        }
+        size_t cap = conn->rbuf.size() - conn->rbuf_size;
+        ssize_t rv = conn_recv(conn, &conn->rbuf[conn->rbuf_size], cap);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv < 0 && errno == EAGAIN) {
+            break;
+        }
+        if (rv <= 0) {
+            conn_fail(c, conn);
+            break;
+        }
+        c->stats.reads++;
+        c->stats.bytes_in += (uint64_t)rv;
+        conn->rbuf_size += (size_t)rv;
+        n += conn_dispatch(c, conn);
+        if ((size_t)rv < cap && !conn->shm.hdr) {
+            break;  // drained, saves a read() that would get EAGAIN
+        }
+    }
+    return n;
+}
+
+// the least loaded connection, preferring the ones that are up or may
+// (re)connect now: one never opened is an idle one
+static ClientConn *conn_pick(Client *c) {
+    uint64_t now = get_msec();
+    ClientConn *best = NULL;
+    for (ClientConn &conn : c->conns) {
+        bool up = conn.fd >= 0 || now >= conn.retry_ms;
+        bool best_up = best && (best->fd >= 0 || now >= best->retry_ms);
+        if (!best || (up && !best_up) || (up == best_up && conn.inflight.size() < best->inflight.size())) {
+            best = &conn;
+        }
+    }
+    return best;
+}
+
+bool client_send(Client *c, const std::vector<std::string> &cmd, ReplyCallback cb, void *arg) {
+    size_t len = 4;
+    for (const std::string &s : cmd) {
+        len += 4 + s.size();
+    }
+    if (cmd.empty() || len > k_client_max_req) {
+        return false;
+    }
+    ClientConn *conn = conn_pick(c);
+    if (conn->fd < 0) {
+        // every connection is down, fail fast until the next attempt
+        if (get_msec() < conn->retry_ms) {
+            return false;
+        }
+        conn_connect(c, conn);
+        if (conn->fd < 0) {
+            return false;
+        }
+    }
+    // written by the next client_poll(), with the other requests sent meanwhile
+    put_req(conn->wbuf, cmd);
+    conn->inflight.push_back({cb, arg});
+    c->pending++;
+    c->stats.requests++;
+    return true;
+}
+
+void client_pollfds(Client *c, std::vector<struct pollfd> &out) {
+    for (ClientConn &conn : c->conns) {
+        if (conn.fd < 0) {
+            continue;
+        }
+        if (conn.handshake) {
+            out.push_back({conn.fd, POLLIN, 0});
+            continue;
+        }
+        if (conn.shm.hdr) {
+            // the socket only tells that the server left; say we sleep on
+            // the eventfd, or make it ready if the rings moved meanwhile
+            out.push_back({conn.fd, 0, 0});
+            bool sleep = true;
+            if (!conn.inflight.empty()) {
+                sleep = shm_wait_data(&conn.shm, SHM_RES);
+            }
+            if (sleep && conn.wbuf_sent < conn.wbuf.size()) {
+                sleep = shm_wait_room(&conn.shm, SHM_REQ);
+            }
+            if (!sleep) {
+                shm_signal(conn.efd_wait);
+            }
+            out.push_back({conn.efd_wait, POLLIN, 0});
+            continue;
+        }
+        struct pollfd pfd = {conn.fd, POLLIN, 0};
+        if (conn.connecting || conn.wbuf_sent < conn.wbuf.size()) {
+            pfd.events |= POLLOUT;
+        }
+        out.push_back(pfd);
+    }
+}
+
+size_t client_process(Client *c, const struct pollfd *pfds, size_t n) {
+    size_t replies = 0;
+    for (size_t i = 0; i < n; ++i) {
+        if (!pfds[i].revents) {
+            continue;
+        }
+        ClientConn *conn = NULL;
+        for (ClientConn &cc : c->conns) {
+            if (cc.fd >= 0 && (cc.fd == pfds[i].fd || cc.efd_wait == pfds[i].fd)) {
+                conn = &cc;
+            }
+        }
+        if (!conn) {
+            continue;
+        }
+        if (conn->handshake) {
+            conn_shm_read(c, conn);
+            continue;
+        }
+        if (conn->shm.hdr) {
+            if (pfds[i].fd == conn->fd) {
+                conn_fail(c, conn);     // the server is gone
+                continue;
+            }
+            shm_drain(conn->efd_wait);
+            replies += conn_read(c, conn);
+            continue;
+        }
+        if (conn->connecting) {
+            if (!tcp_connect_ok(conn->fd)) {
+                conn_fail(c, conn);
+                continue;
+            }
+            conn->connecting = false;
+        }
+        if (pfds[i].revents & (POLLIN | POLLERR | POLLHUP)) {
+            replies += conn_read(c, conn);
+        }
+    }
+    // reconnect, and write what the callbacks queued
+    uint64_t now = get_msec();
+    for (ClientConn &conn : c->conns) {
+        if (conn.handshake && now >= conn.handshake_end_ms) {
+            conn_shm_failed(c, &conn);
+        }
+        if (conn.fd < 0 && !conn.inflight.empty() && now >= conn.retry_ms) {
+            conn_connect(c, &conn);
+        }
+        conn_flush(c, &conn);
+    }
+    return replies;
+}
+
+size_t client_poll(Client *c, int timeout_ms) {
+    for (ClientConn &conn : c->conns) {
+        conn_flush(c, &conn);
+    }
+    c->pfds.clear();
+    client_pollfds(c, c->pfds);
+    if (c->pfds.empty()) {
+        // nothing connected, only the timers
+        bool waiting = false;
+        for (ClientConn &conn : c->conns) {
+            waiting = waiting || !conn.inflight.empty();
+        }
+        if (waiting && timeout_ms > 0) {
+            usleep((useconds_t)std::min<uint32_t>((uint32_t)timeout_ms, c->opts.reconnect_ms) * 1000);
+        }
+        return client_process(c, NULL, 0);
+    }
+    int rv = poll(c->pfds.data(), (nfds_t)c->pfds.size(), timeout_ms);
+    if (rv < 0 && errno != EINTR) {
+        return 0;
+    }
+    return client_process(c, c->pfds.data(), c->pfds.size());
+}
+
+void client_wait(Client *c) {
+    while (c->pending > 0) {
+        client_poll(c, 100);
+    }
+}
@@ -0,0 +1,180 @@
+#pragma once
+
+#include <poll.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#if __cplusplus >= 202002L
+#include <coroutine>
+#endif
+
+/*
+Asynchronous client library.
+
+A Client owns a pool of non-blocking connections to one server and a poll()
+loop that drives them. A request goes to the connection with the fewest
+requests in flight and is written right behind the ones already queued
+there (pipelining); the server answers the requests of a connection in
+order, so each connection keeps a FIFO of callbacks and the next reply
+belongs to the oldest one. Many concurrent requests thus share a few
+sockets and a few syscalls, without one thread per request in flight.
+
+Callbacks run on the thread that calls client_poll(), they may send more
+requests but must not free the client. A Client is not thread-safe, use one
+per thread.
+
+A connection that breaks fails its requests in flight (ERR with code
+k_client_err_io) and reconnects for the next request.
+
+A server on the same host can be reached without TCP: on its Unix socket,
+or on shared memory set up over it (shmring.h), where a request and its
+reply are copies into and out of rings and an eventfd only wakes a side
+that sleeps. CLIENT_TRANSPORT_AUTO uses shared memory when the host is the
+loopback and the server listens on the Unix socket, TCP otherwise.
+*/
+
+// the tags of the values in a reply
+enum {
+    REPLY_NIL = 0,
+    REPLY_ERR = 1,
+    REPLY_STR = 2,
+    REPLY_INT = 3,
+    REPLY_ARR = 4,
+};
+
+// error code of the replies the server never sent
+const int32_t k_client_err_io = -1;
+
+enum {
+    CLIENT_TRANSPORT_AUTO = 0,
+    CLIENT_TRANSPORT_TCP = 1,
+    CLIENT_TRANSPORT_UNIX = 2,
+    CLIENT_TRANSPORT_SHM = 3,
+};
+
+// where a server started with --unixsocket is looked for, with its port
+#define CLIENT_UNIX_PATH_FMT "/tmp/kv.%u.sock"
+
+// a decoded reply
+struct Reply {
+    uint32_t type = REPLY_NIL;
+    int32_t code = 0;           // REPLY_ERR
+    std::string str;            // REPLY_STR, the message of REPLY_ERR
+    int64_t num = 0;            // REPLY_INT
+    std::vector<Reply> arr;     // REPLY_ARR
+};
+
+// the bytes consumed, or -1 if the value is malformed
+int32_t reply_parse(const uint8_t *data, size_t size, Reply *out);
+
+struct ClientOptions {
+    std::string host = "127.0.0.1";
+    uint16_t port = 1234;
+    uint32_t nconns = 4;
+    uint32_t reconnect_ms = 100;    // wait after a failed connection
+    uint32_t transport = CLIENT_TRANSPORT_AUTO;
+    std::string unix_path;          // empty: CLIENT_UNIX_PATH_FMT
+};
+
+// the callback may move the contents of `reply` out
+typedef void (*ReplyCallback)(void *arg, Reply *reply);
+
+struct Client;
+
+Client *client_new(const ClientOptions &opts);
+// the callbacks of the requests still in flight are not called
+void client_free(Client *c);
+
+// queue a request, false if it can't be sent: too large, no arguments, or
+// the server was unreachable less than `reconnect_ms` ago
+bool client_send(Client *c, const std::vector<std::string> &cmd, ReplyCallback cb, void *arg);
+// requests sent and not answered yet
+size_t client_pending(const Client *c);
+
+// one iteration: poll for up to `timeout_ms`, write the queued requests,
+// read the replies and run their callbacks. Returns the replies handled.
+size_t client_poll(Client *c, int timeout_ms);
+// until every request has its reply
+void client_wait(Client *c);
+
+/*
+To run the client in another event loop: add the fds of client_pollfds()
+to its poll() set, hand their revents to client_process(), and call
+client_process() with no fds at least every `reconnect_ms` for the timers.
+*/
+void client_pollfds(Client *c, std::vector<struct pollfd> &out);
+size_t client_process(Client *c, const struct pollfd *pfds, size_t n);
+
+struct ClientStats {
+    uint64_t requests = 0;
+    uint64_t replies = 0;
+    uint64_t errors = 0;        // k_client_err_io replies
+    uint64_t connects = 0;
+    uint64_t bytes_out = 0;
+    uint64_t bytes_in = 0;
+    uint64_t writes = 0;        // write() calls, requests / writes is the pipelining
+    uint64_t reads = 0;
+    uint64_t shm_connects = 0;  // of `connects`, on shared memory
+};
+void client_get_stats(const Client *c, ClientStats *stats);
+
+#if __cplusplus >= 202002L
+/*
+C++20 coroutines. A coroutine returning ClientTask starts right away and
+runs until its first co_await; `co_await client_call(c, cmd)` sends the
+request and resumes the coroutine from client_poll() with the reply.
+
+    ClientTask worker(Client *c) {
+        Reply r = co_await client_call(c, "get", "foo");
+        ...
+    }
+    worker(c);
+    client_wait(c);
+*/
+struct ClientTask {
+    struct promise_type {
+        ClientTask get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { abort(); }
+    };
+};
+
+struct ClientCall {
+    Client *c;
+    std::vector<std::string> cmd;
+    Reply reply;
+    std::coroutine_handle<> waiter;
+
+    static void on_reply(void *arg, Reply *reply) {
+        ClientCall *call = (ClientCall *)arg;
+        call->reply = std::move(*reply);
+        call->waiter.resume();
+    }
+    bool await_ready() { return false; }
+    bool await_suspend(std::coroutine_handle<> h) {
+        waiter = h;
+        if (!client_send(c, cmd, &on_reply, this)) {
+            reply.type = REPLY_ERR;
+            reply.code = k_client_err_io;
+            reply.str = "request not sent";
+            return false;   // resume now
+        }
+        return true;
+    }
+    Reply await_resume() { return std::move(reply); }
+};
+
+inline ClientCall client_call(Client *c, std::vector<std::string> cmd) {
+    return ClientCall{c, std::move(cmd), Reply(), nullptr};
+}
+
+// the arguments one by one; GCC 12 rejects a braced list inside co_await
+template <class... Args>
+inline ClientCall client_call(Client *c, const char *name, Args &&...args) {
+    return ClientCall{c, {std::string(name), std::string(std::forward<Args>(args))...}, Reply(), nullptr};
+}
+#endif
@@ -8,6 +8,11 @@
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <netinet/ip.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "cluster.h"
+#include "protocol.h"
 
 
 static void msg(const char *msg) {
@@ -47,33 +52,132 @@ static int32_t write_all(int fd, const char *buf, size_t n) {
 }
 
 const size_t k_max_msg = 4096;
+const size_t k_max_res = 32 << 20;
 
 /*
-Send request to server
+Send request to server, a command is sent as a list of strings:
+[ len | nstr | len | str1 | ... | len | strn ]
 */
-static int32_t send_req(int fd, const char *text) {
-    uint32_t len = (uint32_t)strlen(text);
-    if(len > k_max_msg) {
+static int32_t send_req(int fd, const std::vector<std::string> &cmd) {
+    if (cmd.empty()) {
+        msg("empty command");
+        return -1;
+    }
+    uint32_t len = 4;
+    for (const std::string &s : cmd) {
+        len += 4 + s.size();
+    }
+    if (len > k_max_msg) {
         return -1;
     }
+
     // Prepare and send the request
     char wbuf[4 + k_max_msg];
-    memcpy(wbuf, &len, 4);
-    memcpy(&wbuf[4], text, len);
-    // [ 0x06 0x00 0x00 0x00  H  e  l  l  o  ! ] something like this for above 2 commands
+    memcpy(&wbuf[0], &len, 4);
+    uint32_t n = cmd.size();
+    memcpy(&wbuf[4], &n, 4);
+    size_t cur = 8;
+    for (const std::string &s : cmd) {
+        uint32_t p = (uint32_t)s.size();
+        memcpy(&wbuf[cur], &p, 4);
+        memcpy(&wbuf[cur + 4], s.data(), s.size());
+        cur += 4 + s.size();
+    }
     return write_all(fd, wbuf, 4 + len);
 }
 
+/*
+Print one serialized value, returns the number of bytes consumed or -1 if
+the response is malformed. Arrays are printed recursively.
+*/
+static int32_t on_response(const uint8_t *data, size_t size) {
+    if (size < 1) {
+        msg("bad response");
+        return -1;
+    }
+    switch (data[0]) {
+    case SER_NIL:
+        printf("(nil)\n");
+        return 1;
+    case SER_ERR:
+        if (size < 1 + 8) {
+            msg("bad response");
+            return -1;
+        }
+        {
+            int32_t code = 0;
+            uint32_t len = 0;
+            memcpy(&code, &data[1], 4);
+            memcpy(&len, &data[1 + 4], 4);
+            if (size < 1 + 8 + len) {
+                msg("bad response");
+                return -1;
+            }
+            printf("(err) %d %.*s\n", code, len, &data[1 + 8]);
+            return 1 + 8 + len;
+        }
+    case SER_STR:
+        if (size < 1 + 4) {
+            msg("bad response");
+            return -1;
+        }
+        {
+            uint32_t len = 0;
+            memcpy(&len, &data[1], 4);
+            if (size < 1 + 4 + len) {
+                msg("bad response");
+                return -1;
+            }
+            printf("(str) %.*s\n", len, &data[1 + 4]);
+            return 1 + 4 + len;
+        }
+    case SER_INT:
+        if (size < 1 + 8) {
+            msg("bad response");
+            return -1;
+        }
+        {
+            int64_t val = 0;
+            memcpy(&val, &data[1], 8);
+            printf("(int) %ld\n", (long)val);
+            return 1 + 8;
+        }
+    case SER_ARR:
+        if (size < 1 + 4) {
+            msg("bad response");
+            return -1;
+        }
+        {
+            uint32_t len = 0;
+            memcpy(&len, &data[1], 4);
+            printf("(arr) len=%u\n", len);
+            size_t arr_bytes = 1 + 4;
+            for (uint32_t i = 0; i < len; ++i) {
+                int32_t rv = on_response(&data[arr_bytes], size - arr_bytes);
+                if (rv < 0) {
+                    return rv;
+                }
+                arr_bytes += (size_t)rv;
+            }
+            printf("(arr) end\n");
+            return (int32_t)arr_bytes;
+        }
+    default:
+        msg("bad response");
+        return -1;
+    }
+}
+
 /*
 Query function has been split into - read response and send req to server
 
-Read response from server
+Read response from server, the body of the reply goes to `rbuf`
 */
-static int32_t read_res(int fd) {
+static int32_t read_reply(int fd, std::vector<char> &rbuf) {
     // 4 bytes header
-    char rbuf[4 + k_max_msg + 1];
+    char hdr[4];
     errno = 0;
-    int32_t err = read_full(fd, rbuf, 4); // Read the first 4 bytes, which has length of the message body
+    int32_t err = read_full(fd, hdr, 4); // Read the first 4 bytes, which has length of the message body
     if (err) {
         if (errno == 0) {
             msg("EOF");
@@ -85,25 +189,37 @@ static int32_t read_res(int fd) {
 
     // Extract the Reply Length and Read the Reply Body
     uint32_t len = 0;
-    memcpy(&len, rbuf, 4);  // assume little endian
-    if (len > k_max_msg) {
+    memcpy(&len, hdr, 4);  // assume little endian
+    if (len > k_max_res) {
         msg("too long");
         return -1;
     }
 
-    // reply body
-    err = read_full(fd, &rbuf[4], len);
+    // reply body, responses can be much larger than requests
+    rbuf.resize(len);
+    err = read_full(fd, rbuf.data(), len);
     if (err) {
         msg("read() error");
         return err;
     }
-
-    // do something
-    rbuf[4 + len] = '\0';
-    printf("server says: %s\n", &rbuf[4]);
     return 0;
 }
 
+static int32_t print_reply(const std::vector<char> &rbuf) {
+    int32_t rv = on_response((const uint8_t *)rbuf.data(), rbuf.size());
+    if (rv > 0 && (uint32_t)rv != rbuf.size()) {
+        msg("bad response");
+        rv = -1;
+    }
+    return rv < 0 ? rv : 0;
+}
+
+static int32_t read_res(int fd) {
+    std::vector<char> rbuf;
+    int32_t err = read_reply(fd, rbuf);
+    return err ? err : print_reply(rbuf);
+}
+
 /*
 static int32_t query(int fd, const char *text) {
     uint32_t len = (uint32_t)strlen(text);
@@ -155,38 +271,273 @@ static int32_t query(int fd, const char *text) {
 }
 */
 
-int main() {
+static int connect_to(const char *host, uint16_t port) {
     int fd = socket(AF_INET, SOCK_STREAM, 0);
     if (fd < 0) {
         die("socket()");
     }
-
     struct sockaddr_in addr = {};
     addr.sin_family = AF_INET;
-    addr.sin_port = ntohs(1234);
-    addr.sin_addr.s_addr = ntohl(INADDR_LOOPBACK);  // 127.0.0.1
-    int rv = connect(fd, (const struct sockaddr *)&addr, sizeof(addr));
-    if (rv) {
-        die("connect");
+    addr.sin_port = ntohs(port);
+    if (inet_pton(AF_INET, host, &addr.sin_addr) != 1
+        || connect(fd, (const struct sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        close(fd);
+        return -1;
     }
+    return fd;
+}
 
-    // Multiple pipelined requests
-    const char *query_list[3] = {"hello1", "hello2", "hello3"};
-    for (size_t i=0; i<3; i++) {
-        int32_t err = send_req(fd, query_list[i]);
-        if (err) {
-            goto L_DONE;
+/*
+Cluster mode: the client keeps the slot table of the cluster and sends each
+command to the owner of its key. A MOVED error updates the table (and
+reloads it from that node), an ASK error sends this one command to the
+other node after "asking", a TRYAGAIN error (keys in the middle of a
+migration) is retried after a short sleep.
+*/
+const uint32_t k_max_redirects = 5;
+
+static struct {
+    std::string seed;
+    std::vector<std::string> slots;     // the owner of each slot
+    std::vector<std::pair<std::string, int>> conns;
+} g_cluster;
+
+static int cluster_conn(const std::string &node) {
+    for (auto &c : g_cluster.conns) {
+        if (c.first == node) {
+            return c.second;
         }
     }
+    std::string host;
+    uint16_t port = 0;
+    int fd = parse_addr(node, host, port) ? connect_to(host.c_str(), port) : -1;
+    if (fd >= 0) {
+        g_cluster.conns.push_back({node, fd});
+    }
+    return fd;
+}
 
-    for (size_t i=0; i<3; i++) {
-        int32_t err = read_res(fd);
-        if (err) {
-            goto L_DONE;
+static void cluster_conn_drop(const std::string &node) {
+    for (size_t i = 0; i < g_cluster.conns.size(); ++i) {
+        if (g_cluster.conns[i].first == node) {
+            close(g_cluster.conns[i].second);
+            g_cluster.conns.erase(g_cluster.conns.begin() + i);
+            return;
         }
     }
+}
+
+// one request and its reply on a connection to `node`
+static int32_t cluster_call(const std::string &node, const std::vector<std::string> &cmd,
+    std::vector<char> &res)
+{
+    int fd = cluster_conn(node);
+    if (fd < 0) {
+        return -1;
+    }
+    int32_t err = send_req(fd, cmd);
+    if (!err) {
+        err = read_reply(fd, res);
+    }
+    if (err) {
+        cluster_conn_drop(node);
+    }
+    return err;
+}
+
+static bool get_u32(const std::vector<char> &res, size_t &pos, uint32_t &v) {
+    if (pos + 4 > res.size()) {
+        return false;
+    }
+    memcpy(&v, &res[pos], 4);
+    pos += 4;
+    return true;
+}
+
+static bool get_i64(const std::vector<char> &res, size_t &pos, int64_t &v) {
+    if (pos + 9 > res.size() || res[pos] != SER_INT) {
+        return false;
+    }
+    memcpy(&v, &res[pos + 1], 8);
+    pos += 9;
+    return true;
+}
+
+// "cluster slots": an array of [first, last, host:port]
+static bool cluster_load_slots(const std::string &node) {
+    std::vector<char> res;
+    if (cluster_call(node, {"cluster", "slots"}, res) != 0 || res.empty() || res[0] != SER_ARR) {
+        return false;
+    }
+    size_t pos = 1;
+    uint32_t n = 0;
+    if (!get_u32(res, pos, n)) {
+        return false;
+    }
+    std::vector<std::string> slots(k_cluster_slots);
+    for (uint32_t i = 0; i < n; ++i) {
+        uint32_t three = 0, len = 0;
+        int64_t first = 0, last = 0;
+        if (pos >= res.size() || res[pos++] != SER_ARR || !get_u32(res, pos, three) || three != 3
+            || !get_i64(res, pos, first) || !get_i64(res, pos, last)
+            || pos >= res.size() || res[pos++] != SER_STR || !get_u32(res, pos, len)
+            || pos + len > res.size() || first < 0 || first > last || last >= k_cluster_slots)
+        {
+            return false;
+        }
+        std::string addr(&res[pos], len);
+        pos += len;
+        for (int64_t slot = first; slot <= last; ++slot) {
+            slots[(size_t)slot] = addr;
+        }
+    }
+    g_cluster.slots.swap(slots);
+    return true;
+}
+
+// the slot of the first key, -1 for commands without keys
+static int32_t command_slot(const std::vector<std::string> &cmd) {
+    const KeySpec *ks = key_spec_lookup(cmd[0].c_str());
+    if (!ks) {
+        return -1;
+    }
+    std::vector<size_t> keys;
+    key_spec_positions(ks, cmd, keys);
+    if (keys.empty()) {
+        return -1;
+    }
+    const std::string &key = cmd[keys[0]];
+    return key_hash_slot(key.data(), key.size());
+}
+
+// the message of an error reply, its code in `code`
+static bool reply_error(const std::vector<char> &res, int32_t &code, std::string &text) {
+    uint32_t len = 0;
+    if (res.size() < 9 || res[0] != SER_ERR) {
+        return false;
+    }
+    memcpy(&code, &res[1], 4);
+    memcpy(&len, &res[5], 4);
+    text.assign(&res[9], std::min((size_t)len, res.size() - 9));
+    return true;
+}
+
+static int32_t cluster_query(const std::vector<std::string> &cmd) {
+    int32_t slot = command_slot(cmd);
+    std::string node = g_cluster.seed;
+    if (slot >= 0 && !g_cluster.slots[(size_t)slot].empty()) {
+        node = g_cluster.slots[(size_t)slot];
+    }
+    bool asking = false;
+    std::vector<char> res;
+    for (uint32_t attempt = 0; ; ++attempt) {
+        if (asking) {
+            if (cluster_call(node, {"asking"}, res) != 0) {
+                return -1;
+            }
+        }
+        if (cluster_call(node, cmd, res) != 0) {
+            return -1;
+        }
+        int32_t code = 0;
+        std::string text;
+        if (!reply_error(res, code, text) || attempt >= k_max_redirects
+            || (code != ERR_MOVED && code != ERR_ASK && code != ERR_TRYAGAIN))
+        {
+            break;
+        }
+        asking = false;
+        if (code == ERR_TRYAGAIN) {
+            usleep(50 * 1000);
+            continue;
+        }
+        // "MOVED <slot> <host:port>" or "ASK <slot> <host:port>"
+        size_t sp = text.rfind(' ');
+        if (sp == std::string::npos) {
+            break;
+        }
+        node = text.substr(sp + 1);
+        if (code == ERR_ASK) {
+            asking = true;
+        } else if (!cluster_load_slots(node) && slot >= 0) {
+            g_cluster.slots[(size_t)slot] = node;
+        }
+    }
+    return print_reply(res);
+}
+
+static void split_words(const char *line, std::vector<std::string> &out) {
+    out.clear();
+    std::string word;
+    for (const char *p = line; ; ++p) {
+        if (*p == '\0' || *p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') {
+            if (!word.empty()) {
+                out.push_back(word);
+                word.clear();
+            }
+            if (*p == '\0') {
+                return;
+            }
+        } else {
+            word.push_back(*p);
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    uint16_t port = 1234;
+    int i = 1;
+    for (; i < argc; ++i) {
+        if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+            port = (uint16_t)atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--cluster") == 0 && i + 1 < argc) {
+            g_cluster.seed = argv[++i];
+        } else {
+            break;
+        }
+    }
+
+    // the command comes from the command line, e.g. ./client pfadd visitors alice bob
+    std::vector<std::string> cmd;
+    for (; i < argc; ++i) {
+        cmd.push_back(argv[i]);
+    }
+
+    if (!g_cluster.seed.empty()) {
+        g_cluster.slots.resize(k_cluster_slots);
+        if (!cluster_load_slots(g_cluster.seed)) {
+            die("cluster slots");
+        }
+        if (!cmd.empty()) {
+            return cluster_query(cmd) ? 1 : 0;
+        }
+        // one command per line
+        char line[k_max_msg];
+        while (fgets(line, sizeof(line), stdin)) {
+            split_words(line, cmd);
+            if (!cmd.empty() && cluster_query(cmd) != 0) {
+                return 1;
+            }
+        }
+        return 0;
+    }
+
+    int fd = connect_to("127.0.0.1", port);
+    if (fd < 0) {
+        die("connect");
+    }
+    int32_t err = send_req(fd, cmd);
+    if (err) {
+        goto L_DONE;
+    }
+    err = read_res(fd);
+    if (err) {
+        goto L_DONE;
+    }
 
 L_DONE:
+    close(fd);
 
 // multiple requests
 //     int32_t err = query(fd, "hello1");
@@ -204,5 +555,5 @@ L_DONE:
 
 // L_DONE:
 //     close(fd);
-    return 0;
+    return err ? 1 : 0;
 }
\ No newline at end of file
@@ -0,0 +1,47 @@
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+#include "clock.h"
+
+bool g_clock_tsc = false;
+double g_clock_ticks_per_ns = 1.0;
+
+static uint64_t monotonic_ns() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return (uint64_t)tv.tv_sec * 1000000000 + (uint64_t)tv.tv_nsec;
+}
+
+// CPUID 0x80000007: EDX bit 8 is the invariant TSC
+static bool tsc_invariant() {
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+    if (!__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) || eax < 0x80000007) {
+        return false;
+    }
+    __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+    return (edx & (1u << 8)) != 0;
+#else
+    return false;
+#endif
+}
+
+void clock_init() {
+    if (!tsc_invariant()) {
+        return;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    // 20 ms against the monotonic clock, the rate is known within 0.01%
+    uint64_t ns0 = monotonic_ns();
+    uint64_t t0 = __rdtsc();
+    usleep(20000);
+    uint64_t ns1 = monotonic_ns();
+    uint64_t t1 = __rdtsc();
+    if (ns1 <= ns0 || t1 <= t0) {
+        return;
+    }
+    g_clock_ticks_per_ns = (double)(t1 - t0) / (double)(ns1 - ns0);
+    g_clock_tsc = true;
+#endif
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/*
+A clock for timing single commands, read several times per request.
+
+On x86 it is the time stamp counter: rdtsc takes a few nanoseconds where
+clock_gettime() takes 20-30, and with an invariant TSC (constant rate, not
+stopped in idle states, synchronized across cores) it measures wall time.
+clock_init() checks for one and measures its rate against CLOCK_MONOTONIC.
+Elsewhere, or without an invariant TSC, a tick is a CLOCK_MONOTONIC ns.
+
+Intervals are kept in ticks and only converted to time when reported.
+*/
+
+extern bool g_clock_tsc;
+extern double g_clock_ticks_per_ns;
+
+// once at startup, before any other thread reads the clock
+void clock_init();
+
+inline uint64_t clock_ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+    if (g_clock_tsc) {
+        return __rdtsc();
+    }
+#endif
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return (uint64_t)tv.tv_sec * 1000000000 + (uint64_t)tv.tv_nsec;
+}
+
+inline uint64_t clock_ticks_to_ns(uint64_t ticks) {
+    return (uint64_t)((double)ticks / g_clock_ticks_per_ns);
+}
+
+inline uint64_t clock_ns_to_ticks(uint64_t ns) {
+    return (uint64_t)((double)ns * g_clock_ticks_per_ns);
+}
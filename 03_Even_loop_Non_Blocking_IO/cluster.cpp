@@ -0,0 +1,541 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <deque>
+#include "cluster.h"
+#include "log.h"
+#include "protocol.h"
+
+static uint16_t g_crc16_table[256];
+
+static bool crc16_init() {
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint16_t crc = (uint16_t)(i << 8);
+        for (int k = 0; k < 8; ++k) {
+            crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+        }
+        g_crc16_table[i] = crc;
+    }
+    return true;
+}
+
+// CRC16-CCITT (XMODEM): polynomial 0x1021, initial value 0
+uint16_t crc16(const char *buf, size_t len) {
+    static const bool ready = crc16_init();
+    (void)ready;
+    uint16_t crc = 0;
+    for (size_t i = 0; i < len; ++i) {
+        crc = (uint16_t)((crc << 8) ^ g_crc16_table[((crc >> 8) ^ (uint8_t)buf[i]) & 0xff]);
+    }
+    return crc;
+}
+
+uint16_t key_hash_slot(const char *key, size_t len) {
+    const char *open = (const char *)memchr(key, '{', len);
+    if (open) {
+        size_t start = (size_t)(open - key) + 1;
+        const char *close = (const char *)memchr(key + start, '}', len - start);
+        if (close && close > key + start) {
+            return crc16(key + start, (size_t)(close - key) - start) & (k_cluster_slots - 1);
+        }
+    }
+    return crc16(key, len) & (k_cluster_slots - 1);
+}
+
+enum {
+    MIG_IDLE = 0,           // nothing to do, or waiting to reconnect
+    MIG_CONNECTING = 1,
+    MIG_HANDSHAKE = 2,      // sent "cluster import"
+    MIG_READY = 3,          // can send the next command
+    MIG_IMPORTING = 4,      // sent "cluster setslot <slot> importing <self>"
+    MIG_BATCH = 5,          // a batch of restores is in flight
+    MIG_FINISH = 6,         // sent "cluster setslot <slot> node <target>"
+};
+
+static const char *mig_state_name(uint32_t state) {
+    switch (state) {
+    case MIG_CONNECTING: return "connecting";
+    case MIG_HANDSHAKE: return "handshake";
+    case MIG_READY: return "ready";
+    case MIG_IMPORTING: return "importing";
+    case MIG_BATCH: return "batch";
+    case MIG_FINISH: return "finish";
+    default: return "idle";
+    }
+}
+
+const uint64_t k_migrate_timeout_ms = 30 * 1000;
+
+static struct {
+    std::string self;
+    std::string config_path;
+    // node addresses, the slot tables hold indexes into it (-1 for none)
+    std::vector<std::string> nodes;
+    std::vector<int16_t> owner;
+    std::vector<int16_t> migrating;
+    std::vector<int16_t> importing;
+    // slots waiting to be migrated, the front one is being sent
+    std::deque<uint16_t> queue;
+    bool announced = false;     // the target of the front slot knows it imports it
+    bool started = false;       // keys of the front slot were sent
+    MigrateHandler h = {};
+    uint32_t state = MIG_IDLE;
+    int fd = -1;
+    int16_t target = -1;        // of the connection
+    std::string rbuf;
+    std::string wbuf;
+    uint32_t pending = 0;       // replies still expected
+    bool batch_failed = false;
+    uint64_t batch_bytes = 0;
+    uint32_t batch_keys = 0;
+    uint64_t retry_ms = 0;
+    uint64_t last_io_ms = 0;
+    // stats
+    uint64_t slots_migrated = 0;
+    uint64_t keys_migrated = 0;
+    uint64_t batches = 0;
+    uint64_t bytes_migrated = 0;
+    uint64_t migrate_errors = 0;
+} g_cluster;
+
+static uint64_t get_msec() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return (uint64_t)tv.tv_sec * 1000 + (uint64_t)tv.tv_nsec / 1000 / 1000;
+}
+
+static int16_t node_index(const std::string &addr) {
+    for (size_t i = 0; i < g_cluster.nodes.size(); ++i) {
+        if (g_cluster.nodes[i] == addr) {
+            return (int16_t)i;
+        }
+    }
+    g_cluster.nodes.push_back(addr);
+    return (int16_t)(g_cluster.nodes.size() - 1);
+}
+
+static const std::string *node_addr(int16_t idx) {
+    return idx < 0 ? NULL : &g_cluster.nodes[(size_t)idx];
+}
+
+std::vector<ClusterRange> cluster_ranges() {
+    std::vector<ClusterRange> ranges;
+    for (uint32_t slot = 0; slot < k_cluster_slots; ) {
+        int16_t idx = g_cluster.owner[slot];
+        uint32_t last = slot;
+        while (last + 1 < k_cluster_slots && g_cluster.owner[last + 1] == idx) {
+            last++;
+        }
+        if (idx >= 0) {
+            ranges.push_back({(uint16_t)slot, (uint16_t)last, g_cluster.nodes[(size_t)idx]});
+        }
+        slot = last + 1;
+    }
+    return ranges;
+}
+
+// one line per range: first last host:port
+static void config_save() {
+    if (g_cluster.config_path.empty()) {
+        return;
+    }
+    std::string tmp = g_cluster.config_path + ".tmp";
+    FILE *fp = fopen(tmp.c_str(), "w");
+    if (!fp) {
+        log_error("cluster config: %s", strerror(errno));
+        return;
+    }
+    for (const ClusterRange &r : cluster_ranges()) {
+        fprintf(fp, "%u %u %s\n", (unsigned)r.first, (unsigned)r.last, r.addr.c_str());
+    }
+    bool ok = fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+    ok = fclose(fp) == 0 && ok;
+    if (!ok || rename(tmp.c_str(), g_cluster.config_path.c_str()) != 0) {
+        log_error("cluster config: %s", strerror(errno));
+        unlink(tmp.c_str());
+    }
+}
+
+static void config_load() {
+    FILE *fp = fopen(g_cluster.config_path.c_str(), "r");
+    if (!fp) {
+        return;
+    }
+    unsigned first = 0, last = 0;
+    char addr[256];
+    while (fscanf(fp, "%u %u %255s", &first, &last, addr) == 3) {
+        if (first > last || last >= k_cluster_slots) {
+            log_warn("cluster config: bad range %u %u", first, last);
+            continue;
+        }
+        int16_t idx = node_index(addr);
+        for (unsigned slot = first; slot <= last; ++slot) {
+            g_cluster.owner[slot] = idx;
+        }
+    }
+    fclose(fp);
+}
+
+void cluster_init(const std::string &self, const std::string &config_path) {
+    g_cluster.self = self;
+    g_cluster.config_path = config_path;
+    g_cluster.owner.assign(k_cluster_slots, -1);
+    g_cluster.migrating.assign(k_cluster_slots, -1);
+    g_cluster.importing.assign(k_cluster_slots, -1);
+    node_index(self);   // index 0
+    config_load();
+}
+
+const std::string &cluster_self() {
+    return g_cluster.self;
+}
+
+const std::string *cluster_slot_owner(uint16_t slot) {
+    return node_addr(g_cluster.owner[slot]);
+}
+
+bool cluster_slot_is_mine(uint16_t slot) {
+    return g_cluster.owner[slot] == 0;
+}
+
+const std::string *cluster_slot_migrating(uint16_t slot) {
+    if (g_cluster.queue.empty() || g_cluster.queue.front() != slot || !g_cluster.announced) {
+        return NULL;
+    }
+    return node_addr(g_cluster.migrating[slot]);
+}
+
+const std::string *cluster_slot_importing(uint16_t slot) {
+    return node_addr(g_cluster.importing[slot]);
+}
+
+bool cluster_set_owner(uint16_t first, uint16_t last, const std::string &addr, std::string &err) {
+    for (uint32_t slot = first; slot <= last; ++slot) {
+        if (g_cluster.migrating[slot] >= 0) {
+            err = "slot " + std::to_string(slot) + " is migrating";
+            return false;
+        }
+    }
+    int16_t idx = node_index(addr);
+    for (uint32_t slot = first; slot <= last; ++slot) {
+        g_cluster.owner[slot] = idx;
+        g_cluster.importing[slot] = -1;
+    }
+    config_save();
+    return true;
+}
+
+bool cluster_set_importing(uint16_t slot, const std::string &source, std::string &err) {
+    if (g_cluster.owner[slot] == 0) {
+        err = "slot " + std::to_string(slot) + " is already served by this node";
+        return false;
+    }
+    g_cluster.importing[slot] = node_index(source);
+    return true;
+}
+
+static bool migration_started(uint16_t slot) {
+    return !g_cluster.queue.empty() && g_cluster.queue.front() == slot && g_cluster.started;
+}
+
+bool cluster_set_stable(uint16_t slot, std::string &err) {
+    if (g_cluster.migrating[slot] >= 0) {
+        if (migration_started(slot)) {
+            err = "the migration of slot " + std::to_string(slot) + " has started";
+            return false;
+        }
+        for (auto it = g_cluster.queue.begin(); it != g_cluster.queue.end(); ++it) {
+            if (*it == slot) {
+                g_cluster.queue.erase(it);
+                break;
+            }
+        }
+        g_cluster.migrating[slot] = -1;
+    }
+    g_cluster.importing[slot] = -1;
+    return true;
+}
+
+bool cluster_migrate(uint16_t slot, const std::string &target, std::string &err) {
+    std::string host;
+    uint16_t port = 0;
+    if (g_cluster.owner[slot] != 0) {
+        err = "slot " + std::to_string(slot) + " is not served by this node";
+    } else if (g_cluster.migrating[slot] >= 0) {
+        err = "slot " + std::to_string(slot) + " is already migrating";
+    } else if (target == g_cluster.self || !parse_addr(target, host, port)) {
+        err = "bad target";
+    } else {
+        g_cluster.migrating[slot] = node_index(target);
+        g_cluster.queue.push_back(slot);
+        return true;
+    }
+    return false;
+}
+
+bool cluster_migration_pending() {
+    return !g_cluster.queue.empty();
+}
+
+void cluster_migrate_init(const MigrateHandler &h) {
+    g_cluster.h = h;
+}
+
+void cluster_get_stats(ClusterStats *stats) {
+    *stats = ClusterStats();
+    for (uint32_t slot = 0; slot < k_cluster_slots; ++slot) {
+        stats->slots_assigned += g_cluster.owner[slot] >= 0;
+        stats->slots_owned += g_cluster.owner[slot] == 0;
+        stats->slots_migrating += g_cluster.migrating[slot] >= 0;
+        stats->slots_importing += g_cluster.importing[slot] >= 0;
+    }
+    stats->migrate_state = mig_state_name(g_cluster.state);
+    stats->migrate_slot = g_cluster.queue.empty() ? -1 : g_cluster.queue.front();
+    stats->slots_migrated = g_cluster.slots_migrated;
+    stats->keys_migrated = g_cluster.keys_migrated;
+    stats->batches = g_cluster.batches;
+    stats->bytes_migrated = g_cluster.bytes_migrated;
+    stats->migrate_errors = g_cluster.migrate_errors;
+}
+
+// drop the connection, the front slot is retried later
+static void mig_close(const char *why) {
+    if (why) {
+        log_warn("slot migration: %s", why);
+    }
+    if (g_cluster.state == MIG_BATCH) {
+        g_cluster.h.rollback(g_cluster.h.arg);
+    }
+    if (g_cluster.fd >= 0) {
+        close(g_cluster.fd);
+        g_cluster.fd = -1;
+    }
+    g_cluster.rbuf.clear();
+    g_cluster.wbuf.clear();
+    g_cluster.pending = 0;
+    // once keys were sent only the new owner can be told, whatever happened
+    // to the target meanwhile
+    g_cluster.announced = g_cluster.announced && g_cluster.started;
+    g_cluster.state = MIG_IDLE;
+    g_cluster.retry_ms = get_msec() + (why ? 1000 : 0);
+}
+
+// the target refused a command, give up on the front slot
+static void mig_abort(const std::string &why) {
+    uint16_t slot = g_cluster.queue.front();
+    log_warn("slot migration: slot %u aborted, %s", (unsigned)slot, why.c_str());
+    g_cluster.migrate_errors++;
+    mig_close(NULL);
+    g_cluster.migrating[slot] = -1;
+    g_cluster.queue.pop_front();
+    g_cluster.started = false;
+}
+
+static void mig_flush() {
+    while (!g_cluster.wbuf.empty()) {
+        ssize_t rv = write(g_cluster.fd, g_cluster.wbuf.data(), g_cluster.wbuf.size());
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv < 0 && errno == EAGAIN) {
+            return;
+        }
+        if (rv <= 0) {
+            return mig_close("write() error");
+        }
+        g_cluster.wbuf.erase(0, (size_t)rv);
+    }
+}
+
+static void mig_send(uint32_t state, const std::vector<std::string> &cmd) {
+    put_req(g_cluster.wbuf, cmd);
+    g_cluster.state = state;
+    g_cluster.pending = 1;
+    g_cluster.last_io_ms = get_msec();
+    mig_flush();
+}
+
+static void mig_connect() {
+    uint16_t slot = g_cluster.queue.front();
+    int16_t target = g_cluster.migrating[slot];
+    std::string host;
+    uint16_t port = 0;
+    parse_addr(g_cluster.nodes[(size_t)target], host, port);
+    g_cluster.fd = tcp_connect_nb(host, port);
+    if (g_cluster.fd < 0) {
+        return mig_close("can't connect to the target");
+    }
+    g_cluster.target = target;
+    g_cluster.state = MIG_CONNECTING;
+    g_cluster.last_io_ms = get_msec();
+}
+
+static void mig_on_reply(bool ok, const std::string &err) {
+    uint16_t slot = g_cluster.queue.front();
+    switch (g_cluster.state) {
+    case MIG_HANDSHAKE:
+        if (!ok) {
+            return mig_abort(err);
+        }
+        g_cluster.state = MIG_READY;
+        break;
+    case MIG_IMPORTING:
+        if (!ok) {
+            return mig_abort(err);
+        }
+        g_cluster.announced = true;
+        g_cluster.state = MIG_READY;
+        break;
+    case MIG_BATCH:
+        g_cluster.batch_failed = g_cluster.batch_failed || !ok;
+        if (--g_cluster.pending > 0) {
+            return;
+        }
+        if (g_cluster.batch_failed) {
+            return mig_abort(err);  // rolls the batch back
+        }
+        g_cluster.h.commit(g_cluster.h.arg);
+        g_cluster.keys_migrated += g_cluster.batch_keys;
+        g_cluster.bytes_migrated += g_cluster.batch_bytes;
+        g_cluster.batches++;
+        g_cluster.state = MIG_READY;
+        break;
+    case MIG_FINISH:
+        if (!ok) {
+            // the keys are there already, keep asking
+            return mig_close(("the target didn't take slot " + std::to_string(slot) + ", " + err).c_str());
+        }
+        g_cluster.owner[slot] = g_cluster.migrating[slot];
+        g_cluster.migrating[slot] = -1;
+        config_save();
+        g_cluster.queue.pop_front();
+        g_cluster.announced = false;
+        g_cluster.started = false;
+        g_cluster.slots_migrated++;
+        log_info("slot migration: slot %u moved to %s",
+            (unsigned)slot, g_cluster.nodes[(size_t)g_cluster.target].c_str());
+        g_cluster.h.moved(g_cluster.h.arg, slot);
+        g_cluster.state = MIG_READY;
+        // the connection is reused for the next slot of the same target
+        if (g_cluster.queue.empty() || g_cluster.migrating[g_cluster.queue.front()] != g_cluster.target) {
+            mig_close(NULL);
+        }
+        break;
+    }
+}
+
+// replies are tagged values, only errors matter here
+static void mig_read() {
+    char buf[4096];
+    while (true) {
+        ssize_t rv = read(g_cluster.fd, buf, sizeof(buf));
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv < 0 && errno == EAGAIN) {
+            break;
+        }
+        if (rv <= 0) {
+            return mig_close(rv == 0 ? "the target closed the connection" : "read() error");
+        }
+        g_cluster.rbuf.append(buf, (size_t)rv);
+        g_cluster.last_io_ms = get_msec();
+    }
+    size_t pos = 0;
+    while (g_cluster.fd >= 0 && g_cluster.rbuf.size() - pos >= 4) {
+        uint32_t len = 0;
+        memcpy(&len, &g_cluster.rbuf[pos], 4);
+        if (g_cluster.rbuf.size() - pos - 4 < len) {
+            break;
+        }
+        const char *res = &g_cluster.rbuf[pos + 4];
+        bool ok = len > 0 && res[0] != SER_ERR;
+        std::string err;
+        uint32_t mlen = 0;
+        if (!ok && len >= 9 && (memcpy(&mlen, res + 5, 4), 9 + (size_t)mlen <= len)) {
+            err.assign(res + 9, mlen);
+        }
+        pos += 4 + len;
+        if (g_cluster.pending == 0) {
+            return mig_close("unexpected reply");
+        }
+        mig_on_reply(ok, err);
+    }
+    if (g_cluster.fd >= 0) {
+        g_cluster.rbuf.erase(0, pos);
+    }
+}
+
+bool cluster_pollfd(struct pollfd *pfd) {
+    if (g_cluster.fd < 0) {
+        return false;
+    }
+    pfd->fd = g_cluster.fd;
+    pfd->events = POLLIN | POLLERR;
+    if (g_cluster.state == MIG_CONNECTING || !g_cluster.wbuf.empty()) {
+        pfd->events |= POLLOUT;
+    }
+    pfd->revents = 0;
+    return true;
+}
+
+void cluster_io(short revents) {
+    if (g_cluster.state == MIG_CONNECTING) {
+        if (!(revents & (POLLOUT | POLLERR | POLLHUP))) {
+            return;
+        }
+        if (!tcp_connect_ok(g_cluster.fd)) {
+            return mig_close("can't connect to the target");
+        }
+        // the target accepts large frames and ASK-only slots on this connection
+        return mig_send(MIG_HANDSHAKE, {"cluster", "import"});
+    }
+    if (revents & POLLOUT) {
+        mig_flush();
+    }
+    if (g_cluster.fd >= 0 && (revents & (POLLIN | POLLERR | POLLHUP))) {
+        mig_read();
+    }
+}
+
+void cluster_cron() {
+    if (g_cluster.queue.empty()) {
+        return;
+    }
+    uint64_t now = get_msec();
+    if (g_cluster.state == MIG_IDLE) {
+        if (now >= g_cluster.retry_ms) {
+            mig_connect();
+        }
+        return;
+    }
+    if (g_cluster.state != MIG_READY) {
+        if (now - g_cluster.last_io_ms > k_migrate_timeout_ms) {
+            mig_close("timeout");
+        }
+        return;
+    }
+
+    uint16_t slot = g_cluster.queue.front();
+    const std::string &target = g_cluster.nodes[(size_t)g_cluster.target];
+    if (!g_cluster.announced) {
+        return mig_send(MIG_IMPORTING, {"cluster", "setslot", std::to_string(slot), "importing", g_cluster.self});
+    }
+    size_t before = g_cluster.wbuf.size();
+    size_t nframes = 0;
+    size_t n = g_cluster.h.take(g_cluster.h.arg, slot, g_cluster.wbuf, &nframes);
+    if (n == 0) {
+        // empty, hand it over
+        return mig_send(MIG_FINISH, {"cluster", "setslot", std::to_string(slot), "node", target});
+    }
+    g_cluster.state = MIG_BATCH;
+    g_cluster.started = true;
+    g_cluster.pending = (uint32_t)nframes;
+    g_cluster.batch_failed = false;
+    g_cluster.batch_keys = (uint32_t)n;
+    g_cluster.batch_bytes = g_cluster.wbuf.size() - before;
+    g_cluster.last_io_ms = now;
+    mig_flush();
+}
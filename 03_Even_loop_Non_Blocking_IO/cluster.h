@@ -0,0 +1,102 @@
+#pragma once
+
+#include <poll.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/*
+Hash slot sharding. A key belongs to one of 16384 slots, CRC16 of the key
+(XMODEM, the one Redis Cluster uses) or of its hash tag: the part between
+the first '{' and the next '}' if it is not empty, so "{user1}.name" and
+"{user1}.mail" share a slot. Every node has the table of which node
+(host:port) owns each slot and redirects the requests for the slots of
+other nodes. There is no gossip: the table is set by an administrator on
+each node, and a node that moved a slot away redirects to its new owner.
+
+Live migration of a slot from this node to `target`:
+  - the target is told it is importing the slot, it then serves the keys
+    of that slot to the connections that say they were redirected (ASK);
+  - batches of keys are detached from the keyspace and sent as RESTORE
+    commands on a non-blocking connection, one batch in flight at a time.
+    The keyspace decides how large a batch is, so neither event loop
+    stalls on a large slot;
+  - once the slot is empty both nodes record the target as its owner.
+*/
+
+const uint32_t k_cluster_slots = 16384;
+
+uint16_t crc16(const char *buf, size_t len);
+uint16_t key_hash_slot(const char *key, size_t len);
+
+// `self` is the address other nodes and clients use for this one. The slot
+// table is loaded from `config_path`, and saved there whenever it changes.
+void cluster_init(const std::string &self, const std::string &config_path);
+const std::string &cluster_self();
+
+// NULL if no node serves the slot
+const std::string *cluster_slot_owner(uint16_t slot);
+bool cluster_slot_is_mine(uint16_t slot);
+// the target of the slot whose keys are being sent, once it knows it
+// imports the slot, or NULL. The keys missing here are there.
+const std::string *cluster_slot_migrating(uint16_t slot);
+// the source of a slot being imported, or NULL
+const std::string *cluster_slot_importing(uint16_t slot);
+
+// false with a message in `err` if the change isn't allowed
+bool cluster_set_owner(uint16_t first, uint16_t last, const std::string &addr, std::string &err);
+bool cluster_set_importing(uint16_t slot, const std::string &source, std::string &err);
+// clears importing, and a migration that hasn't started sending keys yet
+bool cluster_set_stable(uint16_t slot, std::string &err);
+// queue the migration of a slot owned by this node
+bool cluster_migrate(uint16_t slot, const std::string &target, std::string &err);
+
+struct ClusterRange {
+    uint16_t first;
+    uint16_t last;
+    std::string addr;
+};
+// consecutive slots with the same owner
+std::vector<ClusterRange> cluster_ranges();
+
+struct ClusterStats {
+    uint32_t slots_assigned = 0;
+    uint32_t slots_owned = 0;
+    uint32_t slots_migrating = 0;
+    uint32_t slots_importing = 0;
+    const char *migrate_state = "";
+    int32_t migrate_slot = -1;      // the slot being sent
+    uint64_t slots_migrated = 0;
+    uint64_t keys_migrated = 0;
+    uint64_t batches = 0;
+    uint64_t bytes_migrated = 0;
+    uint64_t migrate_errors = 0;
+};
+void cluster_get_stats(ClusterStats *stats);
+
+/*
+The keyspace side of a migration. `take` detaches up to a batch of keys of
+the slot and appends the frames that rebuild them to `out` (a RESTORE ...
+REPLACE, or several commands for a large value), returning how many keys
+with the number of frames in `nframes`; 0 means the slot is empty. After the target has
+replied to the whole batch, `commit` frees the keys, or `rollback` puts
+them back into the keyspace if the batch failed or the connection broke.
+`moved` is called once the target owns the emptied slot.
+*/
+struct MigrateHandler {
+    void *arg;
+    size_t (*take)(void *arg, uint16_t slot, std::string &out, size_t *nframes);
+    void (*commit)(void *arg);
+    void (*rollback)(void *arg);
+    void (*moved)(void *arg, uint16_t slot);
+};
+void cluster_migrate_init(const MigrateHandler &h);
+// slots are queued for migration, the event loop should not sleep long
+bool cluster_migration_pending();
+
+// the connection to the target, polled by the event loop
+bool cluster_pollfd(struct pollfd *pfd);
+void cluster_io(short revents);
+// sends the next batch; call it every loop iteration
+void cluster_cron();
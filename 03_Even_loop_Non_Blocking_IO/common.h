@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// get the struct that embeds `ptr` as its `member`
+#define container_of(ptr, T, member) \
+    ((T *)((char *)(ptr) - offsetof(T, member)))
+
+// FNV-1a
+inline uint64_t str_hash(const uint8_t *data, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ data[i]) * 0x100000001b3ULL;
+    }
+    return h;
+}
@@ -0,0 +1,103 @@
+#include "glob.h"
+
+// match one byte `c` against the pattern element at `p` (not '*'). Returns
+// the length of the element, 0 if it doesn't match, -1 for an unterminated
+// set, which matches nothing.
+static int match_one(const char *p, const char *pend, char c) {
+    const char *start = p;
+    switch (*p) {
+    case '?':
+        return 1;
+    case '[': {
+        p++;
+        bool neg = p < pend && *p == '^';
+        if (neg) {
+            p++;
+        }
+        bool match = false;
+        while (p < pend && *p != ']') {
+            if (*p == '\\' && p + 1 < pend) {
+                match |= p[1] == c;
+                p += 2;
+            } else if (p + 2 < pend && p[1] == '-' && p[2] != ']') {
+                unsigned char lo = (unsigned char)p[0];
+                unsigned char hi = (unsigned char)p[2];
+                if (lo > hi) {
+                    unsigned char t = lo;
+                    lo = hi;
+                    hi = t;
+                }
+                match |= (unsigned char)c >= lo && (unsigned char)c <= hi;
+                p += 3;
+            } else {
+                match |= *p == c;
+                p++;
+            }
+        }
+        if (p == pend) {
+            return -1;
+        }
+        return match != neg ? (int)(p + 1 - start) : 0;
+    }
+    case '\\':
+        if (p + 1 < pend) {
+            p++;
+        }
+        /* fall through */
+    default:
+        return *p == c ? (int)(p + 1 - start) : 0;
+    }
+}
+
+/*
+Only the last '*' is ever retried: when the rest fails to match, the '*'
+takes one more byte and the rest is tried again from there. An earlier '*'
+never needs to take more, whatever it could give to the segments after it
+the last one can take as well. So the cost is O(len(pat) * len(s)) with no
+recursion, where retrying every '*' was exponential in their number.
+*/
+bool glob_match(const char *pat, size_t plen, const char *s, size_t slen) {
+    const char *p = pat;
+    const char *pend = pat + plen;
+    const char *send = s + slen;
+    const char *star_p = NULL;  // the pattern after the last '*'
+    const char *star_s = NULL;  // where the string resumes after it
+    while (p < pend || s < send) {
+        if (p < pend && *p == '*') {
+            while (p < pend && *p == '*') {
+                p++;
+            }
+            if (p == pend) {
+                return true;
+            }
+            star_p = p;
+            star_s = s;
+            continue;
+        }
+        if (p < pend && s < send) {
+            int n = match_one(p, pend, *s);
+            if (n < 0) {
+                return false;   // unterminated set
+            }
+            if (n > 0) {
+                p += n;
+                s++;
+                continue;
+            }
+        }
+        if (!star_p || star_s == send) {
+            return false;
+        }
+        p = star_p;
+        s = ++star_s;
+    }
+    return true;
+}
+
+size_t glob_literal_prefix(const char *pat, size_t plen) {
+    size_t i = 0;
+    while (i < plen && pat[i] != '*' && pat[i] != '?' && pat[i] != '[' && pat[i] != '\\') {
+        i++;
+    }
+    return i;
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stddef.h>
+
+/*
+Glob-style pattern matching, as used by KEYS and SCAN MATCH:
+    *       any sequence of bytes, including an empty one
+    ?       any single byte
+    [abc]   one of the bytes in the set, [^abc] for the opposite, [a-z] for a range
+    \x      the byte x itself
+*/
+bool glob_match(const char *pat, size_t plen, const char *s, size_t slen);
+
+// length of the literal prefix of a pattern, e.g. 7 for "tenant:*:user",
+// every matching string starts with these bytes
+size_t glob_literal_prefix(const char *pat, size_t plen);
@@ -0,0 +1,233 @@
+#include <assert.h>
+#include <stdlib.h>
+#include "hashtable.h"
+
+const size_t k_max_load_factor = 1;
+const size_t k_min_slots = 4;
+const size_t k_rehashing_work = 128;    // nodes moved per operation
+
+static void h_init(HTab *htab, size_t n) {
+    assert(n > 0 && ((n - 1) & n) == 0);
+    htab->tab = (HNode **)calloc(n, sizeof(HNode *));
+    if (!htab->tab) {
+        abort();
+    }
+    htab->mask = n - 1;
+    htab->size = 0;
+}
+
+static void h_insert(HTab *htab, HNode *node) {
+    size_t pos = node->hcode & htab->mask;
+    node->next = htab->tab[pos];
+    htab->tab[pos] = node;
+    htab->size++;
+}
+
+// returns the address of the pointer that points to the target node
+static HNode **h_lookup(HTab *htab, HNode *key, bool (*eq)(HNode *, HNode *)) {
+    if (!htab->tab) {
+        return NULL;
+    }
+    size_t pos = key->hcode & htab->mask;
+    HNode **from = &htab->tab[pos];
+    for (HNode *cur; (cur = *from) != NULL; from = &cur->next) {
+        if (cur->hcode == key->hcode && eq(cur, key)) {
+            return from;
+        }
+    }
+    return NULL;
+}
+
+static HNode *h_detach(HTab *htab, HNode **from) {
+    HNode *node = *from;
+    *from = node->next;
+    htab->size--;
+    return node;
+}
+
+// move some nodes to the new table, empty slots count as work too
+static void hm_help_rehashing(HMap *hmap) {
+    size_t nwork = 0;
+    while (nwork < k_rehashing_work * 10 && hmap->older.size > 0) {
+        HNode **from = &hmap->older.tab[hmap->migrate_pos];
+        if (!*from) {
+            hmap->migrate_pos++;
+            nwork++;
+            continue;
+        }
+        h_insert(&hmap->newer, h_detach(&hmap->older, from));
+        nwork += 10;
+    }
+    if (hmap->older.size == 0 && hmap->older.tab) {
+        free(hmap->older.tab);
+        hmap->older = HTab{};
+    }
+}
+
+static void hm_start_resizing(HMap *hmap, size_t n) {
+    assert(hmap->older.tab == NULL);
+    hmap->older = hmap->newer;
+    h_init(&hmap->newer, n);
+    hmap->migrate_pos = 0;
+}
+
+HNode *hm_lookup(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *)) {
+    hm_help_rehashing(hmap);
+    HNode **from = h_lookup(&hmap->newer, key, eq);
+    if (!from) {
+        from = h_lookup(&hmap->older, key, eq);
+    }
+    return from ? *from : NULL;
+}
+
+void hm_insert(HMap *hmap, HNode *node) {
+    if (!hmap->newer.tab) {
+        h_init(&hmap->newer, k_min_slots);
+    }
+    h_insert(&hmap->newer, node);
+
+    if (!hmap->older.tab) {
+        size_t threshold = (hmap->newer.mask + 1) * k_max_load_factor;
+        if (hmap->newer.size >= threshold) {
+            hm_start_resizing(hmap, (hmap->newer.mask + 1) * 2);
+        }
+    }
+    hm_help_rehashing(hmap);
+}
+
+HNode *hm_delete(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *)) {
+    hm_help_rehashing(hmap);
+    HNode *node = NULL;
+    if (HNode **from = h_lookup(&hmap->newer, key, eq)) {
+        node = h_detach(&hmap->newer, from);
+    } else if (HNode **from = h_lookup(&hmap->older, key, eq)) {
+        node = h_detach(&hmap->older, from);
+    }
+
+    // shrink when less than 1/8 of the slots are used
+    size_t slots = hmap->newer.mask + 1;
+    if (node && !hmap->older.tab && slots > k_min_slots && hmap->newer.size * 8 < slots) {
+        size_t n = k_min_slots;
+        while (n < hmap->newer.size) {
+            n *= 2;
+        }
+        hm_start_resizing(hmap, n);
+        hm_help_rehashing(hmap);
+    }
+    return node;
+}
+
+void hm_clear(HMap *hmap) {
+    free(hmap->newer.tab);
+    free(hmap->older.tab);
+    *hmap = HMap{};
+}
+
+size_t hm_size(HMap *hmap) {
+    return hmap->newer.size + hmap->older.size;
+}
+
+void hm_reserve(HMap *hmap, size_t n) {
+    assert(hm_size(hmap) == 0);
+    hm_clear(hmap);
+    size_t slots = k_min_slots;
+    while (slots * k_max_load_factor < n) {
+        slots *= 2;
+    }
+    h_init(&hmap->newer, slots);
+}
+
+void hm_bulk_insert(HMap *hmap, HNode *const *nodes, size_t n) {
+    HTab *htab = &hmap->newer;
+    for (size_t i = 0; i < n; ++i) {
+        size_t pos = nodes[i]->hcode & htab->mask;
+        nodes[i]->next = htab->tab[pos];
+        htab->tab[pos] = nodes[i];
+    }
+}
+
+void hm_bulk_done(HMap *hmap, size_t n) {
+    hmap->newer.size += n;
+}
+
+static bool h_foreach(HTab *htab, bool (*f)(HNode *, void *), void *arg) {
+    for (size_t i = 0; htab->tab && i <= htab->mask; ++i) {
+        for (HNode *node = htab->tab[i]; node != NULL; node = node->next) {
+            if (!f(node, arg)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+void hm_foreach(HMap *hmap, bool (*f)(HNode *, void *), void *arg) {
+    if (h_foreach(&hmap->newer, f, arg)) {
+        h_foreach(&hmap->older, f, arg);
+    }
+}
+
+static uint64_t rev_bits(uint64_t v) {
+    v = ((v >> 1) & 0x5555555555555555ULL) | ((v & 0x5555555555555555ULL) << 1);
+    v = ((v >> 2) & 0x3333333333333333ULL) | ((v & 0x3333333333333333ULL) << 2);
+    v = ((v >> 4) & 0x0f0f0f0f0f0f0f0fULL) | ((v & 0x0f0f0f0f0f0f0f0fULL) << 4);
+    return __builtin_bswap64(v);
+}
+
+// increment the bits covered by `mask`, starting from the most significant one
+static uint64_t rev_increment(uint64_t v, uint64_t mask) {
+    v |= ~mask;
+    v = rev_bits(v);
+    v++;
+    return rev_bits(v);
+}
+
+static size_t h_emit_slot(HTab *htab, size_t pos, void (*f)(HNode *, void *), void *arg) {
+    size_t n = 0;
+    for (HNode *node = htab->tab[pos]; node != NULL; node = node->next) {
+        f(node, arg);
+        n++;
+    }
+    return n;
+}
+
+uint64_t hm_scan(HMap *hmap, uint64_t cursor, size_t count,
+    void (*f)(HNode *, void *), void *arg)
+{
+    if (!hmap->newer.tab || hm_size(hmap) == 0) {
+        return 0;
+    }
+    size_t emitted = 0;
+    size_t empty_budget = count * 10;
+    do {
+        size_t n = 0;
+        if (!hmap->older.tab) {
+            HTab *t = &hmap->newer;
+            n = h_emit_slot(t, cursor & t->mask, f, arg);
+            cursor = rev_increment(cursor, t->mask);
+        } else {
+            // visit the slot in the small table, then every slot of the
+            // large table that it expands to
+            HTab *t0 = &hmap->older;
+            HTab *t1 = &hmap->newer;
+            if (t0->mask > t1->mask) {
+                HTab *tmp = t0;
+                t0 = t1;
+                t1 = tmp;
+            }
+            n = h_emit_slot(t0, cursor & t0->mask, f, arg);
+            do {
+                n += h_emit_slot(t1, cursor & t1->mask, f, arg);
+                cursor = rev_increment(cursor, t1->mask);
+            } while (cursor & (t0->mask ^ t1->mask));
+        }
+        emitted += n;
+        if (n == 0) {
+            if (empty_budget == 0) {
+                break;
+            }
+            empty_budget--;
+        }
+    } while (cursor != 0 && emitted < count);
+    return cursor;
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+An intrusive chaining hash table: the node is embedded in the caller's
+struct, so inserting does not allocate.
+
+The number of slots is a power of 2. Resizing is progressive: a new table is
+allocated and every operation moves a bounded number of nodes from the old
+one, so no single command pays for rehashing millions of keys.
+*/
+struct HNode {
+    HNode *next = NULL;
+    uint64_t hcode = 0;
+};
+
+struct HTab {
+    HNode **tab = NULL;
+    size_t mask = 0;    // number of slots - 1
+    size_t size = 0;    // number of nodes
+};
+
+struct HMap {
+    HTab newer;
+    HTab older;         // being moved to `newer`, empty if not resizing
+    size_t migrate_pos = 0;
+};
+
+// `eq(node, key)` compares a node in the table with the node passed in
+HNode *hm_lookup(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *));
+void hm_insert(HMap *hmap, HNode *node);
+// detach and return the node, NULL if not found
+HNode *hm_delete(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *));
+void hm_clear(HMap *hmap);
+size_t hm_size(HMap *hmap);
+// visit every node, stops when `f` returns false
+void hm_foreach(HMap *hmap, bool (*f)(HNode *, void *), void *arg);
+
+/*
+Bulk loading into an empty table. hm_reserve allocates the slots for `n`
+nodes up front, so no resize happens while loading. hm_bulk_insert does no
+rehashing work and doesn't update the node count, so several threads may
+call it at once as long as no two of them insert into the same slot, e.g.
+thread i only inserts nodes with `hcode % nthreads == i` and the number of
+threads is a power of 2 no larger than the number of slots.
+hm_bulk_done adds the total number of nodes once all threads are done.
+*/
+void hm_reserve(HMap *hmap, size_t n);
+void hm_bulk_insert(HMap *hmap, HNode *const *nodes, size_t n);
+void hm_bulk_done(HMap *hmap, size_t n);
+
+/*
+Incremental scan with a stateless cursor. Start with 0, pass the returned
+cursor to the next call, the scan is done when 0 is returned again.
+
+The cursor is a slot index incremented from its most significant bit down
+(reverse binary). When the table doubles, slot i splits into i and
+i + old_size, which come after every cursor already returned; when it
+shrinks, slots merge into ones whose cursor has the same low bits. So
+every node present during the whole scan is returned at least once even if
+the table is resized between calls, although some may be returned twice.
+
+Whole slots are visited until about `count` nodes were returned, with a
+bound on empty slots visited, so each call does a bounded amount of work.
+*/
+uint64_t hm_scan(HMap *hmap, uint64_t cursor, size_t count,
+    void (*f)(HNode *, void *), void *arg);
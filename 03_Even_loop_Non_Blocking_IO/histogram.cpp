@@ -0,0 +1,76 @@
+#include <string.h>
+#include "histogram.h"
+
+static uint32_t bucket_of(uint64_t v) {
+    if (v < k_hist_sub) {
+        return (uint32_t)v;
+    }
+    uint32_t e = 63 - (uint32_t)__builtin_clzll(v);     // >= k_hist_sub_bits
+    uint32_t shift = e - k_hist_sub_bits;
+    uint32_t sub = (uint32_t)(v >> shift) & (k_hist_sub - 1);
+    return (shift + 1) * k_hist_sub + sub;
+}
+
+// the largest value of a bucket
+static uint64_t bucket_high(uint32_t b) {
+    if (b < k_hist_sub) {
+        return b;
+    }
+    uint32_t shift = b / k_hist_sub - 1;
+    uint64_t base = (uint64_t)(k_hist_sub + b % k_hist_sub) << shift;
+    return base + (((uint64_t)1 << shift) - 1);
+}
+
+void hist_init(Histogram *h) {
+    memset(h, 0, sizeof(*h));
+    h->min = UINT64_MAX;
+}
+
+void hist_record(Histogram *h, uint64_t v) {
+    h->counts[bucket_of(v)]++;
+    h->total++;
+    h->sum += v;
+    h->min = v < h->min ? v : h->min;
+    h->max = v > h->max ? v : h->max;
+}
+
+void hist_merge(Histogram *dst, const Histogram *src) {
+    for (uint32_t i = 0; i < k_hist_buckets; ++i) {
+        dst->counts[i] += src->counts[i];
+    }
+    dst->total += src->total;
+    dst->sum += src->sum;
+    dst->min = src->min < dst->min ? src->min : dst->min;
+    dst->max = src->max > dst->max ? src->max : dst->max;
+}
+
+uint64_t hist_percentile(const Histogram *h, double p) {
+    if (h->total == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(p / 100.0 * (double)h->total + 0.5);
+    rank = rank < 1 ? 1 : rank;
+    uint64_t seen = 0;
+    for (uint32_t i = 0; i < k_hist_buckets; ++i) {
+        seen += h->counts[i];
+        if (seen >= rank) {
+            uint64_t high = bucket_high(i);
+            return high < h->max ? high : h->max;
+        }
+    }
+    return h->max;
+}
+
+double hist_mean(const Histogram *h) {
+    return h->total ? (double)h->sum / (double)h->total : 0.0;
+}
+
+uint64_t hist_count_le(const Histogram *h, uint64_t v) {
+    uint64_t n = 0;
+    uint32_t last = bucket_of(v);
+    for (uint32_t i = 0; i < last; ++i) {
+        n += h->counts[i];
+    }
+    // the bucket of `v` counts if `v` is its top
+    return bucket_high(last) == v ? n + h->counts[last] : n;
+}
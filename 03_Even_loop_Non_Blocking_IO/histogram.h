@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+Latency histogram in the spirit of HdrHistogram: log-linear buckets with a
+fixed relative precision over the whole uint64 range.
+
+A value v >= 64 falls in the power of two [2^e, 2^(e+1)) of its highest bit,
+split into 64 equal sub-buckets by the next 6 bits; values below 64 have a
+bucket each. Any value is thus reported within 1/64 (1.6%) of itself, and
+recording is a bit scan plus an increment. The 3776 counters take 30 KB,
+histograms of several threads are merged by adding them.
+*/
+
+const uint32_t k_hist_sub_bits = 6;
+const uint32_t k_hist_sub = 1u << k_hist_sub_bits;
+const uint32_t k_hist_buckets = (64 - k_hist_sub_bits + 1) * k_hist_sub;
+
+struct Histogram {
+    uint64_t counts[k_hist_buckets];
+    uint64_t total;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+};
+
+void hist_init(Histogram *h);
+void hist_record(Histogram *h, uint64_t v);
+void hist_merge(Histogram *dst, const Histogram *src);
+// the value at percentile `p` (0-100), the upper bound of its bucket
+uint64_t hist_percentile(const Histogram *h, double p);
+double hist_mean(const Histogram *h);
+// the number of values <= `v`, exact when `v` is the top of a bucket
+uint64_t hist_count_le(const Histogram *h, uint64_t v);
@@ -0,0 +1,120 @@
+#include <string.h>
+#include <algorithm>
+#include "common.h"
+#include "hotkeys.h"
+
+bool g_hotkeys_enabled = false;
+
+static struct {
+    uint32_t sketch[k_hotkeys_depth][k_hotkeys_width];
+    std::vector<HotKey> heap;   // min-heap on `count`
+    uint64_t decay_ms = 1000;
+    uint64_t next_decay_ms = 0;
+} g_hot;
+
+// the count of `pos` went up
+static void heap_down(size_t pos) {
+    std::vector<HotKey> &h = g_hot.heap;
+    while (true) {
+        size_t l = pos * 2 + 1, r = l + 1, min = pos;
+        if (l < h.size() && h[l].count < h[min].count) {
+            min = l;
+        }
+        if (r < h.size() && h[r].count < h[min].count) {
+            min = r;
+        }
+        if (min == pos) {
+            return;
+        }
+        std::swap(h[pos], h[min]);
+        pos = min;
+    }
+}
+
+static void heap_up(size_t pos) {
+    std::vector<HotKey> &h = g_hot.heap;
+    while (pos > 0 && h[(pos - 1) / 2].count > h[pos].count) {
+        std::swap(h[pos], h[(pos - 1) / 2]);
+        pos = (pos - 1) / 2;
+    }
+}
+
+void hotkeys_enable(bool on, uint64_t decay_ms) {
+    if (on && !g_hotkeys_enabled) {
+        hotkeys_reset();
+    }
+    g_hotkeys_enabled = on;
+    g_hot.decay_ms = decay_ms ? decay_ms : 1;
+}
+
+void hotkeys_touch(const std::string &key, bool write) {
+    uint64_t h = str_hash((const uint8_t *)key.data(), key.size());
+    uint32_t h1 = (uint32_t)h;
+    uint32_t h2 = (uint32_t)(h >> 32) | 1;
+    uint32_t *cells[k_hotkeys_depth];
+    uint32_t est = UINT32_MAX;
+    for (uint32_t i = 0; i < k_hotkeys_depth; ++i) {
+        cells[i] = &g_hot.sketch[i][(h1 + i * h2) & (k_hotkeys_width - 1)];
+        est = std::min(est, *cells[i]);
+    }
+    // conservative update: only the counters at the minimum go up
+    est++;
+    for (uint32_t *c : cells) {
+        *c = std::max(*c, est);
+    }
+
+    std::vector<HotKey> &heap = g_hot.heap;
+    if (heap.size() == k_hotkeys_top && est <= heap[0].count) {
+        return;     // not in the top, the common case
+    }
+    for (size_t i = 0; i < heap.size(); ++i) {
+        HotKey &hk = heap[i];
+        if (hk.hash == h && hk.key == key) {
+            hk.count = est;
+            (write ? hk.writes : hk.reads)++;
+            return heap_down(i);
+        }
+    }
+    HotKey hk = {key, h, est, write ? 0u : 1u, write ? 1u : 0u};
+    if (heap.size() < k_hotkeys_top) {
+        heap.push_back(hk);
+        return heap_up(heap.size() - 1);
+    }
+    // replace the coldest
+    heap[0] = hk;
+    heap_down(0);
+}
+
+void hotkeys_cron(uint64_t now_ms) {
+    if (!g_hotkeys_enabled || now_ms < g_hot.next_decay_ms) {
+        return;
+    }
+    g_hot.next_decay_ms = now_ms + g_hot.decay_ms;
+    for (auto &row : g_hot.sketch) {
+        for (uint32_t &c : row) {
+            c >>= 1;
+        }
+    }
+    // halving keeps the heap order, the keys down to 0 leave
+    std::vector<HotKey> &heap = g_hot.heap;
+    for (HotKey &hk : heap) {
+        hk.count >>= 1;
+        hk.reads >>= 1;
+        hk.writes >>= 1;
+    }
+    while (!heap.empty() && heap[0].count == 0) {
+        std::swap(heap[0], heap.back());
+        heap.pop_back();
+        heap_down(0);
+    }
+}
+
+void hotkeys_top(std::vector<HotKey> &out) {
+    out = g_hot.heap;
+    std::sort(out.begin(), out.end(), [](const HotKey &a, const HotKey &b) { return a.count > b.count; });
+}
+
+void hotkeys_reset() {
+    memset(g_hot.sketch, 0, sizeof(g_hot.sketch));
+    g_hot.heap.clear();
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/*
+Hot key detection: every key a command touches is counted in a Count-Min
+sketch, and the keys with the highest counts are kept in a small min-heap.
+
+The sketch is k_hotkeys_depth rows of k_hotkeys_width counters. A key
+increments one counter per row, picked by double hashing of one 64-bit hash,
+and its estimate is the smallest of them: never below the true count, and
+above it by at most e/width of all the accesses with high probability.
+Conservative update (only the counters at the minimum are raised) keeps the
+error much lower in practice. 128 KB, so it stays in the L2 cache.
+
+The heap holds the top k_hotkeys_top keys by estimate. A key is only looked
+for in the heap when its estimate reaches the heap's minimum, so the cold
+keys cost just the sketch update; the lookup is a scan of the 32 hashes of
+the heap, cheaper than another hash table for so few keys.
+
+Every `decay_ms` all the counts are halved: a count is the accesses of the
+last window plus half of the one before, and so on, a sliding window with
+exponential weights. The heap entries also count the reads and the writes
+seen while they are in the heap, halved the same way.
+*/
+
+const uint32_t k_hotkeys_depth = 4;
+const uint32_t k_hotkeys_width = 8192;
+const size_t k_hotkeys_top = 32;
+
+struct HotKey {
+    std::string key;
+    uint64_t hash;
+    uint64_t count;     // the estimate
+    uint64_t reads;
+    uint64_t writes;
+};
+
+extern bool g_hotkeys_enabled;
+
+void hotkeys_enable(bool on, uint64_t decay_ms);
+void hotkeys_touch(const std::string &key, bool write);
+// halve everything if a window has passed
+void hotkeys_cron(uint64_t now_ms);
+// the hottest first
+void hotkeys_top(std::vector<HotKey> &out);
+void hotkeys_reset();
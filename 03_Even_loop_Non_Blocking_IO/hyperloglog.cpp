@@ -0,0 +1,489 @@
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+#include "hyperloglog.h"
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+const size_t k_hll_q = 64 - k_hll_p;    // bits left for the run of zeroes
+const uint32_t k_hll_reg_max = 63;
+const uint32_t k_hll_sparse_val_max = 32;
+const double k_hll_alpha_inf = 0.721347520444481703680;    // 0.5 / ln(2)
+
+/*
+Sparse opcodes, each one describes a run of registers:
+    ZERO  00xxxxxx           run of 1..64 zero registers
+    XZERO 01xxxxxx yyyyyyyy  run of 1..16384 zero registers
+    VAL   1vvvvvxx           run of 1..4 registers set to 1..32
+*/
+static bool sparse_is_zero(uint8_t b)  { return (b & 0xc0) == 0x00; }
+static bool sparse_is_xzero(uint8_t b) { return (b & 0xc0) == 0x40; }
+static uint32_t sparse_zero_len(uint8_t b) { return (b & 0x3f) + 1; }
+static uint32_t sparse_xzero_len(const uint8_t *p) {
+    return (((uint32_t)(p[0] & 0x3f) << 8) | p[1]) + 1;
+}
+static uint32_t sparse_val_value(uint8_t b) { return ((b >> 2) & 0x1f) + 1; }
+static uint32_t sparse_val_len(uint8_t b) { return (b & 0x03) + 1; }
+static uint8_t sparse_val(uint32_t val, uint32_t len) {
+    return (uint8_t)(0x80 | ((val - 1) << 2) | (len - 1));
+}
+
+// emit a run of zero registers, returns the number of bytes written
+static size_t sparse_put_zeroes(uint8_t *p, uint32_t len) {
+    if (len <= 64) {
+        p[0] = (uint8_t)(len - 1);
+        return 1;
+    }
+    p[0] = (uint8_t)(0x40 | ((len - 1) >> 8));
+    p[1] = (uint8_t)((len - 1) & 0xff);
+    return 2;
+}
+
+// MurmurHash2, 64-bit version
+static uint64_t murmur64(const uint8_t *data, size_t len, uint64_t seed) {
+    const uint64_t m = 0xc6a4a7935bd1e995ULL;
+    const int r = 47;
+    uint64_t h = seed ^ (len * m);
+    const uint8_t *end = data + (len - (len & 7));
+    while (data != end) {
+        uint64_t k = 0;
+        memcpy(&k, data, 8);    // assume little endian
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+        h ^= k;
+        h *= m;
+        data += 8;
+    }
+    switch (len & 7) {
+    case 7: h ^= (uint64_t)data[6] << 48; /* fall through */
+    case 6: h ^= (uint64_t)data[5] << 40; /* fall through */
+    case 5: h ^= (uint64_t)data[4] << 32; /* fall through */
+    case 4: h ^= (uint64_t)data[3] << 24; /* fall through */
+    case 3: h ^= (uint64_t)data[2] << 16; /* fall through */
+    case 2: h ^= (uint64_t)data[1] << 8;  /* fall through */
+    case 1: h ^= (uint64_t)data[0];
+            h *= m;
+    }
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+    return h;
+}
+
+// map an element to its register and the length of its run of zeroes + 1
+static uint32_t hll_pattern(const uint8_t *ele, size_t len, uint32_t *reg) {
+    uint64_t hash = murmur64(ele, len, 0xadc83b19ULL);
+    *reg = (uint32_t)(hash & (k_hll_registers - 1));
+    hash >>= k_hll_p;
+    hash |= (uint64_t)1 << k_hll_q;     // make sure the loop terminates
+    return (uint32_t)__builtin_ctzll(hash) + 1;
+}
+
+// header helpers
+static uint8_t *hll_regs(std::string &hll) {
+    return (uint8_t *)&hll[k_hll_hdr_size];
+}
+
+static const uint8_t *hll_regs(const std::string &hll) {
+    return (const uint8_t *)hll.data() + k_hll_hdr_size;
+}
+
+static uint8_t hll_encoding(const std::string &hll) {
+    return (uint8_t)hll[4];
+}
+
+static void hll_set_header(std::string &hll, uint8_t encoding) {
+    memcpy(&hll[0], "HYLL", 4);
+    hll[4] = (char)encoding;
+    memset(&hll[5], 0, 11);
+    hll[15] = (char)0x80;   // cache invalid
+}
+
+static void hll_invalidate_cache(std::string &hll) {
+    hll[15] |= (char)0x80;
+}
+
+/*
+Dense registers are packed LSB first, so register `i` starts at bit 6*i.
+A register never spans more than two bytes.
+*/
+static uint32_t dense_get(const uint8_t *p, uint32_t reg) {
+    size_t bit = (size_t)reg * k_hll_bits;
+    size_t byte = bit / 8;
+    uint32_t fb = bit & 7;
+    uint32_t v = p[byte] >> fb;
+    if (fb > 8 - k_hll_bits) {
+        v |= (uint32_t)p[byte + 1] << (8 - fb);
+    }
+    return v & k_hll_reg_max;
+}
+
+static void dense_set(uint8_t *p, uint32_t reg, uint32_t val) {
+    size_t bit = (size_t)reg * k_hll_bits;
+    size_t byte = bit / 8;
+    uint32_t fb = bit & 7;
+    p[byte] &= (uint8_t)~(k_hll_reg_max << fb);
+    p[byte] |= (uint8_t)(val << fb);
+    if (fb > 8 - k_hll_bits) {
+        p[byte + 1] &= (uint8_t)~(k_hll_reg_max >> (8 - fb));
+        p[byte + 1] |= (uint8_t)(val >> (8 - fb));
+    }
+}
+
+// 4 registers fit exactly in 3 bytes, used for the full scans
+static void dense_unpack(uint8_t *raw, const uint8_t *p) {
+    for (size_t i = 0; i < k_hll_registers; i += 4, p += 3) {
+        uint32_t w = (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16);
+        raw[i + 0] = (uint8_t)(w & 63);
+        raw[i + 1] = (uint8_t)((w >> 6) & 63);
+        raw[i + 2] = (uint8_t)((w >> 12) & 63);
+        raw[i + 3] = (uint8_t)((w >> 18) & 63);
+    }
+}
+
+static void dense_pack(uint8_t *p, const uint8_t *raw) {
+    for (size_t i = 0; i < k_hll_registers; i += 4, p += 3) {
+        uint32_t w = (uint32_t)(raw[i] & 63)
+            | ((uint32_t)(raw[i + 1] & 63) << 6)
+            | ((uint32_t)(raw[i + 2] & 63) << 12)
+            | ((uint32_t)(raw[i + 3] & 63) << 18);
+        p[0] = (uint8_t)w;
+        p[1] = (uint8_t)(w >> 8);
+        p[2] = (uint8_t)(w >> 16);
+    }
+}
+
+static void sparse_to_raw(uint8_t *raw, const std::string &hll) {
+    memset(raw, 0, k_hll_registers);
+    hll_merge_raw(raw, hll);
+}
+
+static void hll_promote(std::string &hll) {
+    assert(hll_encoding(hll) == HLL_SPARSE);
+    uint8_t raw[k_hll_registers];
+    sparse_to_raw(raw, hll);
+    hll_store_raw(hll, raw);
+}
+
+// merge adjacent VAL opcodes of the same value, keeps the sparse form compact
+static void sparse_compact(std::string &hll) {
+    uint8_t *p = hll_regs(hll);
+    uint8_t *end = (uint8_t *)&hll[0] + hll.size();
+    uint8_t *out = p;
+    bool prev_is_val = false;   // was the last opcode written a VAL
+    while (p < end) {
+        if (sparse_is_xzero(*p)) {
+            *out++ = *p++;
+            *out++ = *p++;
+            prev_is_val = false;
+            continue;
+        }
+        if (sparse_is_zero(*p)) {
+            *out++ = *p++;
+            prev_is_val = false;
+            continue;
+        }
+        uint8_t prev = prev_is_val ? out[-1] : 0;
+        if (prev_is_val && sparse_val_value(prev) == sparse_val_value(*p)
+            && sparse_val_len(prev) + sparse_val_len(*p) <= 4)
+        {
+            out[-1] = sparse_val(sparse_val_value(*p),
+                sparse_val_len(prev) + sparse_val_len(*p));
+            p++;
+            continue;
+        }
+        *out++ = *p++;
+        prev_is_val = true;
+    }
+    hll.resize((size_t)(out - (uint8_t *)&hll[0]));
+}
+
+/*
+Set register `reg` to `count` if it is larger than the current value.
+The opcode covering the register is split into at most 3 runs:
+    [first, reg-1] unchanged, [reg] = count, [reg+1, last] unchanged.
+Returns 1 if a register changed, 0 if not, and -1 on a corrupt value.
+*/
+static int sparse_set(std::string &hll, uint32_t reg, uint32_t count) {
+    if (count > k_hll_sparse_val_max) {
+        hll_promote(hll);
+        dense_set(hll_regs(hll), reg, count);
+        return 1;
+    }
+
+    uint8_t *start = hll_regs(hll);
+    uint8_t *end = (uint8_t *)&hll[0] + hll.size();
+    uint8_t *p = start;
+    uint32_t first = 0;
+    uint32_t span = 0;
+    size_t oplen = 1;
+    while (p < end) {
+        oplen = 1;
+        if (sparse_is_zero(*p)) {
+            span = sparse_zero_len(*p);
+        } else if (sparse_is_xzero(*p)) {
+            span = sparse_xzero_len(p);
+            oplen = 2;
+        } else {
+            span = sparse_val_len(*p);
+        }
+        if (reg <= first + span - 1) {
+            break;
+        }
+        p += oplen;
+        first += span;
+    }
+    if (p >= end) {
+        return -1;
+    }
+
+    bool is_val = !sparse_is_zero(*p) && !sparse_is_xzero(*p);
+    uint32_t curval = is_val ? sparse_val_value(*p) : 0;
+    if (curval >= count) {
+        return 0;
+    }
+
+    // build the replacement sequence, 5 bytes at most
+    uint8_t seq[5];
+    size_t seqlen = 0;
+    uint32_t last = first + span - 1;
+    if (is_val) {
+        if (reg != first) {
+            seq[seqlen++] = sparse_val(curval, reg - first);
+        }
+        seq[seqlen++] = sparse_val(count, 1);
+        if (reg != last) {
+            seq[seqlen++] = sparse_val(curval, last - reg);
+        }
+    } else {
+        if (reg != first) {
+            seqlen += sparse_put_zeroes(&seq[seqlen], reg - first);
+        }
+        seq[seqlen++] = sparse_val(count, 1);
+        if (reg != last) {
+            seqlen += sparse_put_zeroes(&seq[seqlen], last - reg);
+        }
+    }
+
+    size_t pos = (size_t)(p - (uint8_t *)&hll[0]);
+    hll.replace(pos, oplen, (const char *)seq, seqlen);
+    sparse_compact(hll);
+    if (hll.size() - k_hll_hdr_size > k_hll_sparse_max_bytes) {
+        hll_promote(hll);
+    }
+    return 1;
+}
+
+void hll_init(std::string &hll) {
+    hll.assign(k_hll_hdr_size, '\0');
+    hll_set_header(hll, HLL_SPARSE);
+    uint8_t op[2];
+    size_t n = sparse_put_zeroes(op, k_hll_registers);
+    hll.append((const char *)op, n);
+}
+
+bool hll_is_valid(const std::string &hll) {
+    if (hll.size() < k_hll_hdr_size || memcmp(hll.data(), "HYLL", 4) != 0) {
+        return false;
+    }
+    if (hll_encoding(hll) == HLL_DENSE) {
+        return hll.size() == k_hll_dense_size;
+    }
+    if (hll_encoding(hll) != HLL_SPARSE) {
+        return false;
+    }
+    // the runs must cover exactly all registers
+    const uint8_t *p = hll_regs(hll);
+    const uint8_t *end = (const uint8_t *)hll.data() + hll.size();
+    size_t total = 0;
+    while (p < end) {
+        if (sparse_is_zero(*p)) {
+            total += sparse_zero_len(*p);
+            p++;
+        } else if (sparse_is_xzero(*p)) {
+            if (p + 1 >= end) {
+                return false;
+            }
+            total += sparse_xzero_len(p);
+            p += 2;
+        } else {
+            total += sparse_val_len(*p);
+            p++;
+        }
+    }
+    return total == k_hll_registers;
+}
+
+bool hll_add(std::string &hll, const uint8_t *ele, size_t len) {
+    uint32_t reg = 0;
+    uint32_t count = hll_pattern(ele, len, &reg);
+    bool changed = false;
+    if (hll_encoding(hll) == HLL_DENSE) {
+        uint8_t *p = hll_regs(hll);
+        if (dense_get(p, reg) < count) {
+            dense_set(p, reg, count);
+            changed = true;
+        }
+    } else {
+        changed = sparse_set(hll, reg, count) == 1;
+    }
+    if (changed) {
+        hll_invalidate_cache(hll);
+    }
+    return changed;
+}
+
+// the improved estimator from Otmar Ertl, works on the register histogram
+static uint64_t hll_estimate(const uint32_t *reghisto) {
+    double m = (double)k_hll_registers;
+    auto sigma = [](double x) -> double {
+        if (x == 1.) {
+            return INFINITY;
+        }
+        double zp = 0;
+        double y = 1;
+        double z = x;
+        do {
+            x *= x;
+            zp = z;
+            z += x * y;
+            y += y;
+        } while (zp != z);
+        return z;
+    };
+    auto tau = [](double x) -> double {
+        if (x == 0. || x == 1.) {
+            return 0.;
+        }
+        double zp = 0;
+        double y = 1.0;
+        double z = 1 - x;
+        do {
+            x = sqrt(x);
+            zp = z;
+            y *= 0.5;
+            z -= pow(1 - x, 2) * y;
+        } while (zp != z);
+        return z / 3;
+    };
+
+    double z = m * tau((m - reghisto[k_hll_q + 1]) / m);
+    for (size_t j = k_hll_q; j >= 1; --j) {
+        z += reghisto[j];
+        z *= 0.5;
+    }
+    z += m * sigma(reghisto[0] / m);
+    return (uint64_t)llround(k_hll_alpha_inf * m * m / z);
+}
+
+uint64_t hll_count(std::string &hll) {
+    uint8_t *hdr = (uint8_t *)&hll[0];
+    uint64_t card = 0;
+    if (!(hdr[15] & 0x80)) {
+        memcpy(&card, &hdr[8], 8);  // assume little endian
+        return card;
+    }
+
+    uint32_t reghisto[64] = {};
+    const uint8_t *p = hll_regs(hll);
+    if (hll_encoding(hll) == HLL_DENSE) {
+        for (size_t i = 0; i < k_hll_registers; i += 4, p += 3) {
+            uint32_t w = (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16);
+            reghisto[w & 63]++;
+            reghisto[(w >> 6) & 63]++;
+            reghisto[(w >> 12) & 63]++;
+            reghisto[(w >> 18) & 63]++;
+        }
+    } else {
+        const uint8_t *end = (const uint8_t *)hll.data() + hll.size();
+        while (p < end) {
+            if (sparse_is_zero(*p)) {
+                reghisto[0] += sparse_zero_len(*p);
+                p++;
+            } else if (sparse_is_xzero(*p)) {
+                reghisto[0] += sparse_xzero_len(p);
+                p += 2;
+            } else {
+                reghisto[sparse_val_value(*p)] += sparse_val_len(*p);
+                p++;
+            }
+        }
+    }
+    card = hll_estimate(reghisto);
+
+    // the cardinality is cached until the next modification
+    memcpy(&hdr[8], &card, 8);
+    hdr[15] &= 0x7f;
+    return card;
+}
+
+void hll_merge_raw(uint8_t *max, const std::string &hll) {
+    const uint8_t *p = hll_regs(hll);
+    if (hll_encoding(hll) == HLL_DENSE) {
+        uint8_t raw[k_hll_registers];
+        dense_unpack(raw, p);
+        hll_max_kernel(max, raw, k_hll_registers);
+        return;
+    }
+
+    // sparse: only the VAL runs can raise a register
+    const uint8_t *end = (const uint8_t *)hll.data() + hll.size();
+    size_t i = 0;
+    while (p < end && i < k_hll_registers) {
+        if (sparse_is_zero(*p)) {
+            i += sparse_zero_len(*p);
+            p++;
+        } else if (sparse_is_xzero(*p)) {
+            i += sparse_xzero_len(p);
+            p += 2;
+        } else {
+            uint8_t val = (uint8_t)sparse_val_value(*p);
+            for (uint32_t n = sparse_val_len(*p); n > 0 && i < k_hll_registers; --n, ++i) {
+                if (max[i] < val) {
+                    max[i] = val;
+                }
+            }
+            p++;
+        }
+    }
+}
+
+uint64_t hll_count_raw(const uint8_t *max) {
+    uint32_t reghisto[64] = {};
+    for (size_t i = 0; i < k_hll_registers; ++i) {
+        reghisto[max[i] & 63]++;
+    }
+    return hll_estimate(reghisto);
+}
+
+void hll_store_raw(std::string &hll, const uint8_t *max) {
+    hll.assign(k_hll_dense_size, '\0');
+    hll_set_header(hll, HLL_DENSE);
+    dense_pack(hll_regs(hll), max);
+}
+
+void hll_max_kernel(uint8_t *dst, const uint8_t *src, size_t n) {
+    size_t i = 0;
+#if defined(__AVX2__)
+    for (; i + 32 <= n; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)&dst[i]);
+        __m256i b = _mm256_loadu_si256((const __m256i *)&src[i]);
+        _mm256_storeu_si256((__m256i *)&dst[i], _mm256_max_epu8(a, b));
+    }
+#endif
+#if defined(__SSE2__)
+    for (; i + 16 <= n; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)&dst[i]);
+        __m128i b = _mm_loadu_si128((const __m128i *)&src[i]);
+        _mm_storeu_si128((__m128i *)&dst[i], _mm_max_epu8(a, b));
+    }
+#endif
+    for (; i < n; ++i) {
+        if (dst[i] < src[i]) {
+            dst[i] = src[i];
+        }
+    }
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+/*
+HyperLogLog with 16384 (2^14) registers of 6 bits each.
+
+A HLL value is a plain byte string so it can live in the keyspace like any
+other value:
+
+    [ "HYLL" | encoding(1) | unused(3) | cardinality cache(8) | registers ]
+
+Two encodings are used for the registers:
+- HLL_SPARSE: run-length opcodes, used while most registers are still 0.
+  Small sets cost a few dozen bytes instead of 12 KB.
+- HLL_DENSE: 16384 packed 6-bit registers, exactly 12288 bytes.
+
+A sparse value is promoted to dense once it grows past k_hll_sparse_max_bytes
+or a register needs a value the sparse opcodes cannot hold.
+*/
+
+const size_t k_hll_p = 14;
+const size_t k_hll_registers = (size_t)1 << k_hll_p;
+const size_t k_hll_bits = 6;
+const size_t k_hll_hdr_size = 16;
+const size_t k_hll_dense_size = k_hll_hdr_size + (k_hll_registers * k_hll_bits + 7) / 8;
+const size_t k_hll_sparse_max_bytes = 3000;
+
+enum {
+    HLL_DENSE = 0,
+    HLL_SPARSE = 1,
+};
+
+// create an empty (sparse) HLL
+void hll_init(std::string &hll);
+// check the header and the encoded length of a value claiming to be a HLL
+bool hll_is_valid(const std::string &hll);
+// add an element, returns true if any register was changed
+bool hll_add(std::string &hll, const uint8_t *ele, size_t len);
+// cardinality estimation, served from the cache until the next change
+uint64_t hll_count(std::string &hll);
+
+// Raw registers: one uint8_t per register, used for unions (PFMERGE and
+// multi-key PFCOUNT). Each source is folded in with a single pass.
+void hll_merge_raw(uint8_t *max, const std::string &hll);
+uint64_t hll_count_raw(const uint8_t *max);
+// overwrite `hll` with the dense encoding of raw registers
+void hll_store_raw(std::string &hll, const uint8_t *max);
+
+// dst[i] = max(dst[i], src[i]), vectorized when the target allows it
+void hll_max_kernel(uint8_t *dst, const uint8_t *src, size_t n);
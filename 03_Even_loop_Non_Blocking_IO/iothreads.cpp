@@ -0,0 +1,85 @@
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include "iothreads.h"
+
+static struct {
+    size_t nthreads = 1;
+    std::mutex mu;
+    std::condition_variable start;
+    std::condition_variable done;
+    // the running batch, written under `mu` before `gen` moves
+    uint64_t gen = 0;
+    void (*fn)(void *, size_t) = NULL;
+    void *arg = NULL;
+    size_t n = 0;
+    std::atomic<size_t> next{0};
+    size_t busy = 0;        // threads still in the batch
+    uint64_t batches = 0;
+} g_io;
+
+static void iothreads_claim() {
+    while (true) {
+        size_t i = g_io.next.fetch_add(1, std::memory_order_relaxed);
+        if (i >= g_io.n) {
+            return;
+        }
+        g_io.fn(g_io.arg, i);
+    }
+}
+
+static void iothreads_worker() {
+    uint64_t seen = 0;
+    std::unique_lock<std::mutex> lock(g_io.mu);
+    while (true) {
+        g_io.start.wait(lock, [&] { return g_io.gen != seen; });
+        seen = g_io.gen;
+        lock.unlock();
+        iothreads_claim();
+        lock.lock();
+        // the mutex also publishes what the items wrote to the loop
+        if (--g_io.busy == 0) {
+            g_io.done.notify_one();
+        }
+    }
+}
+
+void iothreads_init(size_t n) {
+    n = n < 1 ? 1 : n > k_iothreads_max ? k_iothreads_max : n;
+    g_io.nthreads = n;
+    for (size_t i = 1; i < n; ++i) {
+        std::thread(iothreads_worker).detach();
+    }
+}
+
+size_t iothreads_count() {
+    return g_io.nthreads;
+}
+
+void iothreads_run(void (*fn)(void *arg, size_t i), void *arg, size_t n) {
+    if (g_io.nthreads == 1 || n < k_iothreads_min_batch) {
+        for (size_t i = 0; i < n; ++i) {
+            fn(arg, i);
+        }
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(g_io.mu);
+        g_io.fn = fn;
+        g_io.arg = arg;
+        g_io.n = n;
+        g_io.next.store(0, std::memory_order_relaxed);
+        g_io.busy = g_io.nthreads - 1;
+        g_io.gen++;
+        g_io.batches++;
+    }
+    g_io.start.notify_all();
+    iothreads_claim();
+    std::unique_lock<std::mutex> lock(g_io.mu);
+    g_io.done.wait(lock, [] { return g_io.busy == 0; });
+}
+
+uint64_t iothreads_batches() {
+    return g_io.batches;
+}
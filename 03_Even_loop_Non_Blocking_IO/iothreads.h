@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+I/O threads: a pool that runs the read() and write() calls of the ready
+connections in parallel, while parsing and the commands stay on the event
+loop thread.
+
+The loop hands over a batch (a function and `n` items) and works on it too.
+The items are claimed one at a time with a fetch-and-add on a shared index,
+so one slow socket doesn't hold up a fixed share of the others. The loop
+returns only when every item is done, a batch never overlaps the loop's own
+use of the connections, so nothing else needs a lock. Between batches the
+threads sleep on a condition variable; a batch smaller than
+k_iothreads_min_batch is cheaper to run inline than to wake them.
+*/
+
+const size_t k_iothreads_max = 64;
+const size_t k_iothreads_min_batch = 2;
+
+// `n` threads with the caller, 1 to run everything inline
+void iothreads_init(size_t n);
+size_t iothreads_count();
+// call fn(arg, i) for every i in [0, n), returns once they have all returned
+void iothreads_run(void (*fn)(void *arg, size_t i), void *arg, size_t n);
+// batches that went to the threads
+uint64_t iothreads_batches();
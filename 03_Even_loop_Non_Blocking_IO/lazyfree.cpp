@@ -0,0 +1,71 @@
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include <thread>
+#include "lazyfree.h"
+
+struct LazyJob {
+    LazyJob *next;
+    void (*fn)(void *);
+    void *arg;
+    size_t bytes;
+};
+
+static struct {
+    std::atomic<LazyJob *> head{NULL};
+    sem_t sem;
+    std::atomic<size_t> pending_objects{0};
+    std::atomic<size_t> pending_bytes{0};
+    std::atomic<uint64_t> freed_objects{0};
+} g_lazy;
+
+static void lazyfree_worker() {
+    while (true) {
+        sem_wait(&g_lazy.sem);
+        // take everything at once, the order of frees doesn't matter
+        LazyJob *job = g_lazy.head.exchange(NULL, std::memory_order_acquire);
+        while (job) {
+            LazyJob *next = job->next;
+            job->fn(job->arg);
+            g_lazy.pending_bytes.fetch_sub(job->bytes, std::memory_order_relaxed);
+            g_lazy.pending_objects.fetch_sub(1, std::memory_order_relaxed);
+            g_lazy.freed_objects.fetch_add(1, std::memory_order_relaxed);
+            delete job;
+            job = next;
+        }
+    }
+}
+
+void lazyfree_init() {
+    if (sem_init(&g_lazy.sem, 0, 0) != 0) {
+        perror("sem_init");
+        abort();
+    }
+    std::thread(lazyfree_worker).detach();
+}
+
+void lazyfree_submit(void (*fn)(void *), void *arg, size_t bytes) {
+    LazyJob *job = new LazyJob{NULL, fn, arg, bytes};
+    g_lazy.pending_objects.fetch_add(1, std::memory_order_relaxed);
+    g_lazy.pending_bytes.fetch_add(bytes, std::memory_order_relaxed);
+
+    LazyJob *head = g_lazy.head.load(std::memory_order_relaxed);
+    do {
+        job->next = head;
+    } while (!g_lazy.head.compare_exchange_weak(head, job,
+        std::memory_order_release, std::memory_order_relaxed));
+    sem_post(&g_lazy.sem);
+}
+
+size_t lazyfree_pending_objects() {
+    return g_lazy.pending_objects.load(std::memory_order_relaxed);
+}
+
+size_t lazyfree_pending_bytes() {
+    return g_lazy.pending_bytes.load(std::memory_order_relaxed);
+}
+
+uint64_t lazyfree_freed_objects() {
+    return g_lazy.freed_objects.load(std::memory_order_relaxed);
+}
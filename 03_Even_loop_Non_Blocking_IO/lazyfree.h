@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+Lazy free: values that are expensive to destroy are handed to a background
+thread instead of being freed inside the event loop.
+
+The queue is a lock-free stack: the event loop pushes with a single
+compare-and-swap and the reclaim thread takes the whole list at once with
+an exchange, so neither side ever waits for the other. The reclaim thread
+sleeps on a semaphore while there is nothing to free.
+*/
+
+// values smaller than this are cheaper to free inline than to hand over
+const size_t k_lazyfree_threshold = 64 << 10;
+
+void lazyfree_init();
+// run `fn(arg)` on the reclaim thread, `bytes` is the estimated size of the
+// value, it is reported as pending until the value is freed
+void lazyfree_submit(void (*fn)(void *), void *arg, size_t bytes);
+
+size_t lazyfree_pending_objects();
+size_t lazyfree_pending_bytes();
+uint64_t lazyfree_freed_objects();
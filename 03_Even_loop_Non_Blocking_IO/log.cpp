@@ -0,0 +1,219 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "log.h"
+
+// a message is cut to fit a slot
+const size_t k_log_text = 240;
+const size_t k_log_ring_slots = 1024;
+const uint32_t k_log_flush_ms = 10;
+
+struct LogRecord {
+    uint64_t ms;        // wall clock
+    int32_t level;
+    uint32_t len;
+    char text[k_log_text];
+};
+
+struct LogRing {
+    std::atomic<uint64_t> head{0};      // next slot to fill, by the owner thread
+    std::atomic<uint64_t> tail{0};      // next slot to write out, by the writer
+    std::atomic<uint64_t> dropped{0};
+    LogRecord slots[k_log_ring_slots];
+};
+
+int g_log_level = LOG_INFO;
+
+static struct {
+    int fd = 2;
+    std::atomic<bool> async{false};
+    // the rings of every thread that logged, only locked to add one
+    std::mutex rings_mu;
+    std::vector<LogRing *> rings;
+    // one drain at a time: the writer thread or log_flush()
+    std::mutex drain_mu;
+    std::string out;
+} g_log;
+
+static thread_local LogRing *t_ring = NULL;
+
+static uint64_t wall_msec() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_REALTIME_COARSE, &tv);
+    return (uint64_t)tv.tv_sec * 1000 + (uint64_t)tv.tv_nsec / 1000 / 1000;
+}
+
+static LogRing *ring_get() {
+    if (!t_ring) {
+        t_ring = new LogRing();
+        std::lock_guard<std::mutex> lock(g_log.rings_mu);
+        g_log.rings.push_back(t_ring);
+    }
+    return t_ring;
+}
+
+static void write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t rv = write(fd, data, len);
+        if (rv <= 0) {
+            return;     // nowhere else to report it
+        }
+        data += rv;
+        len -= (size_t)rv;
+    }
+}
+
+static void format_line(std::string &out, uint64_t ms, int level, const char *text, size_t len) {
+    static const char k_marks[] = "DIWE";
+    time_t sec = (time_t)(ms / 1000);
+    struct tm tm;
+    localtime_r(&sec, &tm);
+    char buf[64];
+    size_t n = strftime(buf, sizeof(buf), "%d %b %H:%M:%S", &tm);
+    n += (size_t)snprintf(&buf[n], sizeof(buf) - n, ".%03u %c ", (unsigned)(ms % 1000), k_marks[level & 3]);
+    char pid[16];
+    int pn = snprintf(pid, sizeof(pid), "%d ", (int)getpid());
+    out.append(pid, (size_t)pn);
+    out.append(buf, n);
+    out.append(text, len);
+    out.push_back('\n');
+}
+
+static void drain() {
+    std::lock_guard<std::mutex> lock(g_log.drain_mu);
+    std::vector<LogRing *> rings;
+    {
+        std::lock_guard<std::mutex> rlock(g_log.rings_mu);
+        rings = g_log.rings;
+    }
+    std::string &out = g_log.out;
+    out.clear();
+    for (LogRing *r : rings) {
+        uint64_t tail = r->tail.load(std::memory_order_relaxed);
+        uint64_t head = r->head.load(std::memory_order_acquire);
+        for (; tail != head; ++tail) {
+            const LogRecord &rec = r->slots[tail % k_log_ring_slots];
+            format_line(out, rec.ms, rec.level, rec.text, rec.len);
+        }
+        r->tail.store(tail, std::memory_order_release);
+        if (uint64_t n = r->dropped.exchange(0, std::memory_order_relaxed)) {
+            char buf[64];
+            int len = snprintf(buf, sizeof(buf), "log: %llu messages dropped, ring full", (unsigned long long)n);
+            format_line(out, wall_msec(), LOG_WARN, buf, (size_t)len);
+        }
+    }
+    if (!out.empty()) {
+        write_all(g_log.fd, out.data(), out.size());
+    }
+}
+
+static void log_writer() {
+    while (true) {
+        usleep(k_log_flush_ms * 1000);
+        drain();
+    }
+}
+
+// the writer thread doesn't exist in a forked child
+static void log_atfork_child() {
+    g_log.async.store(false, std::memory_order_relaxed);
+}
+
+bool log_init(const char *path, int level) {
+    g_log_level = level;
+    if (path) {
+        int fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            return false;
+        }
+        g_log.fd = fd;
+    }
+    pthread_atfork(NULL, NULL, &log_atfork_child);
+    g_log.async.store(true, std::memory_order_release);
+    std::thread(log_writer).detach();
+    return true;
+}
+
+int log_parse_level(const char *name) {
+    static const char *k_names[] = {"debug", "info", "warn", "error"};
+    for (int i = 0; i < 4; ++i) {
+        if (strcmp(name, k_names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void log_flush() {
+    if (g_log.async.load(std::memory_order_acquire)) {
+        drain();
+    }
+}
+
+// false if the site is over its rate, `*suppressed` is what it skipped since
+// its last message
+static bool site_admit(LogSite *site, uint64_t sec, uint32_t *suppressed) {
+    if (site->sec.load(std::memory_order_relaxed) != sec) {
+        site->sec.store(sec, std::memory_order_relaxed);
+        site->count.store(0, std::memory_order_relaxed);
+    }
+    if (site->count.fetch_add(1, std::memory_order_relaxed) >= k_log_burst) {
+        site->suppressed.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    *suppressed = site->suppressed.exchange(0, std::memory_order_relaxed);
+    return true;
+}
+
+void log_write(LogSite *site, int level, const char *fmt, ...) {
+    uint64_t ms = wall_msec();
+    uint32_t suppressed = 0;
+    if (!site_admit(site, ms / 1000, &suppressed)) {
+        return;
+    }
+
+    LogRecord tmp;
+    LogRecord *rec = &tmp;
+    bool async = g_log.async.load(std::memory_order_acquire);
+    LogRing *r = NULL;
+    uint64_t head = 0;
+    if (async) {
+        r = ring_get();
+        head = r->head.load(std::memory_order_relaxed);
+        if (head - r->tail.load(std::memory_order_acquire) >= k_log_ring_slots) {
+            r->dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        rec = &r->slots[head % k_log_ring_slots];
+    }
+
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(rec->text, k_log_text, fmt, ap);
+    va_end(ap);
+    size_t len = n < 0 ? 0 : (size_t)n < k_log_text ? (size_t)n : k_log_text - 1;
+    if (suppressed && len < k_log_text - 1) {
+        n = snprintf(&rec->text[len], k_log_text - len, " (%u similar messages suppressed)", suppressed);
+        len = n < 0 ? len : std::min(len + (size_t)n, k_log_text - 1);
+    }
+    rec->ms = ms;
+    rec->level = level;
+    rec->len = (uint32_t)len;
+
+    if (async) {
+        r->head.store(head + 1, std::memory_order_release);
+    } else {
+        std::string line;
+        format_line(line, rec->ms, rec->level, rec->text, rec->len);
+        write_all(g_log.fd, line.data(), line.size());
+    }
+}
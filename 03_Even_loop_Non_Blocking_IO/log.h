@@ -0,0 +1,66 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+
+/*
+Asynchronous logging: the calling thread formats the message into a slot
+of its own ring buffer and returns, a background thread writes the rings
+out every few milliseconds. So the event loop never waits for a terminal,
+a pipe or a disk.
+
+- Each thread has a single-producer single-consumer ring, the producer
+  only advances `head` and the writer only `tail`, no lock on either side.
+  A full ring drops the message and counts it, the writer reports the
+  count.
+- Levels below LOG_MIN_LEVEL compile to nothing, e.g. -DLOG_MIN_LEVEL=1
+  removes the debug messages; the others are checked against the runtime
+  level (--loglevel) before anything is formatted.
+- Rate limiting: a call site logs at most k_log_burst messages per second,
+  the next one that gets through says how many were suppressed.
+- Before log_init(), and in a forked child where the writer thread doesn't
+  exist, messages are written directly to stderr.
+*/
+
+#define LOG_DEBUG 0
+#define LOG_INFO 1
+#define LOG_WARN 2
+#define LOG_ERROR 3
+
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_DEBUG
+#endif
+
+const uint32_t k_log_burst = 10;
+
+// the rate limit of a call site, one static instance per log_* call
+struct LogSite {
+    std::atomic<uint64_t> sec{0};
+    std::atomic<uint32_t> count{0};
+    std::atomic<uint32_t> suppressed{0};
+};
+
+extern int g_log_level;
+
+// `path` NULL for stderr, returns false if the file can't be opened
+bool log_init(const char *path, int level);
+// level names: debug, info, warn, error; -1 if unknown
+int log_parse_level(const char *name);
+// write out everything logged so far, from any thread (e.g. before abort())
+void log_flush();
+
+void log_write(LogSite *site, int level, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+#define LOG_AT(level, ...) do { \
+    if ((level) >= LOG_MIN_LEVEL && (level) >= g_log_level) { \
+        static LogSite log_site_; \
+        log_write(&log_site_, (level), __VA_ARGS__); \
+    } \
+} while (0)
+
+#define log_debug(...) LOG_AT(LOG_DEBUG, __VA_ARGS__)
+#define log_info(...) LOG_AT(LOG_INFO, __VA_ARGS__)
+#define log_warn(...) LOG_AT(LOG_WARN, __VA_ARGS__)
+#define log_error(...) LOG_AT(LOG_ERROR, __VA_ARGS__)
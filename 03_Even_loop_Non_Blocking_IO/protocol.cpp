@@ -0,0 +1,171 @@
+#include <errno.h>
+#include <netdb.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "protocol.h"
+
+int32_t parse_req(const uint8_t *data, size_t len, std::vector<std::string> &out) {
+    if (len < 4) {
+        return -1;
+    }
+    uint32_t n = 0;
+    memcpy(&n, &data[0], 4);
+    if (n > k_max_args) {
+        return -1;
+    }
+
+    out.resize(n);
+    size_t pos = 4;
+    for (uint32_t i = 0; i < n; ++i) {
+        if (pos + 4 > len) {
+            return -1;
+        }
+        uint32_t sz = 0;
+        memcpy(&sz, &data[pos], 4);
+        if (pos + 4 + sz > len) {
+            return -1;
+        }
+        out[i].assign((char *)&data[pos + 4], sz);
+        pos += 4 + sz;
+    }
+
+    if (pos != len) {
+        return -1;  // trailing garbage
+    }
+    return 0;
+}
+
+void put_req(std::string &out, const std::vector<std::string> &cmd) {
+    uint32_t len = 4;
+    for (const std::string &s : cmd) {
+        len += 4 + (uint32_t)s.size();
+    }
+    uint32_t n = (uint32_t)cmd.size();
+    out.append((const char *)&len, 4);
+    out.append((const char *)&n, 4);
+    for (const std::string &s : cmd) {
+        uint32_t sz = (uint32_t)s.size();
+        out.append((const char *)&sz, 4);
+        out.append(s);
+    }
+}
+
+static const KeySpec k_key_specs[] = {
+    {"get",     1, 1,  false},
+    {"set",     1, 1,  false},
+    {"append",  1, 1,  false},
+    {"del",     1, -1, false},
+    {"unlink",  1, -1, false},
+    {"pfadd",   1, 1,  false},
+    {"pfcount", 1, -1, false},
+    {"pfmerge", 1, -1, false},
+    {"dump",    1, 1,  false},
+    {"restore", 1, 1,  false},
+    {"xadd",    1, 1,  false},
+    {"xlen",    1, 1,  false},
+    {"xrange",  1, 1,  false},
+    {"xread",   0, 0,  true},
+    {"xtrim",   1, 1,  false},
+};
+
+const KeySpec *key_spec_lookup(const char *name) {
+    for (const KeySpec &ks : k_key_specs) {
+        if (strcasecmp(ks.name, name) == 0) {
+            return &ks;
+        }
+    }
+    return NULL;
+}
+
+void key_spec_positions(const KeySpec *ks, const std::vector<std::string> &cmd,
+    std::vector<size_t> &keys)
+{
+    keys.clear();
+    if (ks->after_streams) {
+        size_t i = 1;
+        while (i < cmd.size() && strcasecmp(cmd[i].c_str(), "streams") != 0) {
+            i++;
+        }
+        size_t nkeys = i < cmd.size() ? (cmd.size() - i - 1) / 2 : 0;
+        for (size_t k = 0; k < nkeys; ++k) {
+            keys.push_back(i + 1 + k);
+        }
+        return;
+    }
+    size_t last = ks->last < 0 ? cmd.size() - 1 : (size_t)ks->last;
+    for (size_t i = (size_t)ks->first; i <= last && i < cmd.size(); ++i) {
+        keys.push_back(i);
+    }
+}
+
+bool parse_addr(const std::string &s, std::string &host, uint16_t &port) {
+    size_t colon = s.rfind(':');
+    if (colon == std::string::npos || colon == 0 || colon + 1 == s.size()) {
+        return false;
+    }
+    char *end = NULL;
+    unsigned long v = strtoul(s.c_str() + colon + 1, &end, 10);
+    if (*end != '\0' || v == 0 || v > 65535) {
+        return false;
+    }
+    host.assign(s, 0, colon);
+    port = (uint16_t)v;
+    return true;
+}
+
+int tcp_connect_nb(const std::string &host, uint16_t port) {
+    struct addrinfo hints = {};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *res = NULL;
+    std::string service = std::to_string(port);
+    if (getaddrinfo(host.c_str(), service.c_str(), &hints, &res) != 0 || !res) {
+        return -1;
+    }
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        freeaddrinfo(res);
+        return -1;
+    }
+    int rv = connect(fd, res->ai_addr, res->ai_addrlen);
+    freeaddrinfo(res);
+    if (rv != 0 && errno != EINPROGRESS) {
+        close(fd);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+bool tcp_connect_ok(int fd) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    return getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err == 0;
+}
+
+int unix_connect_nb(const std::string &path) {
+    struct sockaddr_un addr = {};
+    if (path.size() >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path.c_str(), path.size());
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, (const struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
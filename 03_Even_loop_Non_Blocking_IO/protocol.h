@@ -0,0 +1,132 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+/*
+Request format, inside the 4 bytes length header:
+    +------+-----+------+-----+------+-----+-----+------+
+    | nstr | len | str1 | len | str2 | ... | len | strn |
+    +------+-----+------+-----+------+-----+-----+------+
+`nstr` is the number of strings and `len` is the length of the following string,
+both are 32 bits little endian integers.
+
+The same frames are used by the append-only log and the replication stream.
+*/
+
+const size_t k_max_args = 1024;
+
+// parse the payload of a frame, the part after the length.
+// The strings of `out` are overwritten in place, so once a connection has
+// seen a few requests their buffers are big enough and parsing doesn't allocate.
+int32_t parse_req(const uint8_t *data, size_t len, std::vector<std::string> &out);
+// append a whole frame, length included
+void put_req(std::string &out, const std::vector<std::string> &cmd);
+
+/*
+Responses are serialized as tagged values so the client knows how to decode them:
+    SER_NIL:  tag
+    SER_ERR:  tag | code(4) | len(4) | msg
+    SER_STR:  tag | len(4) | bytes
+    SER_INT:  tag | int64(8)
+    SER_ARR:  tag | n(4) | n values
+*/
+enum {
+    SER_NIL = 0,
+    SER_ERR = 1,
+    SER_STR = 2,
+    SER_INT = 3,
+    SER_ARR = 4,
+};
+
+// the codes of the SER_ERR replies
+enum {
+    ERR_UNKNOWN = 1,
+    ERR_2BIG = 2,
+    ERR_TYPE = 3,
+    ERR_ARG = 4,
+    ERR_READONLY = 5,
+    // cluster redirects, the message says where to go
+    ERR_MOVED = 6,          // "MOVED <slot> <host:port>", the slot has another owner
+    ERR_ASK = 7,            // "ASK <slot> <host:port>", this one request only
+    ERR_TRYAGAIN = 8,       // some keys are being migrated
+    ERR_CROSSSLOT = 9,
+    ERR_CLUSTERDOWN = 10,   // nobody serves the slot
+    ERR_SYSTEM = 11,        // a system call failed
+};
+
+inline void out_nil(std::string &out) {
+    out.push_back(SER_NIL);
+}
+
+inline void out_str(std::string &out, const char *s, size_t size) {
+    out.push_back(SER_STR);
+    uint32_t len = (uint32_t)size;
+    out.append((char *)&len, 4);
+    out.append(s, len);
+}
+
+inline void out_str(std::string &out, const std::string &val) {
+    out_str(out, val.data(), val.size());
+}
+
+inline void out_int(std::string &out, int64_t val) {
+    out.push_back(SER_INT);
+    out.append((char *)&val, 8);
+}
+
+inline void out_arr(std::string &out, uint32_t n) {
+    out.push_back(SER_ARR);
+    out.append((char *)&n, 4);
+}
+
+inline size_t out_begin_arr(std::string &out) {
+    out.push_back(SER_ARR);
+    out.append("\0\0\0\0", 4);   // filled by out_end_arr()
+    return out.size() - 4;
+}
+
+inline void out_end_arr(std::string &out, size_t ctx, uint32_t n) {
+    memcpy(&out[ctx], &n, 4);
+}
+
+inline void out_err(std::string &out, int32_t code, const std::string &msg) {
+    out.push_back(SER_ERR);
+    out.append((char *)&code, 4);
+    uint32_t len = (uint32_t)msg.size();
+    out.append((char *)&len, 4);
+    out.append(msg);
+}
+
+/*
+Which arguments of a command are keys, one table for the server (cluster
+routing, hot keys, blocking, sliced commands) and the cluster client.
+Keys are cmd[first..last], `last` -1 for the last argument; with
+`after_streams` (XREAD) they follow STREAMS, one per ID.
+*/
+struct KeySpec {
+    const char *name;
+    int32_t first;
+    int32_t last;
+    bool after_streams;
+};
+// NULL for a command without keys
+const KeySpec *key_spec_lookup(const char *name);
+// the positions of the keys in `cmd`
+void key_spec_positions(const KeySpec *ks, const std::vector<std::string> &cmd,
+    std::vector<size_t> &keys);
+
+// connections between servers (replication, slot migration)
+// host:port
+bool parse_addr(const std::string &s, std::string &host, uint16_t &port);
+// start a non-blocking connect(), the fd becomes writable once it is done.
+// -1 on error.
+int tcp_connect_nb(const std::string &host, uint16_t port);
+// after the fd became writable, false if the connection failed
+bool tcp_connect_ok(int fd);
+// a non-blocking connect() to a Unix socket, done when it returns. -1 on
+// error, errno EAGAIN if the server's backlog is full.
+int unix_connect_nb(const std::string &path);
@@ -0,0 +1,337 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "rax.h"
+
+static uint8_t *node_seg(RaxNode *node) {
+    return (uint8_t *)(node + 1);
+}
+
+static size_t node_children_offset(size_t seglen) {
+    return (sizeof(RaxNode) + seglen + 7) & ~(size_t)7;
+}
+
+static RaxNode **node_children(RaxNode *node) {
+    return (RaxNode **)((uint8_t *)node + node_children_offset(node->seglen));
+}
+
+static size_t node_size(size_t seglen, size_t nchild) {
+    return node_children_offset(seglen) + nchild * sizeof(RaxNode *);
+}
+
+static RaxNode *node_new(Rax *rax, const uint8_t *seg, size_t seglen, size_t nchild) {
+    size_t size = node_size(seglen, nchild);
+    RaxNode *node = (RaxNode *)malloc(size);
+    if (!node) {
+        abort();
+    }
+    node->is_key = 0;
+    node->seglen = (uint32_t)seglen;
+    node->nchild = (uint32_t)nchild;
+    node->data = NULL;
+    if (seglen) {
+        memcpy(node_seg(node), seg, seglen);
+    }
+    memset(node_children(node), 0, nchild * sizeof(RaxNode *));
+    rax->numnodes++;
+    rax->bytes += size;
+    return node;
+}
+
+static void node_free(Rax *rax, RaxNode *node) {
+    rax->numnodes--;
+    rax->bytes -= node_size(node->seglen, node->nchild);
+    free(node);
+}
+
+// index of the first child whose edge starts with a byte >= `c`
+static uint32_t node_lower_bound(RaxNode *node, uint8_t c) {
+    RaxNode **children = node_children(node);
+    uint32_t lo = 0;
+    uint32_t hi = node->nchild;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (node_seg(children[mid])[0] < c) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static bool node_find_child(RaxNode *node, uint8_t c, uint32_t *idx) {
+    uint32_t i = node_lower_bound(node, c);
+    if (i < node->nchild && node_seg(node_children(node)[i])[0] == c) {
+        *idx = i;
+        return true;
+    }
+    return false;
+}
+
+// the node is reallocated, the caller must update the pointer to it
+static RaxNode *node_add_child(Rax *rax, RaxNode *node, RaxNode *child) {
+    size_t old_size = node_size(node->seglen, node->nchild);
+    uint32_t i = node_lower_bound(node, node_seg(child)[0]);
+    node = (RaxNode *)realloc(node, old_size + sizeof(RaxNode *));
+    if (!node) {
+        abort();
+    }
+    rax->bytes += sizeof(RaxNode *);
+    RaxNode **children = node_children(node);
+    memmove(&children[i + 1], &children[i], (node->nchild - i) * sizeof(RaxNode *));
+    children[i] = child;
+    node->nchild++;
+    return node;
+}
+
+static RaxNode *node_remove_child(Rax *rax, RaxNode *node, uint32_t i) {
+    RaxNode **children = node_children(node);
+    memmove(&children[i], &children[i + 1], (node->nchild - i - 1) * sizeof(RaxNode *));
+    node->nchild--;
+    rax->bytes -= sizeof(RaxNode *);
+    RaxNode *shrunk = (RaxNode *)realloc(node, node_size(node->seglen, node->nchild));
+    return shrunk ? shrunk : node;
+}
+
+static size_t common_prefix(const uint8_t *a, size_t alen, const uint8_t *b, size_t blen) {
+    size_t n = alen < blen ? alen : blen;
+    size_t i = 0;
+    while (i < n && a[i] == b[i]) {
+        i++;
+    }
+    return i;
+}
+
+void rax_init(Rax *rax) {
+    rax->numele = 0;
+    rax->numnodes = 0;
+    rax->bytes = 0;
+    rax->root = node_new(rax, NULL, 0, 0);
+}
+
+static void node_free_all(Rax *rax, RaxNode *node, void (*free_data)(void *)) {
+    RaxNode **children = node_children(node);
+    for (uint32_t i = 0; i < node->nchild; ++i) {
+        node_free_all(rax, children[i], free_data);
+    }
+    if (node->is_key && free_data) {
+        free_data(node->data);
+    }
+    node_free(rax, node);
+}
+
+void rax_clear(Rax *rax, void (*free_data)(void *)) {
+    if (rax->root) {
+        node_free_all(rax, rax->root, free_data);
+    }
+    rax->root = NULL;
+    rax->numele = 0;
+}
+
+bool rax_insert(Rax *rax, const uint8_t *key, size_t len, void *data, void **old) {
+    RaxNode **slot = &rax->root;
+    RaxNode *node = rax->root;
+    size_t pos = 0;
+    while (true) {
+        if (pos == len) {
+            if (node->is_key) {
+                if (old) {
+                    *old = node->data;
+                }
+                node->data = data;
+                return false;
+            }
+            node->is_key = 1;
+            node->data = data;
+            rax->numele++;
+            return true;
+        }
+
+        uint32_t idx = 0;
+        if (!node_find_child(node, key[pos], &idx)) {
+            RaxNode *leaf = node_new(rax, &key[pos], len - pos, 0);
+            leaf->is_key = 1;
+            leaf->data = data;
+            *slot = node_add_child(rax, node, leaf);
+            rax->numele++;
+            return true;
+        }
+
+        RaxNode *child = node_children(node)[idx];
+        size_t m = common_prefix(node_seg(child), child->seglen, &key[pos], len - pos);
+        if (m == child->seglen) {
+            slot = &node_children(node)[idx];
+            node = child;
+            pos += m;
+            continue;
+        }
+
+        // split the edge: child -> mid (first m bytes) -> tail (the rest)
+        RaxNode *mid = node_new(rax, node_seg(child), m, 0);
+        RaxNode *tail = node_new(rax, node_seg(child) + m, child->seglen - m, child->nchild);
+        tail->is_key = child->is_key;
+        tail->data = child->data;
+        memcpy(node_children(tail), node_children(child), child->nchild * sizeof(RaxNode *));
+        node_free(rax, child);
+        mid = node_add_child(rax, mid, tail);
+        if (pos + m == len) {
+            mid->is_key = 1;
+            mid->data = data;
+        } else {
+            RaxNode *leaf = node_new(rax, &key[pos + m], len - pos - m, 0);
+            leaf->is_key = 1;
+            leaf->data = data;
+            mid = node_add_child(rax, mid, leaf);
+        }
+        node_children(node)[idx] = mid;
+        rax->numele++;
+        return true;
+    }
+}
+
+bool rax_find(Rax *rax, const uint8_t *key, size_t len, void **data) {
+    RaxNode *node = rax->root;
+    size_t pos = 0;
+    while (pos < len) {
+        uint32_t idx = 0;
+        if (!node_find_child(node, key[pos], &idx)) {
+            return false;
+        }
+        node = node_children(node)[idx];
+        if (node->seglen > len - pos || memcmp(node_seg(node), &key[pos], node->seglen) != 0) {
+            return false;
+        }
+        pos += node->seglen;
+    }
+    if (!node->is_key) {
+        return false;
+    }
+    if (data) {
+        *data = node->data;
+    }
+    return true;
+}
+
+bool rax_remove(Rax *rax, const uint8_t *key, size_t len, void **old) {
+    std::vector<RaxNode *> parents;
+    std::vector<uint32_t> idxs;     // index of the path node in its parent
+    RaxNode *node = rax->root;
+    size_t pos = 0;
+    while (pos < len) {
+        uint32_t idx = 0;
+        if (!node_find_child(node, key[pos], &idx)) {
+            return false;
+        }
+        RaxNode *child = node_children(node)[idx];
+        if (child->seglen > len - pos || memcmp(node_seg(child), &key[pos], child->seglen) != 0) {
+            return false;
+        }
+        parents.push_back(node);
+        idxs.push_back(idx);
+        node = child;
+        pos += child->seglen;
+    }
+    if (!node->is_key) {
+        return false;
+    }
+    if (old) {
+        *old = node->data;
+    }
+    node->is_key = 0;
+    node->data = NULL;
+    rax->numele--;
+
+    // restore the invariant on the way up
+    while (!parents.empty()) {
+        RaxNode *parent = parents.back();
+        uint32_t i = idxs.back();
+        if (!node->is_key && node->nchild == 0) {
+            node_free(rax, node);
+            parent = node_remove_child(rax, parent, i);
+            parents.pop_back();
+            idxs.pop_back();
+            if (parents.empty()) {
+                rax->root = parent;
+            } else {
+                node_children(parents.back())[idxs.back()] = parent;
+            }
+            node = parent;
+            continue;
+        }
+        if (!node->is_key && node->nchild == 1) {
+            RaxNode *child = node_children(node)[0];
+            std::string seg((const char *)node_seg(node), node->seglen);
+            seg.append((const char *)node_seg(child), child->seglen);
+            RaxNode *merged = node_new(rax, (const uint8_t *)seg.data(), seg.size(), child->nchild);
+            merged->is_key = child->is_key;
+            merged->data = child->data;
+            memcpy(node_children(merged), node_children(child), child->nchild * sizeof(RaxNode *));
+            node_free(rax, node);
+            node_free(rax, child);
+            node_children(parent)[i] = merged;
+        }
+        break;
+    }
+    return true;
+}
+
+void rax_seek(RaxIter *it, Rax *rax, const uint8_t *key, size_t len) {
+    it->rax = rax;
+    it->stack.clear();
+    it->key.clear();
+    it->data = NULL;
+    it->stack.push_back({rax->root, -1});
+    size_t pos = 0;
+    while (pos < len) {
+        // the key of this node is shorter than the target, skip it
+        RaxNode *node = it->stack.back().first;
+        uint32_t j = node_lower_bound(node, key[pos]);
+        if (j == node->nchild) {
+            it->stack.back().second = j;
+            return;
+        }
+        RaxNode *child = node_children(node)[j];
+        size_t m = common_prefix(node_seg(child), child->seglen, &key[pos], len - pos);
+        if (m == child->seglen) {
+            // the edge is a prefix of the target, descend
+            it->stack.back().second = j + 1;
+            it->stack.push_back({child, -1});
+            it->key.append((const char *)node_seg(child), child->seglen);
+            pos += m;
+            continue;
+        }
+        if (pos + m == len || node_seg(child)[m] > key[pos + m]) {
+            // the whole subtree is greater than the target
+            it->stack.back().second = j;
+        } else {
+            it->stack.back().second = j + 1;
+        }
+        return;
+    }
+}
+
+bool rax_next(RaxIter *it) {
+    while (!it->stack.empty()) {
+        RaxNode *node = it->stack.back().first;
+        int64_t state = it->stack.back().second;
+        if (state == -1) {
+            it->stack.back().second = 0;
+            if (node->is_key) {
+                it->data = node->data;
+                return true;
+            }
+            continue;
+        }
+        if (state < (int64_t)node->nchild) {
+            RaxNode *child = node_children(node)[state];
+            it->stack.back().second = state + 1;
+            it->key.append((const char *)node_seg(child), child->seglen);
+            it->stack.push_back({child, -1});
+            continue;
+        }
+        it->key.resize(it->key.size() - node->seglen);
+        it->stack.pop_back();
+    }
+    return false;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/*
+A compressed radix tree (rax) mapping byte strings to pointers.
+
+Every node carries the bytes of the edge leading to it, so a chain of nodes
+with a single child is stored as one node, and keys sharing a prefix share
+the nodes of that prefix. Children are kept sorted by their first byte, which
+makes an in-order walk visit keys in lexicographic order.
+
+Invariant: apart from the root, a node that is not a key has at least 2
+children, otherwise it is merged with its only child.
+
+A node is a single allocation:
+    [ RaxNode | seg bytes | padding | child pointers ]
+so adding or removing a child reallocates the node, and the parent's child
+pointer is updated to follow it.
+*/
+struct RaxNode {
+    uint32_t is_key : 1;
+    uint32_t seglen : 31;   // length of the edge label
+    uint32_t nchild;
+    void *data;             // value, if is_key
+};
+
+struct Rax {
+    RaxNode *root = NULL;
+    size_t numele = 0;      // number of keys
+    size_t numnodes = 0;
+    size_t bytes = 0;       // memory used by the nodes
+};
+
+void rax_init(Rax *rax);
+// free the tree, `free_data` (if not NULL) is called for every value
+void rax_clear(Rax *rax, void (*free_data)(void *));
+
+// returns true if `key` is new, otherwise the value is replaced and the old
+// one is stored in `*old` (if not NULL)
+bool rax_insert(Rax *rax, const uint8_t *key, size_t len, void *data, void **old);
+// returns true if `key` was found and removed, its value goes to `*old`
+bool rax_remove(Rax *rax, const uint8_t *key, size_t len, void **old);
+// returns true if `key` exists and stores its value in `*data`
+bool rax_find(Rax *rax, const uint8_t *key, size_t len, void **data);
+
+/*
+Ordered iteration. The iterator keeps the path from the root to the current
+node, so `rax_next` is amortized O(1). The tree must not be modified while an
+iterator is in use, re-seek after a modification.
+*/
+struct RaxIter {
+    Rax *rax = NULL;
+    // (node, state): state -1 means the node itself has not been emitted yet,
+    // otherwise it is the index of the next child to visit
+    std::vector<std::pair<RaxNode *, int64_t>> stack;
+    std::string key;        // key of the current element
+    void *data = NULL;      // value of the current element
+};
+
+// position before the first key >= `key`, call rax_next to get it
+void rax_seek(RaxIter *it, Rax *rax, const uint8_t *key, size_t len);
+// advance to the next key, returns false at the end
+bool rax_next(RaxIter *it);
@@ -0,0 +1,415 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include "log.h"
+#include "protocol.h"
+#include "replication.h"
+
+void backlog_init(ReplBacklog *b, size_t size, uint64_t off) {
+    b->buf.assign(size, 0);
+    b->start_off = b->end_off = off;
+}
+
+bool backlog_active(const ReplBacklog *b) {
+    return !b->buf.empty();
+}
+
+void backlog_feed(ReplBacklog *b, const char *p, size_t n) {
+    size_t size = b->buf.size();
+    if (n > size) {
+        // only the tail fits
+        b->end_off += n - size;
+        p += n - size;
+        n = size;
+    }
+    while (n > 0) {
+        size_t idx = (size_t)(b->end_off % size);
+        size_t chunk = n < size - idx ? n : size - idx;
+        memcpy(&b->buf[idx], p, chunk);
+        p += chunk;
+        n -= chunk;
+        b->end_off += chunk;
+    }
+}
+
+uint64_t backlog_first_off(const ReplBacklog *b) {
+    uint64_t size = b->buf.size();
+    return b->end_off - b->start_off > size ? b->end_off - size : b->start_off;
+}
+
+bool backlog_read(const ReplBacklog *b, uint64_t off, std::string &out) {
+    if (!backlog_active(b) || off < backlog_first_off(b) || off > b->end_off) {
+        return false;
+    }
+    size_t size = b->buf.size();
+    while (off < b->end_off) {
+        size_t idx = (size_t)(off % size);
+        uint64_t left = b->end_off - off;
+        size_t chunk = left < size - idx ? (size_t)left : size - idx;
+        out.append(&b->buf[idx], chunk);
+        off += chunk;
+    }
+    return true;
+}
+
+std::string repl_gen_id() {
+    uint8_t raw[20];
+    int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    bool ok = fd >= 0 && read(fd, raw, sizeof(raw)) == (ssize_t)sizeof(raw);
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (!ok) {
+        uint64_t x = (uint64_t)time(NULL) * 0x9e3779b97f4a7c15ULL ^ (uint64_t)getpid();
+        for (uint8_t &c : raw) {
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            c = (uint8_t)x;
+        }
+    }
+    static const char hex[] = "0123456789abcdef";
+    std::string id;
+    for (uint8_t c : raw) {
+        id.push_back(hex[c >> 4]);
+        id.push_back(hex[c & 15]);
+    }
+    return id;
+}
+
+uint64_t repl_unix_msec() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_REALTIME, &tv);
+    return (uint64_t)tv.tv_sec * 1000 + (uint64_t)tv.tv_nsec / 1000 / 1000;
+}
+
+static uint64_t get_msec() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return (uint64_t)tv.tv_sec * 1000 + (uint64_t)tv.tv_nsec / 1000 / 1000;
+}
+
+static struct {
+    std::string host;
+    uint16_t port = 0;
+    std::string tmp_path;
+    ReplHandler h = {};
+    uint32_t state = REPL_NONE;
+    int fd = -1;
+    std::string rbuf;
+    std::string wbuf;           // the sync request and the acks
+    std::vector<std::string> cmd;
+    // the snapshot being received
+    int snap_fd = -1;
+    uint64_t snap_size = 0;
+    uint64_t snap_recv = 0;
+    // what the keyspace holds: the stream of `replid` up to `offset`.
+    // They survive a disconnect for the partial resync.
+    std::string replid = "?";
+    uint64_t offset = 0;
+    std::string next_replid;    // of the snapshot being received
+    uint64_t next_offset = 0;
+    // timers, monotonic ms
+    uint64_t retry_ms = 0;
+    uint64_t last_io_ms = 0;
+    uint64_t last_ack_ms = 0;
+    // stats
+    int64_t lag_ms = -1;
+    uint64_t bytes_in = 0;
+    uint64_t bytes_mark = 0;
+    uint64_t mark_ms = 0;
+    uint64_t bytes_per_sec = 0;
+    uint64_t full_syncs = 0;
+    uint64_t partial_syncs = 0;
+} g_link;
+
+void repl_link_init(const std::string &host, uint16_t port, const std::string &tmp_path,
+    const ReplHandler &h)
+{
+    g_link.host = host;
+    g_link.port = port;
+    g_link.tmp_path = tmp_path;
+    g_link.h = h;
+    g_link.state = REPL_CONNECT;
+    g_link.retry_ms = 0;
+    g_link.mark_ms = get_msec();
+}
+
+bool repl_link_enabled() {
+    return g_link.state != REPL_NONE;
+}
+
+const char *repl_state_name(uint32_t state) {
+    switch (state) {
+    case REPL_CONNECT: return "down";
+    case REPL_CONNECTING: return "connecting";
+    case REPL_HANDSHAKE: return "handshake";
+    case REPL_TRANSFER: return "transfer";
+    case REPL_ONLINE: return "up";
+    default: return "none";
+    }
+}
+
+static void link_close(const char *why) {
+    log_warn("replication: %s, reconnecting", why);
+    if (g_link.fd >= 0) {
+        close(g_link.fd);
+        g_link.fd = -1;
+    }
+    if (g_link.snap_fd >= 0) {
+        close(g_link.snap_fd);
+        g_link.snap_fd = -1;
+        unlink(g_link.tmp_path.c_str());
+    }
+    g_link.rbuf.clear();
+    g_link.wbuf.clear();
+    g_link.state = REPL_CONNECT;
+    g_link.retry_ms = get_msec() + 1000;
+}
+
+static void link_connect() {
+    g_link.fd = tcp_connect_nb(g_link.host, g_link.port);
+    if (g_link.fd < 0) {
+        return link_close("can't connect to the leader");
+    }
+    g_link.state = REPL_CONNECTING;
+    g_link.last_io_ms = get_msec();
+}
+
+static void link_flush() {
+    while (!g_link.wbuf.empty()) {
+        ssize_t rv = write(g_link.fd, g_link.wbuf.data(), g_link.wbuf.size());
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv < 0 && errno == EAGAIN) {
+            return;
+        }
+        if (rv <= 0) {
+            return link_close("write() error");
+        }
+        g_link.wbuf.erase(0, (size_t)rv);
+    }
+}
+
+static void link_send(const std::vector<std::string> &cmd) {
+    put_req(g_link.wbuf, cmd);
+    link_flush();
+}
+
+static void link_handshake() {
+    if (!tcp_connect_ok(g_link.fd)) {
+        return link_close("can't connect to the leader");
+    }
+    g_link.state = REPL_HANDSHAKE;
+    link_send({"sync", g_link.replid, std::to_string(g_link.offset)});
+}
+
+// the reply to sync
+static bool link_preamble(std::vector<std::string> &cmd) {
+    if (cmd[0] == "continue" && cmd.size() == 2) {
+        log_info("replication: partial resync from offset %llu",
+            (unsigned long long)g_link.offset);
+        g_link.replid = cmd[1];
+        g_link.state = REPL_ONLINE;
+        g_link.partial_syncs++;
+        return true;
+    }
+    if (cmd[0] != "fullresync" || cmd.size() != 4) {
+        return false;
+    }
+    g_link.next_replid = cmd[1];
+    g_link.next_offset = strtoull(cmd[2].c_str(), NULL, 10);
+    g_link.snap_size = strtoull(cmd[3].c_str(), NULL, 10);
+    g_link.snap_recv = 0;
+    g_link.snap_fd = open(g_link.tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (g_link.snap_fd < 0) {
+        return false;
+    }
+    log_info("replication: full resync, receiving %llu bytes",
+        (unsigned long long)g_link.snap_size);
+    g_link.state = REPL_TRANSFER;
+    return true;
+}
+
+static bool link_transfer_done() {
+    bool ok = close(g_link.snap_fd) == 0;
+    g_link.snap_fd = -1;
+    // the keyspace is replaced, even a failed load leaves nothing to resume
+    g_link.replid = "?";
+    g_link.offset = 0;
+    if (!ok || !g_link.h.load(g_link.h.arg, g_link.tmp_path.c_str())) {
+        unlink(g_link.tmp_path.c_str());
+        return false;
+    }
+    g_link.replid = g_link.next_replid;
+    g_link.offset = g_link.next_offset;
+    g_link.state = REPL_ONLINE;
+    g_link.full_syncs++;
+    return true;
+}
+
+static void link_process() {
+    size_t pos = 0;
+    while (true) {
+        size_t avail = g_link.rbuf.size() - pos;
+        if (g_link.state == REPL_TRANSFER) {
+            uint64_t left = g_link.snap_size - g_link.snap_recv;
+            size_t n = avail < left ? avail : (size_t)left;
+            const char *p = g_link.rbuf.data() + pos;
+            for (size_t done = 0; done < n; ) {
+                ssize_t rv = write(g_link.snap_fd, p + done, n - done);
+                if (rv < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (rv <= 0) {
+                    return link_close("can't write the snapshot");
+                }
+                done += (size_t)rv;
+            }
+            pos += n;
+            g_link.snap_recv += n;
+            if (g_link.snap_recv < g_link.snap_size) {
+                break;
+            }
+            if (!link_transfer_done()) {
+                return link_close("can't load the snapshot");
+            }
+            continue;
+        }
+
+        if (avail < 4) {
+            break;
+        }
+        uint32_t len = 0;
+        memcpy(&len, &g_link.rbuf[pos], 4);
+        if (len > k_repl_max_frame) {
+            g_link.replid = "?";
+            return link_close("bad frame from the leader");
+        }
+        if (avail < 4 + (size_t)len) {
+            break;
+        }
+        const uint8_t *frame = (const uint8_t *)&g_link.rbuf[pos];
+        std::vector<std::string> &cmd = g_link.cmd;
+        if (0 != parse_req(frame + 4, len, cmd) || cmd.empty()) {
+            g_link.replid = "?";
+            return link_close("bad frame from the leader");
+        }
+        pos += 4 + len;
+        if (g_link.state == REPL_HANDSHAKE) {
+            if (!link_preamble(cmd)) {
+                return link_close("unexpected reply to sync");
+            }
+            continue;
+        }
+
+        g_link.offset += 4 + len;
+        if (cmd[0] == "ping" && cmd.size() == 2) {
+            g_link.lag_ms = (int64_t)repl_unix_msec() - (int64_t)strtoull(cmd[1].c_str(), NULL, 10);
+        } else {
+            g_link.h.apply(g_link.h.arg, cmd, frame, 4 + (size_t)len);
+        }
+    }
+    g_link.rbuf.erase(0, pos);
+}
+
+static void link_read() {
+    char buf[64 << 10];
+    while (true) {
+        ssize_t rv = read(g_link.fd, buf, sizeof(buf));
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv < 0 && errno == EAGAIN) {
+            break;
+        }
+        if (rv <= 0) {
+            return link_close(rv == 0 ? "the leader closed the connection" : "read() error");
+        }
+        g_link.rbuf.append(buf, (size_t)rv);
+        g_link.bytes_in += (uint64_t)rv;
+        g_link.last_io_ms = get_msec();
+        // apply as we go, so a large transfer doesn't pile up in memory
+        if (g_link.rbuf.size() >= sizeof(buf)) {
+            link_process();
+            if (g_link.fd < 0) {
+                return;
+            }
+        }
+    }
+    link_process();
+}
+
+bool repl_link_pollfd(struct pollfd *pfd) {
+    if (g_link.fd < 0) {
+        return false;
+    }
+    pfd->fd = g_link.fd;
+    pfd->events = POLLIN | POLLERR;
+    if (g_link.state == REPL_CONNECTING || !g_link.wbuf.empty()) {
+        pfd->events |= POLLOUT;
+    }
+    pfd->revents = 0;
+    return true;
+}
+
+void repl_link_io(short revents) {
+    if (g_link.state == REPL_CONNECTING) {
+        if (revents & (POLLOUT | POLLERR | POLLHUP)) {
+            link_handshake();
+        }
+        return;
+    }
+    if (revents & POLLOUT) {
+        link_flush();
+    }
+    if (g_link.fd >= 0 && (revents & (POLLIN | POLLERR | POLLHUP))) {
+        link_read();
+    }
+}
+
+void repl_link_cron() {
+    if (g_link.state == REPL_NONE) {
+        return;
+    }
+    uint64_t now = get_msec();
+    if (now - g_link.mark_ms >= 1000) {
+        g_link.bytes_per_sec = (g_link.bytes_in - g_link.bytes_mark) * 1000 / (now - g_link.mark_ms);
+        g_link.bytes_mark = g_link.bytes_in;
+        g_link.mark_ms = now;
+    }
+    if (g_link.state == REPL_CONNECT) {
+        if (now >= g_link.retry_ms) {
+            link_connect();
+        }
+        return;
+    }
+    if (now - g_link.last_io_ms > k_repl_timeout_ms) {
+        return link_close("timeout");
+    }
+    if (g_link.state == REPL_ONLINE && now - g_link.last_ack_ms >= 1000) {
+        g_link.last_ack_ms = now;
+        link_send({"replconf", "ack", std::to_string(g_link.offset)});
+    }
+}
+
+void repl_link_get_stats(ReplLinkStats *stats) {
+    stats->state = g_link.state;
+    stats->host = g_link.host;
+    stats->port = g_link.port;
+    stats->replid = g_link.replid;
+    stats->offset = g_link.offset;
+    stats->lag_ms = g_link.lag_ms;
+    stats->last_io_age_ms = g_link.fd >= 0 ? get_msec() - g_link.last_io_ms : 0;
+    stats->bytes_per_sec = g_link.bytes_per_sec;
+    stats->transfer_bytes = g_link.snap_recv;
+    stats->transfer_size = g_link.state == REPL_TRANSFER ? g_link.snap_size : 0;
+    stats->full_syncs = g_link.full_syncs;
+    stats->partial_syncs = g_link.partial_syncs;
+}
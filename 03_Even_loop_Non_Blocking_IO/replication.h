@@ -0,0 +1,101 @@
+#pragma once
+
+#include <poll.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/*
+Leader-follower replication.
+
+The leader numbers every byte of its replication stream: the write commands
+it runs, framed like requests, plus a ["ping", unix ms] frame once per
+second. A follower connects and sends
+    sync <replid> <offset>      (replid "?" the first time)
+If `replid` is the leader's and the backlog still holds the stream from
+`offset`, the leader replies ["continue", replid] followed by the missing
+bytes (partial resync). Otherwise it forks a snapshot and replies
+    ["fullresync", replid, offset, size] | snapshot bytes
+followed by the stream from `offset`, the offset at fork() time. The
+follower acknowledges what it has applied with "replconf ack <offset>"
+once per second.
+
+Both ends are in the event loop: the follower side is a single
+non-blocking link to the leader, the leader side lives in the server
+since the followers are regular connections.
+*/
+
+// replication stream frames can be larger than a request (RESTORE)
+const size_t k_repl_max_frame = 512 << 20;
+const uint64_t k_repl_timeout_ms = 60 * 1000;
+// a follower with more stream than this waiting to be sent is dropped
+const size_t k_repl_max_pending = 64 << 20;
+
+/*
+The backlog: a ring buffer with the last `size` bytes of the stream, so a
+follower that reconnects after a short break only gets what it missed.
+*/
+struct ReplBacklog {
+    std::vector<char> buf;
+    uint64_t start_off = 0;     // the stream offset when the backlog was created
+    uint64_t end_off = 0;       // the offset of the next byte
+};
+
+void backlog_init(ReplBacklog *b, size_t size, uint64_t off);
+bool backlog_active(const ReplBacklog *b);
+void backlog_feed(ReplBacklog *b, const char *p, size_t n);
+// the first offset still in the ring
+uint64_t backlog_first_off(const ReplBacklog *b);
+// append the bytes from `off` to the end, false if they were overwritten
+bool backlog_read(const ReplBacklog *b, uint64_t off, std::string &out);
+
+// 40 random hex digits, identifies the history of a leader
+std::string repl_gen_id();
+uint64_t repl_unix_msec();
+
+/*
+The follower side. The server is called back to swap its keyspace for a
+snapshot received from the leader, and to run every command of the stream.
+*/
+struct ReplHandler {
+    void *arg;
+    bool (*load)(void *arg, const char *path);
+    void (*apply)(void *arg, std::vector<std::string> &cmd, const uint8_t *frame, size_t len);
+};
+
+enum {
+    REPL_NONE = 0,          // not a follower
+    REPL_CONNECT = 1,       // waiting to (re)connect
+    REPL_CONNECTING = 2,    // non-blocking connect()
+    REPL_HANDSHAKE = 3,     // sent sync, waiting for the reply
+    REPL_TRANSFER = 4,      // receiving a snapshot
+    REPL_ONLINE = 5,
+};
+
+struct ReplLinkStats {
+    uint32_t state = REPL_NONE;
+    std::string host;
+    uint16_t port = 0;
+    std::string replid;
+    uint64_t offset = 0;            // stream bytes applied
+    int64_t lag_ms = -1;            // age of the last leader ping when it arrived
+    uint64_t last_io_age_ms = 0;
+    uint64_t bytes_per_sec = 0;
+    uint64_t transfer_bytes = 0;    // of the snapshot being received
+    uint64_t transfer_size = 0;
+    uint64_t full_syncs = 0;
+    uint64_t partial_syncs = 0;
+};
+
+// `tmp_path` receives the snapshots
+void repl_link_init(const std::string &host, uint16_t port, const std::string &tmp_path,
+    const ReplHandler &h);
+bool repl_link_enabled();
+const char *repl_state_name(uint32_t state);
+// the fd to poll, false if there is none
+bool repl_link_pollfd(struct pollfd *pfd);
+void repl_link_io(short revents);
+// reconnects, sends the acks, the timeouts; call it every loop iteration
+void repl_link_cron();
+void repl_link_get_stats(ReplLinkStats *stats);
@@ -2,30 +2,90 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
 #include <stdio.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <malloc.h>
 #include <poll.h>
+#include <signal.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <netinet/ip.h>
+#include <algorithm>
+#include <deque>
+#include <string>
 #include <vector>
+#include "aof.h"
+#include "clock.h"
+#include "cluster.h"
+#include "common.h"
+#include "glob.h"
+#include "hashtable.h"
+#include "histogram.h"
+#include "hotkeys.h"
+#include "hyperloglog.h"
+#include "iothreads.h"
+#include "lazyfree.h"
+#include "list.h"
+#include "log.h"
+#include "protocol.h"
+#include "rax.h"
+#include "replication.h"
+#include "shmring.h"
+#include "slowlog.h"
+#include "snapshot.h"
+#include "stream.h"
+#include "zerocopy.h"
 
 using namespace std;
 
 const size_t k_max_msg = 4096;
+const size_t k_max_res = 32 << 20;
+// batched replies (--io-threads): a read brings up to this much, and a
+// client's requests stop running once this much waits to be written
+const size_t k_io_batch_bytes = 64 << 10;
 
-static void msg(const char *msg) {
-    fprintf(stderr, "%s\n", msg);
-}
+// the usual size of a read buffer
+static size_t g_rbuf_cap = 4 + k_max_msg;
+// GET replies of values this large are sent from the value itself
+// (--zerocopy), 0: off. Smaller ones cost more to pin than to copy, and a
+// short string keeps its bytes inside the object, they would move.
+const size_t k_zc_min_bytes = 16 << 10;
+static size_t g_zc_threshold = 0;
+// fairness: per turn of the loop a client runs at most this many commands
+// and reads at most this many bytes, the rest waits for the next turn
+static uint32_t g_turn_cmds = 256;
+static size_t g_turn_bytes = 64 << 10;
+// output buffer limits: a client's requests stop running while this much of
+// its replies is unsent, and past the hard limit (0: none) it is dropped
+static size_t g_output_soft = k_io_batch_bytes;
+static size_t g_output_hard = 0;
+// a command that runs longer than this is continued in the next turns of
+// the loop, the other clients are served in between (0: to the end)
+static uint64_t g_slice_usec = 250;
+static uint64_t g_slice_ticks = 0;      // once the clock is calibrated
 
 static void die(const char *msg) {
     int err = errno;
-    fprintf(stderr, "[%d] %s\n", err, msg);
+    log_error("[%d] %s", err, msg);
+    log_flush();
     abort();
 }
 
+static uint64_t get_monotonic_usec() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return (uint64_t)tv.tv_sec * 1000000 + (uint64_t)tv.tv_nsec / 1000;
+}
+
 /*
 We need buffers for reading/writing, since in Non-Blocking IO mode operations are defered.
 In non-blocking mode, input/output (I/O) operations are not guaranteed to complete immediately.
@@ -39,20 +99,235 @@ enum {
     STATE_REQ = 0, // request
     STATE_RES = 1, // response
     STATE_END = 2, // mark the connection for deletion
+    STATE_BLOCKED = 3, // a request waits for a key (xread block), nothing is read or written
+};
+
+/*
+A connection that sent "sync". It waits for a snapshot, gets the snapshot,
+then the replication stream from the offset of the snapshot on.
+*/
+enum {
+    FOLLOWER_WAIT_BGSAVE_START = 0, // no snapshot can be started yet
+    FOLLOWER_WAIT_BGSAVE_END = 1,
+    FOLLOWER_SEND_SNAPSHOT = 2,
+    FOLLOWER_ONLINE = 3,
+};
+
+struct Follower {
+    uint32_t state = FOLLOWER_WAIT_BGSAVE_START;
+    std::string addr;
+    uint64_t start_off = 0;     // the offset of the first byte in the connection's `wbuf`
+    // the reply to sync, then the snapshot
+    std::string pre;
+    size_t pre_sent = 0;
+    int snap_fd = -1;
+    uint64_t snap_off = 0;
+    uint64_t snap_size = 0;
+    // the last "replconf ack", monotonic ms
+    uint64_t ack_off = 0;
+    uint64_t ack_ms = 0;
+};
+
+static const char *follower_state_name(uint32_t state) {
+    switch (state) {
+    case FOLLOWER_WAIT_BGSAVE_START: return "wait_bgsave";
+    case FOLLOWER_WAIT_BGSAVE_END: return "wait_bgsave";
+    case FOLLOWER_SEND_SNAPSHOT: return "send_snapshot";
+    default: return "online";
+    }
+}
+
+/*
+A client of the Unix socket that switched to shared memory (SHM): the
+requests and replies go through the rings of `ch`, `efd_server` wakes the
+loop and `efd_client` the client. The memfd and the eventfds are passed
+with the reply to SHM, the rings are used once it was sent.
+*/
+struct ShmConn {
+    ShmChannel ch;
+    int memfd = -1;
+    int efd_server = -1;
+    int efd_client = -1;
+    bool fds_sent = false;
+    bool active = false;
+};
+
+struct ZcPin;
+struct Job;
+struct Block;
+
+// a zero-copy send not completed yet, by sequence number
+struct ZcSend {
+    uint32_t seq;
+    ZcPin *pin;
+};
+
+/*
+The socket of a connection closed with zero-copy sends in flight. The kernel
+may still read the values from their pages, and only the error queue of
+this socket says when it stopped, so the socket stays open (out of fd2conn,
+shut down for both directions) until every completion came back. A peer
+that doesn't read holds them back: after k_zc_linger_ms the socket is reset
+(SO_LINGER 0), which drops the data queued, and the pins go.
+*/
+struct ZcLinger {
+    int fd;
+    std::deque<ZcSend> inflight;
+    uint64_t deadline_ms;
 };
+const uint64_t k_zc_linger_ms = 5000;
 
 struct Conn {
     int fd = -1;
-    uint32_t state = 0; // either STATE_REQ or STATE_RES
-    // buffer for reading
+    uint32_t state = 0; // STATE_*
+    // buffer for reading, it only grows past a request for the RESTOREs
+    // of a slot migration. The next request starts at `rbuf_head`.
+    size_t rbuf_head = 0;
     size_t rbuf_size = 0;
-    uint8_t rbuf[4+k_max_msg];
-    // buffer for writing
+    std::vector<uint8_t> rbuf;
+    // buffer for writing, responses are generated in place so it can grow
     size_t wbuf_size = 0;
     size_t wbuf_sent = 0; // to track how much data has already been sent
-    uint8_t wbuf[4+k_max_msg];
+    std::string wbuf;
+    // the reply to a write command waits for the append-only log
+    bool aof_wait = false;
+    // the parsed request, reused so that parsing doesn't allocate
+    std::vector<std::string> cmd;
+    // set once the peer sent "sync", `wbuf` then holds the replication
+    // stream instead of a reply
+    Follower *follower = NULL;
+    // cluster: the next command may use a slot this node imports ("asking"),
+    // and the node migrating slots here ("cluster import")
+    bool asking = false;
+    bool importer = false;
+    // fairness: what the client used of its budget in loop turn `turn`, and
+    // `deferred` when the budget left complete requests in `rbuf`
+    uint64_t turn = 0;
+    uint32_t turn_cmds = 0;
+    size_t turn_bytes = 0;
+    bool deferred = false;
+    // a long command of this client running in slices, or the request at
+    // `rbuf_head` is a write that waits for the jobs reading its keys
+    Job *job = NULL;
+    bool job_wait = false;
+    // the request at `rbuf_head` waits for its keys (STATE_BLOCKED), or was
+    // woken and runs again
+    Block *block = NULL;
+    // the read() or write() an I/O thread made for the loop (--io-threads)
+    ssize_t io_rv = 0;
+    int io_errno = 0;
+    // on the Unix socket, and on shared memory after SHM
+    bool local = false;
+    ShmConn *shm = NULL;
+    // --zerocopy: the value of the last reply, sent from where it is stored
+    // once `wbuf` is out, then the sends the kernel hasn't released yet.
+    // Off for good once the kernel said it copied anyway.
+    bool zc_ok = false;
+    ZcPin *zc_pin = NULL;
+    size_t zc_sent = 0;
+    uint32_t zc_seq = 0;    // of the next MSG_ZEROCOPY send
+    std::deque<ZcSend> zc_inflight;
 };
 
+/*
+Where the event loop spends its time. Every tick of an iteration is charged
+to exactly one phase: loop_phase() switches to a phase and returns the one
+it interrupted, so a region nested in another (a write() while handling a
+request) is taken out of it and the outer phase resumes afterwards. A switch
+is one clock read.
+*/
+enum {
+    LOOP_POLL = 0,      // waiting in poll()
+    LOOP_READ = 1,      // read() from clients
+    LOOP_PARSE = 2,     // framing, parsing, lookup and routing of requests
+    LOOP_EXEC = 3,      // running commands
+    LOOP_WRITE = 4,     // write() to clients
+    LOOP_ACCEPT = 5,
+    LOOP_OTHER = 6,     // building the poll set, timers, log commit, followers...
+    LOOP_NPHASES = 7,
+};
+
+static const char *const k_loop_phase_names[LOOP_NPHASES] = {
+    "poll", "read", "parse", "exec", "write", "accept", "other",
+};
+
+/*
+Counters for INFO and STATS. Only the event loop thread updates them, so
+they are plain integers; times are in clock ticks (clock.h), converted when
+reported.
+*/
+static struct {
+    uint64_t start_ms = 0;
+    // connections
+    uint64_t conns = 0;             // open now
+    uint64_t conns_total = 0;       // accepted since the start
+    uint64_t shm_conns = 0;         // on shared memory now
+    // requests that didn't get to run: unknown, wrong arity, redirected...
+    uint64_t rejected = 0;
+    uint64_t net_in = 0;
+    uint64_t net_out = 0;
+    uint64_t reads = 0;
+    uint64_t writes = 0;
+    // event loop
+    uint64_t loops = 0;
+    bool profile = true;                    // STATS LOOP ON|OFF
+    uint32_t phase = LOOP_OTHER;
+    uint64_t phase_start = 0;
+    uint64_t iter_ticks[LOOP_NPHASES];      // of the running iteration
+    uint64_t phase_ticks[LOOP_NPHASES];     // since the start
+    Histogram phase_hist[LOOP_NPHASES];     // per iteration that had the phase
+    Histogram ready_fds;                    // per wakeup
+    // system calls, whatever they returned
+    uint64_t poll_calls = 0;
+    uint64_t read_calls = 0;
+    uint64_t write_calls = 0;
+    uint64_t accept_calls = 0;
+    Histogram read_bytes;                   // per read() that got data
+    Histogram write_bytes;
+    // zero-copy replies (--zerocopy)
+    uint64_t zc_sends = 0;
+    uint64_t zc_copied = 0;                 // completed, but the kernel copied
+    uint64_t zc_pins = 0;                   // values lent to the kernel now
+    // fairness and output limits
+    uint64_t turns_deferred = 0;            // a client's budget ran out with requests left
+    uint64_t output_limit_drops = 0;
+    // commands run in slices
+    uint64_t jobs = 0;                      // that didn't finish in their first slice
+    uint64_t job_waits = 0;                 // requests that waited for a job
+    // blocking reads
+    uint64_t blocked = 0;                   // clients waiting now
+    uint64_t blocked_total = 0;
+    uint64_t blocked_timeouts = 0;
+} g_stats;
+
+static uint32_t loop_phase_at(uint32_t phase, uint64_t now) {
+    uint32_t prev = g_stats.phase;
+    if (!g_stats.profile) {
+        return prev;
+    }
+    g_stats.iter_ticks[prev] += now - g_stats.phase_start;
+    g_stats.phase_start = now;
+    g_stats.phase = phase;
+    return prev;
+}
+
+static uint32_t loop_phase(uint32_t phase) {
+    return g_stats.profile ? loop_phase_at(phase, clock_ticks()) : g_stats.phase;
+}
+
+// close the iteration, its phases go to the totals and histograms
+static void loop_iteration_end() {
+    loop_phase(LOOP_OTHER);
+    g_stats.loops++;
+    for (uint32_t i = 0; i < LOOP_NPHASES; ++i) {
+        if (uint64_t t = g_stats.iter_ticks[i]) {
+            g_stats.phase_ticks[i] += t;
+            hist_record(&g_stats.phase_hist[i], t);
+            g_stats.iter_ticks[i] = 0;
+        }
+    }
+}
+
 static int32_t read_full(int fd, char *buf, size_t n) {
     while (n > 0) {
         ssize_t rv = read(fd, buf, n);
@@ -99,37 +374,58 @@ static void fd_set_nb(int fd) {
 static void state_req(Conn *conn);
 static void state_res(Conn *conn);
 
-static void conn_put(std::vector<Conn *> &fd2conn, struct Conn *conn) {
-    if (fd2conn.size() <= (size_t)conn->fd) {
-        fd2conn.resize(conn->fd + 1);
+// ip:port of the client, "unix" or "shm" for the local ones
+static std::string conn_peer_addr(Conn *conn) {
+    if (conn->local) {
+        return conn->shm && conn->shm->active ? "shm" : "unix";
+    }
+    struct sockaddr_in addr = {};
+    socklen_t socklen = sizeof(addr);
+    char ip[INET_ADDRSTRLEN] = "?";
+    if (getpeername(conn->fd, (struct sockaddr *)&addr, &socklen) == 0) {
+        inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip));
+    }
+    return std::string(ip) + ":" + std::to_string(ntohs(addr.sin_port));
+}
+
+// a connection is found by its socket, and by its eventfd once on shared memory
+static void fd2conn_set(std::vector<Conn *> &fd2conn, int fd, struct Conn *conn) {
+    if (fd2conn.size() <= (size_t)fd) {
+        fd2conn.resize(fd + 1);
     }
-    fd2conn[conn->fd] = conn;
+    fd2conn[fd] = conn;
+}
+
+static void conn_put(std::vector<Conn *> &fd2conn, struct Conn *conn) {
+    fd2conn_set(fd2conn, conn->fd, conn);
 }
 
-static int32_t accept_new_conn(std::vector<Conn *> &fd2conn, int fd) {
+static int32_t accept_new_conn(std::vector<Conn *> &fd2conn, int fd, bool local) {
     // accept
-    struct sockaddr_in client_addr = {};
+    struct sockaddr_storage client_addr = {};
     socklen_t socklen = sizeof(client_addr);
     int connfd = accept(fd, (struct sockaddr *)&client_addr, &socklen);
+    g_stats.accept_calls++;
     if (connfd < 0) {
-        msg("accept() error");
+        log_warn("accept() error: %s", strerror(errno));
         return -1;  // error
     }
 
     // set the new connection fd to nonblocking mode
     fd_set_nb(connfd);
     // creating the struct Conn
-    struct Conn *conn = (struct Conn *)malloc(sizeof(struct Conn));
-    if (!conn) {
-        close(connfd);
-        return -1;
-    }
+    struct Conn *conn = new Conn();
     conn->fd = connfd;
+    conn->local = local;
+    conn->zc_ok = g_zc_threshold && !local && zc_enable(connfd);
     conn->state = STATE_REQ;
     conn->rbuf_size = 0;
+    conn->rbuf.resize(g_rbuf_cap);
     conn->wbuf_size = 0;
     conn->wbuf_sent = 0;
     conn_put(fd2conn, conn);
+    g_stats.conns++;
+    g_stats.conns_total++;
     return 0;
 }
 
@@ -174,249 +470,4355 @@ static int32_t accept_new_conn(std::vector<Conn *> &fd2conn, int fd) {
 //     return write_all(connfd, wbuf, 4 + len);
 // }
 
-static bool try_one_request(Conn *conn) {
-    // try to parse a request from the buffer
-    if (conn->rbuf_size < 4) {
-        // not enough data in the buffer
-        return false;
-    }
+static bool str2u64(const std::string &s, uint64_t &out) {
+    char *endp = NULL;
+    errno = 0;
+    out = strtoull(s.c_str(), &endp, 10);
+    return !s.empty() && s[0] != '-' && errno == 0 && endp == s.c_str() + s.size();
+}
 
-    uint32_t len = 0;
-    memcpy(&len, &conn->rbuf[0], 4); 
-    if (len > k_max_msg) {
-        msg("too long");
-        conn->state = STATE_END;
-        return false;
-    }
+/*
+The keyspace. Every value carries a type tag so commands can refuse keys of
+the wrong type instead of misinterpreting their bytes.
+*/
+enum {
+    T_STR = 0,
+    T_HLL = 1,
+    T_STREAM = 2,
+};
 
-    if (4 + len > conn->rbuf_size) {
-        // not enough data in the buffer
-        return false;
+struct Entry {
+    HNode node;     // hashtable node
+    DList slot_node;    // the keys of a slot, in cluster mode
+    std::string key;
+    uint32_t type = T_STR;
+    std::string val;
+    Stream *stream = NULL;
+    ZcPin *zc = NULL;   // `val` is being sent by zero-copy replies
+};
+
+static void entry_free(Entry *ent) {
+    if (ent->stream) {
+        stream_free(ent->stream);
     }
+    delete ent;
+}
 
-    // got one request, do something with it
-    printf("Client says: %.*s\n", len, &conn->rbuf[4]);
+// rough size of a value, decides whether it is freed inline or lazily
+static size_t entry_mem_estimate(Entry *ent) {
+    size_t bytes = sizeof(Entry) + ent->key.capacity() + ent->val.capacity();
+    if (ent->stream) {
+        bytes += ent->stream->index.bytes
+            + ent->stream->nblocks * (sizeof(StreamBlock) + k_stream_block_max_bytes);
+    }
+    return bytes;
+}
 
-    // generating echoing response
-    memcpy(&conn->wbuf[0], &len, 4);
-    memcpy(&conn->wbuf[4], &conn->rbuf[4], len);
-    conn->wbuf_size = 4 + len;
+static void entry_free_cb(void *arg) {
+    entry_free((Entry *)arg);
+}
 
-    // remove the request from the buffer.
-    // note: frequent memmove is inefficient.
-    // note: need better handling for production code.
-    size_t remain = conn->rbuf_size - 4 - len;
-    if (remain) {
-        memmove(conn->rbuf, &conn->rbuf[4 + len], remain);
-    }
-    conn->rbuf_size = remain;
+static void string_free_cb(void *arg) {
+    delete (std::string *)arg;
+}
 
-    // change state
-    conn->state = STATE_RES;
-    state_res(conn);
+/*
+A string value lent to the kernel by zero-copy replies (--zerocopy). Its
+bytes must stay as they are until every send pointing at them completed, so
+a write or a delete of the key meanwhile moves the string out to `orphan`
+(the buffer itself doesn't move) instead of changing or freeing it.
+*/
+struct ZcPin {
+    Entry *ent = NULL;      // NULL once the key let go of the value
+    std::string orphan;
+    const char *data = NULL;
+    size_t len = 0;
+    uint32_t refs = 0;      // the replies queued and the sends in flight
+};
 
-    // continue the outer loop if the request was fully processed
-    return (conn->state == STATE_REQ);
+static ZcPin *zc_pin(Entry *ent) {
+    ZcPin *pin = ent->zc;
+    if (!pin) {
+        pin = ent->zc = new ZcPin();
+        pin->ent = ent;
+        pin->data = ent->val.data();
+        pin->len = ent->val.size();
+        g_stats.zc_pins++;
+    }
+    pin->refs++;
+    return pin;
 }
 
-/**
- * @brief Attempt to read data from the connection's file descriptor into the read buffer.
- *
- * This function performs non-blocking I/O operations to fill the read buffer (`rbuf`) associated 
- * with a connection. It ensures that the buffer is not overfilled and gracefully handles various 
- * edge cases such as interrupted system calls (EINTR) and temporary unavailability of data (EAGAIN).
- * 
- * The function also checks for EOF conditions and updates the connection's state accordingly.
- * If the buffer contains enough data for one or more complete requests, it processes each request 
- * sequentially (pipelining) by calling `try_one_request()` in a loop. The connection state transitions
- * based on the successful processing of data (from `STATE_REQ` to `STATE_RES` or `STATE_END`).
- *
- * @param conn Pointer to the connection structure containing the state and buffers.
- * @return true if the connection is still in the `STATE_REQ` state and ready for further reading.
- * @return false if the connection has encountered an error, reached EOF, or moved to another state.
- */
-static bool try_fill_buffer(Conn *conn) {
-    // try to fill the buffer
-    assert(conn->rbuf_size < sizeof(conn->rbuf));
-    ssize_t rv = 0;
-    do{
-        size_t cap = sizeof(conn->rbuf) - conn->rbuf_size; // remaining capacity in buffer
-        rv = read(conn->fd, &conn->rbuf[conn->rbuf_size], cap); // reading data from current buffer position
-    } while (rv < 0 && errno == EINTR);
-    if (rv < 0 && errno == EAGAIN) {
-        // got EAGAIN, stop
-        return false;
+static void zc_unpin(ZcPin *pin) {
+    assert(pin->refs > 0);
+    if (--pin->refs) {
+        return;
+    }
+    if (pin->ent) {
+        pin->ent->zc = NULL;
     }
+    g_stats.zc_pins--;
+    delete pin;
+}
 
-    if (rv < 0) {
-        msg("read() error");
-        conn->state = STATE_END;
-        return false;
+// before the value changes: the sends keep the old bytes, the entry gets
+// an empty string, or a copy if `keep`
+static void entry_unpin(Entry *ent, bool keep) {
+    ZcPin *pin = ent->zc;
+    if (!pin) {
+        return;
+    }
+    pin->orphan.swap(ent->val);
+    if (keep) {
+        ent->val = pin->orphan;
     }
+    pin->ent = NULL;
+    ent->zc = NULL;
+}
 
-    if (rv == 0) { // Connection is closed (EOF)
-        if (conn->rbuf_size > 0) {
-            msg("Unexpected EOF");
-        } else {
-            msg("EOF");
-        }
-        conn->state = STATE_END;
-        return false;
+// the key is already detached from the keyspace, only the memory is left
+static void entry_dispose(Entry *ent, bool lazy) {
+    entry_unpin(ent, false);
+    size_t bytes = lazy ? entry_mem_estimate(ent) : 0;
+    if (lazy && bytes >= k_lazyfree_threshold) {
+        lazyfree_submit(&entry_free_cb, ent, bytes);
+    } else {
+        entry_free(ent);
     }
+}
 
-    // if read succeeds, conn->rbuf_size is updated by number of bytes read
-    conn->rbuf_size += (size_t)rv;
-    assert(conn->rbuf_size <= sizeof(conn->rbuf)); // to make sure new buffer size doesn't exceed the total buffer capacity
+static struct {
+    HMap db;
+    // optional ordered index of the key names (--key-index), it lets KEYS
+    // visit only the keys under the literal prefix of the pattern
+    bool key_index_enabled = false;
+    Rax key_index;
+    // free large values on the reclaim thread (--lazyfree-del, --lazyfree-overwrite).
+    // UNLINK is always lazy.
+    bool lazyfree_del = false;
+    bool lazyfree_overwrite = false;
+    // snapshots
+    std::string snapshot_path = "dump.snap";
+    pid_t bgsave_pid = -1;
+    int bgsave_pipe = -1;       // the child reports its stats through it
+    time_t last_save_time = 0;
+    bool last_save_ok = true;
+    SnapStats last_save;
+    uint64_t last_cow_bytes = 0;
+    // append-only log (--appendonly)
+    bool aof_enabled = false;
+    std::string aof_path;
+    uint32_t aof_fsync = AOF_FSYNC_EVERYSEC;
+    std::vector<Conn *> aof_waiters;    // replies held until the next group commit
+    pid_t aof_rewrite_pid = -1;
+    bool last_rewrite_ok = true;
+    // set by a command that rewrote its arguments into what should be logged
+    bool cmd_rewritten = false;
+    // GET may answer with the header of its reply only and leave the value in
+    // `zc_reply`, the connection sends it by reference (--zerocopy)
+    bool zc_reply_ok = false;
+    Entry *zc_reply = NULL;
+    std::vector<ZcLinger *> zc_lingering;
+    // the frame of the running write command, for the log and the followers
+    std::string prop;
+    // replication, leader side. The backlog is created by the first sync,
+    // its end is the stream offset.
+    uint16_t port = 1234;
+    std::string unixsocket;     // --unixsocket
+    std::string replid;
+    ReplBacklog backlog;
+    size_t backlog_size = 1 << 20;
+    std::vector<Conn *> followers;
+    uint64_t bgsave_repl_off = UINT64_MAX;  // at the fork, if the backlog existed
+    uint64_t repl_cron_ms = 0;
+    uint64_t repl_off_mark = 0;
+    uint64_t repl_bytes_per_sec = 0;
+    uint64_t repl_full_syncs = 0;
+    uint64_t repl_partial_syncs = 0;
+    // cluster mode (--cluster): the keys of every slot, so a slot can be
+    // migrated without scanning the keyspace
+    bool cluster_enabled = false;
+    std::vector<DList> slot_keys;
+    std::vector<uint32_t> slot_count;
+    // the keys sent to the target of a migration and not yet acknowledged,
+    // out of the keyspace meanwhile
+    std::vector<Entry *> migrate_batch;
+    int32_t migrate_batch_slot = -1;
+    // threaded I/O (--io-threads): the replies to what a read brought pile
+    // up in `wbuf` and go out together from the I/O threads
+    bool batch_replies = false;
+    // a command that used up its slice leaves the rest in `job`, continued
+    // by the loop (only from a client, when `job_ok`). The jobs in flight,
+    // and the clients waiting for them in arrival order.
+    bool job_ok = false;
+    Job *job = NULL;
+    std::deque<Job *> jobs;
+    std::deque<Conn *> job_waiters;
+    // blocking reads: the waiters by key, the keys that got entries since
+    // they were served, and the deadlines of the waiters (a min-heap). A read
+    // that found nothing leaves a Block in `block` (only from a client, when
+    // `block_ok`); a woken client runs again with its IDs, `block_ids`.
+    HMap blocking_keys;
+    std::deque<std::string> ready_keys;
+    std::vector<Block *> block_timers;
+    bool block_ok = false;
+    Block *block = NULL;
+    const std::vector<StreamID> *block_ids = NULL;
+} g_data;
 
-    // Try to process requests one by one
-    // Why is there a loop ? "Pipelining", handling multiple requests from client in single read
-    while (try_one_request(conn)) {}
-    return (conn->state == STATE_REQ);
+// a key to look up, without building an Entry
+struct LookupKey {
+    HNode node;
+    const std::string *key;
+};
 
+static bool entry_eq(HNode *node, HNode *key) {
+    Entry *ent = container_of(node, Entry, node);
+    LookupKey *lk = container_of(key, LookupKey, node);
+    return ent->key == *lk->key;
 }
 
-/**
- * @brief Handle the request processing state (`STATE_REQ`) for a connection.
- *
- * This function is responsible for managing the connection when it is in the request-handling phase.
- * It continuously attempts to fill the read buffer by calling `try_fill_buffer()` until the buffer
- * can no longer be filled or the connection transitions to another state (e.g., `STATE_RES` or `STATE_END`).
- *
- * @param conn Pointer to the connection structure containing the state and buffers.
- */
-static void state_req(Conn *conn) {
-    while (try_fill_buffer(conn)) {} // Keep filling the buffer as long as there is room and data
+static void lookup_key_init(LookupKey *lk, const std::string &key) {
+    lk->node.hcode = str_hash((const uint8_t *)key.data(), key.size());
+    lk->key = &key;
 }
 
-static bool try_flush_buffer(Conn *conn) {
-    ssize_t rv = 0;
-    do {
-        size_t remain = conn->wbuf_size - conn->wbuf_sent;
-        rv = write(conn->fd, &conn->wbuf[conn->wbuf_sent], remain);
-    } while (rv < 0 && errno == EINTR);
+static Entry *entry_lookup(const std::string &key) {
+    LookupKey lk;
+    lookup_key_init(&lk, key);
+    HNode *node = hm_lookup(&g_data.db, &lk.node, &entry_eq);
+    return node ? container_of(node, Entry, node) : NULL;
+}
 
-    if (rv < 0) {
-        msg("write() error");
-        conn->state = STATE_END;
-        return false;
-    }
+// allocate an entry without adding it to the keyspace
+static Entry *entry_new(const std::string &key, uint32_t type) {
+    Entry *ent = new Entry();
+    ent->key = key;
+    ent->type = type;
+    ent->node.hcode = str_hash((const uint8_t *)key.data(), key.size());
+    return ent;
+}
 
-    conn->wbuf_sent += (size_t)rv;
-    assert(conn->wbuf_sent <= conn->wbuf_size);
+// the indexes besides the hashtable
+static void entry_index(Entry *ent) {
+    if (g_data.key_index_enabled) {
+        rax_insert(&g_data.key_index, (const uint8_t *)ent->key.data(), ent->key.size(), ent, NULL);
+    }
+    if (g_data.cluster_enabled) {
+        uint16_t slot = key_hash_slot(ent->key.data(), ent->key.size());
+        dlist_insert_before(&g_data.slot_keys[slot], &ent->slot_node);
+        g_data.slot_count[slot]++;
+    }
+}
 
-    if (conn->wbuf_sent == conn->wbuf_size) {
-        // response was fully sent, change state back
-        conn->state = STATE_REQ;
-        conn->wbuf_sent = 0;
-        conn->wbuf_size = 0;
-        return false;
+static void entry_unindex(Entry *ent) {
+    if (g_data.key_index_enabled) {
+        rax_remove(&g_data.key_index, (const uint8_t *)ent->key.data(), ent->key.size(), NULL);
+    }
+    if (g_data.cluster_enabled) {
+        dlist_detach(&ent->slot_node);
+        g_data.slot_count[key_hash_slot(ent->key.data(), ent->key.size())]--;
     }
+}
 
-    // still got some data in wbuf, could try to write again
-    return true;
+static void entry_attach(Entry *ent) {
+    hm_insert(&g_data.db, &ent->node);
+    entry_index(ent);
 }
 
-static void state_res(Conn *conn) {
-    while (try_flush_buffer(conn)) {}
+static Entry *entry_create(const std::string &key, uint32_t type) {
+    Entry *ent = entry_new(key, type);
+    entry_attach(ent);
+    return ent;
 }
 
-static void connection_io(Conn *conn) {
-    if (conn->state == STATE_REQ) {
-        state_req(conn);
-    } else if (conn->state == STATE_RES) {
-        state_res(conn);
-    } else {
-        assert(0); // not expected
+// take a key out of the keyspace, the entry is left to the caller
+static Entry *entry_detach(const std::string &key) {
+    LookupKey lk;
+    lookup_key_init(&lk, key);
+    HNode *node = hm_delete(&g_data.db, &lk.node, &entry_eq);
+    if (!node) {
+        return NULL;
     }
+    Entry *ent = container_of(node, Entry, node);
+    entry_unindex(ent);
+    return ent;
 }
 
-int main() {
-    int fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (fd < 0) {
-        die("socket()");
+static void block_signal_deleted(const std::string &key);
+
+static bool entry_delete(const std::string &key, bool lazy) {
+    Entry *ent = entry_detach(key);
+    if (!ent) {
+        return false;
     }
+    entry_dispose(ent, lazy);
+    block_signal_deleted(key);
+    return true;
+}
 
-    // this is needed for most server applications
-    int val = 1;
-    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+static bool collect_entry_cb(HNode *node, void *arg) {
+    ((std::vector<Entry *> *)arg)->push_back(container_of(node, Entry, node));
+    return true;
+}
 
-    // bind
-    struct sockaddr_in addr = {};
-    addr.sin_family = AF_INET;
-    addr.sin_port = ntohs(1234);
-    addr.sin_addr.s_addr = ntohl(0);    // wildcard address 0.0.0.0
-    int rv = bind(fd, (const sockaddr *)&addr, sizeof(addr));
-    if (rv) {
-        die("bind()");
+// empty the keyspace, large values are freed in the background
+static void keyspace_clear() {
+    std::vector<Entry *> ents;
+    hm_foreach(&g_data.db, &collect_entry_cb, &ents);
+    hm_clear(&g_data.db);
+    if (g_data.key_index_enabled) {
+        rax_clear(&g_data.key_index, NULL);
+        rax_init(&g_data.key_index);
     }
-
-    // listen
-    rv = listen(fd, SOMAXCONN);
-    if (rv) {
-        die("listen()");
+    for (uint32_t slot = 0; slot < g_data.slot_keys.size(); ++slot) {
+        dlist_init(&g_data.slot_keys[slot]);
+        g_data.slot_count[slot] = 0;
+    }
+    for (Entry *ent : ents) {
+        entry_dispose(ent, true);
     }
+}
 
-    // a map of all client connections, keyed by fd
-    vector<Conn*> fd2conn;
-    
-    // set the listen fd to non-blocking mode
-    fd_set_nb(fd);
+/*
+Commands that can take long run in slices: KEYS over the whole keyspace,
+XRANGE and XREAD over a large stream. Such a command keeps where it is in a
+Job and `step` continues it until the slice's deadline. The first slice runs
+with the request, the next ones between turns of the loop (jobs_run()), so no
+command holds the loop much longer than --command-slice-usec and the other
+clients are served in between. The reply is built in the job and goes out
+whole once it is done.
 
-    // the event loop
-    vector<pollfd> poll_args;
-    
-    while (true) {
-        // prepare the arguments of the poll()
-        poll_args.clear();
+The command stays atomic: what a job reads (every key for KEYS) doesn't
+change until it is done. A client's write to one of its keys waits, with the
+request left in the read buffer, and the client goes on once the job is
+over. Writes that can't wait (the leader's stream, a resync, a slot
+migration) run the jobs in their way to the end first, see jobs_complete().
+*/
+struct Command;
 
-        // for convenience, the listening fd is put in the first position
-        struct pollfd pfd = {fd, POLLIN, 0};
-        poll_args.push_back(pfd);
+struct Job {
+    Conn *conn = NULL;
+    const Command *c = NULL;
+    std::vector<std::string> cmd;
+    bool (*step)(Job *job) = NULL;  // true once done
+    bool done = false;
+    bool all_keys = false;          // KEYS: no write may run
+    std::vector<std::string> keys;  // what it reads otherwise
+    uint64_t deadline = 0;          // of the slice, in clock ticks; 0: none
+    uint64_t ticks = 0;             // in its slices so far
+    std::string out;                // the length of the reply, then the reply so far
+    // where the command is
+    size_t ctx = 0;                 // the array being written, see out_begin_arr()
+    uint32_t n = 0;                 // its elements so far
+    uint64_t cursor = 0;            // KEYS: of hm_scan()
+    RaxIter rax_it;                 // KEYS with --key-index
+    size_t plen = 0;
+    bool in_range = false;          // XRANGE, XREAD: a range of a stream
+    StreamIter stream_it;
+    uint64_t count = UINT64_MAX;
+    size_t range_ctx = 0;
+    uint32_t range_n = 0;
+    size_t first_key = 0;           // XREAD: the streams, in `cmd` from there
+    size_t next = 0;
+    std::vector<StreamID> ids;
+};
 
-        // connection fds
-        for (Conn *conn : fd2conn) {
-            if (!conn) {
-                continue;
+static void jobs_complete(const Command *c, std::vector<std::string> *cmd);
+
+// the steps look at the clock every so many elements
+const uint32_t k_job_check_every = 32;
+
+static bool job_yield(Job *job) {
+    return job->deadline && clock_ticks() >= job->deadline;
+}
+
+static Job *job_new(std::vector<std::string> &cmd, bool (*step)(Job *)) {
+    Job *job = new Job();
+    job->cmd = cmd;
+    job->step = step;
+    job->out.append(4, '\0');
+    return job;
+}
+
+// the first slice, with the request. Done: the reply goes to `out`.
+// Otherwise the rest is left in `g_data.job` for the loop, or runs to the
+// end right away when no client waits for it (the log, the leader's stream).
+static void job_start(Job *job, std::string &out) {
+    job->deadline = g_data.job_ok && g_slice_ticks ? clock_ticks() + g_slice_ticks : 0;
+    if (!job->step(job)) {
+        g_data.job = job;
+        return;
+    }
+    out.append(job->out, 4, std::string::npos);
+    delete job;
+}
+
+static void keys_scan_cb(HNode *node, void *arg) {
+    Job *job = (Job *)arg;
+    Entry *ent = container_of(node, Entry, node);
+    const std::string &pat = job->cmd[1];
+    if (glob_match(pat.data(), pat.size(), ent->key.data(), ent->key.size())) {
+        out_str(job->out, ent->key);
+        job->n++;
+    }
+}
+
+// the keyspace can't change meanwhile, so the cursor of hm_scan() neither
+// misses nor repeats a key, even while the table is being resized
+static bool keys_step(Job *job) {
+    const std::string &pat = job->cmd[1];
+    if (g_data.key_index_enabled) {
+        // only the subtree under the literal prefix can match
+        RaxIter *it = &job->rax_it;
+        for (uint32_t i = 1; rax_next(it); ++i) {
+            if (it->key.compare(0, job->plen, pat, 0, job->plen) != 0) {
+                break;
             }
-            struct pollfd pfd = {};
-            pfd.fd = conn->fd;
-            if (conn->state == STATE_REQ) {
-                pfd.events = POLLIN;
-            } else {
-                pfd.events = POLLOUT;
+            if (glob_match(pat.data(), pat.size(), it->key.data(), it->key.size())) {
+                out_str(job->out, it->key);
+                job->n++;
+            }
+            if (i % k_job_check_every == 0 && job_yield(job)) {
+                return false;
             }
-            // pfd.events = (conn->state == STATE_REQ) ? POLLIN : POLLOUT;
-            pfd.events = pfd.events | POLLERR;
-            poll_args.push_back(pfd);
         }
-
-        // poll for active fds
-        // the timeout argument doesn't matter here
-        int rv = poll(poll_args.data(), (nfds_t)poll_args.size(), 1000);
-        if (rv < 0) {
-            die("poll");
+    } else {
+        do {
+            job->cursor = hm_scan(&g_data.db, job->cursor, k_job_check_every, &keys_scan_cb, job);
+        } while (job->cursor != 0 && !job_yield(job));
+        if (job->cursor != 0) {
+            return false;
         }
+    }
+    out_end_arr(job->out, job->ctx, job->n);
+    return true;
+}
 
-        // process active connections
-        for (size_t i = 1; i < poll_args.size(); ++i) {
-            if (poll_args[i].revents) {
-                Conn *conn = fd2conn[poll_args[i].fd];
-                connection_io(conn);
-                if (conn->state == STATE_END) {
+// KEYS pattern
+static void do_keys(std::vector<std::string> &cmd, std::string &out) {
+    Job *job = job_new(cmd, &keys_step);
+    job->all_keys = true;
+    job->ctx = out_begin_arr(job->out);
+    if (g_data.key_index_enabled) {
+        job->plen = glob_literal_prefix(cmd[1].data(), cmd[1].size());
+        rax_seek(&job->rax_it, &g_data.key_index, (const uint8_t *)cmd[1].data(), job->plen);
+    }
+    job_start(job, out);
+}
+
+static const char *type_name(uint32_t type) {
+    switch (type) {
+    case T_STR:     return "string";
+    case T_HLL:     return "hyperloglog";
+    case T_STREAM:  return "stream";
+    default:        return "unknown";
+    }
+}
+
+// SCAN cursor [MATCH pattern] [COUNT count] [TYPE type]
+static void do_scan(std::vector<std::string> &cmd, std::string &out) {
+    uint64_t cursor = 0;
+    if (!str2u64(cmd[1], cursor)) {
+        return out_err(out, ERR_ARG, "invalid cursor");
+    }
+    const std::string *pat = NULL;
+    const std::string *type = NULL;
+    uint64_t count = 10;
+    for (size_t i = 2; i < cmd.size(); i += 2) {
+        if (i + 1 >= cmd.size()) {
+            return out_err(out, ERR_ARG, "syntax error");
+        }
+        if (strcasecmp(cmd[i].c_str(), "match") == 0) {
+            pat = &cmd[i + 1];
+        } else if (strcasecmp(cmd[i].c_str(), "count") == 0) {
+            if (!str2u64(cmd[i + 1], count) || count == 0) {
+                return out_err(out, ERR_ARG, "expect positive int");
+            }
+        } else if (strcasecmp(cmd[i].c_str(), "type") == 0) {
+            type = &cmd[i + 1];
+        } else {
+            return out_err(out, ERR_ARG, "syntax error");
+        }
+    }
+
+    // collect a bounded number of slots, filter afterwards
+    std::vector<Entry *> found;
+    cursor = hm_scan(&g_data.db, cursor, count, [](HNode *node, void *arg) {
+        ((std::vector<Entry *> *)arg)->push_back(container_of(node, Entry, node));
+    }, &found);
+
+    out_arr(out, 2);
+    out_str(out, std::to_string(cursor));
+    size_t ctx = out_begin_arr(out);
+    uint32_t n = 0;
+    for (Entry *ent : found) {
+        if (pat && !glob_match(pat->data(), pat->size(), ent->key.data(), ent->key.size())) {
+            continue;
+        }
+        if (type && strcasecmp(type->c_str(), type_name(ent->type)) != 0) {
+            continue;
+        }
+        out_str(out, ent->key);
+        n++;
+    }
+    out_end_arr(out, ctx, n);
+}
+
+static void do_get(std::vector<std::string> &cmd, std::string &out) {
+    Entry *ent = entry_lookup(cmd[1]);
+    if (!ent) {
+        return out_nil(out);
+    }
+    if (ent->type != T_STR) {
+        return out_err(out, ERR_TYPE, "expect string type");
+    }
+    if (g_data.zc_reply_ok && ent->val.size() >= g_zc_threshold && ent->val.size() < k_max_res) {
+        uint32_t len = (uint32_t)ent->val.size();
+        out.push_back(SER_STR);
+        out.append((char *)&len, 4);
+        g_data.zc_reply = ent;
+        return;
+    }
+    out_str(out, ent->val);
+}
+
+static void do_set(std::vector<std::string> &cmd, std::string &out) {
+    Entry *ent = entry_lookup(cmd[1]);
+    if (ent && ent->type != T_STR) {
+        entry_delete(cmd[1], g_data.lazyfree_overwrite);
+        ent = NULL;
+    }
+    if (!ent) {
+        ent = entry_create(cmd[1], T_STR);
+    }
+    entry_unpin(ent, false);
+    if (g_data.lazyfree_overwrite && ent->val.capacity() >= k_lazyfree_threshold) {
+        std::string *old = new std::string();
+        old->swap(ent->val);
+        lazyfree_submit(&string_free_cb, old, old->capacity());
+    }
+    ent->val.swap(cmd[2]);
+    out_nil(out);
+}
+
+// APPEND key value, returns the new length. Builds the values larger than a
+// request can carry.
+static void do_append(std::vector<std::string> &cmd, std::string &out) {
+    Entry *ent = entry_lookup(cmd[1]);
+    if (ent && ent->type != T_STR) {
+        return out_err(out, ERR_TYPE, "expect string type");
+    }
+    if (!ent) {
+        ent = entry_create(cmd[1], T_STR);
+    }
+    entry_unpin(ent, true);
+    ent->val.append(cmd[2]);
+    out_int(out, (int64_t)ent->val.size());
+}
+
+static void do_del(std::vector<std::string> &cmd, std::string &out) {
+    int64_t n = 0;
+    for (size_t i = 1; i < cmd.size(); ++i) {
+        n += entry_delete(cmd[i], g_data.lazyfree_del) ? 1 : 0;
+    }
+    out_int(out, n);
+}
+
+// UNLINK key..., like DEL but large values are freed in the background
+static void do_unlink(std::vector<std::string> &cmd, std::string &out) {
+    int64_t n = 0;
+    for (size_t i = 1; i < cmd.size(); ++i) {
+        n += entry_delete(cmd[i], true) ? 1 : 0;
+    }
+    out_int(out, n);
+}
+
+static void info_replication(std::string &info) {
+    char buf[512];
+    int n = 0;
+    if (repl_link_enabled()) {
+        ReplLinkStats link;
+        repl_link_get_stats(&link);
+        n = snprintf(buf, sizeof(buf),
+            "# Replication\r\n"
+            "role:follower\r\n"
+            "leader_host:%s\r\n"
+            "leader_port:%u\r\n"
+            "link_status:%s\r\n"
+            "replid:%s\r\n"
+            "repl_offset:%llu\r\n"
+            "lag_ms:%lld\r\n"
+            "last_io_age_ms:%llu\r\n"
+            "repl_bytes_per_sec:%llu\r\n"
+            "sync_transfer_bytes:%llu\r\n"
+            "sync_transfer_size:%llu\r\n"
+            "full_syncs:%llu\r\n"
+            "partial_syncs:%llu\r\n",
+            link.host.c_str(), (unsigned)link.port,
+            repl_state_name(link.state),
+            link.replid.c_str(),
+            (unsigned long long)link.offset,
+            (long long)link.lag_ms,
+            (unsigned long long)link.last_io_age_ms,
+            (unsigned long long)link.bytes_per_sec,
+            (unsigned long long)link.transfer_bytes,
+            (unsigned long long)link.transfer_size,
+            (unsigned long long)link.full_syncs,
+            (unsigned long long)link.partial_syncs);
+        info.append(buf, (size_t)n);
+        return;
+    }
+
+    const ReplBacklog *b = &g_data.backlog;
+    n = snprintf(buf, sizeof(buf),
+        "# Replication\r\n"
+        "role:leader\r\n"
+        "replid:%s\r\n"
+        "repl_offset:%llu\r\n"
+        "repl_backlog_active:%d\r\n"
+        "repl_backlog_size:%zu\r\n"
+        "repl_backlog_first_offset:%llu\r\n"
+        "repl_bytes_per_sec:%llu\r\n"
+        "full_syncs:%llu\r\n"
+        "partial_syncs:%llu\r\n"
+        "connected_followers:%zu\r\n",
+        g_data.replid.c_str(),
+        (unsigned long long)b->end_off,
+        backlog_active(b) ? 1 : 0,
+        b->buf.size(),
+        (unsigned long long)(backlog_active(b) ? backlog_first_off(b) : 0),
+        (unsigned long long)g_data.repl_bytes_per_sec,
+        (unsigned long long)g_data.repl_full_syncs,
+        (unsigned long long)g_data.repl_partial_syncs,
+        g_data.followers.size());
+    info.append(buf, (size_t)n);
+    uint64_t now_ms = get_monotonic_usec() / 1000;
+    for (size_t i = 0; i < g_data.followers.size(); ++i) {
+        Conn *conn = g_data.followers[i];
+        Follower *f = conn->follower;
+        n = snprintf(buf, sizeof(buf),
+            "follower%zu:addr=%s,state=%s,ack_offset=%llu,lag_bytes=%llu,ack_age_ms=%llu,pending_bytes=%zu\r\n",
+            i, f->addr.c_str(), follower_state_name(f->state),
+            (unsigned long long)f->ack_off,
+            (unsigned long long)(b->end_off - f->ack_off),
+            (unsigned long long)(now_ms - f->ack_ms),
+            conn->wbuf.size() - conn->wbuf_sent);
+        info.append(buf, (size_t)n);
+    }
+}
+
+static void info_cluster(std::string &info) {
+    if (!g_data.cluster_enabled) {
+        info.append("# Cluster\r\ncluster_enabled:0\r\n");
+        return;
+    }
+    ClusterStats st;
+    cluster_get_stats(&st);
+    char buf[1024];
+    int n = snprintf(buf, sizeof(buf),
+        "# Cluster\r\n"
+        "cluster_enabled:1\r\n"
+        "cluster_self:%s\r\n"
+        "cluster_slots_assigned:%u\r\n"
+        "cluster_slots_owned:%u\r\n"
+        "cluster_slots_migrating:%u\r\n"
+        "cluster_slots_importing:%u\r\n"
+        "migrate_state:%s\r\n"
+        "migrate_slot:%d\r\n"
+        "migrate_batch_keys:%zu\r\n"
+        "slots_migrated:%llu\r\n"
+        "keys_migrated:%llu\r\n"
+        "migrate_batches:%llu\r\n"
+        "migrate_bytes:%llu\r\n"
+        "migrate_errors:%llu\r\n",
+        cluster_self().c_str(),
+        st.slots_assigned, st.slots_owned, st.slots_migrating, st.slots_importing,
+        st.migrate_state,
+        st.migrate_slot,
+        g_data.migrate_batch.size(),
+        (unsigned long long)st.slots_migrated,
+        (unsigned long long)st.keys_migrated,
+        (unsigned long long)st.batches,
+        (unsigned long long)st.bytes_migrated,
+        (unsigned long long)st.migrate_errors);
+    info.append(buf, (size_t)n);
+}
+
+// resident set size, from /proc
+static uint64_t get_rss_bytes() {
+    uint64_t pages = 0, rss = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (!fp) {
+        return 0;
+    }
+    if (fscanf(fp, "%lu %lu", &pages, &rss) != 2) {
+        rss = 0;
+    }
+    fclose(fp);
+    return rss * (uint64_t)sysconf(_SC_PAGESIZE);
+}
+
+// with the command table
+static uint64_t command_calls();
+static void info_commandstats(std::string &info);
+
+static double ticks_to_usec(uint64_t ticks) {
+    return (double)clock_ticks_to_ns(ticks) / 1000.0;
+}
+
+// the phases of the event loop, and the system calls per command
+static void info_loop(std::string &info) {
+    uint64_t loop_ticks = 0;
+    for (uint64_t t : g_stats.phase_ticks) {
+        loop_ticks += t;
+    }
+    info.append("# Loop\r\n");
+    char buf[512];
+    for (uint32_t i = 0; i < LOOP_NPHASES; ++i) {
+        const Histogram *h = &g_stats.phase_hist[i];
+        int n = snprintf(buf, sizeof(buf),
+            "loop_%s:usec=%.0f,pct=%.2f,iterations=%llu,p50_usec=%.2f,p99_usec=%.2f,max_usec=%.2f\r\n",
+            k_loop_phase_names[i],
+            ticks_to_usec(g_stats.phase_ticks[i]),
+            loop_ticks ? 100.0 * (double)g_stats.phase_ticks[i] / (double)loop_ticks : 0.0,
+            (unsigned long long)h->total,
+            ticks_to_usec(hist_percentile(h, 50)),
+            ticks_to_usec(hist_percentile(h, 99)),
+            ticks_to_usec(h->total ? h->max : 0));
+        info.append(buf, (size_t)n);
+    }
+    uint64_t cmds = command_calls();
+    uint64_t calls = g_stats.poll_calls + g_stats.read_calls + g_stats.write_calls + g_stats.accept_calls;
+    const Histogram *rb = &g_stats.read_bytes;
+    const Histogram *wb = &g_stats.write_bytes;
+    int n = snprintf(buf, sizeof(buf),
+        "syscalls:poll=%llu,read=%llu,write=%llu,accept=%llu\r\n"
+        "syscalls_per_command:%.3f\r\n"
+        "commands_per_read:%.2f\r\n"
+        "read_bytes:avg=%.1f,p50=%llu,p99=%llu,max=%llu\r\n"
+        "write_bytes:avg=%.1f,p50=%llu,p99=%llu,max=%llu\r\n",
+        (unsigned long long)g_stats.poll_calls,
+        (unsigned long long)g_stats.read_calls,
+        (unsigned long long)g_stats.write_calls,
+        (unsigned long long)g_stats.accept_calls,
+        cmds ? (double)calls / (double)cmds : 0.0,
+        rb->total ? (double)cmds / (double)rb->total : 0.0,
+        hist_mean(rb), (unsigned long long)hist_percentile(rb, 50), (unsigned long long)hist_percentile(rb, 99),
+        (unsigned long long)(rb->total ? rb->max : 0),
+        hist_mean(wb), (unsigned long long)hist_percentile(wb, 50), (unsigned long long)hist_percentile(wb, 99),
+        (unsigned long long)(wb->total ? wb->max : 0));
+    info.append(buf, (size_t)n);
+}
+
+static void info_stats(std::string &info) {
+    struct mallinfo2 mi = mallinfo2();
+    const HMap *db = &g_data.db;
+    uint64_t poll_ticks = g_stats.phase_ticks[LOOP_POLL];
+    uint64_t loop_ticks = 0;
+    for (uint64_t t : g_stats.phase_ticks) {
+        loop_ticks += t;
+    }
+    char buf[2048];
+    int n = snprintf(buf, sizeof(buf),
+        "# Server\r\n"
+        "uptime_sec:%llu\r\n"
+        "clock:%s\r\n"
+        "clock_ticks_per_usec:%.1f\r\n"
+        "io_threads:%zu\r\n"
+        "# Clients\r\n"
+        "connected_clients:%llu\r\n"
+        "shm_clients:%llu\r\n"
+        "blocked_clients:%llu\r\n"
+        "total_connections:%llu\r\n"
+        "# Memory\r\n"
+        "used_memory_rss:%llu\r\n"
+        "heap_in_use:%zu\r\n"
+        "heap_free:%zu\r\n"
+        "heap_mmapped:%zu\r\n"
+        "keyspace_slots:%zu\r\n"
+        "keyspace_rehashing:%d\r\n"
+        "# Stats\r\n"
+        "total_commands:%llu\r\n"
+        "rejected_commands:%llu\r\n"
+        "net_input_bytes:%llu\r\n"
+        "net_output_bytes:%llu\r\n"
+        "reads:%llu\r\n"
+        "writes:%llu\r\n"
+        "io_threaded_batches:%llu\r\n"
+        "zerocopy_sends:%llu\r\n"
+        "zerocopy_copied:%llu\r\n"
+        "zerocopy_values_pinned:%llu\r\n"
+        "client_turns_deferred:%llu\r\n"
+        "client_output_limit_drops:%llu\r\n"
+        "sliced_commands:%llu\r\n"
+        "sliced_commands_running:%llu\r\n"
+        "sliced_command_waits:%llu\r\n"
+        "blocked_reads:%llu\r\n"
+        "blocked_read_timeouts:%llu\r\n"
+        "loop_iterations:%llu\r\n"
+        "loop_ready_fds_avg:%.2f\r\n"
+        "loop_ready_fds_p99:%llu\r\n"
+        "loop_ready_fds_max:%llu\r\n"
+        "loop_poll_usec:%.0f\r\n"
+        "loop_busy_usec:%.0f\r\n"
+        "loop_busy_pct:%.1f\r\n",
+        (unsigned long long)(get_monotonic_usec() / 1000 - g_stats.start_ms) / 1000,
+        g_clock_tsc ? "tsc" : "monotonic",
+        g_clock_ticks_per_ns * 1000.0,
+        iothreads_count(),
+        (unsigned long long)g_stats.conns,
+        (unsigned long long)g_stats.shm_conns,
+        (unsigned long long)g_stats.blocked,
+        (unsigned long long)g_stats.conns_total,
+        (unsigned long long)get_rss_bytes(),
+        mi.uordblks,
+        mi.fordblks,
+        mi.hblkhd,
+        (db->newer.tab ? db->newer.mask + 1 : 0) + (db->older.tab ? db->older.mask + 1 : 0),
+        db->older.tab ? 1 : 0,
+        (unsigned long long)command_calls(),
+        (unsigned long long)g_stats.rejected,
+        (unsigned long long)g_stats.net_in,
+        (unsigned long long)g_stats.net_out,
+        (unsigned long long)g_stats.reads,
+        (unsigned long long)g_stats.writes,
+        (unsigned long long)iothreads_batches(),
+        (unsigned long long)g_stats.zc_sends,
+        (unsigned long long)g_stats.zc_copied,
+        (unsigned long long)g_stats.zc_pins,
+        (unsigned long long)g_stats.turns_deferred,
+        (unsigned long long)g_stats.output_limit_drops,
+        (unsigned long long)g_stats.jobs,
+        (unsigned long long)g_data.jobs.size(),
+        (unsigned long long)g_stats.job_waits,
+        (unsigned long long)g_stats.blocked_total,
+        (unsigned long long)g_stats.blocked_timeouts,
+        (unsigned long long)g_stats.loops,
+        hist_mean(&g_stats.ready_fds),
+        (unsigned long long)hist_percentile(&g_stats.ready_fds, 99),
+        (unsigned long long)(g_stats.ready_fds.total ? g_stats.ready_fds.max : 0),
+        ticks_to_usec(poll_ticks),
+        ticks_to_usec(loop_ticks - poll_ticks),
+        loop_ticks ? 100.0 * (double)(loop_ticks - poll_ticks) / (double)loop_ticks : 0.0);
+    info.append(buf, (size_t)n);
+    info_loop(info);
+    info_commandstats(info);
+}
+
+// the lines of one "# Name" section of `info`
+static std::string info_section(const std::string &info, const std::string &name) {
+    std::string out;
+    bool in = false;
+    size_t pos = 0;
+    while (pos < info.size()) {
+        size_t end = info.find("\r\n", pos);
+        end = end == std::string::npos ? info.size() : end + 2;
+        if (info[pos] == '#') {
+            in = end - pos == name.size() + 4 && strncasecmp(&info[pos + 2], name.data(), name.size()) == 0;
+        }
+        if (in) {
+            out.append(info, pos, end - pos);
+        }
+        pos = end;
+    }
+    return out;
+}
+
+// PING [message]
+static void do_ping(std::vector<std::string> &cmd, std::string &out) {
+    if (cmd.size() > 2) {
+        return out_err(out, ERR_ARG, "wrong number of arguments");
+    }
+    if (cmd.size() == 2) {
+        return out_str(out, cmd[1]);
+    }
+    out_str(out, "pong");
+}
+
+// INFO [section]
+static void do_info(std::vector<std::string> &cmd, std::string &out) {
+    if (cmd.size() > 2) {
+        return out_err(out, ERR_ARG, "wrong number of arguments");
+    }
+    char buf[1024];
+    int n = snprintf(buf, sizeof(buf),
+        "# Keyspace\r\n"
+        "keys:%zu\r\n"
+        "# Lazyfree\r\n"
+        "lazyfree_pending_objects:%zu\r\n"
+        "lazyfree_pending_bytes:%zu\r\n"
+        "lazyfreed_objects:%llu\r\n"
+        "# Persistence\r\n"
+        "bgsave_in_progress:%d\r\n"
+        "last_save_time:%lld\r\n"
+        "last_save_status:%s\r\n"
+        "last_snapshot_keys:%llu\r\n"
+        "last_snapshot_bytes:%llu\r\n"
+        "last_snapshot_usec:%llu\r\n"
+        "last_snapshot_mb_per_sec:%.1f\r\n"
+        "last_cow_bytes:%llu\r\n",
+        hm_size(&g_data.db),
+        lazyfree_pending_objects(),
+        lazyfree_pending_bytes(),
+        (unsigned long long)lazyfree_freed_objects(),
+        g_data.bgsave_pid > 0 ? 1 : 0,
+        (long long)g_data.last_save_time,
+        g_data.last_save_ok ? "ok" : "err",
+        (unsigned long long)g_data.last_save.keys,
+        (unsigned long long)g_data.last_save.bytes,
+        (unsigned long long)g_data.last_save.usec,
+        g_data.last_save.usec ? g_data.last_save.bytes / (double)g_data.last_save.usec : 0.0,
+        (unsigned long long)g_data.last_cow_bytes);
+    std::string info(buf, (size_t)n);
+
+    AofStats aof;
+    aof_get_stats(&aof);
+    n = snprintf(buf, sizeof(buf),
+        "aof_enabled:%d\r\n"
+        "aof_fsync:%s\r\n"
+        "aof_size:%llu\r\n"
+        "aof_buffer_bytes:%llu\r\n"
+        "aof_writes:%llu\r\n"
+        "aof_fsyncs:%llu\r\n"
+        "aof_fsync_avg_usec:%llu\r\n"
+        "aof_last_write_status:%s\r\n"
+        "aof_base_size:%llu\r\n"
+        "aof_rewrite_in_progress:%d\r\n"
+        "aof_rewrite_diff_bytes:%llu\r\n"
+        "aof_rewrites:%llu\r\n"
+        "aof_last_rewrite_status:%s\r\n",
+        aof_is_open() ? 1 : 0,
+        aof_fsync_name(g_data.aof_fsync),
+        (unsigned long long)aof.size,
+        (unsigned long long)aof.buffered,
+        (unsigned long long)aof.writes,
+        (unsigned long long)aof.fsyncs,
+        (unsigned long long)(aof.fsyncs ? aof.fsync_usec / aof.fsyncs : 0),
+        aof.last_write_ok ? "ok" : "err",
+        (unsigned long long)aof.base_size,
+        g_data.aof_rewrite_pid > 0 ? 1 : 0,
+        (unsigned long long)aof.diff_bytes,
+        (unsigned long long)aof.rewrites,
+        g_data.last_rewrite_ok ? "ok" : "err");
+    info.append(buf, (size_t)n);
+    info_replication(info);
+    info_cluster(info);
+    info_stats(info);
+    out_str(out, cmd.size() == 2 ? info_section(info, cmd[1]) : info);
+}
+
+// PFADD key element...
+static void do_pfadd(std::vector<std::string> &cmd, std::string &out) {
+    Entry *ent = entry_lookup(cmd[1]);
+    bool changed = false;
+    if (!ent) {
+        ent = entry_create(cmd[1], T_HLL);
+        hll_init(ent->val);
+        changed = true;
+    } else if (ent->type != T_HLL) {
+        return out_err(out, ERR_TYPE, "expect hyperloglog type");
+    }
+    for (size_t i = 2; i < cmd.size(); ++i) {
+        changed |= hll_add(ent->val, (const uint8_t *)cmd[i].data(), cmd[i].size());
+    }
+    out_int(out, changed ? 1 : 0);
+}
+
+// PFCOUNT key...
+static void do_pfcount(std::vector<std::string> &cmd, std::string &out) {
+    if (cmd.size() == 2) {
+        Entry *ent = entry_lookup(cmd[1]);
+        if (!ent) {
+            return out_int(out, 0);
+        }
+        if (ent->type != T_HLL) {
+            return out_err(out, ERR_TYPE, "expect hyperloglog type");
+        }
+        return out_int(out, (int64_t)hll_count(ent->val));
+    }
+
+    // union of several keys: fold each one into a single register array,
+    // then estimate once instead of scanning the registers per key
+    std::vector<uint8_t> max(k_hll_registers, 0);
+    for (size_t i = 1; i < cmd.size(); ++i) {
+        Entry *ent = entry_lookup(cmd[i]);
+        if (!ent) {
+            continue;
+        }
+        if (ent->type != T_HLL) {
+            return out_err(out, ERR_TYPE, "expect hyperloglog type");
+        }
+        hll_merge_raw(max.data(), ent->val);
+    }
+    out_int(out, (int64_t)hll_count_raw(max.data()));
+}
+
+// PFMERGE destkey sourcekey...
+static void do_pfmerge(std::vector<std::string> &cmd, std::string &out) {
+    std::vector<uint8_t> max(k_hll_registers, 0);
+    for (size_t i = 1; i < cmd.size(); ++i) {
+        Entry *ent = entry_lookup(cmd[i]);
+        if (!ent) {
+            continue;
+        }
+        if (ent->type != T_HLL) {
+            return out_err(out, ERR_TYPE, "expect hyperloglog type");
+        }
+        hll_merge_raw(max.data(), ent->val);
+    }
+
+    Entry *dst = entry_lookup(cmd[1]);
+    if (!dst) {
+        dst = entry_create(cmd[1], T_HLL);
+    }
+    hll_store_raw(dst->val, max.data());
+    out_nil(out);
+}
+
+/*
+Blocking reads. An `xread block ms` that finds nothing new parks its client
+instead of answering nil: the request stays at the head of the read buffer,
+the connection goes to STATE_BLOCKED where it is only polled for a hang-up,
+and a link per key puts it at the end of that key's queue of waiters. A
+write that adds entries to a key (xadd, restore, a resync) marks the key
+ready. After the commands of the turn, once the log is written, the waiters
+of the ready keys that now have something to read are woken oldest first and
+their request runs again as if just read, the `$` IDs resolved to the last
+IDs they had when the client blocked. A waiter whose time is up runs it
+again to answer nil; the next deadline bounds the timeout of poll(). So does
+a waiter whose key was deleted, and in cluster mode one whose slot moved
+away runs again to be redirected.
+*/
+struct BlockKey {
+    HNode node;
+    std::string key;
+    DList waiters;          // BlockLink::node, oldest first
+    bool ready = false;     // in `g_data.ready_keys`
+    bool deleted = false;   // since it was last looked at
+};
+
+struct BlockLink {
+    DList node;
+    BlockKey *bk = NULL;
+    Conn *conn = NULL;
+};
+
+struct Block {
+    Conn *conn = NULL;
+    std::vector<std::string> keys;
+    std::vector<StreamID> ids;      // of `keys`, `$` resolved
+    uint64_t deadline_ms = 0;       // monotonic, 0: none
+    size_t heap_pos = SIZE_MAX;     // in `g_data.block_timers`
+    bool expired = false;           // it runs again only to answer nil
+    std::vector<BlockLink> links;   // of `keys`, while it waits
+};
+
+static bool block_key_eq(HNode *node, HNode *key) {
+    BlockKey *bk = container_of(node, BlockKey, node);
+    LookupKey *lk = container_of(key, LookupKey, node);
+    return bk->key == *lk->key;
+}
+
+static BlockKey *block_key_lookup(const std::string &key) {
+    LookupKey lk;
+    lookup_key_init(&lk, key);
+    HNode *node = hm_lookup(&g_data.blocking_keys, &lk.node, &block_key_eq);
+    return node ? container_of(node, BlockKey, node) : NULL;
+}
+
+static void block_key_ready(BlockKey *bk) {
+    if (!bk->ready) {
+        bk->ready = true;
+        g_data.ready_keys.push_back(bk->key);
+    }
+}
+
+// a write added entries to `key`, its waiters are looked at after the turn
+static void block_signal(const std::string &key) {
+    if (hm_size(&g_data.blocking_keys) == 0) {
+        return;
+    }
+    if (BlockKey *bk = block_key_lookup(key)) {
+        block_key_ready(bk);
+    }
+}
+
+// `key` was deleted (del, unlink, or replaced by another value)
+static void block_signal_deleted(const std::string &key) {
+    if (hm_size(&g_data.blocking_keys) == 0) {
+        return;
+    }
+    if (BlockKey *bk = block_key_lookup(key)) {
+        bk->deleted = true;
+        block_key_ready(bk);
+    }
+}
+
+static bool block_signal_cb(HNode *node, void *) {
+    block_key_ready(container_of(node, BlockKey, node));
+    return true;
+}
+
+// the keyspace was replaced (a resync)
+static void block_signal_all() {
+    hm_foreach(&g_data.blocking_keys, &block_signal_cb, NULL);
+}
+
+static bool block_signal_moved_cb(HNode *node, void *) {
+    BlockKey *bk = container_of(node, BlockKey, node);
+    if (!cluster_slot_is_mine(key_hash_slot(bk->key.data(), bk->key.size()))) {
+        block_key_ready(bk);
+    }
+    return true;
+}
+
+// slots went to another node, their waiters are redirected
+static void block_signal_moved() {
+    if (hm_size(&g_data.blocking_keys) != 0) {
+        hm_foreach(&g_data.blocking_keys, &block_signal_moved_cb, NULL);
+    }
+}
+
+static void block_heap_swap(size_t a, size_t b) {
+    std::vector<Block *> &h = g_data.block_timers;
+    std::swap(h[a], h[b]);
+    h[a]->heap_pos = a;
+    h[b]->heap_pos = b;
+}
+
+static void block_heap_up(size_t pos) {
+    std::vector<Block *> &h = g_data.block_timers;
+    while (pos > 0 && h[(pos - 1) / 2]->deadline_ms > h[pos]->deadline_ms) {
+        block_heap_swap(pos, (pos - 1) / 2);
+        pos = (pos - 1) / 2;
+    }
+}
+
+static void block_heap_down(size_t pos) {
+    std::vector<Block *> &h = g_data.block_timers;
+    while (true) {
+        size_t l = pos * 2 + 1, r = l + 1, min = pos;
+        if (l < h.size() && h[l]->deadline_ms < h[min]->deadline_ms) {
+            min = l;
+        }
+        if (r < h.size() && h[r]->deadline_ms < h[min]->deadline_ms) {
+            min = r;
+        }
+        if (min == pos) {
+            return;
+        }
+        block_heap_swap(pos, min);
+        pos = min;
+    }
+}
+
+// the client waits on the keys of `blk`, and until its deadline
+static void block_park(Conn *conn, Block *blk) {
+    blk->conn = conn;
+    blk->links.resize(blk->keys.size());
+    for (size_t k = 0; k < blk->keys.size(); ++k) {
+        BlockKey *bk = block_key_lookup(blk->keys[k]);
+        if (!bk) {
+            bk = new BlockKey();
+            bk->key = blk->keys[k];
+            bk->node.hcode = str_hash((const uint8_t *)bk->key.data(), bk->key.size());
+            dlist_init(&bk->waiters);
+            hm_insert(&g_data.blocking_keys, &bk->node);
+        }
+        BlockLink *link = &blk->links[k];
+        link->bk = bk;
+        link->conn = conn;
+        dlist_insert_before(&bk->waiters, &link->node);
+    }
+    if (blk->deadline_ms) {
+        blk->heap_pos = g_data.block_timers.size();
+        g_data.block_timers.push_back(blk);
+        block_heap_up(blk->heap_pos);
+    }
+    conn->block = blk;
+    conn->state = STATE_BLOCKED;
+    g_stats.blocked++;
+    g_stats.blocked_total++;
+}
+
+// out of the queues and the timers, a key without waiters is dropped
+static void block_unlink(Block *blk) {
+    if (blk->links.empty()) {
+        return;
+    }
+    for (BlockLink &link : blk->links) {
+        dlist_detach(&link.node);
+        BlockKey *bk = link.bk;
+        if (dlist_empty(&bk->waiters)) {
+            LookupKey lk;
+            lookup_key_init(&lk, bk->key);
+            hm_delete(&g_data.blocking_keys, &lk.node, &block_key_eq);
+            delete bk;
+        }
+    }
+    blk->links.clear();
+    if (size_t pos = blk->heap_pos; pos != SIZE_MAX) {
+        std::vector<Block *> &h = g_data.block_timers;
+        block_heap_swap(pos, h.size() - 1);
+        h.pop_back();
+        blk->heap_pos = SIZE_MAX;
+        if (pos < h.size()) {
+            block_heap_up(pos);
+            block_heap_down(pos);
+        }
+    }
+    g_stats.blocked--;
+}
+
+// wall clock time, for stream IDs; it can go backwards
+static uint64_t get_wall_msec() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_REALTIME, &tv);
+    return (uint64_t)tv.tv_sec * 1000 + (uint64_t)tv.tv_nsec / 1000 / 1000;
+}
+
+// returns false and writes an error if the key holds another type
+static bool stream_lookup(const std::string &key, Entry **ent, std::string &out) {
+    *ent = entry_lookup(key);
+    if (*ent && (*ent)->type != T_STREAM) {
+        out_err(out, ERR_TYPE, "expect stream type");
+        return false;
+    }
+    return true;
+}
+
+// a range of a stream for a job: the entries in [start, end], at most `count`
+static void job_range_start(Job *job, Stream *s, const StreamID &start, const StreamID &end) {
+    job->in_range = true;
+    job->range_ctx = out_begin_arr(job->out);
+    job->range_n = 0;
+    stream_iter_start(&job->stream_it, s, start, end);
+}
+
+// write the entries of the range straight from the blocks into the reply,
+// true once it is complete
+static bool job_range_step(Job *job) {
+    static std::vector<StreamField> fv;
+    StreamID id;
+    while (job->range_n < job->count && stream_iter_next(&job->stream_it, &id, fv)) {
+        out_arr(job->out, 2);
+        out_str(job->out, stream_format_id(id));
+        out_arr(job->out, (uint32_t)fv.size());
+        for (const StreamField &f : fv) {
+            out_str(job->out, (const char *)f.ptr, f.len);
+        }
+        job->range_n++;
+        if (job->range_n % k_job_check_every == 0 && job_yield(job)) {
+            return false;
+        }
+    }
+    out_end_arr(job->out, job->range_ctx, job->range_n);
+    job->in_range = false;
+    return true;
+}
+
+// parse `MAXLEN [~] count` at cmd[i], advances i
+static bool parse_maxlen(std::vector<std::string> &cmd, size_t &i, uint64_t &maxlen, bool &approx) {
+    if (i + 1 >= cmd.size() || strcasecmp(cmd[i].c_str(), "maxlen") != 0) {
+        return false;
+    }
+    i++;
+    approx = false;
+    if (cmd[i] == "~" || cmd[i] == "=") {
+        approx = cmd[i] == "~";
+        i++;
+    }
+    if (i >= cmd.size() || !str2u64(cmd[i], maxlen)) {
+        return false;
+    }
+    i++;
+    return true;
+}
+
+// XADD key [MAXLEN [~] count] id|* field value [field value ...]
+static void do_xadd(std::vector<std::string> &cmd, std::string &out) {
+    size_t i = 2;
+    uint64_t maxlen = 0;
+    bool approx = false;
+    bool trim = false;
+    if (strcasecmp(cmd[i].c_str(), "maxlen") == 0) {
+        if (!parse_maxlen(cmd, i, maxlen, approx)) {
+            return out_err(out, ERR_ARG, "bad maxlen");
+        }
+        trim = true;
+    }
+    if (i + 3 > cmd.size() || (cmd.size() - i - 1) % 2 != 0) {
+        return out_err(out, ERR_ARG, "wrong number of arguments");
+    }
+
+    Entry *ent = NULL;
+    if (!stream_lookup(cmd[1], &ent, out)) {
+        return;
+    }
+    Stream *s = ent ? ent->stream : NULL;
+
+    StreamID id;
+    if (cmd[i] == "*") {
+        if (!stream_auto_id(s, get_wall_msec(), &id)) {
+            return out_err(out, ERR_ARG, "the stream has reached the largest id");
+        }
+    } else if (!stream_parse_id(cmd[i], 0, &id)) {
+        return out_err(out, ERR_ARG, "bad stream id");
+    } else if (!stream_id_ok(s, id)) {
+        return out_err(out, ERR_ARG, "stream id is not greater than the last one");
+    }
+
+    if (!ent) {
+        ent = entry_create(cmd[1], T_STREAM);
+        ent->stream = s = stream_new();
+    }
+    stream_append(s, id, &cmd[i + 1], cmd.size() - i - 1);
+    if (trim) {
+        stream_trim(s, maxlen, approx);
+    }
+    if (cmd[i] == "*") {
+        // log the generated ID, replaying "*" would make a different one
+        cmd[i] = stream_format_id(id);
+        g_data.cmd_rewritten = true;
+    }
+    block_signal(cmd[1]);
+    out_str(out, stream_format_id(id));
+}
+
+// XLEN key
+static void do_xlen(std::vector<std::string> &cmd, std::string &out) {
+    Entry *ent = NULL;
+    if (!stream_lookup(cmd[1], &ent, out)) {
+        return;
+    }
+    out_int(out, ent ? (int64_t)ent->stream->length : 0);
+}
+
+// XRANGE key start end [COUNT count]
+static void do_xrange(std::vector<std::string> &cmd, std::string &out) {
+    StreamID start;
+    StreamID end;
+    end.ms = end.seq = UINT64_MAX;
+    if ((cmd[2] != "-" && !stream_parse_id(cmd[2], 0, &start))
+        || (cmd[3] != "+" && !stream_parse_id(cmd[3], UINT64_MAX, &end)))
+    {
+        return out_err(out, ERR_ARG, "bad stream id");
+    }
+    uint64_t count = UINT64_MAX;
+    if (cmd.size() == 6 && strcasecmp(cmd[4].c_str(), "count") == 0) {
+        if (!str2u64(cmd[5], count)) {
+            return out_err(out, ERR_ARG, "expect int");
+        }
+    } else if (cmd.size() != 4) {
+        return out_err(out, ERR_ARG, "syntax error");
+    }
+
+    Entry *ent = NULL;
+    if (!stream_lookup(cmd[1], &ent, out)) {
+        return;
+    }
+    if (!ent) {
+        return out_arr(out, 0);
+    }
+    Job *job = job_new(cmd, &job_range_step);
+    job->count = count;
+    job_range_start(job, ent->stream, start, end);
+    job_start(job, out);
+}
+
+// the streams one after the other, those without entries after their ID
+// are left out
+static bool xread_step(Job *job) {
+    while (true) {
+        if (job->in_range) {
+            if (!job_range_step(job)) {
+                return false;
+            }
+            job->n++;
+        }
+        Entry *ent = NULL;
+        size_t k = job->next;
+        for (; k < job->ids.size(); ++k) {
+            ent = entry_lookup(job->cmd[job->first_key + k]);
+            if (ent && stream_id_cmp(job->ids[k], ent->stream->last_id) < 0) {
+                break;
+            }
+        }
+        if (k == job->ids.size()) {
+            break;
+        }
+        job->next = k + 1;
+        StreamID start = job->ids[k];
+        if (start.seq == UINT64_MAX) {
+            start.ms++;
+            start.seq = 0;
+        } else {
+            start.seq++;
+        }
+        StreamID end;
+        end.ms = end.seq = UINT64_MAX;
+        out_arr(job->out, 2);
+        out_str(job->out, job->cmd[job->first_key + k]);
+        job_range_start(job, ent->stream, start, end);
+    }
+    if (job->n == 0) {
+        job->out.resize(job->ctx - 1);
+        out_nil(job->out);
+    } else {
+        out_end_arr(job->out, job->ctx, job->n);
+    }
+    return true;
+}
+
+// the longest timeout of a blocking read (a year); 0 waits forever
+const uint64_t k_block_max_ms = 365ULL * 24 * 3600 * 1000;
+
+// XREAD [COUNT count] [BLOCK ms] STREAMS key [key ...] id [id ...]
+static void do_xread(std::vector<std::string> &cmd, std::string &out) {
+    size_t i = 1;
+    uint64_t count = UINT64_MAX;
+    bool block = false;
+    uint64_t block_ms = 0;      // 0: no timeout
+    for (; i + 1 < cmd.size(); i += 2) {
+        if (strcasecmp(cmd[i].c_str(), "count") == 0) {
+            if (!str2u64(cmd[i + 1], count)) {
+                return out_err(out, ERR_ARG, "expect int");
+            }
+        } else if (strcasecmp(cmd[i].c_str(), "block") == 0) {
+            if (!str2u64(cmd[i + 1], block_ms)) {
+                return out_err(out, ERR_ARG, "expect int");
+            }
+            if (block_ms > k_block_max_ms) {
+                return out_err(out, ERR_ARG, "timeout is out of range");
+            }
+            block = true;
+        } else {
+            break;
+        }
+    }
+    if (i >= cmd.size() || strcasecmp(cmd[i].c_str(), "streams") != 0) {
+        return out_err(out, ERR_ARG, "syntax error");
+    }
+    i++;
+    size_t nkeys = (cmd.size() - i) / 2;
+    if (nkeys == 0 || (cmd.size() - i) % 2 != 0) {
+        return out_err(out, ERR_ARG, "unbalanced streams and ids");
+    }
+
+    // check the types and IDs before writing anything
+    std::vector<StreamID> ids(nkeys);
+    bool any = false;
+    for (size_t k = 0; k < nkeys; ++k) {
+        Entry *ent = NULL;
+        if (!stream_lookup(cmd[i + k], &ent, out)) {
+            return;
+        }
+        const std::string &sid = cmd[i + nkeys + k];
+        if (g_data.block_ids) {
+            ids[k] = (*g_data.block_ids)[k];    // woken, `$` is when it blocked
+        } else if (sid == "$") {
+            ids[k] = ent ? ent->stream->last_id : StreamID();
+        } else if (!stream_parse_id(sid, 0, &ids[k])) {
+            return out_err(out, ERR_ARG, "bad stream id");
+        }
+        any = any || (ent && stream_id_cmp(ids[k], ent->stream->last_id) < 0);
+    }
+    if (!any && block && g_data.block_ok) {
+        // nothing yet, the client waits for an entry, see Block
+        Block *blk = new Block();
+        blk->ids.swap(ids);
+        blk->deadline_ms = block_ms ? get_monotonic_usec() / 1000 + block_ms : 0;
+        g_data.block = blk;
+        return;
+    }
+
+    // only the entries after the given IDs
+    Job *job = job_new(cmd, &xread_step);
+    job->count = count;
+    job->first_key = i;
+    job->ids.swap(ids);
+    job->ctx = out_begin_arr(job->out);
+    job_start(job, out);
+}
+
+// XTRIM key MAXLEN [~] count
+static void do_xtrim(std::vector<std::string> &cmd, std::string &out) {
+    size_t i = 2;
+    uint64_t maxlen = 0;
+    bool approx = false;
+    if (!parse_maxlen(cmd, i, maxlen, approx) || i != cmd.size()) {
+        return out_err(out, ERR_ARG, "syntax error");
+    }
+    Entry *ent = NULL;
+    if (!stream_lookup(cmd[1], &ent, out)) {
+        return;
+    }
+    if (!ent) {
+        return out_int(out, 0);
+    }
+    out_int(out, (int64_t)stream_trim(ent->stream, maxlen, approx));
+}
+
+static bool snapshot_entry_cb(HNode *node, void *arg) {
+    SnapWriter *w = (SnapWriter *)arg;
+    Entry *ent = container_of(node, Entry, node);
+    switch (ent->type) {
+    case T_STR:
+        snap_put_str(w, ent->key, ent->val);
+        break;
+    case T_HLL:
+        snap_put_hll(w, ent->key, ent->val);
+        break;
+    case T_STREAM:
+        snap_put_stream(w, ent->key, ent->stream);
+        break;
+    }
+    return true;
+}
+
+static bool snapshot_write(SnapStats *stats) {
+    SnapWriter *w = snap_open(g_data.snapshot_path.c_str());
+    if (!w) {
+        return false;
+    }
+    hm_foreach(&g_data.db, &snapshot_entry_cb, w);
+    return snap_close(w, stats);
+}
+
+// memory the child had to copy because the parent kept writing
+static uint64_t get_private_dirty_bytes() {
+    FILE *fp = fopen("/proc/self/smaps_rollup", "r");
+    if (!fp) {
+        return 0;
+    }
+    char line[256];
+    uint64_t kb = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        unsigned long long v = 0;
+        if (sscanf(line, "Private_Dirty: %llu kB", &v) == 1) {
+            kb = v;
+            break;
+        }
+    }
+    fclose(fp);
+    return kb * 1024;
+}
+
+struct BgsaveResult {
+    uint32_t ok;
+    SnapStats stats;
+    uint64_t cow_bytes;
+};
+
+static void snapshot_done(bool ok, const SnapStats &stats, uint64_t cow_bytes) {
+    g_data.last_save_ok = ok;
+    if (!ok) {
+        log_warn("snapshot failed");
+        return;
+    }
+    g_data.last_save_time = time(NULL);
+    g_data.last_save = stats;
+    g_data.last_cow_bytes = cow_bytes;
+    log_info("snapshot: %llu keys, %.2f MB in %.1f ms (%.1f MB/s), copy-on-write %.2f MB",
+        (unsigned long long)stats.keys, stats.bytes / 1e6, stats.usec / 1e3,
+        stats.usec ? stats.bytes / (double)stats.usec : 0.0, cow_bytes / 1e6);
+}
+
+// SAVE, blocks the event loop
+static void do_save(std::vector<std::string> &, std::string &out) {
+    if (g_data.bgsave_pid > 0) {
+        return out_err(out, ERR_UNKNOWN, "background save in progress");
+    }
+    SnapStats stats;
+    bool ok = snapshot_write(&stats);
+    snapshot_done(ok, stats, 0);
+    if (!ok) {
+        return out_err(out, ERR_UNKNOWN, "snapshot failed");
+    }
+    out_nil(out);
+}
+
+/*
+BGSAVE: the child process gets a copy of the keyspace as it is at fork() time,
+the kernel only copies the pages that the parent modifies while the child
+is writing, so the parent keeps serving requests.
+Returns an error message, or NULL once the child is running.
+*/
+static const char *bgsave_start() {
+    if (g_data.bgsave_pid > 0 || g_data.aof_rewrite_pid > 0) {
+        return "background save or rewrite in progress";
+    }
+    int fds[2];
+    if (pipe(fds) != 0) {
+        return "pipe() failed";
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return "fork() failed";
+    }
+    if (pid == 0) {
+        // child
+        close(fds[0]);
+        BgsaveResult res = {};
+        res.ok = snapshot_write(&res.stats) ? 1 : 0;
+        res.cow_bytes = get_private_dirty_bytes();
+        (void)write_all(fds[1], (const char *)&res, sizeof(res));
+        _exit(res.ok ? 0 : 1);
+    }
+    close(fds[1]);
+    g_data.bgsave_pid = pid;
+    g_data.bgsave_pipe = fds[0];
+    // followers can start their stream from here while the backlog has it
+    g_data.bgsave_repl_off = backlog_active(&g_data.backlog) ? g_data.backlog.end_off : UINT64_MAX;
+    return NULL;
+}
+
+// BGSAVE
+static void do_bgsave(std::vector<std::string> &, std::string &out) {
+    const char *err = bgsave_start();
+    if (err) {
+        return out_err(out, ERR_UNKNOWN, err);
+    }
+    out_str(out, "background saving started");
+}
+
+static void repl_bgsave_done(bool ok);
+
+// called from the event loop, reaps the child when it is done
+static void bgsave_check() {
+    if (g_data.bgsave_pid <= 0) {
+        return;
+    }
+    int status = 0;
+    pid_t rv = waitpid(g_data.bgsave_pid, &status, WNOHANG);
+    if (rv == 0) {
+        return;     // still running
+    }
+    BgsaveResult res = {};
+    bool ok = rv == g_data.bgsave_pid && WIFEXITED(status) && WEXITSTATUS(status) == 0
+        && read_full(g_data.bgsave_pipe, (char *)&res, sizeof(res)) == 0 && res.ok;
+    close(g_data.bgsave_pipe);
+    g_data.bgsave_pipe = -1;
+    g_data.bgsave_pid = -1;
+    snapshot_done(ok, res.stats, res.cow_bytes);
+    repl_bgsave_done(ok);
+}
+
+// called from the loader threads, only allocate
+static HNode *load_str_cb(void *, std::string &key, std::string &val) {
+    Entry *ent = entry_new(key, T_STR);
+    ent->val.swap(val);
+    return &ent->node;
+}
+
+static HNode *load_hll_cb(void *, std::string &key, std::string &val) {
+    if (!hll_is_valid(val)) {
+        log_warn("snapshot: skipping an invalid hyperloglog");
+        return NULL;
+    }
+    Entry *ent = entry_new(key, T_HLL);
+    ent->val.swap(val);
+    return &ent->node;
+}
+
+static HNode *load_stream_cb(void *, std::string &key, Stream *s) {
+    Entry *ent = entry_new(key, T_STREAM);
+    ent->stream = s;
+    return &ent->node;
+}
+
+static bool entry_index_cb(HNode *node, void *) {
+    entry_index(container_of(node, Entry, node));
+    return true;
+}
+
+// into an empty keyspace. 0 on success, -1 if there is no file, -2 if it is corrupt.
+static int snapshot_load_file(const char *path) {
+    SnapHandler h = {NULL, &load_str_cb, &load_hll_cb, &load_stream_cb};
+    SnapStats stats;
+    int rv = snap_load(path, &h, &g_data.db, 0, &stats);
+    if (rv == 0) {
+        if (g_data.key_index_enabled || g_data.cluster_enabled) {
+            hm_foreach(&g_data.db, &entry_index_cb, NULL);
+        }
+        log_info("loaded %llu keys, %.2f MB in %.1f ms (%.1f MB/s)",
+            (unsigned long long)stats.keys, stats.bytes / 1e6, stats.usec / 1e3,
+            stats.usec ? stats.bytes / (double)stats.usec : 0.0);
+    }
+    return rv;
+}
+
+// runs before the listening socket is created, clients can't see a
+// partially loaded keyspace
+static void snapshot_load() {
+    if (snapshot_load_file(g_data.snapshot_path.c_str()) == -2) {
+        die("the snapshot is corrupt");
+    }
+}
+
+static void entry_dump(Entry *ent, std::string &out) {
+    switch (ent->type) {
+    case T_STR:
+        snap_dump_str(out, ent->val);
+        break;
+    case T_HLL:
+        snap_dump_hll(out, ent->val);
+        break;
+    case T_STREAM:
+        snap_dump_stream(out, ent->stream);
+        break;
+    }
+}
+
+// DUMP key, the value serialized with its type and a checksum
+static void do_dump(std::vector<std::string> &cmd, std::string &out) {
+    Entry *ent = entry_lookup(cmd[1]);
+    if (!ent) {
+        return out_nil(out);
+    }
+    std::string payload;
+    entry_dump(ent, payload);
+    out_str(out, payload);
+}
+
+// RESTORE key payload [replace]
+static void do_restore(std::vector<std::string> &cmd, std::string &out) {
+    bool replace = cmd.size() == 4 && strcasecmp(cmd[3].c_str(), "replace") == 0;
+    if (cmd.size() > 4 || (cmd.size() == 4 && !replace)) {
+        return out_err(out, ERR_ARG, "syntax error");
+    }
+    uint32_t type = 0;
+    std::string val;
+    Stream *s = NULL;
+    if (!snap_restore(cmd[2], &type, val, &s) || (type == SNAP_HLL && !hll_is_valid(val))) {
+        return out_err(out, ERR_ARG, "bad payload");
+    }
+    if (entry_lookup(cmd[1])) {
+        if (!replace) {
+            if (s) {
+                stream_free(s);
+            }
+            return out_err(out, ERR_ARG, "key exists");
+        }
+        entry_delete(cmd[1], g_data.lazyfree_overwrite);
+    }
+    Entry *ent = entry_create(cmd[1], type == SNAP_STR ? T_STR : type == SNAP_HLL ? T_HLL : T_STREAM);
+    ent->val.swap(val);
+    ent->stream = s;
+    if (s) {
+        block_signal(cmd[1]);
+    }
+    out_nil(out);
+}
+
+// a value whose SET or RESTORE would be larger is rebuilt in pieces, well
+// within the record limit of the log and the frame limit of a migration
+const size_t k_rebuild_max_bytes = 64 << 20;
+
+/*
+The commands that rebuild a key, for the log rewrite and slot migrations:
+SET for a string, RESTORE ... REPLACE with the DUMP payload for the other
+types. A larger string is a SET of its first piece then APPENDs, a larger
+stream a DEL then an XADD per entry; its last entry carries the last ID
+(only a stream trimmed to empty lacks one, and that is small). Returns the
+number of commands passed to `put`.
+*/
+static size_t entry_rebuild(Entry *ent, std::vector<std::string> &cmd,
+    void (*put)(const std::vector<std::string> &cmd, void *arg), void *arg)
+{
+    size_t n = 0;
+    if (ent->type == T_STR) {
+        cmd.resize(3);
+        cmd[0] = "set";
+        cmd[1] = ent->key;
+        size_t pos = 0;
+        do {
+            cmd[2].assign(ent->val, pos, k_rebuild_max_bytes);
+            put(cmd, arg);
+            cmd[0] = "append";
+            pos += cmd[2].size();
+            n++;
+        } while (pos < ent->val.size());
+        return n;
+    }
+    if (ent->type != T_STREAM || snap_dump_stream_len(ent->stream) <= k_rebuild_max_bytes) {
+        cmd.resize(4);
+        cmd[0] = "restore";
+        cmd[1] = ent->key;
+        cmd[2].clear();
+        entry_dump(ent, cmd[2]);
+        cmd[3] = "replace";
+        put(cmd, arg);
+        return 1;
+    }
+    cmd.resize(2);
+    cmd[0] = "del";
+    cmd[1] = ent->key;
+    put(cmd, arg);
+    n++;
+    StreamID start, end, id;
+    end.ms = end.seq = UINT64_MAX;
+    StreamIter it;
+    stream_iter_start(&it, ent->stream, start, end);
+    std::vector<StreamField> fv;
+    cmd[0] = "xadd";
+    while (stream_iter_next(&it, &id, fv)) {
+        cmd.resize(3);
+        cmd[2] = stream_format_id(id);
+        for (const StreamField &f : fv) {
+            cmd.emplace_back((const char *)f.ptr, f.len);
+        }
+        put(cmd, arg);
+        n++;
+    }
+    return n;
+}
+
+static void aof_rewrite_put_cb(const std::vector<std::string> &cmd, void *arg) {
+    aof_writer_put((AofWriter *)arg, cmd);
+}
+
+struct RewriteArg {
+    AofWriter *w;
+    std::vector<std::string> cmd;
+};
+
+static bool aof_rewrite_entry_cb(HNode *node, void *p) {
+    RewriteArg *arg = (RewriteArg *)p;
+    entry_rebuild(container_of(node, Entry, node), arg->cmd, &aof_rewrite_put_cb, arg->w);
+    return true;
+}
+
+// write a log that rebuilds the keyspace to `path`
+static bool aof_rewrite_write(const std::string &path) {
+    AofWriter *w = aof_writer_open(path.c_str());
+    if (!w) {
+        return false;
+    }
+    RewriteArg arg = {w, {}};
+    hm_foreach(&g_data.db, &aof_rewrite_entry_cb, &arg);
+    return aof_writer_close(w);
+}
+
+static std::string aof_rewrite_tmp_path() {
+    return g_data.aof_path + ".rewrite";
+}
+
+static bool aof_rewrite_fork() {
+    if (!aof_rewrite_start()) {
+        return false;
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        aof_rewrite_abort();
+        return false;
+    }
+    if (pid == 0) {
+        // child
+        _exit(aof_rewrite_write(aof_rewrite_tmp_path()) ? 0 : 1);
+    }
+    g_data.aof_rewrite_pid = pid;
+    return true;
+}
+
+// BGREWRITEAOF
+static void do_bgrewriteaof(std::vector<std::string> &, std::string &out) {
+    if (!aof_is_open()) {
+        return out_err(out, ERR_UNKNOWN, "the append-only log is disabled");
+    }
+    if (g_data.bgsave_pid > 0 || g_data.aof_rewrite_pid > 0) {
+        return out_err(out, ERR_UNKNOWN, "background save or rewrite in progress");
+    }
+    if (!aof_rewrite_fork()) {
+        return out_err(out, ERR_UNKNOWN, "can't start the rewrite");
+    }
+    out_str(out, "background rewrite started");
+}
+
+// called from the event loop: starts a rewrite when the log has grown
+// enough, and swaps the files when the child is done
+static void aof_rewrite_check() {
+    if (g_data.aof_rewrite_pid <= 0) {
+        if (g_data.bgsave_pid <= 0 && aof_rewrite_needed()) {
+            log_info("append-only log: starting a rewrite");
+            (void)aof_rewrite_fork();
+        }
+        return;
+    }
+    int status = 0;
+    pid_t rv = waitpid(g_data.aof_rewrite_pid, &status, WNOHANG);
+    if (rv == 0) {
+        return;     // still running
+    }
+    g_data.aof_rewrite_pid = -1;
+    bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    ok = ok && aof_rewrite_done(aof_rewrite_tmp_path().c_str());
+    if (!ok) {
+        aof_rewrite_abort();
+        unlink(aof_rewrite_tmp_path().c_str());
+        log_warn("append-only log: rewrite failed");
+    } else {
+        AofStats stats;
+        aof_get_stats(&stats);
+        log_info("append-only log: rewritten, %.2f MB", stats.size / 1e6);
+    }
+    g_data.last_rewrite_ok = ok;
+}
+
+// rewrite the log in the foreground, after the keyspace was replaced
+static bool aof_rewrite_now() {
+    if (g_data.aof_rewrite_pid > 0) {
+        // it is writing the old keyspace
+        kill(g_data.aof_rewrite_pid, SIGKILL);
+        waitpid(g_data.aof_rewrite_pid, NULL, 0);
+        g_data.aof_rewrite_pid = -1;
+        aof_rewrite_abort();
+    }
+    std::string tmp = aof_rewrite_tmp_path();
+    if (!aof_rewrite_start()) {
+        return false;
+    }
+    if (!aof_rewrite_write(tmp)) {
+        aof_rewrite_abort();
+        unlink(tmp.c_str());
+        return false;
+    }
+    return aof_rewrite_done(tmp.c_str());
+}
+
+// starts a snapshot for the followers waiting for one, retried from the
+// event loop while another child is running
+static void repl_start_bgsave() {
+    bool waiting = false;
+    for (Conn *conn : g_data.followers) {
+        waiting = waiting || conn->follower->state == FOLLOWER_WAIT_BGSAVE_START;
+    }
+    if (!waiting || g_data.bgsave_pid > 0 || g_data.aof_rewrite_pid > 0) {
+        return;
+    }
+    const char *err = bgsave_start();
+    for (Conn *conn : g_data.followers) {
+        Follower *f = conn->follower;
+        if (f->state != FOLLOWER_WAIT_BGSAVE_START) {
+            continue;
+        }
+        if (err) {
+            conn->state = STATE_END;
+            continue;
+        }
+        f->state = FOLLOWER_WAIT_BGSAVE_END;
+        f->start_off = g_data.bgsave_repl_off;
+    }
+    if (err) {
+        log_warn("replication: can't start a snapshot");
+    }
+}
+
+static void repl_bgsave_done(bool ok) {
+    for (Conn *conn : g_data.followers) {
+        Follower *f = conn->follower;
+        if (f->state != FOLLOWER_WAIT_BGSAVE_END) {
+            continue;
+        }
+        // SAVE may rename another file over it, this one stays readable
+        int fd = ok ? open(g_data.snapshot_path.c_str(), O_RDONLY | O_CLOEXEC) : -1;
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            log_warn("replication: no snapshot for the follower");
+            if (fd >= 0) {
+                close(fd);
+            }
+            conn->state = STATE_END;
+            continue;
+        }
+        f->snap_fd = fd;
+        f->snap_off = 0;
+        f->snap_size = (uint64_t)st.st_size;
+        put_req(f->pre, {"fullresync", g_data.replid, std::to_string(f->start_off),
+            std::to_string(f->snap_size)});
+        f->state = FOLLOWER_SEND_SNAPSHOT;
+    }
+    repl_start_bgsave();
+}
+
+// sync <replid> <offset>
+static void repl_attach(Conn *conn, std::vector<std::string> &cmd) {
+    uint64_t off = 0;
+    if (repl_link_enabled() || cmd.size() != 3 || !str2u64(cmd[2], off)) {
+        log_warn("replication: refusing a sync request");
+        conn->state = STATE_END;
+        return;
+    }
+    if (!backlog_active(&g_data.backlog)) {
+        backlog_init(&g_data.backlog, g_data.backlog_size, 0);
+    }
+    Follower *f = new Follower();
+    f->addr = conn_peer_addr(conn);
+    f->ack_ms = get_monotonic_usec() / 1000;
+    conn->follower = f;
+    conn->wbuf.clear();
+    conn->wbuf_sent = conn->wbuf_size = 0;
+    g_data.followers.push_back(conn);
+
+    // partial resync: the stream it missed is still in the backlog
+    if (cmd[1] == g_data.replid && backlog_read(&g_data.backlog, off, conn->wbuf)) {
+        put_req(f->pre, {"continue", g_data.replid});
+        f->start_off = f->ack_off = off;
+        f->state = FOLLOWER_ONLINE;
+        g_data.repl_partial_syncs++;
+        log_info("replication: partial resync of %s", f->addr.c_str());
+        return;
+    }
+    // full resync, it may share a snapshot that is already being written
+    g_data.repl_full_syncs++;
+    log_info("replication: full resync of %s", f->addr.c_str());
+    if (g_data.bgsave_pid > 0 && backlog_read(&g_data.backlog, g_data.bgsave_repl_off, conn->wbuf)) {
+        f->start_off = g_data.bgsave_repl_off;
+        f->state = FOLLOWER_WAIT_BGSAVE_END;
+        return;
+    }
+    repl_start_bgsave();
+}
+
+// what a follower sends on its connection
+static void repl_request(Conn *conn, std::vector<std::string> &cmd) {
+    Follower *f = conn->follower;
+    if (!f) {
+        return repl_attach(conn, cmd);
+    }
+    uint64_t off = 0;
+    if (cmd.size() == 3 && strcasecmp(cmd[0].c_str(), "replconf") == 0
+        && strcasecmp(cmd[1].c_str(), "ack") == 0 && str2u64(cmd[2], off))
+    {
+        f->ack_off = off;
+        f->ack_ms = get_monotonic_usec() / 1000;
+    }
+}
+
+// append a frame to the stream: the backlog, and every follower that has
+// a starting point
+static void repl_feed(const char *frame, size_t len) {
+    backlog_feed(&g_data.backlog, frame, len);
+    for (Conn *conn : g_data.followers) {
+        if (conn->follower->state == FOLLOWER_WAIT_BGSAVE_START || conn->state == STATE_END) {
+            continue;
+        }
+        conn->wbuf.append(frame, len);
+        if (conn->wbuf.size() - conn->wbuf_sent > k_repl_max_pending) {
+            log_warn("replication: dropping a follower that can't keep up");
+            conn->state = STATE_END;
+        }
+    }
+}
+
+// the log and the followers get the same frame
+static void propagate(const std::string &frame) {
+    aof_append(frame.data(), frame.size());
+    if (backlog_active(&g_data.backlog)) {
+        repl_feed(frame.data(), frame.size());
+    }
+}
+
+// follower side: the leader sent a snapshot, it replaces the keyspace
+static bool repl_load_cb(void *, const char *path) {
+    jobs_complete(NULL, NULL);
+    keyspace_clear();
+    if (snapshot_load_file(path) != 0) {
+        return false;
+    }
+    block_signal_all();
+    // a restart without the leader starts from it
+    if (rename(path, g_data.snapshot_path.c_str()) != 0) {
+        log_warn("replication: can't rename the snapshot");
+    }
+    if (aof_is_open() && !aof_rewrite_now()) {
+        log_warn("append-only log: rewrite failed");
+        g_data.last_rewrite_ok = false;
+    }
+    return true;
+}
+
+static bool parse_slot(const std::string &s, uint16_t &slot) {
+    uint64_t v = 0;
+    if (!str2u64(s, v) || v >= k_cluster_slots) {
+        return false;
+    }
+    slot = (uint16_t)v;
+    return true;
+}
+
+// CLUSTER INFO | SLOTS | KEYSLOT key | COUNTKEYSINSLOT slot | GETKEYSINSLOT slot count
+//       | SETSLOT slot NODE|IMPORTING|MIGRATING host:port | SETSLOT slot STABLE
+//       | SETRANGE first last host:port
+static void do_cluster(std::vector<std::string> &cmd, std::string &out) {
+    const char *sub = cmd[1].c_str();
+    if (strcasecmp(sub, "keyslot") == 0 && cmd.size() == 3) {
+        return out_int(out, key_hash_slot(cmd[2].data(), cmd[2].size()));
+    }
+    if (!g_data.cluster_enabled) {
+        return out_err(out, ERR_ARG, "cluster support is disabled");
+    }
+    uint16_t slot = 0, last = 0;
+    std::string host, err;
+    uint16_t port = 0;
+    if (strcasecmp(sub, "info") == 0 && cmd.size() == 2) {
+        std::string info;
+        info_cluster(info);
+        return out_str(out, info);
+    } else if (strcasecmp(sub, "slots") == 0 && cmd.size() == 2) {
+        std::vector<ClusterRange> ranges = cluster_ranges();
+        out_arr(out, (uint32_t)ranges.size());
+        for (const ClusterRange &r : ranges) {
+            out_arr(out, 3);
+            out_int(out, r.first);
+            out_int(out, r.last);
+            out_str(out, r.addr);
+        }
+        return;
+    } else if (strcasecmp(sub, "countkeysinslot") == 0 && cmd.size() == 3) {
+        if (!parse_slot(cmd[2], slot)) {
+            return out_err(out, ERR_ARG, "bad slot");
+        }
+        return out_int(out, g_data.slot_count[slot]);
+    } else if (strcasecmp(sub, "getkeysinslot") == 0 && cmd.size() == 4) {
+        uint64_t count = 0;
+        if (!parse_slot(cmd[2], slot) || !str2u64(cmd[3], count)) {
+            return out_err(out, ERR_ARG, "expect int");
+        }
+        size_t ctx = out_begin_arr(out);
+        uint32_t n = 0;
+        DList *head = &g_data.slot_keys[slot];
+        for (DList *node = head->next; node != head && n < count; node = node->next, ++n) {
+            out_str(out, container_of(node, Entry, slot_node)->key);
+        }
+        return out_end_arr(out, ctx, n);
+    } else if (strcasecmp(sub, "setslot") == 0 && cmd.size() == 5 && parse_slot(cmd[2], slot)) {
+        if (!parse_addr(cmd[4], host, port)) {
+            return out_err(out, ERR_ARG, "bad address");
+        }
+        const char *how = cmd[3].c_str();
+        bool ok = false;
+        if (strcasecmp(how, "node") == 0) {
+            ok = cluster_set_owner(slot, slot, cmd[4], err);
+            block_signal_moved();
+        } else if (strcasecmp(how, "importing") == 0) {
+            ok = cluster_set_importing(slot, cmd[4], err);
+        } else if (strcasecmp(how, "migrating") == 0) {
+            ok = cluster_migrate(slot, cmd[4], err);
+        } else {
+            return out_err(out, ERR_ARG, "syntax error");
+        }
+        return ok ? out_nil(out) : out_err(out, ERR_ARG, err);
+    } else if (strcasecmp(sub, "setslot") == 0 && cmd.size() == 4 && parse_slot(cmd[2], slot)
+        && strcasecmp(cmd[3].c_str(), "stable") == 0)
+    {
+        return cluster_set_stable(slot, err) ? out_nil(out) : out_err(out, ERR_ARG, err);
+    } else if (strcasecmp(sub, "setrange") == 0 && cmd.size() == 5) {
+        if (!parse_slot(cmd[2], slot) || !parse_slot(cmd[3], last) || slot > last) {
+            return out_err(out, ERR_ARG, "bad slot range");
+        }
+        if (!parse_addr(cmd[4], host, port)) {
+            return out_err(out, ERR_ARG, "bad address");
+        }
+        if (!cluster_set_owner(slot, last, cmd[4], err)) {
+            return out_err(out, ERR_ARG, err);
+        }
+        block_signal_moved();
+        return out_nil(out);
+    }
+    out_err(out, ERR_ARG, "syntax error");
+}
+
+// migration batches, the frames of a key are about the size of its value
+const size_t k_migrate_batch_keys = 128;
+const size_t k_migrate_batch_bytes = 256 << 10;
+
+static void migrate_put_cb(const std::vector<std::string> &cmd, void *arg) {
+    put_req(*(std::string *)arg, cmd);
+}
+
+static size_t migrate_take_cb(void *, uint16_t slot, std::string &out, size_t *nframes) {
+    assert(g_data.migrate_batch.empty());
+    jobs_complete(NULL, NULL);
+    DList *head = &g_data.slot_keys[slot];
+    std::vector<std::string> cmd;
+    size_t start = out.size();
+    while (!dlist_empty(head) && g_data.migrate_batch.size() < k_migrate_batch_keys
+        && out.size() - start < k_migrate_batch_bytes)
+    {
+        Entry *ent = container_of(head->next, Entry, slot_node);
+        std::string key = ent->key;
+        ent = entry_detach(key);
+        *nframes += entry_rebuild(ent, cmd, &migrate_put_cb, &out);
+        g_data.migrate_batch.push_back(ent);
+    }
+    g_data.migrate_batch_slot = g_data.migrate_batch.empty() ? -1 : slot;
+    return g_data.migrate_batch.size();
+}
+
+// the target has the keys, the log and the followers drop them
+static void migrate_commit_cb(void *) {
+    bool prop = aof_is_open() || backlog_active(&g_data.backlog);
+    std::vector<std::string> cmd = {"del", ""};
+    for (Entry *ent : g_data.migrate_batch) {
+        if (prop) {
+            cmd[1].swap(ent->key);
+            g_data.prop.clear();
+            put_req(g_data.prop, cmd);
+            propagate(g_data.prop);
+        }
+        entry_dispose(ent, true);
+    }
+    g_data.migrate_batch.clear();
+    g_data.migrate_batch_slot = -1;
+}
+
+// the slot is the target's, the clients waiting on its keys go there
+static void migrate_moved_cb(void *, uint16_t) {
+    block_signal_moved();
+}
+
+// requests for these keys got TRYAGAIN, so nothing took their place
+static void migrate_rollback_cb(void *) {
+    jobs_complete(NULL, NULL);
+    for (Entry *ent : g_data.migrate_batch) {
+        entry_attach(ent);
+    }
+    g_data.migrate_batch.clear();
+    g_data.migrate_batch_slot = -1;
+}
+
+static bool migrate_batch_has(const std::string &key) {
+    for (Entry *ent : g_data.migrate_batch) {
+        if (ent->key == key) {
+            return true;
+        }
+    }
+    return false;
+}
+
+enum {
+    CMD_READONLY = 1 << 0,
+    CMD_WRITE = 1 << 1,
+    CMD_SLICED = 1 << 2,    // may run in slices, see Job
+};
+
+struct Command {
+    const char *name;
+    int32_t arity;      // exact number of args, or -N for at least N
+    uint32_t flags;     // CMD_*
+    void (*proc)(std::vector<std::string> &cmd, std::string &out);
+};
+
+static void do_stats(std::vector<std::string> &cmd, std::string &out);
+
+static void do_hotkeys(std::vector<std::string> &cmd, std::string &out);
+
+// SLOWLOG GET [count] | LEN | RESET
+static void do_slowlog(std::vector<std::string> &cmd, std::string &out) {
+    const char *sub = cmd[1].c_str();
+    if (strcasecmp(sub, "len") == 0 && cmd.size() == 2) {
+        return out_int(out, (int64_t)slowlog_len());
+    }
+    if (strcasecmp(sub, "reset") == 0 && cmd.size() == 2) {
+        slowlog_reset();
+        return out_nil(out);
+    }
+    uint64_t count = 10;
+    if (strcasecmp(sub, "get") != 0 || cmd.size() > 3 || (cmd.size() == 3 && !str2u64(cmd[2], count))) {
+        return out_err(out, ERR_ARG, "usage: SLOWLOG GET [count] | LEN | RESET");
+    }
+    // [id, unix time, usec, [args...], ip:port, fd] per entry, newest first
+    size_t n = std::min<uint64_t>(count, slowlog_len());
+    out_arr(out, (uint32_t)n);
+    for (size_t i = 0; i < n; ++i) {
+        const SlowlogEntry &e = slowlog_get(i);
+        out_arr(out, 6);
+        out_int(out, (int64_t)e.id);
+        out_int(out, e.time);
+        out_int(out, (int64_t)e.usec);
+        out_arr(out, (uint32_t)e.args.size());
+        for (const std::string &arg : e.args) {
+            out_str(out, arg);
+        }
+        out_str(out, e.addr);
+        out_int(out, e.fd);
+    }
+}
+
+static const Command g_commands[] = {
+    {"ping",    -1, CMD_READONLY, do_ping},
+    {"get",     2,  CMD_READONLY, do_get},
+    {"set",     3,  CMD_WRITE,    do_set},
+    {"append",  3,  CMD_WRITE,    do_append},
+    {"del",     -2, CMD_WRITE,    do_del},
+    {"unlink",  -2, CMD_WRITE,    do_unlink},
+    {"info",    -1, CMD_READONLY, do_info},
+    {"keys",    2,  CMD_READONLY | CMD_SLICED, do_keys},
+    {"scan",    -2, CMD_READONLY, do_scan},
+    {"pfadd",   -2, CMD_WRITE,    do_pfadd},
+    {"pfcount", -2, CMD_READONLY, do_pfcount},
+    {"pfmerge", -2, CMD_WRITE,    do_pfmerge},
+    {"save",    1,  CMD_READONLY, do_save},
+    {"bgsave",  1,  CMD_READONLY, do_bgsave},
+    {"bgrewriteaof", 1, CMD_READONLY, do_bgrewriteaof},
+    {"dump",    2,  CMD_READONLY, do_dump},
+    {"restore", -3, CMD_WRITE,    do_restore},
+    {"xadd",    -5, CMD_WRITE,    do_xadd},
+    {"xlen",    2,  CMD_READONLY, do_xlen},
+    {"xrange",  -4, CMD_READONLY | CMD_SLICED, do_xrange},
+    {"xread",   -4, CMD_READONLY | CMD_SLICED, do_xread},
+    {"xtrim",   -4, CMD_WRITE,    do_xtrim},
+    {"cluster", -2, CMD_READONLY, do_cluster},
+    {"stats",   -1, CMD_READONLY, do_stats},
+    {"slowlog", -2, CMD_READONLY, do_slowlog},
+    {"hotkeys", -1, CMD_READONLY, do_hotkeys},
+};
+
+const size_t k_ncommands = sizeof(g_commands) / sizeof(g_commands[0]);
+
+// per command, in the order of g_commands
+struct CmdStats {
+    uint64_t calls;
+    uint64_t errors;    // error replies
+    uint64_t ticks;     // time spent running it
+    Histogram latency;  // in ticks
+};
+
+static CmdStats g_cmd_stats[k_ncommands];
+
+// the keys of each command, in the order of g_commands, from the table
+// shared with the cluster client
+static const KeySpec *g_cmd_keys[k_ncommands];
+
+static void commands_init() {
+    for (size_t i = 0; i < k_ncommands; ++i) {
+        g_cmd_keys[i] = key_spec_lookup(g_commands[i].name);
+    }
+}
+
+static void stats_reset() {
+    for (CmdStats &cs : g_cmd_stats) {
+        cs.calls = cs.errors = cs.ticks = 0;
+        hist_init(&cs.latency);
+    }
+    g_stats.rejected = 0;
+    g_stats.net_in = g_stats.net_out = 0;
+    g_stats.reads = g_stats.writes = 0;
+    g_stats.loops = 0;
+    for (uint32_t i = 0; i < LOOP_NPHASES; ++i) {
+        g_stats.iter_ticks[i] = g_stats.phase_ticks[i] = 0;
+        hist_init(&g_stats.phase_hist[i]);
+    }
+    hist_init(&g_stats.ready_fds);
+    g_stats.poll_calls = g_stats.read_calls = g_stats.write_calls = g_stats.accept_calls = 0;
+    hist_init(&g_stats.read_bytes);
+    hist_init(&g_stats.write_bytes);
+}
+
+static uint64_t command_calls() {
+    uint64_t n = 0;
+    for (const CmdStats &cs : g_cmd_stats) {
+        n += cs.calls;
+    }
+    return n;
+}
+
+static void info_commandstats(std::string &info) {
+    info.append("# Commandstats\r\n");
+    char buf[512];
+    for (size_t i = 0; i < k_ncommands; ++i) {
+        const CmdStats *cs = &g_cmd_stats[i];
+        if (!cs->calls) {
+            continue;
+        }
+        int n = snprintf(buf, sizeof(buf),
+            "cmdstat_%s:calls=%llu,errors=%llu,usec=%.0f,usec_per_call=%.2f,p50_usec=%.2f,p99_usec=%.2f,"
+            "p999_usec=%.2f,max_usec=%.2f\r\n",
+            g_commands[i].name,
+            (unsigned long long)cs->calls,
+            (unsigned long long)cs->errors,
+            ticks_to_usec(cs->ticks),
+            ticks_to_usec(cs->ticks) / (double)cs->calls,
+            ticks_to_usec(hist_percentile(&cs->latency, 50)),
+            ticks_to_usec(hist_percentile(&cs->latency, 99)),
+            ticks_to_usec(hist_percentile(&cs->latency, 99.9)),
+            ticks_to_usec(cs->latency.max));
+        info.append(buf, (size_t)n);
+    }
+}
+
+static void prom_metric(std::string &out, const char *name, const char *type, const char *help, double val) {
+    char buf[512];
+    int n = snprintf(buf, sizeof(buf), "# HELP %s %s\n# TYPE %s %s\n%s %.9g\n", name, help, name, type, name, val);
+    out.append(buf, (size_t)n);
+}
+
+// the upper bounds of the command latency buckets, usec
+static const double k_prom_buckets[] = {
+    1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000, 50000, 100000, 1000000,
+};
+
+// the metrics in the Prometheus text format
+static void stats_prometheus(std::string &out) {
+    struct mallinfo2 mi = mallinfo2();
+    double uptime = (double)(get_monotonic_usec() / 1000 - g_stats.start_ms) / 1000.0;
+    prom_metric(out, "kv_uptime_seconds", "gauge", "Time since the start.", uptime);
+    prom_metric(out, "kv_connected_clients", "gauge", "Open connections.", (double)g_stats.conns);
+    prom_metric(out, "kv_connections_total", "counter", "Accepted connections.", (double)g_stats.conns_total);
+    prom_metric(out, "kv_keys", "gauge", "Keys in the keyspace.", (double)hm_size(&g_data.db));
+    prom_metric(out, "kv_memory_rss_bytes", "gauge", "Resident set size.", (double)get_rss_bytes());
+    prom_metric(out, "kv_memory_heap_bytes", "gauge", "Heap memory in use.", (double)(mi.uordblks + mi.hblkhd));
+    prom_metric(out, "kv_net_input_bytes_total", "counter", "Bytes read from clients.", (double)g_stats.net_in);
+    prom_metric(out, "kv_net_output_bytes_total", "counter", "Bytes written to clients.", (double)g_stats.net_out);
+    prom_metric(out, "kv_reads_total", "counter", "read() calls returning data.", (double)g_stats.reads);
+    prom_metric(out, "kv_writes_total", "counter", "write() calls to clients.", (double)g_stats.writes);
+    prom_metric(out, "kv_rejected_commands_total", "counter",
+        "Requests refused before running: unknown, arity, redirect.", (double)g_stats.rejected);
+    prom_metric(out, "kv_loop_iterations_total", "counter", "Event loop iterations.", (double)g_stats.loops);
+    prom_metric(out, "kv_loop_ready_fds_total", "counter", "Ready fds returned by poll().",
+        (double)g_stats.ready_fds.sum);
+    prom_metric(out, "kv_read_bytes_per_call", "gauge", "Average bytes per read() that got data.",
+        hist_mean(&g_stats.read_bytes));
+    prom_metric(out, "kv_write_bytes_per_call", "gauge", "Average bytes per write().",
+        hist_mean(&g_stats.write_bytes));
+
+    char buf[512];
+    out.append("# HELP kv_loop_phase_seconds_total Event loop time by phase.\n"
+        "# TYPE kv_loop_phase_seconds_total counter\n");
+    for (uint32_t i = 0; i < LOOP_NPHASES; ++i) {
+        int n = snprintf(buf, sizeof(buf), "kv_loop_phase_seconds_total{phase=\"%s\"} %.9f\n",
+            k_loop_phase_names[i], ticks_to_usec(g_stats.phase_ticks[i]) / 1e6);
+        out.append(buf, (size_t)n);
+    }
+    const std::pair<const char *, uint64_t> syscalls[] = {
+        {"poll", g_stats.poll_calls}, {"read", g_stats.read_calls},
+        {"write", g_stats.write_calls}, {"accept", g_stats.accept_calls},
+    };
+    out.append("# HELP kv_syscalls_total System calls of the event loop.\n# TYPE kv_syscalls_total counter\n");
+    for (const auto &sc : syscalls) {
+        int n = snprintf(buf, sizeof(buf), "kv_syscalls_total{call=\"%s\"} %llu\n",
+            sc.first, (unsigned long long)sc.second);
+        out.append(buf, (size_t)n);
+    }
+
+    out.append("# HELP kv_commands_total Commands run.\n# TYPE kv_commands_total counter\n");
+    for (size_t i = 0; i < k_ncommands; ++i) {
+        int n = snprintf(buf, sizeof(buf), "kv_commands_total{cmd=\"%s\"} %llu\n",
+            g_commands[i].name, (unsigned long long)g_cmd_stats[i].calls);
+        out.append(buf, (size_t)n);
+    }
+    out.append("# HELP kv_command_errors_total Commands that replied with an error.\n"
+        "# TYPE kv_command_errors_total counter\n");
+    for (size_t i = 0; i < k_ncommands; ++i) {
+        int n = snprintf(buf, sizeof(buf), "kv_command_errors_total{cmd=\"%s\"} %llu\n",
+            g_commands[i].name, (unsigned long long)g_cmd_stats[i].errors);
+        out.append(buf, (size_t)n);
+    }
+    out.append("# HELP kv_command_duration_seconds Command execution time.\n"
+        "# TYPE kv_command_duration_seconds histogram\n");
+    for (size_t i = 0; i < k_ncommands; ++i) {
+        const CmdStats *cs = &g_cmd_stats[i];
+        if (!cs->calls) {
+            continue;   // no series for the commands never called
+        }
+        for (double le : k_prom_buckets) {
+            uint64_t count = hist_count_le(&cs->latency, clock_ns_to_ticks((uint64_t)(le * 1000)));
+            int n = snprintf(buf, sizeof(buf), "kv_command_duration_seconds_bucket{cmd=\"%s\",le=\"%g\"} %llu\n",
+                g_commands[i].name, le / 1e6, (unsigned long long)count);
+            out.append(buf, (size_t)n);
+        }
+        int n = snprintf(buf, sizeof(buf),
+            "kv_command_duration_seconds_bucket{cmd=\"%s\",le=\"+Inf\"} %llu\n"
+            "kv_command_duration_seconds_sum{cmd=\"%s\"} %.9f\n"
+            "kv_command_duration_seconds_count{cmd=\"%s\"} %llu\n",
+            g_commands[i].name, (unsigned long long)cs->calls,
+            g_commands[i].name, ticks_to_usec(cs->ticks) / 1e6,
+            g_commands[i].name, (unsigned long long)cs->calls);
+        out.append(buf, (size_t)n);
+    }
+}
+
+// STATS: the metrics for Prometheus
+// STATS LOOP: the event loop profile, as INFO LOOP
+// STATS LOOP ON|OFF: start or stop charging time to the loop phases
+// STATS RESET: zero the counters and histograms
+static void do_stats(std::vector<std::string> &cmd, std::string &out) {
+    if (cmd.size() == 2 && strcasecmp(cmd[1].c_str(), "reset") == 0) {
+        stats_reset();
+        return out_nil(out);
+    }
+    if (cmd.size() == 2 && strcasecmp(cmd[1].c_str(), "loop") == 0) {
+        std::string info;
+        info_loop(info);
+        return out_str(out, info);
+    }
+    if (cmd.size() == 3 && strcasecmp(cmd[1].c_str(), "loop") == 0
+        && (strcasecmp(cmd[2].c_str(), "on") == 0 || strcasecmp(cmd[2].c_str(), "off") == 0))
+    {
+        loop_phase(LOOP_OTHER);     // charge the running phase before stopping
+        g_stats.profile = strcasecmp(cmd[2].c_str(), "on") == 0;
+        g_stats.phase_start = clock_ticks();
+        return out_nil(out);
+    }
+    if (cmd.size() != 1) {
+        return out_err(out, ERR_ARG, "usage: STATS [LOOP [ON | OFF] | RESET]");
+    }
+    std::string text;
+    stats_prometheus(text);
+    out_str(out, text);
+}
+
+static const Command *lookup_command(const std::string &name) {
+    for (const Command &c : g_commands) {
+        if (strcasecmp(c.name, name.c_str()) == 0) {
+            return &c;
+        }
+    }
+    return NULL;
+}
+
+static bool check_arity(const Command *c, size_t argc) {
+    return (c->arity > 0 && (int32_t)argc == c->arity) || (c->arity < 0 && (int32_t)argc >= -c->arity);
+}
+
+// the positions of the keys in `cmd`
+static void command_keys(const Command *c, std::vector<std::string> &cmd, std::vector<size_t> &keys) {
+    const KeySpec *ks = g_cmd_keys[c - g_commands];
+    if (!ks) {
+        keys.clear();
+        return;
+    }
+    key_spec_positions(ks, cmd, keys);
+}
+
+// count the keys of a command in the hot key sketch
+static void hotkeys_feed(const Command *c, std::vector<std::string> &cmd) {
+    static std::vector<size_t> keys;
+    command_keys(c, cmd, keys);
+    for (size_t i : keys) {
+        hotkeys_touch(cmd[i], (c->flags & CMD_WRITE) != 0);
+    }
+}
+
+static uint64_t g_hotkeys_decay_ms = 1000;
+
+// HOTKEYS [count]: [key, count, reads, writes] for the hottest keys
+// HOTKEYS ON | OFF | RESET
+static void do_hotkeys(std::vector<std::string> &cmd, std::string &out) {
+    if (cmd.size() == 2 && (strcasecmp(cmd[1].c_str(), "on") == 0 || strcasecmp(cmd[1].c_str(), "off") == 0)) {
+        hotkeys_enable(strcasecmp(cmd[1].c_str(), "on") == 0, g_hotkeys_decay_ms);
+        return out_nil(out);
+    }
+    if (cmd.size() == 2 && strcasecmp(cmd[1].c_str(), "reset") == 0) {
+        hotkeys_reset();
+        return out_nil(out);
+    }
+    uint64_t count = 10;
+    if (cmd.size() > 2 || (cmd.size() == 2 && !str2u64(cmd[1], count))) {
+        return out_err(out, ERR_ARG, "usage: HOTKEYS [count] | ON | OFF | RESET");
+    }
+    if (!g_hotkeys_enabled) {
+        return out_err(out, ERR_ARG, "hot key detection is off, HOTKEYS ON to start it");
+    }
+    static std::vector<HotKey> top;
+    hotkeys_top(top);
+    size_t n = std::min<uint64_t>(count, top.size());
+    out_arr(out, (uint32_t)n);
+    for (size_t i = 0; i < n; ++i) {
+        out_arr(out, 4);
+        out_str(out, top[i].key);
+        out_int(out, (int64_t)top[i].count);
+        out_int(out, (int64_t)top[i].reads);
+        out_int(out, (int64_t)top[i].writes);
+    }
+}
+
+static void out_redirect(std::string &out, int32_t code, const char *what, uint16_t slot,
+    const std::string &addr)
+{
+    out_err(out, code, std::string(what) + " " + std::to_string(slot) + " " + addr);
+}
+
+// cluster mode: false with a redirect or an error in `out` if the command
+// is not for this node
+static bool cluster_route(Conn *conn, bool asking, const Command *c, std::vector<std::string> &cmd,
+    std::string &out)
+{
+    static std::vector<size_t> keys;
+    command_keys(c, cmd, keys);
+    if (keys.empty() || conn->importer) {
+        return true;    // the node migrating a slot here writes anywhere
+    }
+    uint16_t slot = key_hash_slot(cmd[keys[0]].data(), cmd[keys[0]].size());
+    for (size_t i = 1; i < keys.size(); ++i) {
+        if (key_hash_slot(cmd[keys[i]].data(), cmd[keys[i]].size()) != slot) {
+            out_err(out, ERR_CROSSSLOT, "keys in request don't hash to the same slot");
+            return false;
+        }
+    }
+
+    if (cluster_slot_is_mine(slot)) {
+        // the keys already sent are on the target, the ones in flight
+        // will be on one node or the other
+        const std::string *target = cluster_slot_migrating(slot);
+        if (!target) {
+            return true;
+        }
+        size_t missing = 0;
+        for (size_t i : keys) {
+            if (g_data.migrate_batch_slot == slot && migrate_batch_has(cmd[i])) {
+                out_err(out, ERR_TRYAGAIN, "the key is being migrated");
+                return false;
+            }
+            missing += entry_lookup(cmd[i]) ? 0 : 1;
+        }
+        if (missing == 0) {
+            return true;
+        }
+        if (missing < keys.size()) {
+            out_err(out, ERR_TRYAGAIN, "the keys are split across nodes during a migration");
+            return false;
+        }
+        out_redirect(out, ERR_ASK, "ASK", slot, *target);
+        return false;
+    }
+
+    if (asking && cluster_slot_importing(slot)) {
+        return true;
+    }
+    const std::string *owner = cluster_slot_owner(slot);
+    if (!owner) {
+        out_err(out, ERR_CLUSTERDOWN, "hash slot " + std::to_string(slot) + " is not served");
+        return false;
+    }
+    out_redirect(out, ERR_MOVED, "MOVED", slot, *owner);
+    return false;
+}
+
+static void shm_conn_free(ShmConn *shm) {
+    shm_detach(&shm->ch);
+    for (int fd : {shm->memfd, shm->efd_server, shm->efd_client}) {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    delete shm;
+}
+
+// SHM: the rings and their eventfds go with the reply
+static void conn_shm_start(Conn *conn, std::string &out) {
+    if (!conn->local || conn->shm) {
+        return out_err(out, ERR_ARG, "SHM is for the clients of the Unix socket");
+    }
+    ShmConn *shm = new ShmConn();
+    shm->memfd = shm_create(&shm->ch, k_shm_ring_bytes);
+    shm->efd_server = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    shm->efd_client = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (shm->memfd < 0 || shm->efd_server < 0 || shm->efd_client < 0) {
+        log_warn("shm: %s", strerror(errno));
+        shm_conn_free(shm);
+        return out_err(out, ERR_SYSTEM, "can't set up the shared memory");
+    }
+    conn->shm = shm;
+    out_nil(out);
+}
+
+// commands about the connection itself, true if `cmd` was one
+static bool conn_command(Conn *conn, std::vector<std::string> &cmd, std::string &out) {
+    if (strcasecmp(cmd[0].c_str(), "shm") == 0 && cmd.size() == 1) {
+        conn_shm_start(conn, out);
+        return true;
+    }
+    if (strcasecmp(cmd[0].c_str(), "asking") == 0 && cmd.size() == 1) {
+        // the next command may use a slot being imported
+        conn->asking = true;
+        out_nil(out);
+        return true;
+    }
+    if (strcasecmp(cmd[0].c_str(), "cluster") == 0 && cmd.size() == 2
+        && strcasecmp(cmd[1].c_str(), "import") == 0)
+    {
+        // a node migrating slots here, it sends RESTOREs of any size
+        if (!g_data.cluster_enabled) {
+            out_err(out, ERR_ARG, "cluster support is disabled");
+            return true;
+        }
+        conn->importer = true;
+        out_nil(out);
+        return true;
+    }
+    return false;
+}
+
+// the arguments as they were received: SET moved its value out of `cmd`,
+// but the request is still in the read buffer
+static void slowlog_record(Conn *conn, uint64_t ticks) {
+    static std::vector<std::string> args;
+    uint32_t len = 0;
+    memcpy(&len, &conn->rbuf[conn->rbuf_head], 4);
+    if (parse_req(&conn->rbuf[conn->rbuf_head + 4], len, args) != 0) {
+        return;
+    }
+    slowlog_push(args, clock_ticks_to_ns(ticks) / 1000, conn->fd, conn_peer_addr(conn));
+}
+
+// returns true if the command was added to the append-only log
+static bool do_request(Conn *conn, std::vector<std::string> &cmd, std::string &out) {
+    if (conn_command(conn, cmd, out)) {
+        return false;
+    }
+    bool asking = conn->asking;
+    conn->asking = false;   // for one command only
+    const Command *c = lookup_command(cmd[0]);
+    if (!c) {
+        g_stats.rejected++;
+        out_err(out, ERR_UNKNOWN, "unknown command");
+        return false;
+    }
+    if (!check_arity(c, cmd.size())) {
+        g_stats.rejected++;
+        out_err(out, ERR_ARG, "wrong number of arguments");
+        return false;
+    }
+    if (g_data.cluster_enabled && !cluster_route(conn, asking, c, cmd, out)) {
+        g_stats.rejected++;
+        return false;
+    }
+
+    // the follower only runs the writes of its leader
+    if ((c->flags & CMD_WRITE) && repl_link_enabled()) {
+        g_stats.rejected++;
+        out_err(out, ERR_READONLY, "this server is a read-only follower");
+        return false;
+    }
+
+    if (g_hotkeys_enabled) {
+        hotkeys_feed(c, cmd);
+    }
+
+    // SET moves its value out of `cmd`, so a write command is framed before
+    // it runs, and dropped if it fails
+    bool prop = (c->flags & CMD_WRITE) && (aof_is_open() || backlog_active(&g_data.backlog));
+    size_t pos = out.size();
+    if (prop) {
+        g_data.prop.clear();
+        put_req(g_data.prop, cmd);
+    }
+    g_data.cmd_rewritten = false;
+    uint64_t t0 = clock_ticks();
+    uint32_t prev = loop_phase_at(LOOP_EXEC, t0);
+    c->proc(cmd, out);
+    uint64_t t1 = clock_ticks();
+    loop_phase_at(prev, t1);
+    uint64_t dt = t1 - t0;
+    static std::vector<size_t> keys;
+    if (Job *job = g_data.job) {
+        // counted once it is done, see job_done()
+        command_keys(c, cmd, keys);
+        for (size_t i : keys) {
+            job->keys.push_back(cmd[i]);
+        }
+        job->c = c;
+        job->ticks = dt;
+        return false;
+    }
+    if (Block *blk = g_data.block) {
+        // counted when it runs again and answers
+        command_keys(c, cmd, keys);
+        for (size_t i : keys) {
+            blk->keys.push_back(cmd[i]);
+        }
+        return false;
+    }
+    CmdStats *cs = &g_cmd_stats[c - g_commands];
+    cs->calls++;
+    cs->ticks += dt;
+    hist_record(&cs->latency, dt);
+    bool failed = out[pos] == SER_ERR;
+    cs->errors += failed ? 1 : 0;
+    if (slowlog_is_slow(dt)) {
+        slowlog_record(conn, dt);
+    }
+    if (!prop || failed) {
+        return false;
+    }
+    if (g_data.cmd_rewritten) {
+        g_data.prop.clear();
+        put_req(g_data.prop, cmd);
+    }
+    propagate(g_data.prop);
+    return aof_is_open();
+}
+
+// the budget of a turn is for the clients, not for a follower or a node
+// migrating slots here
+static void conn_turn(Conn *conn) {
+    if (conn->turn != g_stats.loops) {
+        conn->turn = g_stats.loops;
+        conn->turn_cmds = 0;
+        conn->turn_bytes = 0;
+    }
+}
+
+static bool conn_over_budget(Conn *conn) {
+    conn_turn(conn);
+    return !conn->follower && !conn->importer
+        && (conn->turn_cmds >= g_turn_cmds || conn->turn_bytes >= g_turn_bytes);
+}
+
+// replies not sent yet, a zero-copy value included
+static size_t conn_unsent(Conn *conn) {
+    size_t n = conn->wbuf_size - conn->wbuf_sent;
+    return conn->zc_pin ? n + conn->zc_pin->len - conn->zc_sent : n;
+}
+
+// past --client-output-hard the client is dropped
+static bool conn_output_over_limit(Conn *conn) {
+    if (!g_output_hard || conn_unsent(conn) <= g_output_hard) {
+        return false;
+    }
+    log_warn("%s: %zu bytes of replies unsent, over the output limit, dropped",
+        conn_peer_addr(conn).c_str(), conn_unsent(conn));
+    g_stats.output_limit_drops++;
+    conn->state = STATE_END;
+    return true;
+}
+
+// a job reads a key that the write `cmd` changes
+static bool job_conflicts(Job *job, std::vector<std::string> &cmd, const std::vector<size_t> &keys) {
+    if (job->done) {
+        return false;
+    }
+    if (job->all_keys) {
+        return true;
+    }
+    for (size_t i : keys) {
+        for (const std::string &key : job->keys) {
+            if (cmd[i] == key) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static bool jobs_block(const Command *c, std::vector<std::string> &cmd) {
+    static std::vector<size_t> keys;
+    command_keys(c, cmd, keys);
+    for (Job *job : g_data.jobs) {
+        if (job_conflicts(job, cmd, keys)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// a write waits for the jobs reading its keys, and a long command waits
+// behind the writes already waiting, so a stream of them can't hold the
+// writes back forever
+static bool job_must_wait(std::vector<std::string> &cmd) {
+    const Command *c = lookup_command(cmd[0]);
+    if (!c) {
+        return false;
+    }
+    if (c->flags & CMD_SLICED) {
+        return !g_data.job_waiters.empty();
+    }
+    return (c->flags & CMD_WRITE) && jobs_block(c, cmd);
+}
+
+static void job_step(Job *job, uint64_t deadline) {
+    uint64_t t0 = clock_ticks();
+    job->deadline = deadline;
+    // past the largest reply the rest would be dropped anyway
+    job->done = job->step(job) || job->out.size() > 4 + k_max_res;
+    job->ticks += clock_ticks() - t0;
+}
+
+// a write that can't wait (the leader's stream, a resync, a slot
+// migration): the jobs in its way, all of them without `c`, run to the end
+// now. Their replies go out with the next turn.
+static void jobs_complete(const Command *c, std::vector<std::string> *cmd) {
+    static std::vector<size_t> keys;
+    if (c) {
+        command_keys(c, *cmd, keys);
+    }
+    for (Job *job : g_data.jobs) {
+        if (!job->done && (!c || job_conflicts(job, *cmd, keys))) {
+            job_step(job, 0);
+        }
+    }
+}
+
+// remove a request from the buffer. Only the head moves, the rest of a
+// pipeline is moved to the front once, by conn_compact().
+static void conn_consume(Conn *conn, size_t n) {
+    conn->rbuf_head += n;
+    if (conn->rbuf_head == conn->rbuf_size) {
+        conn->rbuf_head = conn->rbuf_size = 0;
+    }
+}
+
+// only a partial request is left, make room after it for the next read
+static void conn_compact(Conn *conn) {
+    size_t remain = conn->rbuf_size - conn->rbuf_head;
+    if (remain && conn->rbuf_head) {
+        memmove(&conn->rbuf[0], &conn->rbuf[conn->rbuf_head], remain);
+    }
+    conn->rbuf_head = 0;
+    conn->rbuf_size = remain;
+    if (conn->rbuf.size() > g_rbuf_cap && remain <= g_rbuf_cap) {
+        // back to the usual size after a large RESTORE
+        conn->rbuf.resize(g_rbuf_cap);
+        conn->rbuf.shrink_to_fit();
+    }
+}
+
+static bool try_one_request(Conn *conn) {
+    if (conn->shm && !conn->shm->active) {
+        return false;   // the next requests come through the ring
+    }
+    if (conn->job || conn->job_wait) {
+        return false;   // the next requests wait for the job
+    }
+    // try to parse a request from the buffer
+    size_t avail = conn->rbuf_size - conn->rbuf_head;
+    if (avail < 4) {
+        // not enough data in the buffer
+        conn_compact(conn);
+        return false;
+    }
+
+    uint32_t len = 0;
+    memcpy(&len, &conn->rbuf[conn->rbuf_head], 4);
+    if (len > k_max_msg && !(conn->importer && len <= k_repl_max_frame)) {
+        log_warn("request too long: %u bytes", len);
+        conn->state = STATE_END;
+        return false;
+    }
+
+    if (4 + len > avail) {
+        // not enough data in the buffer
+        conn_compact(conn);
+        if (4 + len > conn->rbuf.size()) {
+            conn->rbuf.resize(4 + len);
+        }
+        return false;
+    }
+
+    conn_turn(conn);
+    if (conn->turn_cmds >= g_turn_cmds && !conn->follower && !conn->importer) {
+        // the others go first, the rest runs next turn
+        if (!conn->deferred) {
+            conn->deferred = true;
+            g_stats.turns_deferred++;
+        }
+        return false;
+    }
+    conn->turn_cmds++;
+
+    // got one request, do something with it
+    std::vector<std::string> &cmd = conn->cmd;
+    if (0 != parse_req(&conn->rbuf[conn->rbuf_head + 4], len, cmd) || cmd.empty()) {
+        log_warn("bad request");
+        conn->state = STATE_END;
+        return false;
+    }
+    if (conn->follower || strcasecmp(cmd[0].c_str(), "sync") == 0) {
+        if (!conn->follower && conn->wbuf_size > conn->wbuf_sent) {
+            return false;   // the batched replies go out before the stream
+        }
+        // a follower gets the replication stream instead of replies
+        repl_request(conn, cmd);
+        conn_consume(conn, 4 + len);
+        return conn->state == STATE_REQ;
+    }
+    log_debug("client says: %s", cmd[0].c_str());
+    if ((!g_data.jobs.empty() || !g_data.job_waiters.empty()) && job_must_wait(cmd)) {
+        // the request stays in the buffer until the jobs are out of its way
+        conn->job_wait = true;
+        g_data.job_waiters.push_back(conn);
+        g_stats.job_waits++;
+        return false;
+    }
+
+    // generating the response directly in the write buffer, after the header
+    // (and after the replies not sent yet, when they are batched)
+    size_t base = conn->wbuf_size;
+    conn->wbuf.resize(base);
+    conn->wbuf.append(4, '\0');
+    g_data.zc_reply_ok = conn->zc_ok && !conn->zc_pin;
+    g_data.job_ok = g_slice_ticks != 0;
+    g_data.block_ok = !conn->block || !conn->block->expired;
+    g_data.block_ids = conn->block ? &conn->block->ids : NULL;
+    bool logged = do_request(conn, cmd, conn->wbuf);
+    g_data.zc_reply_ok = false;
+    g_data.job_ok = false;
+    g_data.block_ok = false;
+    g_data.block_ids = NULL;
+    if (Block *blk = g_data.block) {
+        // nothing to read yet, the request stays in the buffer until an
+        // entry comes or the time is up (blocked_serve(), blocked_expire())
+        g_data.block = NULL;
+        conn->wbuf.resize(base);
+        if (conn->wbuf_size > conn->wbuf_sent) {
+            delete blk;     // the batched replies go out first, then it runs again
+            return false;
+        }
+        if (Block *prev = conn->block) {
+            // woken, but the entries are gone already: it waits again, as long
+            // as it was going to
+            blk->deadline_ms = prev->deadline_ms;
+            delete prev;
+        }
+        block_park(conn, blk);
+        return false;
+    }
+    if (conn->block) {
+        // a request that had blocked got its answer
+        delete conn->block;
+        conn->block = NULL;
+    }
+    if (Job *job = g_data.job) {
+        // the rest of the command runs in the next turns, its reply comes
+        // once it is done (job_done())
+        g_data.job = NULL;
+        job->conn = conn;
+        conn->job = job;
+        g_data.jobs.push_back(job);
+        g_stats.jobs++;
+        conn->wbuf.resize(base);
+        conn_consume(conn, 4 + len);
+        return false;
+    }
+    if (conn->wbuf.size() - base - 4 > k_max_res) {
+        conn->wbuf.resize(base + 4);
+        out_err(conn->wbuf, ERR_2BIG, "response is too big");
+    }
+    uint32_t wlen = (uint32_t)(conn->wbuf.size() - base - 4);
+    if (Entry *ent = g_data.zc_reply) {
+        // the value follows the header, from where it is stored
+        g_data.zc_reply = NULL;
+        conn->zc_pin = zc_pin(ent);
+        wlen += (uint32_t)conn->zc_pin->len;
+    }
+    memcpy(&conn->wbuf[base], &wlen, 4);
+    conn->wbuf_size = conn->wbuf.size();
+
+    conn_consume(conn, 4 + len);
+
+    if (conn_output_over_limit(conn)) {
+        return false;
+    }
+    if (logged) {
+        // the reply is sent by aof_commit() once the log is written
+        conn->state = STATE_RES;
+        conn->aof_wait = true;
+        g_data.aof_waiters.push_back(conn);
+        return false;
+    }
+    if (g_data.batch_replies) {
+        // sent by the write stage of the loop, see conn_replies_ready().
+        // Nothing can follow a zero-copy value.
+        return conn_unsent(conn) < g_output_soft && !conn->zc_pin;
+    }
+    conn->state = STATE_RES;
+    state_res(conn);
+
+    // continue the outer loop if the request was fully processed
+    return (conn->state == STATE_REQ);
+}
+
+/*
+The read() and write() of a connection. On shared memory they copy out of
+the request ring and into the reply ring, and wake the client only if it
+sleeps; an empty (full) ring is an EAGAIN. The reply to SHM carries the fds.
+Called from the I/O threads too, they only touch the connection.
+*/
+static ssize_t conn_recv(Conn *conn, void *buf, size_t cap) {
+    ShmConn *shm = conn->shm;
+    if (!shm || !shm->active) {
+        return read(conn->fd, buf, cap);
+    }
+    ssize_t rv = shm_read(&shm->ch, SHM_REQ, buf, cap);
+    if (rv > 0 && shm_wake_writer(&shm->ch, SHM_REQ)) {
+        shm_signal(shm->efd_client);
+    }
+    errno = rv < 0 ? EPROTO : EAGAIN;
+    return rv == 0 ? -1 : rv;
+}
+
+static ssize_t conn_send(Conn *conn, const void *buf, size_t len) {
+    ShmConn *shm = conn->shm;
+    if (shm && !shm->active && !shm->fds_sent) {
+        int fds[3] = {shm->memfd, shm->efd_server, shm->efd_client};
+        ssize_t rv = send_fds(conn->fd, buf, len, fds, 3);
+        shm->fds_sent = rv > 0;
+        return rv;
+    }
+    if (conn->zc_pin) {
+        // the header of a zero-copy reply, in the same segment as its value
+        return send(conn->fd, buf, len, MSG_MORE);
+    }
+    if (!shm || !shm->active) {
+        return write(conn->fd, buf, len);
+    }
+    ssize_t rv = shm_write(&shm->ch, SHM_RES, buf, len);
+    if (rv > 0 && shm_wake_reader(&shm->ch, SHM_RES)) {
+        shm_signal(shm->efd_client);
+    }
+    errno = rv < 0 ? EPROTO : EAGAIN;
+    return rv == 0 ? -1 : rv;
+}
+
+static bool conn_read_done(Conn *conn, ssize_t rv, int err);
+
+// batched replies: the requests that were read have run, what they produced
+// waits for the write stage
+static void conn_replies_ready(Conn *conn) {
+    if (conn->state == STATE_REQ && conn->wbuf_size > conn->wbuf_sent) {
+        conn->state = STATE_RES;
+    }
+}
+
+/**
+ * @brief Attempt to read data from the connection's file descriptor into the read buffer.
+ *
+ * This function performs non-blocking I/O operations to fill the read buffer (`rbuf`) associated 
+ * with a connection. It ensures that the buffer is not overfilled and gracefully handles various 
+ * edge cases such as interrupted system calls (EINTR) and temporary unavailability of data (EAGAIN).
+ * 
+ * The function also checks for EOF conditions and updates the connection's state accordingly.
+ * If the buffer contains enough data for one or more complete requests, it processes each request 
+ * sequentially (pipelining) by calling `try_one_request()` in a loop. The connection state transitions
+ * based on the successful processing of data (from `STATE_REQ` to `STATE_RES` or `STATE_END`).
+ *
+ * @param conn Pointer to the connection structure containing the state and buffers.
+ * @return true if the connection is still in the `STATE_REQ` state and ready for further reading.
+ * @return false if the connection has encountered an error, reached EOF, or moved to another state.
+ */
+static bool try_fill_buffer(Conn *conn) {
+    // try to fill the buffer
+    assert(conn->rbuf_size < conn->rbuf.size());
+    ssize_t rv = 0;
+    do{
+        size_t cap = conn->rbuf.size() - conn->rbuf_size; // remaining capacity in buffer
+        uint32_t prev = loop_phase(LOOP_READ);
+        rv = conn_recv(conn, &conn->rbuf[conn->rbuf_size], cap); // reading data from current buffer position
+        loop_phase(prev);
+        g_stats.read_calls++;
+    } while (rv < 0 && errno == EINTR);
+    return conn_read_done(conn, rv, errno);
+}
+
+// the result of a read() into `rbuf`, then the requests it completed
+static bool conn_read_done(Conn *conn, ssize_t rv, int err) {
+    if (rv < 0 && err == EAGAIN) {
+        // got EAGAIN, stop
+        return false;
+    }
+
+    if (rv < 0) {
+        log_warn("read() error: %s", strerror(err));
+        conn->state = STATE_END;
+        return false;
+    }
+
+    if (rv == 0) { // Connection is closed (EOF)
+        if (conn->rbuf_size > 0) {
+            log_info("unexpected EOF");
+        } else {
+            log_debug("EOF");
+        }
+        conn->state = STATE_END;
+        return false;
+    }
+
+    // if read succeeds, conn->rbuf_size is updated by number of bytes read
+    conn->rbuf_size += (size_t)rv;
+    conn_turn(conn);
+    conn->turn_bytes += (size_t)rv;
+    g_stats.reads++;
+    g_stats.net_in += (uint64_t)rv;
+    hist_record(&g_stats.read_bytes, (uint64_t)rv);
+    assert(conn->rbuf_size <= conn->rbuf.size()); // to make sure new buffer size doesn't exceed the total buffer capacity
+
+    // Try to process requests one by one
+    // Why is there a loop ? "Pipelining", handling multiple requests from client in single read
+    uint32_t prev = loop_phase(LOOP_PARSE);
+    while (try_one_request(conn)) {}
+    conn_replies_ready(conn);
+    loop_phase(prev);
+    return (conn->state == STATE_REQ);
+
+}
+
+/**
+ * @brief Handle the request processing state (`STATE_REQ`) for a connection.
+ *
+ * This function is responsible for managing the connection when it is in the request-handling phase.
+ * It continuously attempts to fill the read buffer by calling `try_fill_buffer()` until the buffer
+ * can no longer be filled or the connection transitions to another state (e.g., `STATE_RES` or `STATE_END`).
+ *
+ * @param conn Pointer to the connection structure containing the state and buffers.
+ */
+static void state_req(Conn *conn) {
+    // first the requests the budget of the last turn left in the buffer
+    while (conn->state == STATE_REQ && try_one_request(conn)) {}
+    // Keep filling the buffer as long as there is room, data and budget
+    while (conn->state == STATE_REQ && !conn->deferred && conn->rbuf_size < conn->rbuf.size()
+        && !conn_over_budget(conn) && try_fill_buffer(conn)) {}
+    conn_replies_ready(conn);
+}
+
+static bool conn_write_done(Conn *conn, ssize_t rv, int err);
+static bool conn_zc_flush(Conn *conn);
+
+static bool try_flush_buffer(Conn *conn) {
+    if (conn->zc_pin && conn->wbuf_sent == conn->wbuf_size) {
+        return conn_zc_flush(conn);
+    }
+    ssize_t rv = 0;
+    do {
+        size_t remain = conn->wbuf_size - conn->wbuf_sent;
+        uint32_t prev = loop_phase(LOOP_WRITE);
+        rv = conn_send(conn, &conn->wbuf[conn->wbuf_sent], remain);
+        loop_phase(prev);
+        g_stats.write_calls++;
+    } while (rv < 0 && errno == EINTR);
+    return conn_write_done(conn, rv, errno);
+}
+
+// a write buffer larger than this is freed once its replies are out
+const size_t k_wbuf_keep = 1 << 20;
+
+// response was fully sent, change state back
+static void conn_res_done(Conn *conn) {
+    conn->state = STATE_REQ;
+    conn->wbuf_sent = 0;
+    conn->wbuf_size = 0;
+    if (conn->wbuf.capacity() > k_wbuf_keep) {
+        // a large reply (GET of a big value, a job's) isn't kept for good
+        std::string().swap(conn->wbuf);
+    }
+    if (ShmConn *shm = conn->shm; shm && shm->fds_sent && !shm->active) {
+        // the reply to SHM is out, from now on the rings
+        shm->active = true;
+        close(shm->memfd);
+        shm->memfd = -1;
+        g_stats.shm_conns++;
+    }
+}
+
+// the result of a write() from `wbuf`
+static bool conn_write_done(Conn *conn, ssize_t rv, int err) {
+    if (rv < 0 && err == EAGAIN) {
+        return false;   // the socket buffer is full, wait for POLLOUT
+    }
+
+    if (rv < 0) {
+        log_warn("write() error: %s", strerror(err));
+        conn->state = STATE_END;
+        return false;
+    }
+
+    conn->wbuf_sent += (size_t)rv;
+    assert(conn->wbuf_sent <= conn->wbuf_size);
+    g_stats.writes++;
+    g_stats.net_out += (uint64_t)rv;
+    hist_record(&g_stats.write_bytes, (uint64_t)rv);
+
+    if (conn->wbuf_sent == conn->wbuf_size && !conn->zc_pin) {
+        conn_res_done(conn);
+        return false;
+    }
+
+    // still got some data in wbuf, could try to write again
+    return true;
+}
+
+/*
+The value of a zero-copy reply, once the rest of `wbuf` is out. Each send
+holds the value until its completion comes back on the error queue, see
+conn_zc_reap(). Over the socket's budget of pinned pages the rest is copied.
+*/
+static bool conn_zc_flush(Conn *conn) {
+    ZcPin *pin = conn->zc_pin;
+    const char *data = pin->data + conn->zc_sent;
+    size_t remain = pin->len - conn->zc_sent;
+    ssize_t rv = 0;
+    bool zc = true;
+    do {
+        uint32_t prev = loop_phase(LOOP_WRITE);
+        rv = zc_send(conn->fd, data, remain);
+        if (rv < 0 && errno == ENOBUFS) {
+            zc = false;
+            rv = write(conn->fd, data, remain);
+        }
+        loop_phase(prev);
+        g_stats.write_calls++;
+    } while (rv < 0 && errno == EINTR);
+    if (rv < 0 && errno == EAGAIN) {
+        return false;
+    }
+    if (rv < 0) {
+        log_warn("write() error: %s", strerror(errno));
+        conn->state = STATE_END;
+        return false;
+    }
+    if (zc) {
+        pin->refs++;
+        conn->zc_inflight.push_back({conn->zc_seq++, pin});
+        g_stats.zc_sends++;
+    }
+    conn->zc_sent += (size_t)rv;
+    g_stats.writes++;
+    g_stats.net_out += (uint64_t)rv;
+    hist_record(&g_stats.write_bytes, (uint64_t)rv);
+    if (conn->zc_sent < pin->len) {
+        return true;
+    }
+    conn->zc_pin = NULL;
+    conn->zc_sent = 0;
+    zc_unpin(pin);
+    conn_res_done(conn);
+    return false;
+}
+
+// the completions of the error queue of `fd` (POLLERR): the values they
+// hold go back. True if the kernel copied some of them.
+static bool zc_reap(int fd, std::deque<ZcSend> &q) {
+    uint32_t lo = 0, hi = 0;
+    bool copied = false;
+    bool any_copied = false;
+    while (zc_completion(fd, &lo, &hi, &copied)) {
+        if (copied) {
+            g_stats.zc_copied += hi - lo + 1;
+            any_copied = true;
+        }
+        for (size_t i = 0; i < q.size();) {
+            if (q[i].seq - lo <= hi - lo) {
+                zc_unpin(q[i].pin);
+                q.erase(q.begin() + (ptrdiff_t)i);
+            } else {
+                ++i;
+            }
+        }
+    }
+    return any_copied;
+}
+
+static void conn_zc_reap(Conn *conn) {
+    if (zc_reap(conn->fd, conn->zc_inflight)) {
+        // copied anyway (the client is on this host...), plain sends are cheaper
+        conn->zc_ok = false;
+    }
+}
+
+static void zc_linger_close(ZcLinger *zl, bool abort) {
+    if (abort) {
+        struct linger lg = {1, 0};
+        setsockopt(zl->fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    }
+    (void)close(zl->fd);
+    for (ZcSend &zs : zl->inflight) {
+        zc_unpin(zs.pin);
+    }
+    delete zl;
+}
+
+// the lingering sockets that got completions, and those past their deadline
+static void zc_linger_check(const std::vector<pollfd> &pfds, size_t first, size_t n) {
+    std::vector<ZcLinger *> &v = g_data.zc_lingering;
+    uint64_t now_ms = get_monotonic_usec() / 1000;
+    for (size_t i = 0; i < n; ++i) {
+        if (pfds[first + i].revents) {
+            (void)zc_reap(v[i]->fd, v[i]->inflight);
+        }
+    }
+    size_t kept = 0;
+    for (ZcLinger *zl : v) {
+        if (zl->inflight.empty() || now_ms >= zl->deadline_ms) {
+            zc_linger_close(zl, !zl->inflight.empty());
+        } else {
+            v[kept++] = zl;
+        }
+    }
+    v.resize(kept);
+}
+
+static void state_res(Conn *conn) {
+    while (try_flush_buffer(conn)) {}
+}
+
+/*
+The output of a follower: the reply to sync, the snapshot (with sendfile(),
+it doesn't go through user space) and then the stream.
+*/
+static void follower_flush(Conn *conn) {
+    Follower *f = conn->follower;
+    while (conn->state != STATE_END) {
+        ssize_t rv = 0;
+        if (f->pre_sent < f->pre.size()) {
+            rv = write(conn->fd, &f->pre[f->pre_sent], f->pre.size() - f->pre_sent);
+            if (rv > 0) {
+                f->pre_sent += (size_t)rv;
+            }
+        } else if (f->state == FOLLOWER_SEND_SNAPSHOT) {
+            if (f->snap_off == f->snap_size) {
+                close(f->snap_fd);
+                f->snap_fd = -1;
+                f->state = FOLLOWER_ONLINE;
+                f->ack_ms = get_monotonic_usec() / 1000;
+                log_info("replication: snapshot sent to %s", f->addr.c_str());
+                continue;
+            }
+            off_t off = (off_t)f->snap_off;
+            uint64_t left = f->snap_size - f->snap_off;
+            rv = sendfile(conn->fd, f->snap_fd, &off, left < (1 << 20) ? (size_t)left : (1 << 20));
+            if (rv > 0) {
+                f->snap_off += (uint64_t)rv;
+            }
+        } else if (f->state == FOLLOWER_ONLINE && conn->wbuf_sent < conn->wbuf.size()) {
+            rv = write(conn->fd, &conn->wbuf[conn->wbuf_sent], conn->wbuf.size() - conn->wbuf_sent);
+            if (rv > 0) {
+                conn->wbuf_sent += (size_t)rv;
+            }
+        } else {
+            break;
+        }
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv < 0 && errno == EAGAIN) {
+            break;
+        }
+        if (rv <= 0) {
+            log_warn("replication: write() error: %s", strerror(errno));
+            conn->state = STATE_END;
+        }
+    }
+    // drop what was sent, without moving the rest every time
+    if (conn->wbuf_sent == conn->wbuf.size()) {
+        conn->wbuf.clear();
+        conn->wbuf_sent = 0;
+    } else if (conn->wbuf_sent >= (1 << 20) && conn->wbuf_sent * 2 >= conn->wbuf.size()) {
+        conn->wbuf.erase(0, conn->wbuf_sent);
+        conn->wbuf_sent = 0;
+    }
+}
+
+static bool follower_has_output(Conn *conn) {
+    Follower *f = conn->follower;
+    return f->pre_sent < f->pre.size() || f->state == FOLLOWER_SEND_SNAPSHOT
+        || (f->state == FOLLOWER_ONLINE && conn->wbuf_sent < conn->wbuf.size());
+}
+
+static void connection_io(Conn *conn) {
+    if (conn->follower) {
+        // the acks, then the output
+        state_req(conn);
+        if (conn->state != STATE_END) {
+            follower_flush(conn);
+        }
+    } else if (conn->state == STATE_REQ) {
+        state_req(conn);
+    } else if (conn->state == STATE_RES) {
+        state_res(conn);
+        // the pipelined requests left in the read buffer while the replies
+        // waited for POLLOUT
+        while (conn->state == STATE_REQ && try_one_request(conn)) {}
+        conn_replies_ready(conn);
+    } else {
+        assert(0); // not expected
+    }
+    if (g_data.batch_replies && !conn->follower && conn->state == STATE_RES && !conn->aof_wait) {
+        // a client outside of io_stage() (shared memory): the replies
+        // batched now, then the requests a full batch left behind
+        state_res(conn);
+        while (conn->state == STATE_REQ && try_one_request(conn)) {}
+        conn_replies_ready(conn);
+    }
+}
+
+static void conn_destroy(std::vector<Conn *> &fd2conn, Conn *conn) {
+    if (Follower *f = conn->follower) {
+        log_warn("replication: lost follower %s", f->addr.c_str());
+        if (f->snap_fd >= 0) {
+            close(f->snap_fd);
+        }
+        std::vector<Conn *> &v = g_data.followers;
+        v.erase(std::find(v.begin(), v.end(), conn));
+        delete f;
+    }
+    if (ShmConn *shm = conn->shm) {
+        if (shm->active) {
+            if ((size_t)shm->efd_server < fd2conn.size() && fd2conn[shm->efd_server] == conn) {
+                fd2conn[shm->efd_server] = NULL;
+            }
+            g_stats.shm_conns--;
+        }
+        shm_conn_free(shm);
+    }
+    fd2conn[conn->fd] = NULL;
+    if (conn->zc_pin) {
+        zc_unpin(conn->zc_pin);     // not sent yet
+    }
+    if (conn->zc_inflight.empty()) {
+        (void)close(conn->fd);
+    } else {
+        // the kernel may still read the sends in flight, see ZcLinger
+        (void)shutdown(conn->fd, SHUT_RDWR);
+        ZcLinger *zl = new ZcLinger();
+        zl->fd = conn->fd;
+        zl->inflight.swap(conn->zc_inflight);
+        zl->deadline_ms = get_monotonic_usec() / 1000 + k_zc_linger_ms;
+        g_data.zc_lingering.push_back(zl);
+    }
+    // the clients waiting for its job see that it is gone next turn
+    if (Job *job = conn->job) {
+        g_data.jobs.erase(std::find(g_data.jobs.begin(), g_data.jobs.end(), job));
+        delete job;
+    }
+    if (conn->job_wait) {
+        std::deque<Conn *> &w = g_data.job_waiters;
+        w.erase(std::find(w.begin(), w.end(), conn));
+    }
+    if (Block *blk = conn->block) {
+        block_unlink(blk);
+        delete blk;
+    }
+    delete conn;
+    g_stats.conns--;
+}
+
+/*
+The I/O of the clients with --io-threads. The read() of every client with
+input goes to the I/O threads, then the loop parses and runs what they
+brought in, in the order of the poll set, and the replies pile up in the
+write buffers; then the write() of every client with replies goes to the I/O
+threads. The threads only make the system call into or out of the buffers,
+the accounting, the commands and the state changes stay on the loop.
+*/
+static void io_read_cb(void *arg, size_t i) {
+    Conn *conn = ((Conn **)arg)[i];
+    if (conn->rbuf_size == conn->rbuf.size()) {
+        // full of requests a budget left, they run first
+        conn->io_rv = -1;
+        conn->io_errno = EAGAIN;
+        return;
+    }
+    ssize_t rv = 0;
+    do {
+        rv = conn_recv(conn, &conn->rbuf[conn->rbuf_size], conn->rbuf.size() - conn->rbuf_size);
+    } while (rv < 0 && errno == EINTR);
+    conn->io_rv = rv;
+    conn->io_errno = rv < 0 ? errno : 0;
+}
+
+static void io_write_cb(void *arg, size_t i) {
+    Conn *conn = ((Conn **)arg)[i];
+    ssize_t rv = 0;
+    do {
+        rv = conn_send(conn, &conn->wbuf[conn->wbuf_sent], conn->wbuf_size - conn->wbuf_sent);
+    } while (rv < 0 && errno == EINTR);
+    conn->io_rv = rv;
+    conn->io_errno = rv < 0 ? errno : 0;
+}
+
+static void io_stage(std::vector<Conn *> &fd2conn, std::vector<Conn *> &readers, std::vector<Conn *> &writers) {
+    uint32_t prev = loop_phase(LOOP_READ);
+    iothreads_run(&io_read_cb, readers.data(), readers.size());
+    loop_phase(LOOP_PARSE);
+    for (Conn *conn : readers) {
+        g_stats.read_calls++;
+        conn_read_done(conn, conn->io_rv, conn->io_errno);
+        // the requests left by the budget of the last turn, if nothing came
+        while (conn->state == STATE_REQ && try_one_request(conn)) {}
+        conn_replies_ready(conn);
+        if (conn->state == STATE_END) {
+            conn_destroy(fd2conn, conn);
+        } else if (conn->state == STATE_RES && !conn->aof_wait) {
+            writers.push_back(conn);
+        }
+    }
+
+    loop_phase(LOOP_WRITE);
+    iothreads_run(&io_write_cb, writers.data(), writers.size());
+    loop_phase(LOOP_PARSE);
+    for (Conn *conn : writers) {
+        g_stats.write_calls++;
+        if (conn_write_done(conn, conn->io_rv, conn->io_errno) && conn->zc_pin) {
+            state_res(conn);    // a zero-copy value, from the loop
+        }
+        // the requests left behind by a full batch, written next time
+        while (conn->state == STATE_REQ && try_one_request(conn)) {}
+        conn_replies_ready(conn);
+        if (conn->state == STATE_END) {
+            conn_destroy(fd2conn, conn);
+        }
+    }
+    loop_phase(prev);
+}
+
+/*
+Group commit: a single write (and a single fsync under "always") for the
+write commands of every client in this loop iteration, then their replies
+are released. Returns false if the log couldn't be written or synced, the
+replies stay held and the write is retried.
+*/
+static bool aof_commit(std::vector<Conn *> &fd2conn) {
+    if (!aof_flush()) {
+        log_error("append-only log: write or fsync error");
+        return false;
+    }
+    std::vector<Conn *> waiters;
+    waiters.swap(g_data.aof_waiters);
+    for (Conn *conn : waiters) {
+        conn->aof_wait = false;
+        state_res(conn);
+        // pipelined requests left in the read buffer
+        while (conn->state == STATE_REQ && try_one_request(conn)) {}
+        conn_replies_ready(conn);
+        if (conn->state == STATE_END) {
+            conn_destroy(fd2conn, conn);
+        }
+    }
+    return true;
+}
+
+static void job_done(std::vector<Conn *> &fd2conn, Job *job);
+static void jobs_release();
+
+/*
+The jobs in flight, a slice each in turn until the turn's share is used up,
+so the loop gets back to poll() after about --command-slice-usec however
+much they have left. Then the replies of those done, and the waiting
+clients that may go on.
+*/
+static void jobs_run(std::vector<Conn *> &fd2conn) {
+    uint32_t prev = loop_phase(LOOP_EXEC);
+    uint64_t now = clock_ticks();
+    uint64_t end = now + g_slice_ticks;
+    size_t njobs = g_data.jobs.size();
+    uint64_t slice = njobs ? std::max(g_slice_ticks / njobs, g_slice_ticks / 8) : 0;
+    for (size_t i = 0; i < njobs && now < end; ++i) {
+        // round robin, the first next time is the one after the last run
+        Job *job = g_data.jobs.front();
+        g_data.jobs.pop_front();
+        g_data.jobs.push_back(job);
+        if (!job->done) {
+            job_step(job, std::min(now + slice, end));
+            now = clock_ticks();
+        }
+    }
+    loop_phase(prev);
+    for (size_t i = 0; i < g_data.jobs.size();) {
+        Job *job = g_data.jobs[i];
+        if (!job->done) {
+            ++i;
+            continue;
+        }
+        g_data.jobs.erase(g_data.jobs.begin() + (ptrdiff_t)i);
+        job_done(fd2conn, job);
+    }
+    jobs_release();
+}
+
+// the command is counted, its reply goes out after those not sent yet, then
+// the requests the client sent meanwhile. The time is that of the slices.
+static void job_done(std::vector<Conn *> &fd2conn, Job *job) {
+    Conn *conn = job->conn;
+    conn->job = NULL;
+    CmdStats *cs = &g_cmd_stats[job->c - g_commands];
+    cs->calls++;
+    cs->ticks += job->ticks;
+    hist_record(&cs->latency, job->ticks);
+    if (slowlog_is_slow(job->ticks)) {
+        slowlog_push(job->cmd, clock_ticks_to_ns(job->ticks) / 1000, conn->fd, conn_peer_addr(conn));
+    }
+    if (job->out.size() > 4 + k_max_res) {
+        job->out.resize(4);
+        out_err(job->out, ERR_2BIG, "response is too big");
+    }
+    uint32_t wlen = (uint32_t)(job->out.size() - 4);
+    memcpy(&job->out[0], &wlen, 4);
+    if (conn->wbuf_sent == conn->wbuf_size) {
+        // nothing else to send, the reply is taken as it is, not copied
+        conn->wbuf.swap(job->out);
+        conn->wbuf_sent = 0;
+    } else {
+        conn->wbuf.resize(conn->wbuf_size);
+        conn->wbuf.append(job->out);
+    }
+    conn->wbuf_size = conn->wbuf.size();
+    delete job;
+    if (!conn_output_over_limit(conn)) {
+        conn->state = STATE_RES;
+        state_res(conn);
+        while (conn->state == STATE_REQ && try_one_request(conn)) {}
+        conn_replies_ready(conn);
+    }
+    if (conn->state == STATE_END) {
+        conn_destroy(fd2conn, conn);
+    }
+}
+
+// the waiting clients in arrival order, up to the first write still in the
+// way of a job; those let go run next turn as if readable
+static void jobs_release() {
+    static std::vector<std::string> cmd;
+    while (!g_data.job_waiters.empty()) {
+        Conn *conn = g_data.job_waiters.front();
+        uint32_t len = 0;
+        memcpy(&len, &conn->rbuf[conn->rbuf_head], 4);
+        const Command *c = NULL;
+        if (parse_req(&conn->rbuf[conn->rbuf_head + 4], len, cmd) == 0 && !cmd.empty()) {
+            c = lookup_command(cmd[0]);
+        }
+        if (c && (c->flags & CMD_WRITE) && jobs_block(c, cmd)) {
+            break;
+        }
+        g_data.job_waiters.pop_front();
+        conn->job_wait = false;
+        conn->deferred = true;
+    }
+}
+
+// the request of a client let go by blocked_serve() or blocked_expire()
+static void block_rerun(std::vector<Conn *> &fd2conn, Conn *conn) {
+    conn->state = STATE_REQ;
+    while (conn->state == STATE_REQ && try_one_request(conn)) {}
+    conn_replies_ready(conn);
+    if (conn->state == STATE_END) {
+        conn_destroy(fd2conn, conn);
+    }
+}
+
+// the waiter of `link` has entries to read, or an error to get. One whose
+// key was deleted answers nil.
+static bool block_link_ready(BlockLink *link, bool deleted) {
+    Block *blk = link->conn->block;
+    const std::string &key = link->bk->key;
+    if (g_data.cluster_enabled && !cluster_slot_is_mine(key_hash_slot(key.data(), key.size()))) {
+        return true;    // MOVED
+    }
+    Entry *ent = entry_lookup(key);
+    if (!ent) {
+        blk->expired = blk->expired || deleted;
+        return deleted;
+    }
+    const StreamID &id = blk->ids[(size_t)(link - blk->links.data())];
+    return ent->type != T_STREAM || stream_id_cmp(id, ent->stream->last_id) < 0;
+}
+
+// the waiters of the ready keys, oldest first; the writes of those woken
+// may make more keys ready
+static void blocked_serve(std::vector<Conn *> &fd2conn) {
+    static std::vector<Conn *> ready, woken;
+    uint32_t prev = loop_phase(LOOP_PARSE);
+    while (!g_data.ready_keys.empty()) {
+        BlockKey *bk = block_key_lookup(g_data.ready_keys.front());
+        g_data.ready_keys.pop_front();
+        if (!bk) {
+            continue;   // its waiters left
+        }
+        bool deleted = bk->deleted;
+        bk->ready = bk->deleted = false;
+        ready.clear();
+        for (DList *node = bk->waiters.next; node != &bk->waiters; node = node->next) {
+            BlockLink *link = container_of(node, BlockLink, node);
+            if (block_link_ready(link, deleted)) {
+                ready.push_back(link->conn);
+            }
+        }
+        // out of the queues before anything runs, `bk` may go with them
+        woken.clear();
+        for (Conn *conn : ready) {
+            if (conn->state == STATE_BLOCKED) {     // once, for a key given twice
+                block_unlink(conn->block);
+                conn->state = STATE_REQ;
+                woken.push_back(conn);
+            }
+        }
+        for (Conn *conn : woken) {
+            block_rerun(fd2conn, conn);
+        }
+    }
+    loop_phase(prev);
+}
+
+// the waiters whose time is up answer nil
+static void blocked_expire(std::vector<Conn *> &fd2conn) {
+    uint64_t now_ms = get_monotonic_usec() / 1000;
+    std::vector<Block *> &h = g_data.block_timers;
+    uint32_t prev = loop_phase(LOOP_PARSE);
+    while (!h.empty() && h[0]->deadline_ms <= now_ms) {
+        Block *blk = h[0];
+        blk->expired = true;
+        block_unlink(blk);
+        g_stats.blocked_timeouts++;
+        block_rerun(fd2conn, blk->conn);
+    }
+    loop_phase(prev);
+}
+
+// until the next deadline of a waiter, for poll()
+static int block_timeout_ms() {
+    uint64_t now_ms = get_monotonic_usec() / 1000;
+    uint64_t deadline = g_data.block_timers[0]->deadline_ms;
+    return deadline <= now_ms ? 0 : (int)std::min<uint64_t>(deadline - now_ms, INT32_MAX);
+}
+
+// send the stream of this iteration, after it was written to the log
+static void repl_flush_followers(std::vector<Conn *> &fd2conn) {
+    std::vector<Conn *> followers = g_data.followers;
+    for (Conn *conn : followers) {
+        if (conn->state != STATE_END && follower_has_output(conn)) {
+            follower_flush(conn);
+        }
+        if (conn->state == STATE_END) {
+            conn_destroy(fd2conn, conn);
+        }
+    }
+}
+
+// once per second: the heartbeat, the timeouts and the stats
+static void repl_cron() {
+    repl_link_cron();
+    repl_start_bgsave();
+    uint64_t now_ms = get_monotonic_usec() / 1000;
+    if (now_ms - g_data.repl_cron_ms < 1000) {
+        return;
+    }
+    uint64_t end_off = g_data.backlog.end_off;
+    if (g_data.repl_cron_ms) {
+        g_data.repl_bytes_per_sec = (end_off - g_data.repl_off_mark) * 1000 / (now_ms - g_data.repl_cron_ms);
+    }
+    g_data.repl_off_mark = end_off;
+    g_data.repl_cron_ms = now_ms;
+    if (g_data.followers.empty()) {
+        return;
+    }
+    // the followers measure their lag with it
+    std::string ping;
+    put_req(ping, {"ping", std::to_string(repl_unix_msec())});
+    repl_feed(ping.data(), ping.size());
+    for (Conn *conn : g_data.followers) {
+        Follower *f = conn->follower;
+        if (f->state == FOLLOWER_ONLINE && now_ms - f->ack_ms > k_repl_timeout_ms) {
+            log_warn("replication: timeout of %s", f->addr.c_str());
+            conn->state = STATE_END;
+        }
+    }
+}
+
+struct ReplayState {
+    std::vector<std::string> cmd;
+    std::string out;
+    const Command *last = NULL;
+};
+
+// the commands run inline, without the logging and error paths of
+// do_request
+static bool replay_command(ReplayState *st, std::vector<std::string> &cmd) {
+    // a log is mostly long runs of the same command, skip the table search
+    const Command *c = st->last;
+    if (!c || strcasecmp(c->name, cmd[0].c_str()) != 0) {
+        c = st->last = lookup_command(cmd[0]);
+    }
+    if (!c || !check_arity(c, cmd.size())) {
+        return false;
+    }
+    st->out.clear();
+    c->proc(cmd, st->out);
+    return true;
+}
+
+// the parser reuses the same strings for every record
+static bool aof_replay_cb(const uint8_t *req, size_t len, void *arg) {
+    ReplayState *st = (ReplayState *)arg;
+    if (0 != parse_req(req, len, st->cmd) || st->cmd.empty()) {
+        return false;
+    }
+    return replay_command(st, st->cmd);
+}
+
+// follower side: a command of the stream, logged like a client's
+static void repl_apply_cb(void *arg, std::vector<std::string> &cmd, const uint8_t *frame, size_t len) {
+    ReplayState *st = (ReplayState *)arg;
+    if (!g_data.jobs.empty()) {
+        // only a write that runs can be in their way; NULL would be every job
+        const Command *c = lookup_command(cmd[0]);
+        if (c && (c->flags & CMD_WRITE) && check_arity(c, cmd.size())) {
+            jobs_complete(c, &cmd);
+        }
+    }
+    if (!replay_command(st, cmd)) {
+        log_warn("replication: skipping an unknown command");
+        return;
+    }
+    if (st->out[0] != SER_ERR) {
+        aof_append((const char *)frame, len);
+    }
+}
+
+// the log has every write since it was created, so it replaces the snapshot
+static void persistence_load() {
+    if (!g_data.aof_enabled) {
+        snapshot_load();
+        return;
+    }
+    uint64_t start_us = get_monotonic_usec();
+    ReplayState st;
+    uint64_t ncmds = 0;
+    int rv = aof_replay(g_data.aof_path.c_str(), &aof_replay_cb, &st, &ncmds);
+    if (rv == -2) {
+        die("the append-only log is corrupt");
+    }
+    if (rv == -1) {
+        // no log yet, it starts from the snapshot
+        snapshot_load();
+        std::string tmp = aof_rewrite_tmp_path();
+        if (!aof_rewrite_write(tmp) || rename(tmp.c_str(), g_data.aof_path.c_str()) != 0) {
+            die("write the append-only log");
+        }
+    } else {
+        log_info("replayed %llu commands in %.1f ms",
+            (unsigned long long)ncmds, (get_monotonic_usec() - start_us) / 1e3);
+    }
+    if (!aof_open(g_data.aof_path.c_str(), g_data.aof_fsync)) {
+        die("open() the append-only log");
+    }
+}
+
+// the Unix socket for the clients on this host, it replaces a stale one
+static int unix_listen(const std::string &path) {
+    struct sockaddr_un addr = {};
+    if (path.size() >= sizeof(addr.sun_path)) {
+        die("unix socket path too long");
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        die("socket()");
+    }
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path.c_str(), path.size());
+    (void)unlink(path.c_str());
+    if (bind(fd, (const sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0) {
+        die("unix socket");
+    }
+    fd_set_nb(fd);
+    return fd;
+}
+
+int main(int argc, char **argv) {
+    std::string leader_host;
+    uint16_t leader_port = 0;
+    std::string announce_host = "127.0.0.1";
+    uint16_t announce_port = 0;     // --port by default
+    std::string cluster_config = "cluster.conf";
+    const char *log_path = NULL;
+    int log_level = LOG_INFO;
+    int64_t slowlog_slower_than = 10000;
+    bool hotkeys = false;
+    size_t io_threads = 0;      // 0: no batching, the I/O of a client right away
+    uint64_t slowlog_max_len = 128;
+    for (int i = 1; i < argc; ++i) {
+        uint64_t v = 0;
+        if (strcmp(argv[i], "--key-index") == 0) {
+            g_data.key_index_enabled = true;
+        } else if (strcmp(argv[i], "--lazyfree-del") == 0) {
+            g_data.lazyfree_del = true;
+        } else if (strcmp(argv[i], "--lazyfree-overwrite") == 0) {
+            g_data.lazyfree_overwrite = true;
+        } else if (strcmp(argv[i], "--snapshot") == 0 && i + 1 < argc) {
+            g_data.snapshot_path = argv[++i];
+        } else if (strcmp(argv[i], "--appendonly") == 0 && i + 1 < argc) {
+            g_data.aof_enabled = true;
+            g_data.aof_path = argv[++i];
+        } else if (strcmp(argv[i], "--appendfsync") == 0 && i + 1 < argc
+            && aof_parse_fsync(argv[i + 1], &g_data.aof_fsync))
+        {
+            ++i;
+        } else if (strcmp(argv[i], "--port") == 0 && i + 1 < argc
+            && str2u64(argv[i + 1], v) && v > 0 && v <= 65535)
+        {
+            g_data.port = (uint16_t)v;
+            ++i;
+        } else if (strcmp(argv[i], "--replicaof") == 0 && i + 1 < argc
+            && parse_addr(argv[i + 1], leader_host, leader_port))
+        {
+            ++i;
+        } else if (strcmp(argv[i], "--repl-backlog-size") == 0 && i + 1 < argc
+            && str2u64(argv[i + 1], v) && v > 0)
+        {
+            g_data.backlog_size = (size_t)v;
+            ++i;
+        } else if (strcmp(argv[i], "--cluster") == 0) {
+            g_data.cluster_enabled = true;
+        } else if (strcmp(argv[i], "--cluster-config") == 0 && i + 1 < argc) {
+            cluster_config = argv[++i];
+        } else if (strcmp(argv[i], "--cluster-announce") == 0 && i + 1 < argc
+            && parse_addr(argv[i + 1], announce_host, announce_port))
+        {
+            ++i;
+        } else if (strcmp(argv[i], "--slowlog-slower-than") == 0 && i + 1 < argc
+            && (strcmp(argv[i + 1], "-1") == 0 || (str2u64(argv[i + 1], v) && v <= (uint64_t)k_slowlog_max_usec)))
+        {
+            slowlog_slower_than = strcmp(argv[i + 1], "-1") == 0 ? -1 : (int64_t)v;
+            ++i;
+        } else if (strcmp(argv[i], "--slowlog-max-len") == 0 && i + 1 < argc
+            && str2u64(argv[i + 1], v) && v <= k_slowlog_max_len)
+        {
+            slowlog_max_len = v;
+            ++i;
+        } else if (strcmp(argv[i], "--hotkeys") == 0) {
+            hotkeys = true;
+        } else if (strcmp(argv[i], "--hotkeys-decay-ms") == 0 && i + 1 < argc
+            && str2u64(argv[i + 1], v) && v > 0)
+        {
+            g_hotkeys_decay_ms = v;
+            ++i;
+        } else if (strcmp(argv[i], "--unixsocket") == 0 && i + 1 < argc) {
+            g_data.unixsocket = argv[++i];
+        } else if (strcmp(argv[i], "--io-threads") == 0 && i + 1 < argc
+            && str2u64(argv[i + 1], v) && v > 0 && v <= k_iothreads_max)
+        {
+            io_threads = (size_t)v;
+            ++i;
+        } else if (strcmp(argv[i], "--zerocopy") == 0 && i + 1 < argc
+            && str2u64(argv[i + 1], v) && (v == 0 || v >= k_zc_min_bytes))
+        {
+            g_zc_threshold = (size_t)v;
+            ++i;
+        } else if (strcmp(argv[i], "--client-turn-cmds") == 0 && i + 1 < argc
+            && str2u64(argv[i + 1], v) && v > 0 && v <= UINT32_MAX)
+        {
+            g_turn_cmds = (uint32_t)v;
+            ++i;
+        } else if (strcmp(argv[i], "--client-turn-bytes") == 0 && i + 1 < argc
+            && str2u64(argv[i + 1], v) && v > 0)
+        {
+            g_turn_bytes = (size_t)v;
+            ++i;
+        } else if (strcmp(argv[i], "--client-output-soft") == 0 && i + 1 < argc
+            && str2u64(argv[i + 1], v) && v > 0)
+        {
+            g_output_soft = (size_t)v;
+            ++i;
+        } else if (strcmp(argv[i], "--client-output-hard") == 0 && i + 1 < argc
+            && str2u64(argv[i + 1], v))
+        {
+            g_output_hard = (size_t)v;
+            ++i;
+        } else if (strcmp(argv[i], "--command-slice-usec") == 0 && i + 1 < argc
+            && str2u64(argv[i + 1], v))
+        {
+            g_slice_usec = v;
+            ++i;
+        } else if (strcmp(argv[i], "--logfile") == 0 && i + 1 < argc) {
+            log_path = argv[++i];
+        } else if (strcmp(argv[i], "--loglevel") == 0 && i + 1 < argc
+            && log_parse_level(argv[i + 1]) >= 0)
+        {
+            log_level = log_parse_level(argv[++i]);
+        } else {
+            fprintf(stderr, "usage: %s [--key-index] [--lazyfree-del] [--lazyfree-overwrite]"
+                " [--snapshot path] [--appendonly path] [--appendfsync always|everysec|no]"
+                " [--port n] [--unixsocket path] [--replicaof host:port] [--repl-backlog-size bytes]"
+                " [--cluster] [--cluster-config path] [--cluster-announce host:port]"
+                " [--slowlog-slower-than usec] [--slowlog-max-len n] [--hotkeys] [--hotkeys-decay-ms ms]"
+                " [--io-threads n] [--zerocopy bytes]"
+                " [--client-turn-cmds n] [--client-turn-bytes bytes] [--client-output-soft bytes] [--client-output-hard bytes]"
+                " [--command-slice-usec usec] [--logfile path] [--loglevel debug|info|warn|error]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (!log_init(log_path, log_level)) {
+        perror(log_path);
+        return 1;
+    }
+    // a client or a follower that went away must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+    clock_init();
+    g_slice_ticks = clock_ns_to_ticks(g_slice_usec * 1000);
+    commands_init();
+    stats_reset();
+    slowlog_init(slowlog_slower_than, (size_t)slowlog_max_len);
+    hotkeys_enable(hotkeys, g_hotkeys_decay_ms);
+    if (io_threads) {
+        iothreads_init(io_threads);
+        g_data.batch_replies = true;
+        g_rbuf_cap = k_io_batch_bytes;
+    }
+    g_stats.start_ms = get_monotonic_usec() / 1000;
+    if (g_data.key_index_enabled) {
+        rax_init(&g_data.key_index);
+    }
+    if (g_data.cluster_enabled) {
+        g_data.slot_keys.resize(k_cluster_slots);
+        g_data.slot_count.assign(k_cluster_slots, 0);
+        for (DList &head : g_data.slot_keys) {
+            dlist_init(&head);
+        }
+        std::string self = announce_host + ":" + std::to_string(announce_port ? announce_port : g_data.port);
+        cluster_init(self, cluster_config);
+        MigrateHandler h = {NULL, &migrate_take_cb, &migrate_commit_cb, &migrate_rollback_cb, &migrate_moved_cb};
+        cluster_migrate_init(h);
+    }
+    lazyfree_init();
+    persistence_load();
+    g_data.replid = repl_gen_id();
+    ReplayState repl_st;
+    if (!leader_host.empty()) {
+        ReplHandler h = {&repl_st, &repl_load_cb, &repl_apply_cb};
+        repl_link_init(leader_host, leader_port, g_data.snapshot_path + ".repl", h);
+    }
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        die("socket()");
+    }
+
+    // this is needed for most server applications
+    int val = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+
+    // bind
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = ntohs(g_data.port);
+    addr.sin_addr.s_addr = ntohl(0);    // wildcard address 0.0.0.0
+    int rv = bind(fd, (const sockaddr *)&addr, sizeof(addr));
+    if (rv) {
+        die("bind()");
+    }
+
+    // listen
+    rv = listen(fd, SOMAXCONN);
+    if (rv) {
+        die("listen()");
+    }
+
+    // a map of all client connections, keyed by fd
+    vector<Conn*> fd2conn;
+    
+    // set the listen fd to non-blocking mode
+    fd_set_nb(fd);
+    int unix_fd = g_data.unixsocket.empty() ? -1 : unix_listen(g_data.unixsocket);
+
+    // the event loop
+    vector<pollfd> poll_args;
+    vector<Conn *> io_readers, io_writers;
+    // the poll positions of the clients with requests left from the last turn
+    vector<size_t> deferred;
+    bool aof_ok = true;
+    g_stats.phase_start = clock_ticks();
+    
+    while (true) {
+        // prepare the arguments of the poll()
+        poll_args.clear();
+
+        // for convenience, the listening fds are put in the first positions
+        struct pollfd pfd = {fd, POLLIN, 0};
+        poll_args.push_back(pfd);
+        if (unix_fd >= 0) {
+            poll_args.push_back({unix_fd, POLLIN, 0});
+        }
+        size_t nlisten = poll_args.size();
+
+        // connection fds
+        deferred.clear();
+        for (size_t fdi = 0; fdi < fd2conn.size(); ++fdi) {
+            Conn *conn = fd2conn[fdi];
+            if (!conn || conn->aof_wait || conn->fd != (int)fdi) {
+                continue;   // the eventfds of shared memory come with the socket
+            }
+            if ((conn->job || conn->job_wait) && conn->state == STATE_REQ) {
+                continue;   // nothing to do until the job is done
+            }
+            bool carried = conn->deferred;
+            conn->deferred = false;
+            if (conn->state == STATE_BLOCKED) {
+                // nothing is read until it is woken, only a hang-up matters
+                poll_args.push_back({conn->fd, POLLRDHUP, 0});
+                continue;
+            }
+            if (ShmConn *shm = conn->shm; shm && shm->active) {
+                // the socket only tells that the client left, the eventfd that
+                // the rings have something, or will once we said we sleep
+                poll_args.push_back({conn->fd, 0, 0});
+                fd2conn_set(fd2conn, shm->efd_server, conn);
+                bool sleep = conn->state == STATE_REQ
+                    ? shm_wait_data(&shm->ch, SHM_REQ) : shm_wait_room(&shm->ch, SHM_RES);
+                if (!sleep || carried) {
+                    shm_signal(shm->efd_server);
+                }
+                poll_args.push_back({shm->efd_server, POLLIN, 0});
+                continue;
+            }
+            struct pollfd pfd = {};
+            pfd.fd = conn->fd;
+            if (conn->state == STATE_REQ) {
+                pfd.events = POLLIN;
+            } else {
+                pfd.events = POLLOUT;
+            }
+            // pfd.events = (conn->state == STATE_REQ) ? POLLIN : POLLOUT;
+            if (conn->follower) {
+                // the acks come in while the stream goes out
+                pfd.events = POLLIN | (follower_has_output(conn) ? POLLOUT : 0);
+            }
+            pfd.events = pfd.events | POLLERR;
+            if (carried && conn->state == STATE_REQ) {
+                // requests left from the last turn, handled as if readable
+                deferred.push_back(poll_args.size());
+            }
+            poll_args.push_back(pfd);
+        }
+        // the link to the leader, after the connections and the sockets
+        // waiting for zero-copy completions
+        size_t nconn_fds = poll_args.size();
+        for (ZcLinger *zl : g_data.zc_lingering) {
+            poll_args.push_back({zl->fd, 0, 0});    // POLLERR
+        }
+        size_t nlinger = g_data.zc_lingering.size();
+        size_t link_pfd_idx = poll_args.size();
+        struct pollfd link_pfd = {};
+        if (repl_link_pollfd(&link_pfd)) {
+            poll_args.push_back(link_pfd);
+        }
+        // then the connection to the target of a slot migration
+        size_t cluster_pfd_idx = poll_args.size();
+        struct pollfd cluster_pfd = {};
+        if (cluster_pollfd(&cluster_pfd)) {
+            poll_args.push_back(cluster_pfd);
+        }
+
+        // poll for active fds
+        // the timeout argument doesn't matter here, unless replies are
+        // waiting for the log
+        int timeout = 1000;
+        if (repl_link_enabled() || !g_data.followers.empty() || cluster_migration_pending()) {
+            timeout = 100;      // for repl_cron(), cluster_cron()
+        }
+        if (!g_data.aof_waiters.empty()) {
+            timeout = aof_ok ? 0 : 100;
+        }
+        if (!g_data.block_timers.empty()) {
+            timeout = std::min(timeout, block_timeout_ms());
+        }
+        if (!g_data.zc_lingering.empty()) {
+            timeout = std::min(timeout, 100);   // for their deadline
+        }
+        if (!deferred.empty() || !g_data.jobs.empty()) {
+            timeout = 0;
+        }
+        loop_phase(LOOP_POLL);
+        int rv = poll(poll_args.data(), (nfds_t)poll_args.size(), timeout);
+        if (rv < 0) {
+            die("poll");
+        }
+        loop_phase(LOOP_OTHER);
+        g_stats.poll_calls++;
+        hist_record(&g_stats.ready_fds, (uint64_t)rv);
+        for (size_t i : deferred) {
+            poll_args[i].revents |= POLLIN;
+        }
+
+        // process active connections
+        io_readers.clear();
+        io_writers.clear();
+        for (size_t i = nlisten; i < nconn_fds; ++i) {
+            if (poll_args[i].revents) {
+                Conn *conn = fd2conn[poll_args[i].fd];
+                if (!conn) {
+                    continue;   // closed by its other fd
+                }
+                if ((poll_args[i].revents & POLLERR) && !conn->zc_inflight.empty()) {
+                    // zero-copy completions, not an error of the socket
+                    conn_zc_reap(conn);
+                    poll_args[i].revents &= (short)~POLLERR;
+                    if (!poll_args[i].revents) {
+                        continue;
+                    }
+                }
+                if (conn->state == STATE_BLOCKED) {
+                    conn->state = STATE_END;    // it left while it waited
+                } else if (conn->shm && conn->shm->active) {
+                    if (poll_args[i].fd == conn->fd) {
+                        conn->state = STATE_END;    // the client is gone
+                    } else {
+                        shm_drain(conn->shm->efd_server);
+                        connection_io(conn);
+                    }
+                } else if (g_data.batch_replies && !conn->follower) {
+                    (conn->state == STATE_REQ ? io_readers : io_writers).push_back(conn);
+                    continue;
+                } else {
+                    connection_io(conn);
+                }
+                if (conn->state == STATE_END) {
                     // client closed normally, or something bad happened.
                     // destroy this connection
-                    fd2conn[conn->fd] = NULL;
-                    (void)close(conn->fd);
-                    free(conn);
+                    conn_destroy(fd2conn, conn);
                 }
             }
         }
+        if (g_data.batch_replies) {
+            io_stage(fd2conn, io_readers, io_writers);
+        }
+
+        if (nlinger) {
+            zc_linger_check(poll_args, nconn_fds, nlinger);
+        }
+        if (link_pfd_idx < cluster_pfd_idx && poll_args[link_pfd_idx].revents) {
+            repl_link_io(poll_args[link_pfd_idx].revents);
+        }
+        if (cluster_pfd_idx < poll_args.size() && poll_args[cluster_pfd_idx].revents) {
+            cluster_io(poll_args[cluster_pfd_idx].revents);
+        }
 
         // try to accept a new connection if the listening fd is active
-        if (poll_args[0].revents) {
-            (void)accept_new_conn(fd2conn, fd);
+        if (poll_args[0].revents || (nlisten > 1 && poll_args[1].revents)) {
+            loop_phase(LOOP_ACCEPT);
+            if (poll_args[0].revents) {
+                (void)accept_new_conn(fd2conn, fd, false);
+            }
+            if (nlisten > 1 && poll_args[1].revents) {
+                (void)accept_new_conn(fd2conn, unix_fd, true);
+            }
+            loop_phase(LOOP_OTHER);
+        }
+
+        bgsave_check();
+        aof_rewrite_check();
+        repl_cron();
+        if (g_hotkeys_enabled) {
+            hotkeys_cron(get_monotonic_usec() / 1000);
+        }
+        if (g_data.cluster_enabled) {
+            cluster_cron();
+        }
+        if (!g_data.jobs.empty() || !g_data.job_waiters.empty()) {
+            jobs_run(fd2conn);
+        }
+        aof_ok = aof_commit(fd2conn);
+        // the entries are in the log by now
+        if (aof_ok && !g_data.ready_keys.empty()) {
+            blocked_serve(fd2conn);
+        }
+        if (!g_data.block_timers.empty()) {
+            blocked_expire(fd2conn);
         }
+        repl_flush_followers(fd2conn);
 
+        loop_iteration_end();
     }
 
 
@@ -0,0 +1,206 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include "shmring.h"
+
+static size_t shm_map_size(size_t ring_bytes) {
+    return sizeof(ShmHeader) + 2 * ring_bytes;
+}
+
+static void shm_map(ShmChannel *ch, void *p, size_t ring_bytes) {
+    ch->hdr = (ShmHeader *)p;
+    ch->data[SHM_REQ] = (uint8_t *)p + sizeof(ShmHeader);
+    ch->data[SHM_RES] = ch->data[SHM_REQ] + ring_bytes;
+    ch->ring_bytes = ring_bytes;
+    ch->map_size = shm_map_size(ring_bytes);
+}
+
+int shm_create(ShmChannel *ch, size_t ring_bytes) {
+    int fd = memfd_create("kv-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) {
+        return -1;
+    }
+    size_t size = shm_map_size(ring_bytes);
+    void *p = MAP_FAILED;
+    // sealed, so that the peer can't shrink it under the mapping (SIGBUS)
+    if (ftruncate(fd, (off_t)size) == 0 && fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == 0) {
+        p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (p == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    // a new memfd is zeroed: the counters and the flags start at 0
+    shm_map(ch, p, ring_bytes);
+    ch->hdr->magic = k_shm_magic;
+    ch->hdr->ring_bytes = (uint32_t)ring_bytes;
+    return fd;
+}
+
+bool shm_attach(ShmChannel *ch, int memfd) {
+    struct stat st = {};
+    if (fstat(memfd, &st) != 0 || (size_t)st.st_size < sizeof(ShmHeader)) {
+        return false;
+    }
+    void *p = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (p == MAP_FAILED) {
+        return false;
+    }
+    ShmHeader *hdr = (ShmHeader *)p;
+    size_t ring_bytes = hdr->ring_bytes;
+    if (hdr->magic != k_shm_magic || ring_bytes == 0 || (ring_bytes & (ring_bytes - 1))
+        || shm_map_size(ring_bytes) != (size_t)st.st_size)
+    {
+        munmap(p, (size_t)st.st_size);
+        return false;
+    }
+    shm_map(ch, p, ring_bytes);
+    return true;
+}
+
+void shm_detach(ShmChannel *ch) {
+    if (ch->hdr) {
+        munmap(ch->hdr, ch->map_size);
+    }
+    *ch = ShmChannel();
+}
+
+ssize_t shm_write(ShmChannel *ch, uint32_t ring, const void *src, size_t n) {
+    ShmRing *r = &ch->hdr->rings[ring];
+    size_t cap = ch->ring_bytes;
+    uint64_t tail = r->tail.load(std::memory_order_relaxed);
+    uint64_t head = r->head.load(std::memory_order_acquire);
+    if (tail - head > cap) {
+        return -1;
+    }
+    n = n < cap - (tail - head) ? n : cap - (tail - head);
+    size_t off = (size_t)(tail & (cap - 1));
+    size_t first = n < cap - off ? n : cap - off;
+    memcpy(&ch->data[ring][off], src, first);
+    memcpy(&ch->data[ring][0], (const uint8_t *)src + first, n - first);
+    r->tail.store(tail + n, std::memory_order_release);
+    return (ssize_t)n;
+}
+
+ssize_t shm_read(ShmChannel *ch, uint32_t ring, void *dst, size_t n) {
+    ShmRing *r = &ch->hdr->rings[ring];
+    size_t cap = ch->ring_bytes;
+    uint64_t head = r->head.load(std::memory_order_relaxed);
+    uint64_t tail = r->tail.load(std::memory_order_acquire);
+    if (tail - head > cap) {
+        return -1;
+    }
+    n = n < tail - head ? n : (size_t)(tail - head);
+    size_t off = (size_t)(head & (cap - 1));
+    size_t first = n < cap - off ? n : cap - off;
+    memcpy(dst, &ch->data[ring][off], first);
+    memcpy((uint8_t *)dst + first, &ch->data[ring][0], n - first);
+    r->head.store(head + n, std::memory_order_release);
+    return (ssize_t)n;
+}
+
+bool shm_wait_data(ShmChannel *ch, uint32_t ring) {
+    ShmRing *r = &ch->hdr->rings[ring];
+    r->reader_waiting.store(1, std::memory_order_seq_cst);
+    if (r->tail.load(std::memory_order_seq_cst) != r->head.load(std::memory_order_relaxed)) {
+        r->reader_waiting.store(0, std::memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
+
+bool shm_wait_room(ShmChannel *ch, uint32_t ring) {
+    ShmRing *r = &ch->hdr->rings[ring];
+    r->writer_waiting.store(1, std::memory_order_seq_cst);
+    uint64_t head = r->head.load(std::memory_order_seq_cst);
+    if (r->tail.load(std::memory_order_relaxed) - head < ch->ring_bytes) {
+        r->writer_waiting.store(0, std::memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
+
+bool shm_wake_reader(ShmChannel *ch, uint32_t ring) {
+    ShmRing *r = &ch->hdr->rings[ring];
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return r->reader_waiting.load(std::memory_order_relaxed)
+        && r->reader_waiting.exchange(0, std::memory_order_relaxed);
+}
+
+bool shm_wake_writer(ShmChannel *ch, uint32_t ring) {
+    ShmRing *r = &ch->hdr->rings[ring];
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return r->writer_waiting.load(std::memory_order_relaxed)
+        && r->writer_waiting.exchange(0, std::memory_order_relaxed);
+}
+
+void shm_signal(int efd) {
+    uint64_t one = 1;
+    ssize_t rv = 0;
+    do {
+        rv = write(efd, &one, sizeof(one));
+    } while (rv < 0 && errno == EINTR);
+}
+
+void shm_drain(int efd) {
+    uint64_t n = 0;
+    ssize_t rv = 0;
+    do {
+        rv = read(efd, &n, sizeof(n));
+    } while (rv < 0 && errno == EINTR);
+}
+
+ssize_t send_fds(int sock, const void *buf, size_t len, const int *fds, size_t nfds) {
+    struct iovec iov = {(void *)buf, len};
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    char ctl[CMSG_SPACE(sizeof(int) * 4)] = {};
+    if (nfds > 4) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (nfds) {
+        msg.msg_control = ctl;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+        memcpy(CMSG_DATA(cm), fds, sizeof(int) * nfds);
+    }
+    return sendmsg(sock, &msg, MSG_NOSIGNAL);
+}
+
+ssize_t recv_fds(int sock, void *buf, size_t len, int *fds, size_t max, size_t *nfds) {
+    struct iovec iov = {buf, len};
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    char ctl[CMSG_SPACE(sizeof(int) * 4)] = {};
+    msg.msg_control = ctl;
+    msg.msg_controllen = sizeof(ctl);
+    ssize_t rv = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    *nfds = 0;
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); rv >= 0 && cm; cm = CMSG_NXTHDR(&msg, cm)) {
+        if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        size_t n = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t i = 0; i < n; ++i) {
+            int fd = -1;
+            memcpy(&fd, CMSG_DATA(cm) + i * sizeof(int), sizeof(int));
+            if (*nfds < max) {
+                fds[(*nfds)++] = fd;
+            } else {
+                close(fd);
+            }
+        }
+    }
+    return rv;
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <atomic>
+
+/*
+Shared-memory transport for the clients on the same host.
+
+A channel is a memfd holding two single-producer single-consumer byte rings:
+the requests (client to server) and the replies (server to client), with the
+same framing as on a socket. The server creates it when a client connected
+to the Unix socket sends SHM, and passes back the memfd and two eventfds with
+the reply (SCM_RIGHTS): one the client signals to wake the server, one the
+server signals to wake the client. From then on the bytes go through the
+rings instead of the socket, which stays open so each side sees the other
+go away.
+
+`head` (moved by the consumer) and `tail` (moved by the producer) are
+free-running counters, there are no locks. A side is only signaled if it
+said it would sleep: before blocking in poll(), the consumer of an empty
+ring (the producer of a full one) raises its `waiting` flag and looks at the
+ring again; after moving its counter, the other side looks at the flag,
+with a full fence in between. Either the sleeper sees the move or the mover
+sees the flag, no wakeup is lost, and while both sides are busy requests and
+replies cross without a system call.
+
+The peer can write anything in the mapping: the counters are checked on
+every access and a ring that makes no sense is an error, never a read or a
+write out of the data.
+*/
+
+const uint32_t k_shm_magic = 0x314d4853;    // "SHM1"
+const size_t k_shm_ring_bytes = 1 << 20;    // a power of 2
+
+enum {
+    SHM_REQ = 0,
+    SHM_RES = 1,
+};
+
+struct ShmRing {
+    alignas(64) std::atomic<uint64_t> head;
+    alignas(64) std::atomic<uint64_t> tail;
+    alignas(64) std::atomic<uint32_t> reader_waiting;
+    std::atomic<uint32_t> writer_waiting;
+};
+
+// the start of the memfd, the data of the two rings follow
+struct ShmHeader {
+    uint32_t magic;
+    uint32_t ring_bytes;
+    ShmRing rings[2];
+};
+
+struct ShmChannel {
+    ShmHeader *hdr = NULL;
+    uint8_t *data[2] = {NULL, NULL};
+    size_t ring_bytes = 0;      // a private copy, the header's may change
+    size_t map_size = 0;
+};
+
+// a new channel, returns its memfd or -1
+int shm_create(ShmChannel *ch, size_t ring_bytes);
+// map the memfd received from the server
+bool shm_attach(ShmChannel *ch, int memfd);
+void shm_detach(ShmChannel *ch);
+
+// copy at most `n` bytes into or out of a ring: the bytes copied, or -1 if
+// the ring is corrupt
+ssize_t shm_write(ShmChannel *ch, uint32_t ring, const void *src, size_t n);
+ssize_t shm_read(ShmChannel *ch, uint32_t ring, void *dst, size_t n);
+
+// going to sleep until the ring has data (room), false if it already has
+bool shm_wait_data(ShmChannel *ch, uint32_t ring);
+bool shm_wait_room(ShmChannel *ch, uint32_t ring);
+// after a write (read): true if the reader (writer) sleeps and must be woken
+bool shm_wake_reader(ShmChannel *ch, uint32_t ring);
+bool shm_wake_writer(ShmChannel *ch, uint32_t ring);
+
+// an eventfd: signal, and reset after it woke poll()
+void shm_signal(int efd);
+void shm_drain(int efd);
+
+// `len` bytes on a Unix socket with `nfds` fds attached, like write()
+ssize_t send_fds(int sock, const void *buf, size_t len, const int *fds, size_t nfds);
+// like read(), the fds that came with the bytes are stored in `fds` (at most
+// `max`) and counted in `nfds`
+ssize_t recv_fds(int sock, void *buf, size_t len, int *fds, size_t max, size_t *nfds);
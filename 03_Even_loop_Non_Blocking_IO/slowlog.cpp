@@ -0,0 +1,65 @@
+#include <time.h>
+#include <algorithm>
+#include "clock.h"
+#include "slowlog.h"
+
+uint64_t g_slowlog_threshold_ticks = UINT64_MAX;
+
+static struct {
+    std::vector<SlowlogEntry> ring;     // allocated up front, entries are reused
+    size_t next = 0;                    // where the next entry goes
+    size_t len = 0;
+    uint64_t next_id = 0;
+} g_slowlog;
+
+void slowlog_init(int64_t slower_than_usec, size_t max_len) {
+    max_len = std::min(max_len, k_slowlog_max_len);
+    slower_than_usec = std::min(slower_than_usec, k_slowlog_max_usec);
+    g_slowlog.ring.resize(max_len);
+    g_slowlog.next = g_slowlog.len = 0;
+    g_slowlog_threshold_ticks = UINT64_MAX;
+    if (slower_than_usec >= 0 && max_len > 0) {
+        g_slowlog_threshold_ticks = clock_ns_to_ticks((uint64_t)slower_than_usec * 1000);
+    }
+}
+
+void slowlog_push(const std::vector<std::string> &cmd, uint64_t usec, int fd, const std::string &addr) {
+    if (g_slowlog.ring.empty()) {
+        return;
+    }
+    SlowlogEntry &e = g_slowlog.ring[g_slowlog.next];
+    g_slowlog.next = (g_slowlog.next + 1) % g_slowlog.ring.size();
+    g_slowlog.len = std::min(g_slowlog.len + 1, g_slowlog.ring.size());
+
+    e.id = g_slowlog.next_id++;
+    e.time = (int64_t)time(NULL);
+    e.usec = usec;
+    e.fd = fd;
+    e.addr = addr;
+    size_t nargs = std::min(cmd.size(), k_slowlog_max_args);
+    e.args.resize(nargs);
+    for (size_t i = 0; i < nargs; ++i) {
+        std::string &arg = e.args[i];
+        if (i == k_slowlog_max_args - 1 && cmd.size() > k_slowlog_max_args) {
+            arg = "... (" + std::to_string(cmd.size() - i) + " more arguments)";
+        } else if (cmd[i].size() > k_slowlog_max_arg_len) {
+            arg.assign(cmd[i], 0, k_slowlog_max_arg_len);
+            arg += "... (" + std::to_string(cmd[i].size() - k_slowlog_max_arg_len) + " more bytes)";
+        } else {
+            arg = cmd[i];
+        }
+    }
+}
+
+size_t slowlog_len() {
+    return g_slowlog.len;
+}
+
+const SlowlogEntry &slowlog_get(size_t i) {
+    size_t n = g_slowlog.ring.size();
+    return g_slowlog.ring[(g_slowlog.next + n - 1 - i) % n];
+}
+
+void slowlog_reset() {
+    g_slowlog.len = 0;
+}
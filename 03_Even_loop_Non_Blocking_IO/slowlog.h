@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/*
+Slow log: the commands that ran longer than a threshold, newest first, in a
+ring of fixed size. The dispatcher already times every command in clock
+ticks, so checking a command costs a compare with the threshold converted
+to ticks once; only a slow command pays for copying its arguments.
+
+Arguments are cut like Redis does: at most k_slowlog_max_args of them (the
+last one says how many more there were), each at most k_slowlog_max_arg_len
+bytes.
+*/
+
+const size_t k_slowlog_max_args = 32;
+const size_t k_slowlog_max_arg_len = 128;
+// the ring is allocated up front, an entry may hold about 4 KB of arguments
+const size_t k_slowlog_max_len = 65536;
+// an hour, far beyond any command and the tick conversion
+const int64_t k_slowlog_max_usec = 3600LL * 1000 * 1000;
+
+struct SlowlogEntry {
+    uint64_t id = 0;
+    int64_t time = 0;       // unix seconds
+    uint64_t usec = 0;      // execution time
+    int fd = -1;            // of the client
+    std::string addr;       // ip:port of the client
+    std::vector<std::string> args;
+};
+
+// `slower_than_usec` < 0 disables it, 0 logs every command. Values beyond
+// the limits above are clamped.
+void slowlog_init(int64_t slower_than_usec, size_t max_len);
+
+extern uint64_t g_slowlog_threshold_ticks;
+
+inline bool slowlog_is_slow(uint64_t ticks) {
+    return ticks >= g_slowlog_threshold_ticks;
+}
+
+void slowlog_push(const std::vector<std::string> &cmd, uint64_t usec, int fd, const std::string &addr);
+size_t slowlog_len();
+// the `i`-th newest entry, i < slowlog_len()
+const SlowlogEntry &slowlog_get(size_t i);
+void slowlog_reset();
@@ -0,0 +1,687 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "snapshot.h"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+const size_t k_snap_buf_size = 64 << 10;
+const size_t k_snap_index_entry = 8 + 8 + 8 + 4;
+const size_t k_snap_footer = 8 + 4 + 8 + 4;
+// the nodes are split by hash into this many groups for the parallel insert
+const size_t k_snap_partitions = 256;
+
+static uint64_t get_usec() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return (uint64_t)tv.tv_sec * 1000000 + (uint64_t)tv.tv_nsec / 1000;
+}
+
+// software CRC32C, one table lookup per byte
+static const uint32_t *crc32c_table() {
+    static uint32_t table[256];
+    static bool init = []() {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) {
+                c = (c & 1) ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+            }
+            table[i] = c;
+        }
+        return true;
+    }();
+    (void)init;
+    return table;
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t len) {
+    const uint32_t *table = crc32c_table();
+    while (len--) {
+        crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len) {
+    uint64_t c = crc;
+    while (len >= 8) {
+        uint64_t v = 0;
+        memcpy(&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+        p += 8;
+        len -= 8;
+    }
+    uint32_t c32 = (uint32_t)c;
+    while (len--) {
+        c32 = _mm_crc32_u8(c32, *p++);
+    }
+    return c32;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t len) {
+    crc = ~crc;
+#if defined(__x86_64__)
+    static const bool has_sse42 = __builtin_cpu_supports("sse4.2");
+    if (has_sse42) {
+        return ~crc32c_hw(crc, (const uint8_t *)data, len);
+    }
+#endif
+    return ~crc32c_sw(crc, (const uint8_t *)data, len);
+}
+
+static size_t varint_len(uint64_t v) {
+    size_t n = 1;
+    while (v >= 0x80) {
+        v >>= 7;
+        n++;
+    }
+    return n;
+}
+
+// bounds checked, returns false on truncated input
+static bool get_varint(const uint8_t *&p, const uint8_t *end, uint64_t &v) {
+    v = 0;
+    for (uint32_t shift = 0; p < end && shift < 64; shift += 7) {
+        uint8_t b = *p++;
+        v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// a string written as an integer must read back as exactly the same bytes
+static bool str_is_int(const std::string &s, int64_t &out) {
+    if (s.empty() || s.size() > 20) {
+        return false;
+    }
+    char *endp = NULL;
+    errno = 0;
+    long long v = strtoll(s.c_str(), &endp, 10);
+    if (errno || endp != s.c_str() + s.size()) {
+        return false;
+    }
+    char buf[32];
+    int n = snprintf(buf, sizeof(buf), "%lld", v);
+    if ((size_t)n != s.size() || memcmp(buf, s.data(), s.size()) != 0) {
+        return false;
+    }
+    out = v;
+    return true;
+}
+
+struct SnapSection {
+    uint64_t offset = 0;
+    uint64_t len = 0;
+    uint64_t keys = 0;
+    uint32_t crc = 0;
+};
+
+struct SnapWriter {
+    int fd = -1;
+    std::string path;
+    std::string tmp_path;
+    std::string buf;
+    uint32_t crc = 0;       // of the current section
+    bool failed = false;
+    SnapStats stats;
+    uint64_t start_us = 0;
+    SnapSection cur;        // the section being written
+    std::vector<SnapSection> sections;
+};
+
+static void w_flush(SnapWriter *w) {
+    if (w->failed || w->buf.empty()) {
+        w->buf.clear();
+        return;
+    }
+    w->crc = crc32c(w->crc, w->buf.data(), w->buf.size());
+    const char *p = w->buf.data();
+    size_t n = w->buf.size();
+    while (n > 0) {
+        ssize_t rv = write(w->fd, p, n);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv <= 0) {
+            w->failed = true;
+            break;
+        }
+        p += rv;
+        n -= (size_t)rv;
+    }
+    w->stats.bytes += w->buf.size();
+    w->buf.clear();
+}
+
+static void w_append(SnapWriter *w, const void *data, size_t len) {
+    if (w->buf.size() + len > k_snap_buf_size) {
+        w_flush(w);
+    }
+    if (len >= k_snap_buf_size) {
+        // large values bypass the buffer
+        w->buf.assign((const char *)data, len);
+        w_flush(w);
+        return;
+    }
+    w->buf.append((const char *)data, len);
+}
+
+// values are encoded either into the snapshot file or into a DUMP payload
+static void put_bytes(SnapWriter *w, const void *data, size_t len) {
+    w_append(w, data, len);
+}
+
+static void put_bytes(std::string *out, const void *data, size_t len) {
+    out->append((const char *)data, len);
+}
+
+template <class Out>
+static void put_varint(Out out, uint64_t v) {
+    uint8_t tmp[10];
+    size_t n = 0;
+    while (v >= 0x80) {
+        tmp[n++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    tmp[n++] = (uint8_t)v;
+    put_bytes(out, tmp, n);
+}
+
+static uint64_t zigzag(int64_t v) {
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+// the length is known before the blocks are written, so they are copied
+// straight from memory without building the value
+static size_t stream_value_len(const Stream *s) {
+    size_t len = varint_len(s->length) + varint_len(s->last_id.ms)
+        + varint_len(s->last_id.seq) + varint_len(s->nblocks);
+    for (const StreamBlock *blk = s->head; blk; blk = blk->next) {
+        len += varint_len(blk->master.ms) + varint_len(blk->master.seq)
+            + varint_len(blk->last.ms) + varint_len(blk->last.seq)
+            + varint_len(blk->count) + varint_len(blk->buf.size()) + blk->buf.size();
+    }
+    return len;
+}
+
+template <class Out>
+static void put_stream_value(Out out, const Stream *s) {
+    put_varint(out, s->length);
+    put_varint(out, s->last_id.ms);
+    put_varint(out, s->last_id.seq);
+    put_varint(out, s->nblocks);
+    for (const StreamBlock *blk = s->head; blk; blk = blk->next) {
+        put_varint(out, blk->master.ms);
+        put_varint(out, blk->master.seq);
+        put_varint(out, blk->last.ms);
+        put_varint(out, blk->last.seq);
+        put_varint(out, blk->count);
+        put_varint(out, blk->buf.size());
+        put_bytes(out, blk->buf.data(), blk->buf.size());
+    }
+}
+
+// bytes written so far, including the buffer
+static uint64_t w_offset(SnapWriter *w) {
+    return w->stats.bytes + w->buf.size();
+}
+
+static void w_end_section(SnapWriter *w) {
+    w_flush(w);
+    w->cur.len = w_offset(w) - w->cur.offset;
+    w->cur.crc = w->crc;
+    if (w->cur.len > 0) {
+        w->sections.push_back(w->cur);
+    }
+    w->cur = SnapSection{};
+    w->cur.offset = w_offset(w);
+    w->crc = 0;
+}
+
+static void w_record_header(SnapWriter *w, size_t len, uint8_t type, const std::string &key) {
+    if (w_offset(w) - w->cur.offset >= k_snap_section_bytes) {
+        w_end_section(w);
+    }
+    w->cur.keys++;
+    uint32_t rlen = (uint32_t)(1 + varint_len(key.size()) + key.size() + len);
+    w_append(w, &rlen, 4);
+    w_append(w, &type, 1);
+    put_varint(w, key.size());
+    w_append(w, key.data(), key.size());
+    w->stats.keys++;
+}
+
+SnapWriter *snap_open(const char *path) {
+    SnapWriter *w = new SnapWriter();
+    w->path = path;
+    w->tmp_path = w->path + ".tmp";
+    w->fd = open(w->tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (w->fd < 0) {
+        delete w;
+        return NULL;
+    }
+    w->start_us = get_usec();
+    w->buf.reserve(k_snap_buf_size);
+    w_append(w, "SNAP", 4);
+    w_append(w, &k_snap_version, 4);
+    // the header is not part of any section
+    w_flush(w);
+    w->crc = 0;
+    w->cur.offset = w_offset(w);
+    return w;
+}
+
+void snap_put_str(SnapWriter *w, const std::string &key, const std::string &val) {
+    int64_t v = 0;
+    if (str_is_int(val, v)) {
+        w_record_header(w, varint_len(zigzag(v)), SNAP_INT, key);
+        put_varint(w, zigzag(v));
+        return;
+    }
+    w_record_header(w, val.size(), SNAP_STR, key);
+    w_append(w, val.data(), val.size());
+}
+
+void snap_put_hll(SnapWriter *w, const std::string &key, const std::string &val) {
+    w_record_header(w, val.size(), SNAP_HLL, key);
+    w_append(w, val.data(), val.size());
+}
+
+void snap_put_stream(SnapWriter *w, const std::string &key, const Stream *s) {
+    w_record_header(w, stream_value_len(s), SNAP_STREAM, key);
+    put_stream_value(w, s);
+}
+
+bool snap_close(SnapWriter *w, SnapStats *stats) {
+    w_end_section(w);
+
+    // the section index and the footer, with their own checksum
+    uint64_t index_off = w_offset(w);
+    std::string tail;
+    for (const SnapSection &sec : w->sections) {
+        tail.append((const char *)&sec.offset, 8);
+        tail.append((const char *)&sec.len, 8);
+        tail.append((const char *)&sec.keys, 8);
+        tail.append((const char *)&sec.crc, 4);
+    }
+    uint32_t nsections = (uint32_t)w->sections.size();
+    tail.append((const char *)&index_off, 8);
+    tail.append((const char *)&nsections, 4);
+    tail.append((const char *)&w->stats.keys, 8);
+    uint32_t crc = crc32c(0, tail.data(), tail.size());
+    tail.append((const char *)&crc, 4);
+    w_append(w, tail.data(), tail.size());
+    w_flush(w);
+
+    bool ok = !w->failed && fsync(w->fd) == 0;
+    ok = close(w->fd) == 0 && ok;
+    ok = ok && rename(w->tmp_path.c_str(), w->path.c_str()) == 0;
+    if (!ok) {
+        unlink(w->tmp_path.c_str());
+    }
+    w->stats.usec = get_usec() - w->start_us;
+    if (stats) {
+        *stats = w->stats;
+    }
+    delete w;
+    return ok;
+}
+
+static bool load_stream(const uint8_t *p, const uint8_t *end, Stream *s) {
+    uint64_t length = 0, nblocks = 0;
+    StreamID last_id;
+    if (!get_varint(p, end, length) || !get_varint(p, end, last_id.ms)
+        || !get_varint(p, end, last_id.seq) || !get_varint(p, end, nblocks))
+    {
+        return false;
+    }
+    for (uint64_t i = 0; i < nblocks; ++i) {
+        StreamID master, last;
+        uint64_t count = 0, len = 0;
+        if (!get_varint(p, end, master.ms) || !get_varint(p, end, master.seq)
+            || !get_varint(p, end, last.ms) || !get_varint(p, end, last.seq)
+            || !get_varint(p, end, count) || !get_varint(p, end, len)
+            || len > (uint64_t)(end - p)
+            || !stream_append_block(s, master, last, count, p, (size_t)len))
+        {
+            return false;
+        }
+        p += len;
+    }
+    // the last ID survives trimming, it is never below the last entry's
+    if (p != end || s->length != length || stream_id_cmp(last_id, s->last_id) < 0) {
+        return false;
+    }
+    s->last_id = last_id;
+    return true;
+}
+
+static void dump_end(std::string &out, size_t start) {
+    uint16_t version = (uint16_t)k_snap_version;
+    out.append((const char *)&version, 2);
+    uint32_t crc = crc32c(0, out.data() + start, out.size() - start);
+    out.append((const char *)&crc, 4);
+}
+
+void snap_dump_str(std::string &out, const std::string &val) {
+    size_t start = out.size();
+    int64_t v = 0;
+    if (str_is_int(val, v)) {
+        out.push_back((char)SNAP_INT);
+        put_varint(&out, zigzag(v));
+    } else {
+        out.push_back((char)SNAP_STR);
+        out.append(val);
+    }
+    dump_end(out, start);
+}
+
+void snap_dump_hll(std::string &out, const std::string &val) {
+    size_t start = out.size();
+    out.push_back((char)SNAP_HLL);
+    out.append(val);
+    dump_end(out, start);
+}
+
+void snap_dump_stream(std::string &out, const Stream *s) {
+    size_t start = out.size();
+    out.reserve(start + snap_dump_stream_len(s));
+    out.push_back((char)SNAP_STREAM);
+    put_stream_value(&out, s);
+    dump_end(out, start);
+}
+
+size_t snap_dump_stream_len(const Stream *s) {
+    return 1 + stream_value_len(s) + 6;
+}
+
+bool snap_restore(const std::string &payload, uint32_t *type, std::string &val, Stream **s) {
+    if (payload.size() < 1 + 6) {
+        return false;
+    }
+    const uint8_t *p = (const uint8_t *)payload.data();
+    const uint8_t *end = p + payload.size() - 6;
+    uint16_t version = 0;
+    uint32_t crc = 0;
+    memcpy(&version, end, 2);
+    memcpy(&crc, end + 2, 4);
+    if (version != k_snap_version || crc32c(0, p, payload.size() - 4) != crc) {
+        return false;
+    }
+    uint8_t t = *p++;
+    switch (t) {
+    case SNAP_STR:
+    case SNAP_HLL:
+        *type = t;
+        val.assign((const char *)p, (size_t)(end - p));
+        return true;
+    case SNAP_INT: {
+        uint64_t zz = 0;
+        if (!get_varint(p, end, zz) || p != end) {
+            return false;
+        }
+        *type = SNAP_STR;
+        val = std::to_string((int64_t)(zz >> 1) ^ -(int64_t)(zz & 1));
+        return true;
+    }
+    case SNAP_STREAM:
+        *type = SNAP_STREAM;
+        *s = stream_new();
+        if (!load_stream(p, end, *s)) {
+            stream_free(*s);
+            return false;
+        }
+        return true;
+    default:
+        return false;
+    }
+}
+
+// decode one record, returns false if it is malformed
+static bool load_record(SnapHandler *h, const uint8_t *p, const uint8_t *end, HNode **node) {
+    uint8_t type = *p++;
+    uint64_t klen = 0;
+    if (!get_varint(p, end, klen) || klen > (uint64_t)(end - p)) {
+        return false;
+    }
+    std::string key((const char *)p, (size_t)klen);
+    p += klen;
+
+    switch (type) {
+    case SNAP_STR:
+    case SNAP_HLL: {
+        std::string val((const char *)p, (size_t)(end - p));
+        *node = type == SNAP_STR ? h->on_str(h->arg, key, val) : h->on_hll(h->arg, key, val);
+        return true;
+    }
+    case SNAP_INT: {
+        uint64_t zz = 0;
+        if (!get_varint(p, end, zz)) {
+            return false;
+        }
+        int64_t v = (int64_t)(zz >> 1) ^ -(int64_t)(zz & 1);
+        std::string val = std::to_string(v);
+        *node = h->on_str(h->arg, key, val);
+        return true;
+    }
+    case SNAP_STREAM: {
+        Stream *s = stream_new();
+        if (!load_stream(p, end, s)) {
+            stream_free(s);
+            return false;
+        }
+        *node = h->on_stream(h->arg, key, s);
+        return true;
+    }
+    default:
+        return false;
+    }
+}
+
+struct SnapLoader {
+    SnapHandler *h = NULL;
+    const uint8_t *data = NULL;
+    std::vector<SnapSection> sections;
+    size_t nparts = 1;
+    std::atomic<size_t> next{0};
+    std::atomic<bool> failed{false};
+};
+
+// the nodes decoded by one thread, grouped by `hcode % nparts`
+struct SnapWorker {
+    std::vector<std::vector<HNode *>> parts;
+    uint64_t keys = 0;
+};
+
+static bool load_section(SnapLoader *ld, SnapWorker *wk, const SnapSection &sec) {
+    const uint8_t *p = ld->data + sec.offset;
+    const uint8_t *end = p + sec.len;
+    // start reading the whole section from disk instead of faulting page by page
+    uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)p & ~(page - 1);
+    madvise((void *)start, (uintptr_t)end - start, MADV_WILLNEED);
+    if (crc32c(0, p, sec.len) != sec.crc) {
+        return false;
+    }
+    uint64_t keys = 0;
+    while (p < end) {
+        uint32_t rlen = 0;
+        if (end - p < 5) {
+            return false;
+        }
+        memcpy(&rlen, p, 4);
+        p += 4;
+        if (rlen < 1 || rlen > (size_t)(end - p)) {
+            return false;
+        }
+        HNode *node = NULL;
+        if (!load_record(ld->h, p, p + rlen, &node)) {
+            return false;
+        }
+        if (node) {
+            wk->parts[node->hcode & (ld->nparts - 1)].push_back(node);
+            wk->keys++;
+        }
+        p += rlen;
+        keys++;
+    }
+    return keys == sec.keys;
+}
+
+static void load_worker(SnapLoader *ld, SnapWorker *wk) {
+    wk->parts.resize(ld->nparts);
+    while (!ld->failed.load(std::memory_order_relaxed)) {
+        size_t i = ld->next.fetch_add(1);
+        if (i >= ld->sections.size()) {
+            break;
+        }
+        if (!load_section(ld, wk, ld->sections[i])) {
+            ld->failed = true;
+        }
+    }
+}
+
+// every thread inserts whole groups, no two threads touch the same slot
+static void insert_worker(SnapLoader *ld, std::vector<SnapWorker> *workers, HMap *db) {
+    while (true) {
+        size_t part = ld->next.fetch_add(1);
+        if (part >= ld->nparts) {
+            break;
+        }
+        for (SnapWorker &wk : *workers) {
+            hm_bulk_insert(db, wk.parts[part].data(), wk.parts[part].size());
+        }
+    }
+}
+
+// run `f` on `nthreads` threads, this one included
+template <class F>
+static void run_threads(uint32_t nthreads, F f) {
+    std::vector<std::thread> threads;
+    for (uint32_t i = 1; i < nthreads; ++i) {
+        threads.emplace_back(f, i);
+    }
+    f(0);
+    for (std::thread &t : threads) {
+        t.join();
+    }
+}
+
+// check the footer and read the section index
+static bool load_index(const uint8_t *data, size_t size, SnapLoader *ld, uint64_t *keys) {
+    if (size < 8 + k_snap_footer || memcmp(data, "SNAP", 4) != 0) {
+        return false;
+    }
+    uint32_t version = 0;
+    memcpy(&version, data + 4, 4);
+    if (version != k_snap_version) {
+        return false;
+    }
+    const uint8_t *footer = data + size - k_snap_footer;
+    uint64_t index_off = 0;
+    uint32_t nsections = 0;
+    uint32_t crc = 0;
+    memcpy(&index_off, footer, 8);
+    memcpy(&nsections, footer + 8, 4);
+    memcpy(keys, footer + 12, 8);
+    memcpy(&crc, footer + 20, 4);
+    if (index_off < 8 || *keys > size || index_off + (uint64_t)nsections * k_snap_index_entry + k_snap_footer != size
+        || crc32c(0, data + index_off, size - index_off - 4) != crc)
+    {
+        return false;
+    }
+    const uint8_t *p = data + index_off;
+    for (uint32_t i = 0; i < nsections; ++i, p += k_snap_index_entry) {
+        SnapSection sec;
+        memcpy(&sec.offset, p, 8);
+        memcpy(&sec.len, p + 8, 8);
+        memcpy(&sec.keys, p + 16, 8);
+        memcpy(&sec.crc, p + 24, 4);
+        if (sec.offset < 8 || sec.offset > index_off || sec.len > index_off - sec.offset) {
+            return false;
+        }
+        ld->sections.push_back(sec);
+    }
+    return true;
+}
+
+int snap_load(const char *path, SnapHandler *h, HMap *db, uint32_t nthreads, SnapStats *stats) {
+    uint64_t start_us = get_usec();
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return -2;
+    }
+    size_t size = (size_t)st.st_size;
+    void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return -2;
+    }
+
+    SnapLoader ld;
+    ld.h = h;
+    ld.data = (const uint8_t *)data;
+    uint64_t keys = 0;
+    if (!load_index(ld.data, size, &ld, &keys)) {
+        munmap(data, size);
+        return -2;
+    }
+
+    if (nthreads == 0) {
+        nthreads = std::thread::hardware_concurrency();
+    }
+    if (nthreads > ld.sections.size()) {
+        nthreads = (uint32_t)ld.sections.size();
+    }
+    if (nthreads == 0) {
+        nthreads = 1;
+    }
+    hm_reserve(db, (size_t)keys);
+    ld.nparts = k_snap_partitions;
+    while (ld.nparts > db->newer.mask + 1) {
+        ld.nparts /= 2;
+    }
+
+    // decode the sections, then insert the nodes, both on every thread
+    std::vector<SnapWorker> workers(nthreads);
+    run_threads(nthreads, [&](uint32_t i) { load_worker(&ld, &workers[i]); });
+    ld.next = 0;
+    run_threads(nthreads, [&](uint32_t) { insert_worker(&ld, &workers, db); });
+    uint64_t loaded = 0;
+    for (SnapWorker &wk : workers) {
+        loaded += wk.keys;
+    }
+    hm_bulk_done(db, (size_t)loaded);
+    munmap(data, size);
+    if (ld.failed) {
+        return -2;
+    }
+
+    if (stats) {
+        stats->keys = loaded;
+        stats->bytes = size;
+        stats->usec = get_usec() - start_us;
+    }
+    return 0;
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include "hashtable.h"
+#include "stream.h"
+
+/*
+Point-in-time snapshot of the keyspace.
+
+File format, integers are little endian:
+    "SNAP" | version(4)
+    section: record | record | ...
+    ...
+    index:   offset(8) | len(8) | keys(8) | crc32c(4)     one per section
+    footer:  index offset(8) | nsections(4) | keys(8) | crc32c(4) of the index and footer
+
+A record is len(4) | type(1) | varint key len | key | value, and never spans
+two sections. Sections are about k_snap_section_bytes long and each has its
+own checksum, so they can be verified and decoded independently, on as many
+threads as there are cores.
+Values are written in their in-memory encoding:
+    SNAP_STR     raw bytes
+    SNAP_INT     zigzag varint, for strings that are canonical integers
+    SNAP_HLL     the HLL bytes (sparse or dense) as they are
+    SNAP_STREAM  varint length, last ID, number of blocks, then for each
+                 block its master ID, last ID, count and packed bytes
+*/
+
+const uint32_t k_snap_version = 2;
+const size_t k_snap_section_bytes = 8 << 20;
+
+enum {
+    SNAP_STR = 0,
+    SNAP_INT = 1,
+    SNAP_HLL = 2,
+    SNAP_STREAM = 3,
+};
+
+struct SnapStats {
+    uint64_t keys = 0;
+    uint64_t bytes = 0;
+    uint64_t usec = 0;
+};
+
+// CRC32C (Castagnoli), with the SSE4.2 instruction when the CPU has it
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+
+/*
+Writer. The file is written to "<path>.tmp" and renamed over `path` only
+once it is complete and fsync'ed, so a crash never leaves a partial
+snapshot behind.
+*/
+struct SnapWriter;
+
+SnapWriter *snap_open(const char *path);
+void snap_put_str(SnapWriter *w, const std::string &key, const std::string &val);
+void snap_put_hll(SnapWriter *w, const std::string &key, const std::string &val);
+void snap_put_stream(SnapWriter *w, const std::string &key, const Stream *s);
+// returns false on any I/O error, the temporary file is removed
+bool snap_close(SnapWriter *w, SnapStats *stats);
+
+/*
+DUMP/RESTORE payload of a single value:
+    type(1) | value | version(2) | crc32c(4) of the bytes before it
+with the value encoded as in a snapshot record.
+*/
+void snap_dump_str(std::string &out, const std::string &val);
+void snap_dump_hll(std::string &out, const std::string &val);
+void snap_dump_stream(std::string &out, const Stream *s);
+// the size of the payload snap_dump_stream would write
+size_t snap_dump_stream_len(const Stream *s);
+// false if the payload is corrupt. `type` is set to SNAP_STR or SNAP_HLL
+// with the value in `val`, or to SNAP_STREAM with a new stream in `*s`.
+bool snap_restore(const std::string &payload, uint32_t *type, std::string &val, Stream **s);
+
+/*
+Loader. The file is mmap'ed and its sections are decoded in parallel. The
+handler builds a node for each record and returns it (NULL to skip the
+record), it is called from the loader threads and must be thread safe.
+The nodes are then inserted into `db`, which must be empty: it is sized
+from the key count in the footer and filled by all threads at once,
+each one owning a disjoint set of slots.
+*/
+struct SnapHandler {
+    void *arg;
+    HNode *(*on_str)(void *arg, std::string &key, std::string &val);
+    HNode *(*on_hll)(void *arg, std::string &key, std::string &val);
+    HNode *(*on_stream)(void *arg, std::string &key, Stream *s);
+};
+
+// `nthreads` 0 means one per core.
+// 0 on success, -1 if the file doesn't exist, -2 if it is corrupt, in which
+// case the keys decoded before the error are left in `db`.
+int snap_load(const char *path, SnapHandler *h, HMap *db, uint32_t nthreads, SnapStats *stats);
@@ -0,0 +1,467 @@
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "stream.h"
+
+enum {
+    ENTRY_SAMEFIELDS = 1 << 0,  // only the values are stored
+};
+
+static void put_varint(std::string &buf, uint64_t v) {
+    while (v >= 0x80) {
+        buf.push_back((char)(v | 0x80));
+        v >>= 7;
+    }
+    buf.push_back((char)v);
+}
+
+static uint64_t get_varint(const uint8_t *&p) {
+    uint64_t v = 0;
+    uint32_t shift = 0;
+    while (*p & 0x80) {
+        v |= (uint64_t)(*p++ & 0x7f) << shift;
+        shift += 7;
+    }
+    v |= (uint64_t)(*p++) << shift;
+    return v;
+}
+
+static void put_str(std::string &buf, const std::string &s) {
+    put_varint(buf, s.size());
+    buf.append(s);
+}
+
+static StreamField get_str(const uint8_t *&p) {
+    StreamField f;
+    f.len = (uint32_t)get_varint(p);
+    f.ptr = p;
+    p += f.len;
+    return f;
+}
+
+// the index key, big endian so that the byte order is the ID order
+static void id_to_key(const StreamID &id, uint8_t *key) {
+    for (int i = 0; i < 8; ++i) {
+        key[i] = (uint8_t)(id.ms >> (56 - 8 * i));
+        key[8 + i] = (uint8_t)(id.seq >> (56 - 8 * i));
+    }
+}
+
+int stream_id_cmp(const StreamID &a, const StreamID &b) {
+    if (a.ms != b.ms) {
+        return a.ms < b.ms ? -1 : 1;
+    }
+    if (a.seq != b.seq) {
+        return a.seq < b.seq ? -1 : 1;
+    }
+    return 0;
+}
+
+static bool parse_u64(const char *s, size_t len, uint64_t *out) {
+    if (len == 0 || len > 20) {
+        return false;
+    }
+    char buf[32];
+    memcpy(buf, s, len);
+    buf[len] = '\0';
+    char *endp = NULL;
+    errno = 0;
+    unsigned long long v = strtoull(buf, &endp, 10);
+    if (errno || endp != buf + len || buf[0] == '-') {
+        return false;
+    }
+    *out = v;
+    return true;
+}
+
+bool stream_parse_id(const std::string &s, uint64_t missing_seq, StreamID *id) {
+    size_t dash = s.find('-');
+    if (dash == std::string::npos) {
+        id->seq = missing_seq;
+        return parse_u64(s.data(), s.size(), &id->ms);
+    }
+    return parse_u64(s.data(), dash, &id->ms)
+        && parse_u64(s.data() + dash + 1, s.size() - dash - 1, &id->seq);
+}
+
+std::string stream_format_id(const StreamID &id) {
+    char buf[48];
+    int n = snprintf(buf, sizeof(buf), "%llu-%llu",
+        (unsigned long long)id.ms, (unsigned long long)id.seq);
+    return std::string(buf, (size_t)n);
+}
+
+/*
+The last ID is kept when entries are trimmed, even down to an empty stream,
+so IDs never go backwards and a reader holding an old ID can't see a new
+entry under it.
+*/
+bool stream_id_ok(const Stream *s, const StreamID &id) {
+    StreamID last = s ? s->last_id : StreamID();
+    return stream_id_cmp(last, id) < 0;
+}
+
+bool stream_auto_id(const Stream *s, uint64_t now_ms, StreamID *id) {
+    id->ms = now_ms;
+    id->seq = 0;
+    if (!s || now_ms > s->last_id.ms) {
+        return true;
+    }
+    // the clock is behind the last ID, continue its sequence
+    id->ms = s->last_id.ms;
+    id->seq = s->last_id.seq + 1;
+    if (id->seq == 0) {
+        id->ms++;
+    }
+    return stream_id_ok(s, *id);
+}
+
+Stream *stream_new() {
+    Stream *s = new Stream();
+    rax_init(&s->index);
+    return s;
+}
+
+void stream_free(Stream *s) {
+    StreamBlock *blk = s->head;
+    while (blk) {
+        StreamBlock *next = blk->next;
+        delete blk;
+        blk = next;
+    }
+    rax_clear(&s->index, NULL);
+    delete s;
+}
+
+// add a block at the tail and to the index
+static void block_link(Stream *s, StreamBlock *blk) {
+    uint8_t key[16];
+    id_to_key(blk->master, key);
+    rax_insert(&s->index, key, 16, blk, NULL);
+    blk->prev = s->tail;
+    if (s->tail) {
+        s->tail->next = blk;
+    } else {
+        s->head = blk;
+    }
+    s->tail = blk;
+    s->nblocks++;
+}
+
+static StreamBlock *block_new(Stream *s, const StreamID &master, const std::string *fv, size_t n) {
+    StreamBlock *blk = new StreamBlock();
+    blk->master = master;
+    blk->last = master;
+    blk->buf.reserve(k_stream_block_max_bytes);
+    put_varint(blk->buf, n / 2);
+    for (size_t i = 0; i < n; i += 2) {
+        put_str(blk->buf, fv[i]);
+    }
+
+    block_link(s, blk);
+    return blk;
+}
+
+static void block_unlink(Stream *s, StreamBlock *blk) {
+    uint8_t key[16];
+    id_to_key(blk->master, key);
+    rax_remove(&s->index, key, 16, NULL);
+    if (blk->prev) {
+        blk->prev->next = blk->next;
+    } else {
+        s->head = blk->next;
+    }
+    if (blk->next) {
+        blk->next->prev = blk->prev;
+    } else {
+        s->tail = blk->prev;
+    }
+    s->nblocks--;
+}
+
+// decode the master fields, returns the position of the first entry
+static const uint8_t *block_master_fields(const StreamBlock *blk, std::vector<StreamField> &out) {
+    const uint8_t *p = (const uint8_t *)blk->buf.data();
+    uint64_t n = get_varint(p);
+    out.clear();
+    for (uint64_t i = 0; i < n; ++i) {
+        out.push_back(get_str(p));
+    }
+    return p;
+}
+
+// compare the fields of a new entry with the master fields, in place
+static bool same_fields(const StreamBlock *blk, const std::string *fv, size_t n) {
+    const uint8_t *p = (const uint8_t *)blk->buf.data();
+    if (get_varint(p) != n / 2) {
+        return false;
+    }
+    for (size_t i = 0; i < n; i += 2) {
+        StreamField f = get_str(p);
+        if (fv[i].size() != f.len || memcmp(fv[i].data(), f.ptr, f.len) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void block_append(StreamBlock *blk, const StreamID &id, const std::string *fv, size_t n) {
+    bool same = same_fields(blk, fv, n);
+
+    // IDs only grow, so the deltas are never negative
+    uint64_t ms_delta = id.ms - blk->master.ms;
+    blk->buf.push_back(same ? ENTRY_SAMEFIELDS : 0);
+    put_varint(blk->buf, ms_delta);
+    put_varint(blk->buf, ms_delta == 0 ? id.seq - blk->master.seq : id.seq);
+    if (same) {
+        for (size_t i = 1; i < n; i += 2) {
+            put_str(blk->buf, fv[i]);
+        }
+    } else {
+        put_varint(blk->buf, n / 2);
+        for (size_t i = 0; i < n; ++i) {
+            put_str(blk->buf, fv[i]);
+        }
+    }
+    blk->last = id;
+    blk->count++;
+}
+
+// decode one entry at `p`, advances `p`
+static void block_decode(const StreamBlock *blk, const std::vector<StreamField> &master,
+    const uint8_t *&p, StreamID *id, std::vector<StreamField> &fv)
+{
+    uint8_t flags = *p++;
+    uint64_t ms_delta = get_varint(p);
+    uint64_t seq = get_varint(p);
+    id->ms = blk->master.ms + ms_delta;
+    id->seq = ms_delta == 0 ? blk->master.seq + seq : seq;
+    fv.clear();
+    if (flags & ENTRY_SAMEFIELDS) {
+        for (const StreamField &f : master) {
+            fv.push_back(f);
+            fv.push_back(get_str(p));
+        }
+    } else {
+        uint64_t n = get_varint(p);
+        for (uint64_t i = 0; i < 2 * n; ++i) {
+            fv.push_back(get_str(p));
+        }
+    }
+}
+
+void stream_append(Stream *s, const StreamID &id, const std::string *fv, size_t n) {
+    assert(stream_id_ok(s, id));
+    StreamBlock *blk = s->tail;
+    if (!blk || blk->count >= k_stream_block_max_entries
+        || blk->buf.size() >= k_stream_block_max_bytes)
+    {
+        blk = block_new(s, id, fv, n);
+    }
+    block_append(blk, id, fv, n);
+    s->length++;
+    s->last_id = id;
+}
+
+/*
+The bounds-checked decoding of a block that comes from outside (RESTORE, a
+snapshot). Every other reader trusts the blocks: a field running past the
+end, or an entry count that doesn't match, would read out of the buffer.
+*/
+static bool get_varint_in(const uint8_t *&p, const uint8_t *end, uint64_t &v) {
+    v = 0;
+    for (uint32_t shift = 0; p < end && shift < 64; shift += 7) {
+        uint8_t b = *p++;
+        v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool skip_strs_in(const uint8_t *&p, const uint8_t *end, uint64_t n) {
+    for (uint64_t i = 0; i < n; ++i) {
+        uint64_t len = 0;
+        if (!get_varint_in(p, end, len) || len > (uint64_t)(end - p)) {
+            return false;
+        }
+        p += len;
+    }
+    return true;
+}
+
+// every entry fits in the block, and the IDs strictly increase from
+// `master` (the first one) to `last`
+static bool block_valid(const StreamID &master, const StreamID &last, uint64_t count,
+    const uint8_t *p, const uint8_t *end)
+{
+    uint64_t nmaster = 0;
+    if (count == 0 || count > UINT32_MAX || !get_varint_in(p, end, nmaster)
+        || nmaster > (uint64_t)(end - p) || !skip_strs_in(p, end, nmaster))
+    {
+        return false;
+    }
+    StreamID prev;
+    for (uint64_t i = 0; i < count; ++i) {
+        uint64_t ms_delta = 0, seq = 0, n = nmaster;
+        if (p == end) {
+            return false;
+        }
+        uint8_t flags = *p++;
+        if ((flags & ~ENTRY_SAMEFIELDS) || !get_varint_in(p, end, ms_delta)
+            || !get_varint_in(p, end, seq))
+        {
+            return false;
+        }
+        StreamID id;
+        id.ms = master.ms + ms_delta;
+        id.seq = ms_delta == 0 ? master.seq + seq : seq;
+        if (id.ms < master.ms || (ms_delta == 0 && id.seq < master.seq)) {
+            return false;   // wrapped around
+        }
+        if (i == 0 ? stream_id_cmp(id, master) != 0 : stream_id_cmp(prev, id) >= 0) {
+            return false;
+        }
+        if (!(flags & ENTRY_SAMEFIELDS)) {
+            if (!get_varint_in(p, end, n) || n > (uint64_t)(end - p)) {
+                return false;
+            }
+            n *= 2;
+        }
+        if (!skip_strs_in(p, end, n)) {
+            return false;
+        }
+        prev = id;
+    }
+    return p == end && stream_id_cmp(prev, last) == 0;
+}
+
+bool stream_append_block(Stream *s, const StreamID &master, const StreamID &last,
+    uint64_t count, const uint8_t *buf, size_t len)
+{
+    if (!stream_id_ok(s, master) || !block_valid(master, last, count, buf, buf + len)) {
+        return false;
+    }
+    StreamBlock *blk = new StreamBlock();
+    blk->master = master;
+    blk->last = last;
+    blk->count = (uint32_t)count;
+    blk->buf.reserve(len > k_stream_block_max_bytes ? len : k_stream_block_max_bytes);
+    blk->buf.assign((const char *)buf, len);
+
+    block_link(s, blk);
+    s->length += count;
+    s->last_id = last;
+    return true;
+}
+
+uint64_t stream_trim(Stream *s, uint64_t maxlen, bool approx) {
+    uint64_t removed = 0;
+    // whole blocks first, no decoding needed
+    while (s->head && s->length - s->head->count >= maxlen) {
+        StreamBlock *blk = s->head;
+        block_unlink(s, blk);
+        s->length -= blk->count;
+        removed += blk->count;
+        delete blk;
+    }
+    if (approx || !s->head || s->length <= maxlen) {
+        return removed;
+    }
+
+    // exact trimming: re-encode the tail of the head block
+    StreamBlock *old = s->head;
+    uint32_t skip = (uint32_t)(s->length - maxlen);
+    std::vector<StreamField> master;
+    std::vector<StreamField> fv;
+    const uint8_t *p = block_master_fields(old, master);
+    StreamID id;
+    for (uint32_t i = 0; i < skip; ++i) {
+        block_decode(old, master, p, &id, fv);
+    }
+
+    StreamBlock *blk = new StreamBlock();
+    blk->buf.assign((const char *)old->buf.data(), (size_t)(block_master_fields(old, master)
+        - (const uint8_t *)old->buf.data()));
+    std::vector<std::string> strs;
+    for (uint32_t i = skip; i < old->count; ++i) {
+        block_decode(old, master, p, &id, fv);
+        if (i == skip) {
+            blk->master = id;
+        }
+        strs.clear();
+        for (const StreamField &f : fv) {
+            strs.push_back(std::string((const char *)f.ptr, f.len));
+        }
+        block_append(blk, id, strs.data(), strs.size());
+    }
+
+    // swap the new block in place of the old one
+    uint8_t key[16];
+    id_to_key(old->master, key);
+    rax_remove(&s->index, key, 16, NULL);
+    id_to_key(blk->master, key);
+    rax_insert(&s->index, key, 16, blk, NULL);
+    blk->next = old->next;
+    if (blk->next) {
+        blk->next->prev = blk;
+    } else {
+        s->tail = blk;
+    }
+    s->head = blk;
+    delete old;
+
+    s->length -= skip;
+    return removed + skip;
+}
+
+void stream_iter_start(StreamIter *it, Stream *s, const StreamID &start, const StreamID &end) {
+    it->start = start;
+    it->end = end;
+    it->blk = NULL;
+    it->left = 0;
+
+    // the first block whose master ID >= start, or the one before it if the
+    // start falls inside the previous block
+    uint8_t key[16];
+    id_to_key(start, key);
+    RaxIter ri;
+    rax_seek(&ri, &s->index, key, 16);
+    StreamBlock *blk = rax_next(&ri) ? (StreamBlock *)ri.data : NULL;
+    StreamBlock *prev = blk ? blk->prev : s->tail;
+    if (prev && stream_id_cmp(prev->last, start) >= 0) {
+        blk = prev;
+    }
+    if (blk) {
+        it->blk = blk;
+        it->p = block_master_fields(blk, it->master);
+        it->left = blk->count;
+    }
+}
+
+bool stream_iter_next(StreamIter *it, StreamID *id, std::vector<StreamField> &fv) {
+    while (it->blk) {
+        if (it->left == 0) {
+            it->blk = it->blk->next;
+            if (it->blk) {
+                it->p = block_master_fields(it->blk, it->master);
+                it->left = it->blk->count;
+            }
+            continue;
+        }
+        block_decode(it->blk, it->master, it->p, id, fv);
+        it->left--;
+        if (stream_id_cmp(*id, it->start) < 0) {
+            continue;
+        }
+        if (stream_id_cmp(*id, it->end) > 0) {
+            it->blk = NULL;
+            return false;
+        }
+        return true;
+    }
+    return false;
+}
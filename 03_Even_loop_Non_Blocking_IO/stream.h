@@ -0,0 +1,99 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "rax.h"
+
+/*
+An append-only log of entries, each entry is an ID and a list of field-value
+pairs. IDs are 128 bits (milliseconds, sequence) and strictly increasing.
+
+Entries are packed into blocks instead of being allocated one by one:
+
+    block: [ nfields | field1 | ... | fieldn ]           master fields
+           [ flags | ms delta | seq | values... ] ...    entries
+
+- The master ID is the ID of the first entry in the block, other IDs are
+  stored as a delta from it, most entries take 2 bytes of ID.
+- If an entry has the same fields as the master fields (the common case for
+  event logs), only its values are stored.
+
+Blocks are linked in ID order and indexed by a radix tree keyed by the
+big endian master ID, so finding the block of an ID is a single seek.
+*/
+
+struct StreamID {
+    uint64_t ms = 0;
+    uint64_t seq = 0;
+};
+
+const size_t k_stream_block_max_bytes = 4096;
+const uint32_t k_stream_block_max_entries = 128;
+
+struct StreamBlock {
+    StreamBlock *prev = NULL;
+    StreamBlock *next = NULL;
+    StreamID master;        // ID of the first entry
+    StreamID last;          // ID of the last entry
+    uint32_t count = 0;     // number of entries
+    std::string buf;
+};
+
+struct Stream {
+    Rax index;              // master ID -> StreamBlock *
+    StreamBlock *head = NULL;
+    StreamBlock *tail = NULL;
+    uint64_t length = 0;
+    uint64_t nblocks = 0;
+    StreamID last_id;
+};
+
+// a field or a value, points into a block
+struct StreamField {
+    const uint8_t *ptr;
+    uint32_t len;
+};
+
+int stream_id_cmp(const StreamID &a, const StreamID &b);
+// "ms-seq" or "ms", a missing sequence is replaced by `missing_seq`
+bool stream_parse_id(const std::string &s, uint64_t missing_seq, StreamID *id);
+std::string stream_format_id(const StreamID &id);
+// whether `id` may be added to `s` (NULL for a new stream): it must be
+// greater than every ID the stream ever had, and so never 0-0
+bool stream_id_ok(const Stream *s, const StreamID &id);
+// the ID for "*" at time `now_ms`, false if the stream is out of IDs
+bool stream_auto_id(const Stream *s, uint64_t now_ms, StreamID *id);
+
+Stream *stream_new();
+void stream_free(Stream *s);
+// `fv` holds `n` strings: field, value, field, value...
+// the ID must be greater than `s->last_id`
+void stream_append(Stream *s, const StreamID &id, const std::string *fv, size_t n);
+// append an encoded block as it is, used to load snapshots. The block is
+// checked first: false, and nothing appended, if it is malformed or its
+// IDs don't all come after `s->last_id`.
+bool stream_append_block(Stream *s, const StreamID &master, const StreamID &last,
+    uint64_t count, const uint8_t *buf, size_t len);
+// remove the oldest entries until at most `maxlen` are left. With `approx`
+// only whole blocks are dropped, so a few more entries may be kept.
+// Returns the number of entries removed.
+uint64_t stream_trim(Stream *s, uint64_t maxlen, bool approx);
+
+/*
+Iterate the entries with start <= ID <= end. The fields and values returned
+by stream_iter_next point into the blocks, so they can be copied straight
+into a response.
+*/
+struct StreamIter {
+    StreamBlock *blk = NULL;
+    const uint8_t *p = NULL;
+    uint32_t left = 0;      // entries left in the current block
+    StreamID start;
+    StreamID end;
+    std::vector<StreamField> master;    // master fields of the current block
+};
+
+void stream_iter_start(StreamIter *it, Stream *s, const StreamID &start, const StreamID &end);
+bool stream_iter_next(StreamIter *it, StreamID *id, std::vector<StreamField> &fv);
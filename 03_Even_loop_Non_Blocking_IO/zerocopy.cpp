@@ -0,0 +1,56 @@
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include "zerocopy.h"
+
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
+
+bool zc_enable(int fd) {
+    int one = 1;
+    return setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+}
+
+ssize_t zc_send(int fd, const void *buf, size_t len) {
+    return send(fd, buf, len, MSG_ZEROCOPY | MSG_NOSIGNAL);
+}
+
+bool zc_completion(int fd, uint32_t *lo, uint32_t *hi, bool *copied) {
+    char ctl[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))] = {};
+    struct msghdr msg = {};
+    msg.msg_control = ctl;
+    msg.msg_controllen = sizeof(ctl);
+    while (true) {
+        ssize_t rv = recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv < 0) {
+            return false;   // EAGAIN: no more
+        }
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            bool ip = (cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR)
+                || (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR);
+            if (!ip) {
+                continue;
+            }
+            struct sock_extended_err ee;
+            memcpy(&ee, CMSG_DATA(cm), sizeof(ee));
+            if (ee.ee_errno != 0 || ee.ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+            *lo = ee.ee_info;
+            *hi = ee.ee_data;
+            *copied = (ee.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) != 0;
+            return true;
+        }
+        // something else on the error queue, dropped
+        msg.msg_controllen = sizeof(ctl);
+    }
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+Zero-copy sends on a TCP socket (MSG_ZEROCOPY, Linux 4.14).
+
+A send() with MSG_ZEROCOPY doesn't copy the bytes into the socket buffer,
+the kernel pins the pages and the NIC reads them from where they are. So the
+bytes must not change until the kernel is done with them: every such send()
+of a socket gets the next sequence number (0, 1, 2...) and a completion with
+a range of sequence numbers is queued on the error queue of the socket, which
+poll() reports as POLLERR.
+
+A completion may say that the kernel copied the bytes after all (to a socket
+of the same host, or a device without scatter-gather); the sender should
+then go back to plain sends, the pinning only costs.
+
+Only worth it for large sends: pinning and the completion cost more than
+copying a few KB.
+*/
+
+// SO_ZEROCOPY on the socket, false if the kernel or the socket can't
+bool zc_enable(int fd);
+// a send() by reference, like write(). ENOBUFS: over the socket's budget of
+// pinned pages (optmem_max), a plain send() works.
+ssize_t zc_send(int fd, const void *buf, size_t len);
+// the next completion of the error queue: the sends [lo, hi] are done, and
+// were copied if `copied`. False once the queue is empty.
+bool zc_completion(int fd, uint32_t *lo, uint32_t *hi, bool *copied);